@@ -0,0 +1,106 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// Fenwick (binary indexed) tree over counts at positions [0, size)
+// Add and PrefixSum in O(log n), Select by binary lifting in O(log n)
+template <typename T>
+class FenwickTree {
+public:
+    FenwickTree() = default;
+    explicit FenwickTree(size_t size) : tree_(size + 1) {
+        while ((high_bit_ << 1) <= size) {
+            high_bit_ <<= 1;
+        }
+    }
+
+    void Add(size_t position, T delta) {
+        for (size_t i = position + 1; i < tree_.size(); i += i & (~i + 1)) {
+            tree_[i] += delta;
+        }
+    }
+    // sum over positions [0, count)
+    T PrefixSum(size_t count) const {
+        T sum{};
+        for (size_t i = count; i > 0; i -= i & (~i + 1)) {
+            sum += tree_[i];
+        }
+        return sum;
+    }
+    // smallest position whose prefix sum including it reaches k (k >= 1),
+    // Size() if the total is less than k;
+    // rest receives k minus the sum over the positions before the result
+    size_t Select(T k, T* rest = nullptr) const {
+        size_t position = 0;
+        for (size_t step = high_bit_; step > 0; step >>= 1) {
+            if (position + step < tree_.size() && tree_[position + step] < k) {
+                position += step;
+                k -= tree_[position];
+            }
+        }
+        if (rest != nullptr) {
+            *rest = k;
+        }
+        return position;
+    }
+    size_t Size() const noexcept {
+        return tree_.size() - 1;
+    }
+
+private:
+    std::vector<T> tree_ = std::vector<T>(1);
+    size_t high_bit_ = 1;
+};
+
+// Fenwick tree of counts that many threads may Add to at once.
+// A PrefixSum or Select running alongside Add sees every cell either before or after the
+// update, so it is exact whenever no Add is in flight. Add updates the cells from the lower
+// to the upper ones with release stores and the readers load with acquire, so a reader that
+// sees an upper cell updated also sees the cells below it that the same Add updated first.
+class AtomicFenwickTree {
+public:
+    AtomicFenwickTree() = default;
+    explicit AtomicFenwickTree(size_t size) : tree_(size + 1) {
+        while ((high_bit_ << 1) <= size) {
+            high_bit_ <<= 1;
+        }
+    }
+
+    void Add(size_t position, size_t delta) {
+        for (size_t i = position + 1; i < tree_.size(); i += i & (~i + 1)) {
+            tree_[i].fetch_add(delta, std::memory_order_release);
+        }
+    }
+    size_t PrefixSum(size_t count) const {
+        size_t sum = 0;
+        for (size_t i = count; i > 0; i -= i & (~i + 1)) {
+            sum += tree_[i].load(std::memory_order_acquire);
+        }
+        return sum;
+    }
+    size_t Select(size_t k, size_t* rest = nullptr) const {
+        size_t position = 0;
+        for (size_t step = high_bit_; step > 0; step >>= 1) {
+            if (position + step < tree_.size()) {
+                size_t count = tree_[position + step].load(std::memory_order_acquire);
+                if (count < k) {
+                    position += step;
+                    k -= count;
+                }
+            }
+        }
+        if (rest != nullptr) {
+            *rest = k;
+        }
+        return position;
+    }
+    size_t Size() const noexcept {
+        return tree_.size() - 1;
+    }
+
+private:
+    std::vector<std::atomic<size_t>> tree_ = std::vector<std::atomic<size_t>>(1);
+    size_t high_bit_ = 1;
+};
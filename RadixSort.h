@@ -0,0 +1,76 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+// Stable LSD radix sort by an unsigned 64-bit key, 8 passes of 8 bits.
+// Each pass splits the input into per-thread chunks: the threads count digits of their chunk,
+// the counts are turned into per-thread offsets, and the threads scatter in parallel.
+// Passes where every key has the same digit are skipped, so narrow key ranges sort fast.
+
+// order-preserving map of signed keys onto unsigned ones
+inline uint64_t RadixKey(long long key) noexcept {
+    return static_cast<uint64_t>(key) ^ (uint64_t{1} << 63);
+}
+
+template <typename T, typename KeyOf>
+void ParallelRadixSort(std::vector<T>& items, KeyOf key_of, size_t threads = 0) {
+    constexpr size_t kRadix = 256;
+    constexpr size_t kMinChunk = 1 << 16;
+    size_t size = items.size();
+    if (threads == 0) {
+        threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+    }
+    threads = std::max<size_t>(1, std::min(threads, size / kMinChunk));
+
+    std::vector<T> buffer(size);
+    std::vector<std::array<size_t, kRadix>> counts(threads);
+    auto chunk_begin = [&](size_t thread) {
+        return size * thread / threads;
+    };
+    auto run = [&](auto&& task) {
+        std::vector<std::thread> workers;
+        for (size_t thread = 1; thread < threads; ++thread) {
+            workers.emplace_back(task, thread);
+        }
+        task(0);
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    };
+
+    for (int shift = 0; shift < 64; shift += 8) {
+        run([&](size_t thread) {
+            counts[thread].fill(0);
+            for (size_t i = chunk_begin(thread); i < chunk_begin(thread + 1); ++i) {
+                ++counts[thread][(key_of(items[i]) >> shift) & (kRadix - 1)];
+            }
+        });
+        size_t offset = 0;
+        size_t used_digits = 0;
+        for (size_t digit = 0; digit < kRadix; ++digit) {
+            size_t digit_total = 0;
+            for (size_t thread = 0; thread < threads; ++thread) {
+                size_t count = counts[thread][digit];
+                counts[thread][digit] = offset + digit_total;
+                digit_total += count;
+            }
+            offset += digit_total;
+            used_digits += (digit_total > 0);
+        }
+        if (used_digits <= 1) {
+            continue;
+        }
+        run([&](size_t thread) {
+            auto& positions = counts[thread];
+            for (size_t i = chunk_begin(thread); i < chunk_begin(thread + 1); ++i) {
+                buffer[positions[(key_of(items[i]) >> shift) & (kRadix - 1)]++] = items[i];
+            }
+        });
+        items.swap(buffer);
+    }
+}
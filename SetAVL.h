@@ -1,28 +1,243 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <bit>
 #include <cassert>
 #include <cmath>
 #include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
 #include <limits>
 #include <memory>
-#include <stack>
+#include <new>
 #include <stdexcept>
-#include <tuple>
+#include <string>
+#include <type_traits>
 #include <utility>
+#include <vector>
 #include <iostream>
+#include <istream>
+#include <iterator>
+#include <ostream>
 #include "compressed_pair.h"
+#include "SetBalance.h"
+#include "SetNodeArena.h"
+#include "SetSnapshot.h"
 
 template <typename K1, typename K2, typename Compare>
 bool Equivalent(const K1& key_1, const K2& key_2, Compare compare) {
     return !(compare(key_1, key_2)) && (!compare(key_2, key_1));
 }
 
+// Normalized inline key prefix: the leading bytes of a key packed big-endian into an
+// unsigned integer, so that integer order of prefixes agrees with the order of keys.
+// Equal prefixes say nothing, then the full keys are compared.
+struct SetNoPrefix {};
+
 template <typename K>
-class SetNode;
+struct SetKeyPrefix {
+    static constexpr bool kEnabled = false;
+    using Type = SetNoPrefix;
+
+    static Type Make(const K&) noexcept {
+        return {};
+    }
+};
+
+template <>
+struct SetKeyPrefix<std::string> {
+    static constexpr bool kEnabled = true;
+    using Type = uint64_t;
+
+    static Type Make(const std::string& key) noexcept {
+        Type prefix = 0;
+        size_t length = std::min(key.size(), sizeof(Type));
+        for (size_t i = 0; i < length; ++i) {
+            prefix |= static_cast<Type>(static_cast<unsigned char>(key[i]))
+                      << (8 * (sizeof(Type) - 1 - i));
+        }
+        return prefix;
+    }
+};
 
+// Order of prefixes under the comparator: 1 ascending, -1 descending,
+// 0 if the comparator is unknown and prefixes can not be used
+template <typename Compare>
+inline constexpr int kSetPrefixDirection = 0;
+template <typename T>
+inline constexpr int kSetPrefixDirection<std::less<T>> = 1;
+template <typename T>
+inline constexpr int kSetPrefixDirection<std::greater<T>> = -1;
+
+// Subtree augmentation: a monoid (Identity, associative Combine) over the keys of a
+// subtree in order, FromKey gives the value of a single key.
+// SetAVL keeps the aggregate of every subtree next to its size.
 template <typename K>
-class SetBaseNode {
+struct SetNoAugment {
+    static constexpr bool kEnabled = false;
+    struct ValueType {};
+
+    static ValueType Identity() noexcept {
+        return {};
+    }
+    static ValueType FromKey(const K&) noexcept {
+        return {};
+    }
+    static ValueType Combine(const ValueType&, const ValueType&) noexcept {
+        return {};
+    }
+};
+
+// sum of the keys in a subtree
+template <typename K>
+struct SetSumAugment {
+    static constexpr bool kEnabled = true;
+    using ValueType = K;
+
+    static ValueType Identity() {
+        return K{};
+    }
+    static ValueType FromKey(const K& key) {
+        return key;
+    }
+    static ValueType Combine(const ValueType& lhs, const ValueType& rhs) {
+        return lhs + rhs;
+    }
+};
+
+// total weight of a subtree, Weight maps a key to its non-negative weight
+template <typename K, typename Weight>
+struct SetWeightAugment {
+    static constexpr bool kEnabled = true;
+    using ValueType = std::invoke_result_t<Weight, const K&>;
+
+    static ValueType Identity() {
+        return ValueType{};
+    }
+    static ValueType FromKey(const K& key) {
+        return Weight{}(key);
+    }
+    static ValueType Combine(const ValueType& lhs, const ValueType& rhs) {
+        return lhs + rhs;
+    }
+};
+
+// minimal and maximal key together with the minimal gap between neighbouring keys
+// (meaningful for ascending arithmetic keys, the gap is defined when count >= 2)
+template <typename K>
+struct SetMinGapAugment {
+    static constexpr bool kEnabled = true;
+    struct ValueType {
+        size_t count = 0;
+        K min{};
+        K max{};
+        K min_gap = std::numeric_limits<K>::max();
+    };
+
+    static ValueType Identity() {
+        return {};
+    }
+    static ValueType FromKey(const K& key) {
+        return {1, key, key, std::numeric_limits<K>::max()};
+    }
+    static ValueType Combine(const ValueType& lhs, const ValueType& rhs) {
+        if (lhs.count == 0) {
+            return rhs;
+        }
+        if (rhs.count == 0) {
+            return lhs;
+        }
+        K gap = std::min({lhs.min_gap, rhs.min_gap, static_cast<K>(rhs.min - lhs.max)});
+        return {lhs.count + rhs.count, lhs.min, rhs.max, gap};
+    }
+};
+
+// Node layout: Threaded keeps in-order prev/next links in every node, so an iterator step
+// is O(1); without them iteration climbs parent pointers (amortized O(1) per step), nodes
+// are two pointers smaller and an insert writes two links instead of four.
+// HotCold aligns nodes to cache lines: the fields a descent reads (key, prefix, children,
+// size, balance) come first and share the first line, parent and threading links follow.
+template <bool Threaded, bool HotCold>
+struct SetNodeLayout {
+    static constexpr bool kThreaded = Threaded;
+    static constexpr size_t kAlignment = HotCold ? 64 : 1;
+};
+using SetThreadedLayout = SetNodeLayout<true, false>;
+using SetUnthreadedLayout = SetNodeLayout<false, false>;
+using SetHotColdLayout = SetNodeLayout<true, true>;
+using SetHotColdUnthreadedLayout = SetNodeLayout<false, true>;
+
+// placeholder of an absent node field
+struct SetNoLink {};
+
+// Compile-time node layout chosen from the key and comparator traits
+template <typename K, typename Compare, typename Augment = SetNoAugment<K>,
+          typename Balance = SetAVLBalance, typename Layout = SetThreadedLayout>
+struct SetNodePolicy {
+    static constexpr int kPrefixDirection =
+        SetKeyPrefix<K>::kEnabled ? kSetPrefixDirection<Compare> : 0;
+    static constexpr bool kUsePrefix = (kPrefixDirection != 0);
+
+    using PrefixType =
+        std::conditional_t<kUsePrefix, typename SetKeyPrefix<K>::Type, SetNoPrefix>;
+
+    using AugmentType = Augment;
+    using AggregateType = typename Augment::ValueType;
+    static constexpr bool kAugmented = Augment::kEnabled;
+
+    using BalanceType = typename Balance::BalanceType;
+
+    static constexpr bool kThreaded = Layout::kThreaded;
+    // never below the natural alignment of the node fields, which alignas may not lower
+    static constexpr size_t kNodeAlignment =
+        std::max({Layout::kAlignment, alignof(K), alignof(PrefixType), alignof(AggregateType),
+                  alignof(BalanceType), alignof(size_t), alignof(void*)});
+};
+
+template <typename K, typename Policy = SetNodePolicy<K, std::less<K>>>
+class SetNode;
+
+// Owner of a node: nodes relocated by SetAVL::Compact or allocated from a SetNodeArena live
+// in memory owned by the tree, for them only the destructor runs.
+// SetNode is final, so deleting it through its own type is exact.
+struct SetNodeDeleter {
+    template <typename Node>
+    void operator()(Node* node) const noexcept {
+        if (node->InBlock()) {
+            node->~Node();
+        } else {
+            delete node;
+        }
+    }
+};
+
+template <typename K, typename Policy>
+using SetNodePtr = std::unique_ptr<SetNode<K, Policy>, SetNodeDeleter>;
+
+template <typename K, typename Policy>
+class SetBaseNode;
+
+// In-order prev/next links of every node; the unthreaded layout has none to declare,
+// so asking its nodes for them does not compile
+template <typename K, typename Policy, bool Threaded = Policy::kThreaded>
+class SetThreadLinks {
+public:
+    virtual SetBaseNode<K, Policy>* GetPrev() const noexcept = 0;
+    virtual SetBaseNode<K, Policy>*& GetPrev() noexcept = 0;
+    virtual SetBaseNode<K, Policy>* GetNext() const noexcept = 0;
+    virtual SetBaseNode<K, Policy>*& GetNext() noexcept = 0;
+
+protected:
+    ~SetThreadLinks() noexcept = default;
+};
+
+template <typename K, typename Policy>
+class SetThreadLinks<K, Policy, false> {};
+
+template <typename K, typename Policy = SetNodePolicy<K, std::less<K>>>
+class SetBaseNode : public SetThreadLinks<K, Policy> {
 public:
     SetBaseNode() noexcept = default;
     SetBaseNode(const SetBaseNode& other) = delete;
@@ -32,25 +247,20 @@ public:
     ~SetBaseNode() noexcept = default;
 
     virtual const K& GetKey() const = 0;
-    virtual const std::unique_ptr<SetNode<K>>& GetLeft() const = 0;
-    virtual std::unique_ptr<SetNode<K>>& GetLeft() = 0;
-    virtual const std::unique_ptr<SetNode<K>>& GetRight() const = 0;
-    virtual std::unique_ptr<SetNode<K>>& GetRight() = 0;
-    virtual SetNode<K>* GetParent() const = 0;
-    virtual SetNode<K>*& GetParent() = 0;
-    virtual SetBaseNode<K>* GetPrev() const noexcept = 0;
-    virtual SetBaseNode<K>*& GetPrev() noexcept = 0;
-    virtual SetBaseNode<K>* GetNext() const noexcept = 0;
-    virtual SetBaseNode<K>*& GetNext() noexcept = 0;
+    virtual const SetNodePtr<K, Policy>& GetLeft() const = 0;
+    virtual SetNodePtr<K, Policy>& GetLeft() = 0;
+    virtual const SetNodePtr<K, Policy>& GetRight() const = 0;
+    virtual SetNodePtr<K, Policy>& GetRight() = 0;
+    virtual SetNode<K, Policy>* GetParent() const = 0;
     virtual size_t GetSize() const = 0;
     virtual size_t& GetSize() = 0;
-    virtual signed char GetBalance() const = 0;
-    virtual signed char& GetBalance() = 0;
+    virtual typename Policy::BalanceType GetBalance() const = 0;
+    virtual typename Policy::BalanceType& GetBalance() = 0;
     virtual bool IsSetEndNode() const noexcept = 0;
 };
 
-template <typename K>
-class SetNode : public SetBaseNode<K> {
+template <typename K, typename Policy>
+class alignas(Policy::kNodeAlignment) SetNode final : public SetBaseNode<K, Policy> {
 public:
     SetNode() = default;
     SetNode(const SetNode& other) = delete;
@@ -59,49 +269,99 @@ public:
     SetNode& operator=(SetNode&& other) = delete;
     ~SetNode() = default;
 
-    SetNode(const K& key, SetBaseNode<K>* prev, SetBaseNode<K>* next, size_t size,
-            signed char balance)
-        : key_(key), prev_(prev), next_(next), size_(size), balance_(balance) {
+    SetNode(const K& key, SetBaseNode<K, Policy>* prev, SetBaseNode<K, Policy>* next, size_t size,
+            typename Policy::BalanceType balance)
+        : key_(key), size_(size), balance_(balance) {
+        InitCached();
+        if constexpr (Policy::kThreaded) {
+            thread_ = {prev, next};
+        }
     }
-    SetNode(K&& key, SetBaseNode<K>* prev, SetBaseNode<K>* next, size_t size, signed char balance)
-        : key_(std::move(key)), prev_(prev), next_(next), size_(size), balance_(balance) {
+    SetNode(K&& key, SetBaseNode<K, Policy>* prev, SetBaseNode<K, Policy>* next, size_t size,
+            typename Policy::BalanceType balance)
+        : key_(std::move(key)), size_(size), balance_(balance) {
+        InitCached();
+        if constexpr (Policy::kThreaded) {
+            thread_ = {prev, next};
+        }
     }
     template <typename P>
-    SetNode(P&& key, SetBaseNode<K>* prev, SetBaseNode<K>* next, size_t size, signed char balance)
-        : key_(std::forward<P>(key)), prev_(prev), next_(next), size_(size), balance_(balance) {
+    SetNode(P&& key, SetBaseNode<K, Policy>* prev, SetBaseNode<K, Policy>* next, size_t size,
+            typename Policy::BalanceType balance)
+        : key_(std::forward<P>(key)), size_(size), balance_(balance) {
+        InitCached();
+        if constexpr (Policy::kThreaded) {
+            thread_ = {prev, next};
+        }
     }
     const K& GetKey() const noexcept {
         return key_;
     }
-    const std::unique_ptr<SetNode<K>>& GetLeft() const noexcept {
+    const typename Policy::PrefixType& GetPrefix() const noexcept {
+        return prefix_;
+    }
+    const typename Policy::AggregateType& GetAggregate() const noexcept {
+        return aggregate_;
+    }
+    typename Policy::AggregateType& GetAggregate() noexcept {
+        return aggregate_;
+    }
+    const SetNodePtr<K, Policy>& GetLeft() const noexcept {
         return left_;
     }
-    std::unique_ptr<SetNode<K>>& GetLeft() noexcept {
+    SetNodePtr<K, Policy>& GetLeft() noexcept {
         return left_;
     }
-    const std::unique_ptr<SetNode<K>>& GetRight() const noexcept {
+    const SetNodePtr<K, Policy>& GetRight() const noexcept {
         return right_;
     }
-    std::unique_ptr<SetNode<K>>& GetRight() noexcept {
+    SetNodePtr<K, Policy>& GetRight() noexcept {
         return right_;
     }
-    SetNode<K>* GetParent() const noexcept {
-        return parent_;
+    SetNode<K, Policy>* GetParent() const noexcept {
+        if constexpr (Policy::kThreaded) {
+            return parent_;
+        } else {
+            return (parent_ & kEndLinkTag) != 0 ? nullptr
+                                                 : reinterpret_cast<SetNode<K, Policy>*>(parent_);
+        }
     }
-    SetNode<K>*& GetParent() noexcept {
-        return parent_;
+    void SetParent(SetNode<K, Policy>* parent) noexcept {
+        if constexpr (Policy::kThreaded) {
+            parent_ = parent;
+        } else {
+            parent_ = reinterpret_cast<std::uintptr_t>(parent);
+        }
     }
-    SetBaseNode<K>* GetPrev() const noexcept {
-        return prev_;
+    // Without threading the parent field of the root holds the end node of its tree, tagged
+    // in the low bit, so iterators find the end nodes through the nodes alone and stay
+    // valid when the nodes change owner by a move or swap. Nullptr below the root.
+    SetBaseNode<K, Policy>* GetEndLink() const noexcept {
+        static_assert(!Policy::kThreaded, "threaded nodes link the end nodes directly");
+        if ((parent_ & kEndLinkTag) == 0) {
+            return nullptr;
+        }
+        return reinterpret_cast<SetBaseNode<K, Policy>*>(parent_ & ~kEndLinkTag);
     }
-    SetBaseNode<K>*& GetPrev() noexcept {
-        return prev_;
+    void SetEndLink(SetBaseNode<K, Policy>* end) noexcept {
+        static_assert(!Policy::kThreaded, "threaded nodes link the end nodes directly");
+        parent_ = reinterpret_cast<std::uintptr_t>(end) | kEndLinkTag;
     }
-    SetBaseNode<K>* GetNext() const noexcept {
-        return next_;
+    SetBaseNode<K, Policy>* GetPrev() const noexcept {
+        static_assert(Policy::kThreaded, "the unthreaded layout has no prev/next links");
+        return thread_.prev;
     }
-    SetBaseNode<K>*& GetNext() noexcept {
-        return next_;
+    SetBaseNode<K, Policy>*& GetPrev() noexcept {
+        static_assert(Policy::kThreaded, "the unthreaded layout has no prev/next links");
+        return thread_.prev;
+    }
+    SetBaseNode<K, Policy>* GetNext() const noexcept {
+        static_assert(Policy::kThreaded, "the unthreaded layout has no prev/next links");
+        return thread_.next;
+    }
+    SetBaseNode<K, Policy>*& GetNext() noexcept {
+        static_assert(Policy::kThreaded, "the unthreaded layout has no prev/next links");
+        return thread_.next;
     }
     size_t GetSize() const noexcept {
         return size_;
@@ -109,29 +369,58 @@ public:
     size_t& GetSize() noexcept {
         return size_;
     }
-    signed char GetBalance() const {
+    typename Policy::BalanceType GetBalance() const {
         return balance_;
     }
-    signed char& GetBalance() {
+    typename Policy::BalanceType& GetBalance() {
         return balance_;
     }
     bool IsSetEndNode() const noexcept {
         return false;
     }
+    // placed in the arena of the tree instead of allocated on its own
+    bool InBlock() const noexcept {
+        return in_block_;
+    }
+    void SetInBlock() noexcept {
+        in_block_ = true;
+    }
 
 private:
+    struct ThreadLinks {
+        SetBaseNode<K, Policy>* prev = nullptr;
+        SetBaseNode<K, Policy>* next = nullptr;
+    };
+    using ThreadType = std::conditional_t<Policy::kThreaded, ThreadLinks, SetNoLink>;
+    using ParentType = std::conditional_t<Policy::kThreaded, SetNode*, std::uintptr_t>;
+    static constexpr std::uintptr_t kEndLinkTag = 1;
+
+    void InitCached() {
+        if constexpr (Policy::kUsePrefix) {
+            prefix_ = SetKeyPrefix<K>::Make(key_);
+        }
+        if constexpr (Policy::kAugmented) {
+            aggregate_ = Policy::AugmentType::FromKey(key_);
+        }
+    }
+
+    // kept in front of the key, so a descent resolves most comparisons
+    // without touching the key's own storage
+    [[no_unique_address]] typename Policy::PrefixType prefix_{};
     const K key_;
-    std::unique_ptr<SetNode<K>> left_;
-    std::unique_ptr<SetNode<K>> right_;
-    SetNode<K>* parent_ = nullptr;
-    SetBaseNode<K>* prev_ = nullptr;
-    SetBaseNode<K>* next_ = nullptr;
+    SetNodePtr<K, Policy> left_;
+    SetNodePtr<K, Policy> right_;
     size_t size_ = 1;
-    signed char balance_ = 0;
+    typename Policy::BalanceType balance_ = 0;
+    bool in_block_ = false;
+    [[no_unique_address]] typename Policy::AggregateType aggregate_{};
+    // fields a descent does not read
+    ParentType parent_{};
+    [[no_unique_address]] ThreadType thread_{};
 };
 
-template <typename K>
-class SetEndNode : public SetBaseNode<K> {
+template <typename K, typename Policy = SetNodePolicy<K, std::less<K>>>
+class SetEndNode : public SetBaseNode<K, Policy> {
 public:
     SetEndNode() noexcept = default;
     SetEndNode(const SetEndNode& other) = delete;
@@ -140,39 +429,42 @@ public:
     SetEndNode& operator=(SetEndNode&& other) noexcept = default;
     ~SetEndNode() noexcept = default;
 
-    SetEndNode(SetBaseNode<K>* prev, SetBaseNode<K>* next) noexcept : prev_(prev), next_(next) {
+    SetEndNode(SetBaseNode<K, Policy>* prev, SetBaseNode<K, Policy>* next,
+               SetEndNode* partner = nullptr) noexcept
+        : prev_(prev), next_(next), partner_(partner) {
     }
-    const K& GetKey() const {
-        throw std::out_of_range("Out of range!");
+    // the other end node of the same tree
+    SetEndNode* GetPartner() const noexcept {
+        return partner_;
     }
-    const std::unique_ptr<SetNode<K>>& GetLeft() const {
+    const K& GetKey() const {
         throw std::out_of_range("Out of range!");
     }
-    std::unique_ptr<SetNode<K>>& GetLeft() {
+    const SetNodePtr<K, Policy>& GetLeft() const {
         throw std::out_of_range("Out of range!");
     }
-    const std::unique_ptr<SetNode<K>>& GetRight() const {
+    SetNodePtr<K, Policy>& GetLeft() {
         throw std::out_of_range("Out of range!");
     }
-    std::unique_ptr<SetNode<K>>& GetRight() {
+    const SetNodePtr<K, Policy>& GetRight() const {
         throw std::out_of_range("Out of range!");
     }
-    SetNode<K>* GetParent() const {
+    SetNodePtr<K, Policy>& GetRight() {
         throw std::out_of_range("Out of range!");
     }
-    SetNode<K>*& GetParent() {
+    SetNode<K, Policy>* GetParent() const {
         throw std::out_of_range("Out of range!");
     }
-    SetBaseNode<K>* GetPrev() const noexcept {
+    SetBaseNode<K, Policy>* GetPrev() const noexcept {
         return prev_;
     }
-    SetBaseNode<K>*& GetPrev() noexcept {
+    SetBaseNode<K, Policy>*& GetPrev() noexcept {
         return prev_;
     }
-    SetBaseNode<K>* GetNext() const noexcept {
+    SetBaseNode<K, Policy>* GetNext() const noexcept {
         return next_;
     }
-    SetBaseNode<K>*& GetNext() noexcept {
+    SetBaseNode<K, Policy>*& GetNext() noexcept {
         return next_;
     }
     size_t GetSize() const {
@@ -181,10 +473,10 @@ public:
     size_t& GetSize() {
         throw std::out_of_range("Out of range!");
     }
-    signed char GetBalance() const {
+    typename Policy::BalanceType GetBalance() const {
         throw std::out_of_range("Out of range!");
     }
-    signed char& GetBalance() {
+    typename Policy::BalanceType& GetBalance() {
         throw std::out_of_range("Out of range!");
     }
     bool IsSetEndNode() const noexcept {
@@ -192,31 +484,44 @@ public:
     }
 
 private:
-    SetBaseNode<K>* prev_ = nullptr;
-    SetBaseNode<K>* next_ = nullptr;
+    SetBaseNode<K, Policy>* prev_ = nullptr;
+    SetBaseNode<K, Policy>* next_ = nullptr;
+    SetEndNode* partner_ = nullptr;
 };
 
-template <typename K, typename Compare = std::less<K>>
+// Order in which SetAVL::Compact lays the nodes out in memory
+//   kBreadthFirst: level by level, the top levels of every descent share few pages
+//   kVanEmdeBoas: the top half of the levels first, then every bottom subtree recursively,
+//   so any subtree of h levels spans O(1) blocks of about 2^h nodes at every scale
+enum class SetCompactOrder { kBreadthFirst, kVanEmdeBoas };
+
+// const member functions only read the tree, so any number of threads may call them
+// concurrently as long as no thread modifies the tree at the same time
+template <typename K, typename Compare = std::less<K>, typename Augment = SetNoAugment<K>,
+          typename Balance = SetAVLBalance, typename Layout = SetThreadedLayout>
 class SetAVL {
-public:
-    enum {
-        LEFT_VISITED = true,
-        LEFT_NOT_VISITED = false,
-        RIGHT_VISITED = true,
-        RIGHT_NOT_VISITED = false
-    };
+    friend Balance;
 
+public:
     using SetType = const K;
     using Reference = SetType&;
     using Pointer = SetType*;
     using ConstReference = const SetType&;
     using ConstPointer = const SetType*;
 
+    using NodePolicy = SetNodePolicy<K, Compare, Augment, Balance, Layout>;
+    using Node = SetNode<K, NodePolicy>;
+    using NodePtr = SetNodePtr<K, NodePolicy>;
+    using BaseNode = SetBaseNode<K, NodePolicy>;
+    using EndNode = SetEndNode<K, NodePolicy>;
+    using PrefixType = typename NodePolicy::PrefixType;
+    using AggregateType = typename NodePolicy::AggregateType;
+
     class ConstIterator;
 
     class Iterator {
     public:
-        explicit Iterator(SetBaseNode<K>* node) noexcept : node_(node) {
+        explicit Iterator(BaseNode* node) noexcept : node_(node) {
         }
         Reference operator*() const {
             return node_->GetKey();
@@ -250,26 +555,27 @@ public:
         }
 
         friend class ConstIterator;
+        friend class SetAVL;
 
     private:
         void Inc() {
             if (node_ != nullptr) {
-                node_ = node_->GetNext();
+                node_ = SetAVL::NextNode(node_);
             }
         }
         void Dec() {
-            if (node_ != nullptr && !(node_->GetPrev()->IsSetEndNode())) {
-                node_ = node_->GetPrev();
+            if (node_ != nullptr && !(SetAVL::PrevNode(node_)->IsSetEndNode())) {
+                node_ = SetAVL::PrevNode(node_);
             } else {
                 node_ = nullptr;
             }
         }
-        SetBaseNode<K>* node_ = nullptr;
+        BaseNode* node_ = nullptr;
     };
 
     class ConstIterator {
     public:
-        explicit ConstIterator(const SetBaseNode<K>* node) noexcept : node_(node) {
+        explicit ConstIterator(const BaseNode* node) noexcept : node_(node) {
         }
         ConstIterator(Iterator it) noexcept : node_(it.node_) {
         }
@@ -304,27 +610,29 @@ public:
             return node_ != other.node_;
         }
 
+        friend class SetAVL;
+
     private:
         void Inc() {
             if (node_ != nullptr) {
-                node_ = node_->GetNext();
+                node_ = SetAVL::NextNode(node_);
             }
         }
         void Dec() {
-            if (node_ != nullptr && !(node_->GetPrev()->IsSetEndNode())) {
-                node_ = node_->GetPrev();
+            if (node_ != nullptr && !(SetAVL::PrevNode(node_)->IsSetEndNode())) {
+                node_ = SetAVL::PrevNode(node_);
             } else {
                 node_ = nullptr;
             }
         }
-        const SetBaseNode<K>* node_ = nullptr;
+        const BaseNode* node_ = nullptr;
     };
 
     class ConstReverseIterator;
 
     class ReverseIterator {
     public:
-        explicit ReverseIterator(SetBaseNode<K>* node) : node_(node) {
+        explicit ReverseIterator(BaseNode* node) : node_(node) {
         }
         Reference operator*() const {
             return node_->GetKey();
@@ -358,26 +666,27 @@ public:
         }
 
         friend class ConstReverseIterator;
+        friend class SetAVL;
 
     private:
         void Inc() {
             if (node_ != nullptr) {
-                node_ = node_->GetPrev();
+                node_ = SetAVL::PrevNode(node_);
             }
         }
         void Dec() {
-            if (node_ != nullptr && !(node_->GetNext()->IsSetEndNode())) {
-                node_ = node_->GetNext();
+            if (node_ != nullptr && !(SetAVL::NextNode(node_)->IsSetEndNode())) {
+                node_ = SetAVL::NextNode(node_);
             } else {
                 node_ = nullptr;
             }
         }
-        SetBaseNode<K>* node_ = nullptr;
+        BaseNode* node_ = nullptr;
     };
 
     class ConstReverseIterator {
     public:
-        explicit ConstReverseIterator(const SetBaseNode<K>* node) noexcept : node_(node) {
+        explicit ConstReverseIterator(const BaseNode* node) noexcept : node_(node) {
         }
         ConstReverseIterator(ReverseIterator it) noexcept : node_(it.node_) {
         }
@@ -415,28 +724,77 @@ public:
     private:
         void Inc() {
             if (node_ != nullptr) {
-                node_ = node_->GetPrev();
+                node_ = SetAVL::PrevNode(node_);
             }
         }
         void Dec() {
-            if (node_ != nullptr && !(node_->GetNext()->IsSetEndNode())) {
-                node_ = node_->GetNext();
+            if (node_ != nullptr && !(SetAVL::NextNode(node_)->IsSetEndNode())) {
+                node_ = SetAVL::NextNode(node_);
             } else {
                 node_ = nullptr;
             }
         }
-        const SetBaseNode<K>* node_ = nullptr;
+        const BaseNode* node_ = nullptr;
     };
 
     SetAVL() : SetAVL(Compare()) {
     }
     explicit SetAVL(const Compare& compare) : root_compare_(nullptr, compare) {
     }
-    SetAVL(const SetAVL& other) {
-        Copy(other);
-    }
+    // one pass over other that puts the copies in one block of the arena: a chunk of exactly
+    // their size, or a part of the pooled chunks
+    SetAVL(const SetAVL& other)
+        : arena_(other.arena_.Options()), root_compare_(nullptr, other.KeyCompare()) {
+        CloneFresh(other);
+    }
+    // The nodes of this tree are rebuilt in place as copies, the surplus is freed and the
+    // shortfall allocated as in the copy constructor; keeps the arena options of this tree.
+    // A pooled tree that would leave dead nodes in its arena is copied afresh into a released
+    // arena instead, and arena memory no node lives in any more is released.
+    // A throwing key copy leaves the tree empty.
     SetAVL& operator=(const SetAVL& other) {
-        return *this = SetAVL(other);
+        if (this == std::addressof(other)) {
+            return *this;
+        }
+        size_t spare_count = Size();
+        DetachedNodes spare = DetachNodes();
+        try {
+            root_compare_.GetSecond() = other.KeyCompare();
+            rotation_count_ = 0;
+            if (arena_.Options().Pooled() && other.Size() < spare_count) {
+                spare.Free();
+                Clear();
+                CloneFresh(other);
+                return *this;
+            }
+            size_t fresh = other.Size() - std::min(other.Size(), spare_count);
+            char* block = (fresh == 0 || !arena_.Options().Pooled())
+                              ? nullptr
+                              : static_cast<char*>(
+                                    arena_.Allocate(fresh * sizeof(Node), alignof(Node)));
+            size_t used = 0;
+            bool in_arena = (block != nullptr);
+            CloneFrom(other, [&]() {
+                Node* node = spare.Take();
+                if (node == nullptr) {
+                    return FreshPlace(block, used);
+                }
+                bool in_block = node->InBlock();
+                in_arena = in_arena || in_block;
+                node->~Node();
+                return NodePlace{node, in_block};
+            });
+            spare.Free();
+            if (!in_arena) {
+                arena_.Release();
+            }
+        } catch (...) {
+            spare.Free();
+            Clear();
+            throw;
+        }
+        block_nodes_ = 0;
+        return *this;
     }
     SetAVL(SetAVL&& other) noexcept {
         Swap(other);
@@ -450,6 +808,8 @@ public:
 
     void Clear() noexcept {
         GetRoot() = nullptr;
+        arena_.Release();
+        block_nodes_ = 0;
         rend_node_.GetPrev() = nullptr;
         rend_node_.GetNext() = std::addressof(end_node_);
         end_node_.GetNext() = nullptr;
@@ -457,8 +817,142 @@ public:
     }
     void Swap(SetAVL& other) {
         std::swap(GetRoot(), other.GetRoot());
+        arena_.Swap(other.arena_);
+        std::swap(block_nodes_, other.block_nodes_);
+        std::swap(rotation_count_, other.rotation_count_);
+        std::swap(compaction_count_, other.compaction_count_);
         ConnectSetEndNodesAfterSwap(other);
+        LinkRootToEnd();
+        other.LinkRootToEnd();
+    }
+
+    // Relocates all nodes into one contiguous block in the given order, so that descents
+    // touch few pages and cache lines again after many scattered allocations. O(n).
+    // Keys are copied, as with rehashing of an unordered container every iterator and
+    // reference to a key is invalidated; CompactionCount() tells that it happened.
+    // A throwing key copy leaves the tree as it was.
+    void Compact(SetCompactOrder order = SetCompactOrder::kVanEmdeBoas) {
+        if (Empty()) {
+            Clear();
+            ++compaction_count_;
+            return;
+        }
+        std::vector<Node*> old_nodes;
+        old_nodes.reserve(Size());
+        if (order == SetCompactOrder::kBreadthFirst) {
+            BreadthFirstOrder(old_nodes);
+        } else {
+            VanEmdeBoasOrder(GetRootPtr(), CalcNodeHeight(GetRootPtr()), old_nodes);
+        }
+        SetNodeArena arena(arena_.Options());
+        Node* new_nodes = static_cast<Node*>(
+            arena.AllocateExact(old_nodes.size() * sizeof(Node), alignof(Node)));
+        size_t built = 0;
+        try {
+            for (; built < old_nodes.size(); ++built) {
+                CopyToBlock(old_nodes[built], new_nodes + built);
+            }
+        } catch (...) {
+            for (size_t i = 0; i < built; ++i) {
+                new_nodes[i].~Node();
+            }
+            throw;
+        }
+        RelinkInBlock(old_nodes, new_nodes);
+        // the old nodes go before the block some of them may live in
+        NodePtr old_root = std::move(GetRoot());
+        GetRoot() = NodePtr(new_nodes);
+        LinkRootToEnd();
+        old_root.reset();
+        arena_ = std::move(arena);
+        block_nodes_ = old_nodes.size();
+        ++compaction_count_;
+    }
+    // Idle trigger for Compact: compacts when the tree has at least min_size keys and more
+    // than half of them were allocated after the last compaction, so the copying stays
+    // amortized O(1) per insert. Call it where no iterator is held; true if it compacted.
+    bool CompactIfScattered(size_t min_size = size_t{1} << 16,
+                            SetCompactOrder order = SetCompactOrder::kVanEmdeBoas) {
+        if (Size() < min_size || ScatteredCount() * 2 <= Size()) {
+            return false;
+        }
+        Compact(order);
+        return true;
     }
+    // keys allocated outside the block of the last compaction
+    size_t ScatteredCount() const noexcept {
+        return Size() - std::min(Size(), block_nodes_);
+    }
+    // number of Compact calls so far; iterators taken before it changed are invalid
+    size_t CompactionCount() const noexcept {
+        return compaction_count_;
+    }
+
+    // Node storage of this tree, see SetNodeArena.h: with huge pages or a NUMA node the
+    // nodes are carved from arena chunks, otherwise each node is allocated on its own.
+    // Nodes already in the tree stay where they are until the next Compact.
+    void UseNodeArena(SetArenaOptions options) {
+        arena_.SetOptions(std::move(options));
+    }
+    // backing and size of the node storage
+    const SetNodeArena& NodeArena() const noexcept {
+        return arena_;
+    }
+    // replaces the content with keys in strictly ascending order of the comparator,
+    // O(n) without comparisons or rebalancing: the tree is built with halves of equal size
+    template <typename ForwardIt>
+    void AssignSorted(ForwardIt first, ForwardIt last) {
+        size_t count = static_cast<size_t>(std::distance(first, last));
+        BuildFromSource(count, [&first]() { return *first++; });
+    }
+
+    // writes the keys in order in the snapshot format of SetSnapshot.h
+    template <typename Serializer = SetSerializer<K>>
+    void Save(std::ostream& out, const Serializer& serializer = {}) const {
+        SetSnapshotWriter writer(out);
+        writer.Write(kSetSnapshotMagic, sizeof(kSetSnapshotMagic));
+        writer.WriteValue(kSetSnapshotVersion);
+        writer.WriteValue(kSetSnapshotByteOrder);
+        writer.WriteValue(static_cast<uint32_t>(Serializer::kFormat));
+        writer.WriteValue(uint32_t{0});
+        writer.WriteValue(static_cast<uint64_t>(Size()));
+        for (auto it = Begin(); it != End(); ++it) {
+            serializer.Write(writer, *it);
+        }
+        writer.Finish();
+    }
+    // replaces the content with the keys of a snapshot written by Save in O(n),
+    // throws SetSnapshotError and keeps the content if the snapshot is damaged or foreign
+    template <typename Serializer = SetSerializer<K>>
+    void Load(std::istream& in, const Serializer& serializer = {}) {
+        SetSnapshotReader reader(in);
+        std::array<char, sizeof(kSetSnapshotMagic)> magic;
+        reader.Read(magic.data(), magic.size());
+        if (!std::equal(magic.begin(), magic.end(), kSetSnapshotMagic)) {
+            throw SetSnapshotError("SetAVL snapshot: bad magic");
+        }
+        if (reader.ReadValue<uint32_t>() != kSetSnapshotVersion) {
+            throw SetSnapshotError("SetAVL snapshot: unsupported version");
+        }
+        if (reader.ReadValue<uint32_t>() != kSetSnapshotByteOrder) {
+            throw SetSnapshotError("SetAVL snapshot: foreign byte order");
+        }
+        if (reader.ReadValue<uint32_t>() != Serializer::kFormat) {
+            throw SetSnapshotError("SetAVL snapshot: key format differs");
+        }
+        reader.ReadValue<uint32_t>();
+        uint64_t count = reader.ReadValue<uint64_t>();
+        if (count > MaxSize()) {
+            throw SetSnapshotError("SetAVL snapshot: bad key count");
+        }
+        SetAVL loaded(KeyCompare());
+        loaded.UseNodeArena(arena_.Options());
+        loaded.BuildFromSource(static_cast<size_t>(count),
+                               [&]() { return serializer.Read(reader); });
+        reader.Finish();
+        Swap(loaded);
+    }
+
     std::pair<Iterator, bool> Insert(const SetType& key) {
         auto pair = InsertSetNode(key);
         auto node = pair.first;
@@ -466,7 +960,7 @@ public:
         if (!inserted) {
             return {Iterator(node), false};
         }
-        BalanceAfterInsert(node);
+        Balance::AfterInsert(*this, node);
         return {Iterator(node), true};
     }
     std::pair<Iterator, bool> Insert(SetType&& key) {
@@ -476,7 +970,7 @@ public:
         if (!inserted) {
             return {Iterator(node), false};
         }
-        BalanceAfterInsert(node);
+        Balance::AfterInsert(*this, node);
         return {Iterator(node), true};
     }
     template <typename P>
@@ -487,7 +981,7 @@ public:
         if (!inserted) {
             return {Iterator(node), false};
         }
-        BalanceAfterInsert(node);
+        Balance::AfterInsert(*this, node);
         return {Iterator(node), true};
     }
     template <typename InputIt>
@@ -533,7 +1027,7 @@ public:
             return End();
         }
         if (Equivalent(node->GetKey(), key, KeyCompare())) {
-            return Iterator{node->GetNext()};
+            return Iterator{NextNode(node)};
         }
         return Iterator{node};
     }
@@ -543,7 +1037,7 @@ public:
             return End();
         }
         if (Equivalent(node->GetKey(), key, KeyCompare())) {
-            return ConstIterator{node->GetNext()};
+            return ConstIterator{NextNode(node)};
         }
         return ConstIterator{node};
     }
@@ -553,7 +1047,7 @@ public:
             return {End(), End()};
         }
         if (Equivalent(node->GetKey(), key, KeyCompare())) {
-            return {Iterator{node}, Iterator{node->GetNext()}};
+            return {Iterator{node}, Iterator{NextNode(node)}};
         }
         return {Iterator{node}, Iterator{node}};
     }
@@ -563,7 +1057,7 @@ public:
             return {End(), End()};
         }
         if (Equivalent(node->GetKey(), key, KeyCompare())) {
-            return {ConstIterator{node}, ConstIterator{node->GetNext()}};
+            return {ConstIterator{node}, ConstIterator{NextNode(node)}};
         }
         return {ConstIterator{node}, ConstIterator{node}};
     }
@@ -629,6 +1123,123 @@ public:
         return ConstIterator(SelectNode(i));
     }
 
+    // number of keys in [lo, hi) in one descent shared by both bounds
+    size_t CountRange(const K& lo, const K& hi) const {
+        Node* split = FindRangeSplit(lo, hi);
+        if (split == nullptr) {
+            return 0;
+        }
+        return CountNotLess(split->GetLeft().get(), lo) + 1 +
+               CountLess(split->GetRight().get(), hi);
+    }
+    // iterators to the keys with 0-indexed ranks [i, j), j is clamped to Size()
+    std::pair<Iterator, Iterator> SelectRange(size_t i, size_t j) {
+        j = std::min(j, Size());
+        if (i >= j) {
+            return {End(), End()};
+        }
+        Iterator first = SelectInd0(i);
+        return {first, Advance(first, static_cast<std::ptrdiff_t>(j - i))};
+    }
+    std::pair<ConstIterator, ConstIterator> SelectRange(size_t i, size_t j) const {
+        j = std::min(j, Size());
+        if (i >= j) {
+            return {End(), End()};
+        }
+        ConstIterator first = SelectInd0(i);
+        return {first, Advance(first, static_cast<std::ptrdiff_t>(j - i))};
+    }
+    // 0-indexed position of the iterator, Size() for End(), O(log n) by parent pointers
+    size_t IndexOf(ConstIterator it) const {
+        return IndexOfNode(it.node_);
+    }
+    std::ptrdiff_t Distance(ConstIterator first, ConstIterator last) const {
+        return static_cast<std::ptrdiff_t>(IndexOf(last)) -
+               static_cast<std::ptrdiff_t>(IndexOf(first));
+    }
+    // iterator k positions away (k may be negative), End() if out of range
+    // climbs only until the subtree holding the target, O(log k) away from subtree borders
+    Iterator Advance(Iterator it, std::ptrdiff_t k) {
+        auto node = AdvanceNode(it.node_, k);
+        if (node == nullptr) {
+            return End();
+        }
+        return Iterator(const_cast<Node*>(node));
+    }
+    ConstIterator Advance(ConstIterator it, std::ptrdiff_t k) const {
+        auto node = AdvanceNode(it.node_, k);
+        if (node == nullptr) {
+            return End();
+        }
+        return ConstIterator(node);
+    }
+
+    // Finger search: start from a caller-supplied iterator instead of the root,
+    // climb only to the lowest ancestor whose subtree holds the key, then descend.
+    // O(log d) for keys d positions away from the finger that share a small subtree.
+    // finger_rank is the 0-indexed rank of the finger (Size() for End()).
+    Iterator FindFrom(ConstIterator finger, const K& key) {
+        auto node = FindNodeFrom(finger.node_, key);
+        if (node == nullptr) {
+            return End();
+        }
+        return Iterator{node};
+    }
+    ConstIterator FindFrom(ConstIterator finger, const K& key) const {
+        auto node = FindNodeFrom(finger.node_, key);
+        if (node == nullptr) {
+            return End();
+        }
+        return ConstIterator{node};
+    }
+    Iterator LowerBoundFrom(ConstIterator finger, const K& key) {
+        auto node = LowerBoundNodeFrom(finger.node_, key);
+        if (node == nullptr) {
+            return End();
+        }
+        return Iterator{node};
+    }
+    ConstIterator LowerBoundFrom(ConstIterator finger, const K& key) const {
+        auto node = LowerBoundNodeFrom(finger.node_, key);
+        if (node == nullptr) {
+            return End();
+        }
+        return ConstIterator{node};
+    }
+    Iterator SelectInd0From(ConstIterator finger, size_t finger_rank, size_t i) {
+        if (i >= Size()) {
+            return End();
+        }
+        return Advance(Iterator(const_cast<BaseNode*>(finger.node_)),
+                       static_cast<std::ptrdiff_t>(i) - static_cast<std::ptrdiff_t>(finger_rank));
+    }
+    ConstIterator SelectInd0From(ConstIterator finger, size_t finger_rank, size_t i) const {
+        if (i >= Size()) {
+            return End();
+        }
+        return Advance(finger,
+                       static_cast<std::ptrdiff_t>(i) - static_cast<std::ptrdiff_t>(finger_rank));
+    }
+    size_t RankInd0From(ConstIterator finger, size_t finger_rank, const K& key) const {
+        return LowerBoundAndRankFrom(finger, finger_rank, key).second;
+    }
+    // lower bound of the key together with its 0-indexed rank, the next finger
+    // for a caller that keeps following its own queries
+    std::pair<ConstIterator, size_t> LowerBoundAndRankFrom(ConstIterator finger,
+                                                           size_t finger_rank,
+                                                           const K& key) const {
+        if (finger.node_->IsSetEndNode()) {
+            auto node = FindLowerBound(key);
+            size_t rank = CountLess(GetRootPtr(), key);
+            return {(node == nullptr) ? End() : ConstIterator{node}, rank};
+        }
+        FingerClimb climb = ClimbFromFinger(static_cast<const Node*>(finger.node_), key);
+        size_t rank = finger_rank + static_cast<size_t>(climb.offset) +
+                      CountLess(climb.node, key);
+        auto node = LowerBoundInSubTree(climb.node, climb.upper, key);
+        return {(node == nullptr) ? End() : ConstIterator{node}, rank};
+    }
+
     size_t RankInd1(const K& key) const {
         return RankKey(key);
     }
@@ -636,6 +1247,63 @@ public:
         return RankInd1(key) - 1;
     }
 
+    // Batched lookups: up to kBatchWindow independent descents are interleaved level by level
+    // and each step prefetches the node the descent reads next, so the cache misses of
+    // different queries overlap instead of stalling one after another.
+    // Results come in the order of the queries.
+    // Find for each key
+    std::vector<ConstIterator> FindBatch(const std::vector<K>& keys) const {
+        return InterleaveDescents(keys, End(), [this](const K& key) {
+            return FindDescent{GetRootPtr(), MakePrefix(key), std::addressof(key)};
+        });
+    }
+    // RankInd0 for each key
+    std::vector<size_t> RankBatch(const std::vector<K>& keys) const {
+        return InterleaveDescents(keys, size_t{0}, [this](const K& key) {
+            return RankDescent{GetRootPtr(), MakePrefix(key), std::addressof(key)};
+        });
+    }
+    // SelectInd1 for each index
+    std::vector<ConstIterator> SelectBatch(const std::vector<size_t>& indices) const {
+        return InterleaveDescents(indices, End(), [this](size_t i) {
+            return SelectDescent{(i > Size() || i == 0) ? nullptr : GetRootPtr(), i};
+        });
+    }
+
+    // aggregate of all keys
+    AggregateType Aggregate() const {
+        static_assert(NodePolicy::kAugmented, "SetAVL is not augmented");
+        return GetNodeAggregate(GetRootPtr());
+    }
+    // aggregate of keys in [lo, hi), O(log n) for any monoid
+    AggregateType RangeAggregate(const K& lo, const K& hi) const {
+        static_assert(NodePolicy::kAugmented, "SetAVL is not augmented");
+        Node* split = FindRangeSplit(lo, hi);
+        if (split == nullptr) {
+            return Augment::Identity();
+        }
+        AggregateType result =
+            Augment::Combine(SuffixAggregate(split->GetLeft().get(), lo),
+                             Augment::FromKey(split->GetKey()));
+        return Augment::Combine(result, PrefixAggregate(split->GetRight().get(), hi));
+    }
+    // first key at which the running aggregate of keys in order exceeds weight,
+    // End() if the total does not exceed it (aggregates must be non-decreasing)
+    Iterator SelectByWeight(const AggregateType& weight) {
+        auto node = SelectNodeByWeight(weight);
+        if (node == nullptr) {
+            return End();
+        }
+        return Iterator(node);
+    }
+    ConstIterator SelectByWeight(const AggregateType& weight) const {
+        auto node = SelectNodeByWeight(weight);
+        if (node == nullptr) {
+            return End();
+        }
+        return ConstIterator(node);
+    }
+
     size_t Size() const noexcept {
         if (GetRoot() == nullptr) {
             return 0;
@@ -643,78 +1311,84 @@ public:
         return GetRoot()->GetSize();
     }
     size_t MaxSize() const noexcept {
-        return (std::numeric_limits<std::ptrdiff_t>::max() / sizeof(SetNode<K>));
+        return (std::numeric_limits<std::ptrdiff_t>::max() / sizeof(Node));
     }
     bool Empty() const noexcept {
         return (GetRoot() == nullptr);
     }
+    // single rotations done by the balancing policy so far, a double rotation counts twice
+    size_t RotationCount() const noexcept {
+        return rotation_count_;
+    }
     Compare KeyCompare() const {
         return root_compare_.GetSecond();
     }
-    const std::unique_ptr<SetNode<K>>& GetRoot() const {
+    const NodePtr& GetRoot() const {
         return root_compare_.GetFirst();
     }
-    std::unique_ptr<SetNode<K>>& GetRoot() {
+    NodePtr& GetRoot() {
         return root_compare_.GetFirst();
     }
-    SetNode<K>* GetRootPtr() const {
+    Node* GetRootPtr() const {
         return GetRoot().get();
     }
 
 private:
-    size_t GetNodeSize(SetNode<K>* node) const {
+    size_t GetNodeSize(Node* node) const {
         if (node == nullptr) {
             return 0;
         }
         return node->GetSize();
     }
-    signed char GetNodeBalance(SetNode<K>* node) const {
+    AggregateType GetNodeAggregate(const Node* node) const {
         if (node == nullptr) {
-            return 0;
+            return Augment::Identity();
         }
-        return node->GetBalance();
-    }
-    bool IsBalanceNormal(SetNode<K>* node) const {
-        return std::abs(GetNodeBalance(node)) <= 2;
+        return node->GetAggregate();
     }
+    // prefixes are only comparable for probes of the key type itself
+    template <typename P>
+    static constexpr bool kProbeUsesPrefix =
+        NodePolicy::kUsePrefix && std::is_same_v<std::remove_cvref_t<P>, K>;
 
-    bool LeftRotateNeeded(SetNode<K>* node) {
-        if (node == nullptr || node->GetRight() == nullptr) {
-            return false;
+    template <typename P>
+    PrefixType MakePrefix(const P& key) const {
+        if constexpr (kProbeUsesPrefix<P>) {
+            return SetKeyPrefix<K>::Make(key);
+        } else {
+            return PrefixType{};
         }
-        return (GetNodeBalance(node) == -2) && ((GetNodeBalance(node->GetRight().get()) == -1) ||
-                                                (GetNodeBalance(node->GetRight().get()) == 0));
     }
-    bool RightRotateNeded(SetNode<K>* node) {
-        if (node == nullptr || node->GetLeft() == nullptr) {
-            return false;
+
+    // three-way comparison of a probe with a node key: negative, zero or positive
+    // the full keys are compared only when the inline prefixes tie
+    template <typename P>
+    int CompareWithNode(const P& key, const PrefixType& prefix, const Node* node) const {
+        if constexpr (kProbeUsesPrefix<P>) {
+            if (prefix != node->GetPrefix()) {
+                return (prefix < node->GetPrefix()) ? -NodePolicy::kPrefixDirection
+                                                    : NodePolicy::kPrefixDirection;
+            }
         }
-        return (GetNodeBalance(node) == 2) && ((GetNodeBalance(node->GetLeft().get()) == 1) ||
-                                               (GetNodeBalance(node->GetLeft().get()) == 0));
-    }
-    bool RightLeftRotateNeeded(SetNode<K>* node) {
-        if (node == nullptr || node->GetRight() == nullptr ||
-            node->GetRight()->GetLeft() == nullptr) {
-            return false;
+        if (KeyCompare()(key, node->GetKey())) {
+            return -1;
         }
-        return (GetNodeBalance(node) == -2) && (GetNodeBalance(node->GetRight().get()) == 1);
-    }
-    bool LeftRightRotateNeeded(SetNode<K>* node) {
-        if (node == nullptr || node->GetLeft() == nullptr ||
-            node->GetLeft()->GetRight() == nullptr) {
-            return false;
+        if (KeyCompare()(node->GetKey(), key)) {
+            return 1;
         }
-        return (GetNodeBalance(node) == 2) && (GetNodeBalance(node->GetLeft().get()) == -1);
+        return 0;
     }
 
-    SetNode<K>* FindSetNode(const K& key) const {
-        SetNode<K>* node = GetRootPtr();
+    Node* FindSetNode(const K& key) const {
+        Node* node = GetRootPtr();
+        PrefixType prefix = MakePrefix(key);
 
         while (node != nullptr) {
-            if (Equivalent(key, node->GetKey(), KeyCompare())) {
+            int order = CompareWithNode(key, prefix, node);
+            if (order == 0) {
                 return node;
             }
-            if (KeyCompare()(key, node->GetKey())) {
+            if (order < 0) {
                 node = node->GetLeft().get();
             } else {
                 node = node->GetRight().get();
@@ -723,15 +1397,17 @@ private:
         return nullptr;
     }
 
-    SetNode<K>* FindLowerBound(const K& key) const {
-        SetNode<K>* node = GetRootPtr();
-        SetNode<K>* best_bound = nullptr;
+    Node* FindLowerBound(const K& key) const {
+        Node* node = GetRootPtr();
+        Node* best_bound = nullptr;
+        PrefixType prefix = MakePrefix(key);
 
         while (node != nullptr) {
-            if (Equivalent(key, node->GetKey(), KeyCompare())) {
+            int order = CompareWithNode(key, prefix, node);
+            if (order == 0) {
                 return node;
             }
-            if (KeyCompare()(key, node->GetKey())) {
+            if (order < 0) {
                 best_bound = node;
                 node = node->GetLeft().get();
             } else {
@@ -741,354 +1417,431 @@ private:
         return best_bound;
     }
 
-    void ConnectSetEndNodesAfterSwap(SetAVL& other) {
-        if (GetRoot() != nullptr) {
-            std::swap(rend_node_.GetNext(), other.rend_node_.GetNext());
-            rend_node_.GetNext()->GetPrev() = std::addressof(rend_node_);
-            other.rend_node_.GetNext()->GetPrev() = std::addressof(other.rend_node_);
-
-            std::swap(end_node_.GetPrev(), other.end_node_.GetPrev());
-            end_node_.GetPrev()->GetNext() = std::addressof(end_node_);
-            other.end_node_.GetPrev()->GetNext() = std::addressof(other.end_node_);
+    // in-order neighbours; a threaded node has them at hand, otherwise they are found by
+    // the parent pointers, and past the last or first key through the end link of the root
+    static BaseNode* NextNode(const BaseNode* base) {
+        if constexpr (NodePolicy::kThreaded) {
+            return base->GetNext();
+        } else {
+            if (base->IsSetEndNode()) {
+                return static_cast<const EndNode*>(base)->GetNext();
+            }
+            auto node = static_cast<const Node*>(base);
+            if (node->GetRight() != nullptr) {
+                Node* next = node->GetRight().get();
+                while (next->GetLeft() != nullptr) {
+                    next = next->GetLeft().get();
+                }
+                return next;
+            }
+            Node* parent = node->GetParent();
+            while (parent != nullptr && parent->GetRight().get() == node) {
+                node = parent;
+                parent = node->GetParent();
+            }
+            if (parent == nullptr) {
+                return node->GetEndLink();
+            }
+            return parent;
         }
     }
-
-    void ConnectSetEndNodesAfterCopy(SetBaseNode<K>* max_node) {
-        if (GetRoot() != nullptr) {
-            max_node->GetNext() = std::addressof(end_node_);
-            end_node_.GetPrev() = max_node;
+    static BaseNode* PrevNode(const BaseNode* base) {
+        if constexpr (NodePolicy::kThreaded) {
+            return base->GetPrev();
+        } else {
+            if (base->IsSetEndNode()) {
+                return static_cast<const EndNode*>(base)->GetPrev();
+            }
+            auto node = static_cast<const Node*>(base);
+            if (node->GetLeft() != nullptr) {
+                Node* prev = node->GetLeft().get();
+                while (prev->GetRight() != nullptr) {
+                    prev = prev->GetRight().get();
+                }
+                return prev;
+            }
+            Node* parent = node->GetParent();
+            while (parent != nullptr && parent->GetLeft().get() == node) {
+                node = parent;
+                parent = node->GetParent();
+            }
+            if (parent == nullptr) {
+                return static_cast<EndNode*>(node->GetEndLink())->GetPartner();
+            }
+            return parent;
         }
     }
-
-    void MarkVisited(std::stack<std::tuple<SetNode<K>*, bool, bool>>& nodes, bool left) const {
-        auto top_other_node = std::get<0>(nodes.top());
-        auto visit_left = std::get<1>(nodes.top());
-        auto visit_right = std::get<2>(nodes.top());
-        nodes.pop();
-        if (left) {
-            nodes.push({top_other_node, LEFT_VISITED, visit_right});
-        } else {
-            nodes.push({top_other_node, visit_left, RIGHT_VISITED});
+    // links the root of an unthreaded tree to the end node, after the root changed
+    void LinkRootToEnd() noexcept {
+        if constexpr (!NodePolicy::kThreaded) {
+            if (GetRoot() != nullptr) {
+                GetRoot()->SetEndLink(std::addressof(end_node_));
+            }
         }
     }
 
-    void MakeVisited(std::stack<std::tuple<SetNode<K>*, bool, bool>>& nodes,
-                     SetNode<K>* child) const {
-        if (nodes.size() == 0) {
-            return;
-        }
-        auto top_other_node = std::get<0>(nodes.top());
-        if (top_other_node->GetLeft().get() == child) {
-            MarkVisited(nodes, true);
-        } else {
-            MarkVisited(nodes, false);
+    // puts node right after prev in the in-order chain; without threading only the links
+    // of the end nodes are kept
+    void LinkAfter(BaseNode* prev, Node* node) {
+        if constexpr (NodePolicy::kThreaded) {
+            node->GetPrev() = prev;
+            prev->GetNext() = node;
+        } else if (prev->IsSetEndNode()) {
+            static_cast<EndNode*>(prev)->GetNext() = node;
         }
     }
-
-    bool LeftNull(SetNode<K>* node) const {
-        return node->GetLeft() == nullptr;
+    void LinkBefore(Node* node, BaseNode* next) {
+        if constexpr (NodePolicy::kThreaded) {
+            node->GetNext() = next;
+            next->GetPrev() = node;
+        } else if (next->IsSetEndNode()) {
+            static_cast<EndNode*>(next)->GetPrev() = node;
+        }
     }
 
-    bool RightNull(SetNode<K>* node) const {
-        return node->GetRight() == nullptr;
+    // the roots are already swapped, the in-order chains follow them;
+    // an empty side is told by its new root, so swapping with an empty tree works both ways
+    void ConnectSetEndNodesAfterSwap(SetAVL& other) {
+        BaseNode* first = rend_node_.GetNext();
+        BaseNode* last = end_node_.GetPrev();
+        AdoptChain(other.rend_node_.GetNext(), other.end_node_.GetPrev());
+        other.AdoptChain(first, last);
     }
-
-    bool LeftVisited(SetNode<K>* node, bool visit_left) const {
-        return (node->GetLeft() != nullptr) && (visit_left);
+    void AdoptChain(BaseNode* first, BaseNode* last) {
+        if (GetRoot() == nullptr) {
+            rend_node_.GetNext() = std::addressof(end_node_);
+            end_node_.GetPrev() = std::addressof(rend_node_);
+            return;
+        }
+        LinkAfter(std::addressof(rend_node_), static_cast<Node*>(first));
+        LinkBefore(static_cast<Node*>(last), std::addressof(end_node_));
     }
 
-    bool RightVisited(SetNode<K>* node, bool visit_right) const {
-        return (node->GetRight() != nullptr) && (visit_right);
+    void ConnectSetEndNodesAfterCopy(BaseNode* max_node) {
+        if (GetRoot() != nullptr) {
+            LinkBefore(static_cast<Node*>(max_node), std::addressof(end_node_));
+        }
     }
 
-    bool LeftNotVisited(SetNode<K>* node, bool visit_left) const {
-        return (node->GetLeft() != nullptr) && (!visit_left);
-    }
+    // memory for one copied node and whether it lies in the arena
+    struct NodePlace {
+        void* memory = nullptr;
+        bool in_block = false;
+    };
 
-    bool RightNotVisited(SetNode<K>* node, bool visit_right) const {
-        return (node->GetRight() != nullptr) && (!visit_right);
+    // Structural clone of other in one walk over its parent links, without a stack.
+    // Each node is copied on the way down, so the copies follow in depth-first order and
+    // every copy hangs in the tree as soon as it exists; it is threaded on its in-order visit.
+    template <typename TakePlace>
+    void CloneFrom(const SetAVL& other, TakePlace take_place) {
+        enum class Step { kDown, kFromLeft, kFromRight };
+        Step step = Step::kDown;
+        const Node* node = other.GetRootPtr();
+        // copy of node on the way up, of its parent on the way down
+        Node* copy = nullptr;
+        BaseNode* prev_node = std::addressof(rend_node_);
+        while (node != nullptr) {
+            if (step == Step::kDown) {
+                Node* made = CloneNode(node, take_place());
+                if (copy == nullptr) {
+                    GetRoot() = NodePtr(made);
+                } else if (node->GetParent()->GetLeft().get() == node) {
+                    copy->GetLeft() = NodePtr(made);
+                } else {
+                    copy->GetRight() = NodePtr(made);
+                }
+                made->SetParent(copy);
+                copy = made;
+                if (node->GetLeft() != nullptr) {
+                    node = node->GetLeft().get();
+                } else {
+                    step = Step::kFromLeft;
+                }
+            } else if (step == Step::kFromLeft) {
+                LinkAfter(prev_node, copy);
+                prev_node = copy;
+                if (node->GetRight() != nullptr) {
+                    node = node->GetRight().get();
+                    step = Step::kDown;
+                } else {
+                    step = Step::kFromRight;
+                }
+            } else {
+                const Node* parent = node->GetParent();
+                step = (parent != nullptr && parent->GetLeft().get() == node) ? Step::kFromLeft
+                                                                             : Step::kFromRight;
+                node = parent;
+                copy = copy->GetParent();
+            }
+        }
+        ConnectSetEndNodesAfterCopy(prev_node);
+        LinkRootToEnd();
     }
 
-    std::unique_ptr<SetNode<K>> CreateCopied(SetNode<K>* top_other_node,
-                                             SetBaseNode<K>*& prev_node) {
-        auto node =
-            std::make_unique<SetNode<K>>(top_other_node->GetKey(), nullptr, nullptr,
-                                         top_other_node->GetSize(), top_other_node->GetBalance());
-        node->GetPrev() = prev_node;
-        prev_node->GetNext() = node.get();
-        prev_node = node.get();
-        return node;
+    static Node* CloneNode(const Node* node, NodePlace place) {
+        Node* copy = nullptr;
+        try {
+            copy = new (place.memory)
+                Node(node->GetKey(), nullptr, nullptr, node->GetSize(), node->GetBalance());
+        } catch (...) {
+            if (!place.in_block) {
+                FreeNodeMemory(place.memory);
+            }
+            throw;
+        }
+        copy->GetAggregate() = node->GetAggregate();
+        if (place.in_block) {
+            copy->SetInBlock();
+        }
+        return copy;
     }
 
-    void PushOrRoot(const SetAVL& other, std::stack<std::unique_ptr<SetNode<K>>>& nodes,
-                    std::unique_ptr<SetNode<K>>&& node, SetNode<K>* top_other_node) {
-        if (top_other_node == other.GetRoot().get()) {
-            GetRoot() = std::move(node);
+    // memory of a node allocated on its own whose object is already destroyed
+    static void FreeNodeMemory(void* memory) noexcept {
+        if constexpr (alignof(Node) > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+            ::operator delete(memory, std::align_val_t(alignof(Node)));
         } else {
-            nodes.push(std::move(node));
+            ::operator delete(memory);
         }
     }
 
-    void LNVRN(std::stack<std::tuple<SetNode<K>*, bool, bool>>& other_nodes,
-               SetNode<K>* top_other_node) {
-        other_nodes.push({top_other_node, LEFT_VISITED, RIGHT_VISITED});
-        other_nodes.push({top_other_node->GetLeft().get(), LEFT_NOT_VISITED, RIGHT_NOT_VISITED});
-    }
-    void LNVRNV(std::stack<std::tuple<SetNode<K>*, bool, bool>>& other_nodes,
-                SetNode<K>* top_other_node) {
-        other_nodes.push({top_other_node->GetRight().get(), LEFT_NOT_VISITED, RIGHT_NOT_VISITED});
-        other_nodes.push({top_other_node, LEFT_VISITED, RIGHT_NOT_VISITED});
-        other_nodes.push({top_other_node->GetLeft().get(), LEFT_NOT_VISITED, RIGHT_NOT_VISITED});
-    }
-    void LVRNV(std::stack<std::tuple<SetNode<K>*, bool, bool>>& other_nodes,
-               SetNode<K>* top_other_node) {
-        other_nodes.pop();
-        other_nodes.push({top_other_node, LEFT_VISITED, RIGHT_VISITED});
-        other_nodes.push({top_other_node->GetRight().get(), LEFT_NOT_VISITED, RIGHT_NOT_VISITED});
+    // memory for a node allocated on its own, as by new Node
+    static void* AllocateNodeMemory() {
+        if constexpr (alignof(Node) > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+            return ::operator new(sizeof(Node), std::align_val_t(alignof(Node)));
+        } else {
+            return ::operator new(sizeof(Node));
+        }
     }
-    void LNRNV(std::stack<std::tuple<SetNode<K>*, bool, bool>>& other_nodes,
-               SetNode<K>* top_other_node) {
-        other_nodes.push({top_other_node, LEFT_VISITED, RIGHT_VISITED});
-        other_nodes.push({top_other_node->GetRight().get(), LEFT_NOT_VISITED, RIGHT_NOT_VISITED});
+    // the next place of a block when there is one, memory of a node on its own otherwise
+    static NodePlace FreshPlace(char* block, size_t& used) {
+        if (block != nullptr) {
+            return NodePlace{block + sizeof(Node) * used++, true};
+        }
+        return NodePlace{AllocateNodeMemory(), false};
     }
-    std::unique_ptr<SetNode<K>> ConnectL(std::unique_ptr<SetNode<K>>&& node,
-                                         std::stack<std::unique_ptr<SetNode<K>>>& nodes) {
-        node->GetLeft() = std::move(nodes.top());
-        node->GetLeft()->GetParent() = node.get();
-        nodes.pop();
+    // copy of other into this empty tree, in one block
+    void CloneFresh(const SetAVL& other) {
+        if (other.Empty()) {
+            return;
+        }
+        char* block = static_cast<char*>(
+            arena_.AllocateExact(other.Size() * sizeof(Node), alignof(Node)));
+        size_t used = 0;
+        CloneFrom(other, [&]() { return FreshPlace(block, used); });
+        block_nodes_ = Size();
+    }
+
+    // Nodes of a detached tree handed out one at a time in post-order: a node is a leaf by
+    // the time it is taken and is unhooked from its parent first, so no stack is needed, and
+    // a node is reused right after the walk touched it.
+    struct DetachedNodes {
+        Node* node = nullptr;
+
+        Node* Take() noexcept {
+            while (node != nullptr) {
+                if (node->GetLeft() != nullptr) {
+                    node = node->GetLeft().get();
+                } else if (node->GetRight() != nullptr) {
+                    node = node->GetRight().get();
+                } else {
+                    Node* leaf = node;
+                    node = leaf->GetParent();
+                    if (node != nullptr && node->GetLeft().get() == leaf) {
+                        node->GetLeft().release();
+                    } else if (node != nullptr) {
+                        node->GetRight().release();
+                    }
+                    return leaf;
+                }
+            }
+            return nullptr;
+        }
+        void Free() noexcept {
+            for (Node* leaf = Take(); leaf != nullptr; leaf = Take()) {
+                SetNodeDeleter()(leaf);
+            }
+        }
+    };
+    // unlinks the nodes without destroying them, the tree is left empty
+    DetachedNodes DetachNodes() noexcept {
+        DetachedNodes nodes{GetRoot().release()};
+        rend_node_.GetNext() = std::addressof(end_node_);
+        end_node_.GetPrev() = std::addressof(rend_node_);
+        return nodes;
+    }
+
+    // subtree of count keys taken in order from next_key, threaded after prev_node;
+    // the left half gets the smaller share, so sizes of the halves differ by at most one
+    template <typename NextKey>
+    NodePtr BuildSubTree(size_t count, size_t depth, size_t max_depth, NextKey& next_key,
+                         BaseNode*& prev_node, size_t& height) {
+        if (count == 0) {
+            height = 0;
+            return nullptr;
+        }
+        size_t left_count = (count - 1) / 2;
+        size_t left_height = 0;
+        size_t right_height = 0;
+        NodePtr left =
+            BuildSubTree(left_count, depth + 1, max_depth, next_key, prev_node, left_height);
+        NodePtr node = NewNode(next_key(), count, typename NodePolicy::BalanceType{});
+        LinkAfter(prev_node, node.get());
+        prev_node = node.get();
+        NodePtr right = BuildSubTree(count - 1 - left_count, depth + 1, max_depth, next_key,
+                                     prev_node, right_height);
+        if (left != nullptr) {
+            left->SetParent(node.get());
+            node->GetLeft() = std::move(left);
+        }
+        if (right != nullptr) {
+            right->SetParent(node.get());
+            node->GetRight() = std::move(right);
+        }
+        node->GetBalance() = Balance::BuiltBalance(depth, max_depth, left_height, right_height);
+        if constexpr (NodePolicy::kAugmented) {
+            FixAggregate(node.get());
+        }
+        height = std::max(left_height, right_height) + 1;
         return node;
     }
-    std::unique_ptr<SetNode<K>> ConnectR(std::stack<std::unique_ptr<SetNode<K>>>& nodes) {
-        auto rhs = std::move(nodes.top());
-        nodes.pop();
-        auto current = std::move(nodes.top());
-        nodes.pop();
-        current->GetRight() = std::move(rhs);
-        current->GetRight()->GetParent() = current.get();
-        return current;
-    }
-
-    void CopyIteration(const SetAVL& other,
-                       std::stack<std::tuple<SetNode<K>*, bool, bool>>& other_nodes,
-                       std::stack<std::unique_ptr<SetNode<K>>>& nodes, SetNode<K>* top_other_node,
-                       bool visit_left, bool visit_right, SetBaseNode<K>*& prev_node) {
-        if (LeftNotVisited(top_other_node, visit_left) && RightNull(top_other_node)) {
-            LNVRN(other_nodes, top_other_node);
-        } else if (LeftNotVisited(top_other_node, visit_left) &&
-                   RightNotVisited(top_other_node, visit_right)) {
-            LNVRNV(other_nodes, top_other_node);
-        } else if (LeftVisited(top_other_node, visit_left) &&
-                   RightNotVisited(top_other_node, visit_right)) {
-            auto node = CreateCopied(top_other_node, prev_node);
-            node = ConnectL(std::move(node), nodes);
-            nodes.push(std::move(node));
-            LVRNV(other_nodes, top_other_node);
-        } else if (LeftVisited(top_other_node, visit_left) && RightNull(top_other_node)) {
-            auto node = CreateCopied(top_other_node, prev_node);
-            node = ConnectL(std::move(node), nodes);
-            PushOrRoot(other, nodes, std::move(node), top_other_node);
-            MakeVisited(other_nodes, top_other_node);
-        } else if (LeftVisited(top_other_node, visit_left) &&
-                   RightVisited(top_other_node, visit_right)) {
-            auto current = ConnectR(nodes);
-            PushOrRoot(other, nodes, std::move(current), top_other_node);
-            MakeVisited(other_nodes, top_other_node);
-        } else if (LeftNull(top_other_node) && RightNotVisited(top_other_node, visit_right)) {
-            auto node = CreateCopied(top_other_node, prev_node);
-            nodes.push(std::move(node));
-            LNRNV(other_nodes, top_other_node);
-        } else if (LeftNull(top_other_node) && RightVisited(top_other_node, visit_right)) {
-            auto current = ConnectR(nodes);
-            PushOrRoot(other, nodes, std::move(current), top_other_node);
-            MakeVisited(other_nodes, top_other_node);
-        } else if (LeftNull(top_other_node) && RightNull(top_other_node)) {
-            auto node = CreateCopied(top_other_node, prev_node);
-            PushOrRoot(other, nodes, std::move(node), top_other_node);
-            MakeVisited(other_nodes, top_other_node);
-        }
-    }
-
-    void Copy(const SetAVL& other) {
-        if (other.Empty()) {
+
+    template <typename NextKey>
+    void BuildFromSource(size_t count, NextKey next_key) {
+        Clear();
+        if (count == 0) {
             return;
         }
-        SetBaseNode<K>* prev_node = std::addressof(rend_node_);
-        std::stack<std::tuple<SetNode<K>*, bool, bool>> other_nodes;
-        std::stack<std::unique_ptr<SetNode<K>>> nodes;
-        other_nodes.push({other.GetRootPtr(), LEFT_NOT_VISITED, RIGHT_NOT_VISITED});
-        while (!other_nodes.empty()) {
-            auto top_other_node = std::get<0>(other_nodes.top());
-            auto visit_left = std::get<1>(other_nodes.top());
-            auto visit_right = std::get<2>(other_nodes.top());
-            other_nodes.pop();
-            CopyIteration(other, other_nodes, nodes, top_other_node, visit_left, visit_right,
-                          prev_node);
+        BaseNode* prev_node = std::addressof(rend_node_);
+        size_t height = 0;
+        size_t max_depth = static_cast<size_t>(std::bit_width(count)) - 1;
+        try {
+            GetRoot() = BuildSubTree(count, 0, max_depth, next_key, prev_node, height);
+            LinkRootToEnd();
+        } catch (...) {
+            Clear();
+            throw;
         }
         ConnectSetEndNodesAfterCopy(prev_node);
     }
 
-    void ConnectPrevNext(SetNode<K>* node, SetBaseNode<K>* prev, SetBaseNode<K>* next) {
-        node->GetNext() = next;
-        next->GetPrev() = node;
-        node->GetPrev() = prev;
-        prev->GetNext() = node;
+    // unlinked node from the arena when it is pooled, from the heap otherwise
+    template <typename P>
+    NodePtr NewNode(P&& key, size_t size, typename NodePolicy::BalanceType balance) {
+        if (!arena_.Options().Pooled()) {
+            return NodePtr(new Node(std::forward<P>(key), nullptr, nullptr, size, balance));
+        }
+        void* place = arena_.Allocate(sizeof(Node), alignof(Node));
+        NodePtr node(new (place) Node(std::forward<P>(key), nullptr, nullptr, size, balance));
+        node->SetInBlock();
+        return node;
+    }
+
+    void ConnectPrevNext(Node* node, BaseNode* prev, BaseNode* next) {
+        LinkBefore(node, next);
+        LinkAfter(prev, node);
     }
 
-    void IncreaseSizeInBranch(SetNode<K>* node) {
+    void IncreaseSizeInBranch(Node* node) {
         while (node != nullptr) {
             ++(node->GetSize());
+            if constexpr (NodePolicy::kAugmented) {
+                FixAggregate(node);
+            }
             node = node->GetParent();
         }
     }
 
-    std::pair<SetNode<K>*, bool> InsertSetNode(const SetType& key) {
-        SetNode<K>* node = GetRootPtr();
-        SetNode<K>* parent = nullptr;
+    // place for a new key found by one descent: either the equivalent node
+    // or the parent to attach to together with the in-order neighbours
+    struct InsertPosition {
+        Node* equivalent = nullptr;
+        Node* parent = nullptr;
         bool left = false;
-        SetBaseNode<K>* current_prev = std::addressof(rend_node_);
-        SetBaseNode<K>* current_next = std::addressof(end_node_);
-
-        while (true) {
-            if ((node == nullptr) && (parent == nullptr)) {
-                GetRoot() = std::make_unique<SetNode<K>>(key, std::addressof(rend_node_),
-                                                         std::addressof(end_node_), 1, 0);
-                ConnectPrevNext(GetRootPtr(), current_prev, current_next);
-                return {GetRootPtr(), true};
-            }
-            if ((node == nullptr) && (parent != nullptr) && left) {
-                parent->GetLeft() = std::make_unique<SetNode<K>>(key, nullptr, nullptr, 1, 0);
-                parent->GetLeft()->GetParent() = parent;
-                ConnectPrevNext(parent->GetLeft().get(), current_prev, current_next);
-                IncreaseSizeInBranch(parent);
-                return {parent->GetLeft().get(), true};
-            }
-            if ((node == nullptr) && (parent != nullptr) && !left) {
-                parent->GetRight() = std::make_unique<SetNode<K>>(key, nullptr, nullptr, 1, 0);
-                parent->GetRight()->GetParent() = parent;
-                ConnectPrevNext(parent->GetRight().get(), current_prev, current_next);
-                IncreaseSizeInBranch(parent);
-                return {parent->GetRight().get(), true};
-            }
-            if ((node != nullptr) && Equivalent(node->GetKey(), key, KeyCompare())) {
-                return {node, false};
-            }
-            if ((node != nullptr) && (KeyCompare()(key, node->GetKey()))) {
-                left = true;
-                parent = node;
-                current_next = node;
+        BaseNode* prev = nullptr;
+        BaseNode* next = nullptr;
+    };
+
+    template <typename P>
+    InsertPosition FindInsertPosition(const P& key) {
+        InsertPosition position;
+        position.prev = std::addressof(rend_node_);
+        position.next = std::addressof(end_node_);
+        Node* node = GetRootPtr();
+        PrefixType prefix = MakePrefix(key);
+
+        while (node != nullptr) {
+            int order = CompareWithNode(key, prefix, node);
+            if (order == 0) {
+                position.equivalent = node;
+                return position;
+            }
+            position.parent = node;
+            position.left = (order < 0);
+            if (position.left) {
+                position.next = node;
                 node = node->GetLeft().get();
             } else {
-                left = false;
-                parent = node;
-                current_prev = node;
+                position.prev = node;
                 node = node->GetRight().get();
             }
         }
+        return position;
     }
-    std::pair<SetNode<K>*, bool> InsertSetNode(SetType&& key) {
-        SetNode<K>* node = GetRootPtr();
-        SetNode<K>* parent = nullptr;
-        bool left = false;
-        SetBaseNode<K>* current_prev = std::addressof(rend_node_);
-        SetBaseNode<K>* current_next = std::addressof(end_node_);
-
-        while (true) {
-            if ((node == nullptr) && (parent == nullptr)) {
-                GetRoot() = std::make_unique<SetNode<K>>(std::move(key), std::addressof(rend_node_),
-                                                         std::addressof(end_node_), 1, 0);
-                ConnectPrevNext(GetRootPtr(), current_prev, current_next);
-                return {GetRootPtr(), true};
-            }
-            if ((node == nullptr) && (parent != nullptr) && left) {
-                parent->GetLeft() =
-                    std::make_unique<SetNode<K>>(std::move(key), nullptr, nullptr, 1, 0);
-                parent->GetLeft()->GetParent() = parent;
-                ConnectPrevNext(parent->GetLeft().get(), current_prev, current_next);
-                IncreaseSizeInBranch(parent);
-                return {parent->GetLeft().get(), true};
-            }
-            if ((node == nullptr) && (parent != nullptr) && !left) {
-                parent->GetRight() =
-                    std::make_unique<SetNode<K>>(std::move(key), nullptr, nullptr, 1, 0);
-                parent->GetRight()->GetParent() = parent;
-                ConnectPrevNext(parent->GetRight().get(), current_prev, current_next);
-                IncreaseSizeInBranch(parent);
-                return {parent->GetRight().get(), true};
-            }
-            if ((node != nullptr) && Equivalent(node->GetKey(), key, KeyCompare())) {
-                return {node, false};
-            }
-            if ((node != nullptr) && (KeyCompare()(key, node->GetKey()))) {
-                left = true;
-                parent = node;
-                current_next = node;
-                node = node->GetLeft().get();
-            } else {
-                left = false;
-                parent = node;
-                current_prev = node;
-                node = node->GetRight().get();
-            }
+
+    Node* AttachNode(NodePtr&& new_node, const InsertPosition& position) {
+        Node* node = new_node.get();
+        if (position.parent == nullptr) {
+            GetRoot() = std::move(new_node);
+            LinkRootToEnd();
+        } else if (position.left) {
+            position.parent->GetLeft() = std::move(new_node);
+            node->SetParent(position.parent);
+        } else {
+            position.parent->GetRight() = std::move(new_node);
+            node->SetParent(position.parent);
         }
+        ConnectPrevNext(node, position.prev, position.next);
+        IncreaseSizeInBranch(position.parent);
+        return node;
+    }
+
+    std::pair<Node*, bool> InsertSetNode(const SetType& key) {
+        InsertPosition position = FindInsertPosition(key);
+        if (position.equivalent != nullptr) {
+            return {position.equivalent, false};
+        }
+        return {AttachNode(NewNode(key, 1, 0), position), true};
+    }
+    std::pair<Node*, bool> InsertSetNode(SetType&& key) {
+        InsertPosition position = FindInsertPosition(key);
+        if (position.equivalent != nullptr) {
+            return {position.equivalent, false};
+        }
+        return {AttachNode(NewNode(std::move(key), 1, 0), position), true};
     }
     template <typename P>
-    std::pair<SetNode<K>*, bool> InsertSetNode(P&& key) {
-        SetNode<K>* node = GetRootPtr();
-        SetNode<K>* parent = nullptr;
-        bool left = false;
-        SetBaseNode<K>* current_prev = std::addressof(rend_node_);
-        SetBaseNode<K>* current_next = std::addressof(end_node_);
-
-        while (true) {
-            if ((node == nullptr) && (parent == nullptr)) {
-                GetRoot() =
-                    std::make_unique<SetNode<K>>(std::forward<P>(key), std::addressof(rend_node_),
-                                                 std::addressof(end_node_), 1, 0);
-                ConnectPrevNext(GetRootPtr(), current_prev, current_next);
-                return {GetRootPtr(), true};
-            }
-            if ((node == nullptr) && (parent != nullptr) && left) {
-                parent->GetLeft() =
-                    std::make_unique<SetNode<K>>(std::forward<P>(key), nullptr, nullptr, 1, 0);
-                parent->GetLeft()->GetParent() = parent;
-                ConnectPrevNext(parent->GetLeft().get(), current_prev, current_next);
-                IncreaseSizeInBranch(parent);
-                return {parent->GetLeft().get(), true};
-            }
-            if ((node == nullptr) && (parent != nullptr) && !left) {
-                parent->GetRight() =
-                    std::make_unique<SetNode<K>>(std::forward<P>(key), nullptr, nullptr, 1, 0);
-                parent->GetRight()->GetParent() = parent;
-                ConnectPrevNext(parent->GetRight().get(), current_prev, current_next);
-                IncreaseSizeInBranch(parent);
-                return {parent->GetRight().get(), true};
-            }
-            if ((node != nullptr) && Equivalent(node->GetKey(), key, KeyCompare())) {
-                return {node, false};
-            }
-            if ((node != nullptr) && (KeyCompare()(key, node->GetKey()))) {
-                left = true;
-                parent = node;
-                current_next = node;
-                node = node->GetLeft().get();
-            } else {
-                left = false;
-                parent = node;
-                current_prev = node;
-                node = node->GetRight().get();
-            }
+    std::pair<Node*, bool> InsertSetNode(P&& key) {
+        InsertPosition position = FindInsertPosition(key);
+        if (position.equivalent != nullptr) {
+            return {position.equivalent, false};
         }
+        return {AttachNode(NewNode(std::forward<P>(key), 1, 0), position), true};
     }
 
-    size_t GetNumInSubTree(SetNode<K>* node) const {
+    size_t GetNumInSubTree(Node* node) const {
         if (node == nullptr || node->GetLeft() == nullptr) {
             return 1;
         }
         return (node->GetLeft()->GetSize() + 1);
     }
 
-    SetNode<K>* SelectNode(size_t i) const {
-        SetNode<K>* node = GetRootPtr();
+    Node* SelectNode(size_t i) const {
+        return SelectInSubTree(GetRootPtr(), i);
+    }
+
+    // i-th (1-indexed) node of the subtree rooted at node
+    Node* SelectInSubTree(Node* node, size_t i) const {
         size_t current_size = GetNumInSubTree(node);
         while (current_size != i) {
             if (i < current_size) {
@@ -1102,15 +1855,143 @@ private:
         return node;
     }
 
+    static void Prefetch(const void* address) noexcept {
+#if defined(__GNUC__) || defined(__clang__)
+        __builtin_prefetch(address);
+#endif
+    }
+
+    static constexpr size_t kBatchWindow = 16;
+
+    // Descent states for the batched lookups. Step moves a descent one stage and returns
+    // true with the result once it is done. A stage touches only nodes prefetched by the
+    // previous stage of the same descent.
+    struct FindDescent {
+        Node* node;
+        PrefixType prefix;
+        const K* key;
+
+        bool Step(const SetAVL& tree, ConstIterator& result) {
+            if (node == nullptr) {
+                result = tree.End();
+                return true;
+            }
+            int order = tree.CompareWithNode(*key, prefix, node);
+            if (order == 0) {
+                result = ConstIterator{node};
+                return true;
+            }
+            node = (order < 0) ? node->GetLeft().get() : node->GetRight().get();
+            Prefetch(node);
+            return false;
+        }
+    };
+    // the size of the left child is a second miss per level, it is prefetched in its own stage
+    struct RankDescent {
+        Node* node;
+        PrefixType prefix;
+        const K* key;
+        size_t less = 0;
+        bool left_ready = false;
+
+        bool Step(const SetAVL& tree, size_t& result) {
+            if (node == nullptr) {
+                result = less;
+                return true;
+            }
+            if (!left_ready) {
+                Prefetch(node->GetLeft().get());
+                left_ready = true;
+                return false;
+            }
+            int order = tree.CompareWithNode(*key, prefix, node);
+            if (order < 0) {
+                node = node->GetLeft().get();
+            } else {
+                less += tree.GetNumInSubTree(node) - (order == 0);
+                node = (order == 0) ? nullptr : node->GetRight().get();
+            }
+            Prefetch(node);
+            left_ready = false;
+            return false;
+        }
+    };
+    struct SelectDescent {
+        Node* node;
+        size_t i;
+        bool left_ready = false;
+
+        bool Step(const SetAVL& tree, ConstIterator& result) {
+            if (node == nullptr) {
+                result = tree.End();
+                return true;
+            }
+            if (!left_ready) {
+                Prefetch(node->GetLeft().get());
+                left_ready = true;
+                return false;
+            }
+            size_t current_size = tree.GetNumInSubTree(node);
+            if (i == current_size) {
+                result = ConstIterator{node};
+                return true;
+            }
+            if (i < current_size) {
+                node = node->GetLeft().get();
+            } else {
+                node = node->GetRight().get();
+                i -= current_size;
+            }
+            Prefetch(node);
+            left_ready = false;
+            return false;
+        }
+    };
+
+    // AMAC-style executor: a window of descents is stepped round-robin,
+    // a finished descent hands its slot to the next query
+    template <typename Result, typename Query, typename Start>
+    std::vector<Result> InterleaveDescents(const std::vector<Query>& queries, Result fill,
+                                           Start start) const {
+        using Descent = std::invoke_result_t<Start, const Query&>;
+        std::vector<Result> results(queries.size(), fill);
+        std::vector<Descent> descents;
+        std::vector<size_t> owners;
+        size_t next = 0;
+        for (; next < queries.size() && next < kBatchWindow; ++next) {
+            descents.push_back(start(queries[next]));
+            owners.push_back(next);
+        }
+        while (!descents.empty()) {
+            for (size_t slot = 0; slot < descents.size();) {
+                if (!descents[slot].Step(*this, results[owners[slot]])) {
+                    ++slot;
+                } else if (next < queries.size()) {
+                    descents[slot] = start(queries[next]);
+                    owners[slot] = next++;
+                    ++slot;
+                } else {
+                    descents[slot] = descents.back();
+                    owners[slot] = owners.back();
+                    descents.pop_back();
+                    owners.pop_back();
+                }
+            }
+        }
+        return results;
+    }
+
     size_t RankKey(const K& key) const {
-        SetNode<K>* node = GetRootPtr();
+        Node* node = GetRootPtr();
         size_t current_size = GetNumInSubTree(node);
+        PrefixType prefix = MakePrefix(key);
 
         while (node != nullptr) {
-            if (Equivalent(key, node->GetKey(), KeyCompare())) {
+            int order = CompareWithNode(key, prefix, node);
+            if (order == 0) {
                 return current_size;
             }
-            if (KeyCompare()(key, node->GetKey())) {
+            if (order < 0) {
                 size_t parent_size = GetNumInSubTree(node);
                 node = node->GetLeft().get();
                 current_size = current_size - parent_size + GetNumInSubTree(node);
@@ -1122,119 +2003,271 @@ private:
         return current_size;
     }
 
-    SetNode<K>* GetReleased(std::unique_ptr<SetNode<K>>& node) {
-        if (node != nullptr) {
-            return node.release();
+    // highest node with lo <= key < hi, the paths to both bounds split there
+    Node* FindRangeSplit(const K& lo, const K& hi) const {
+        Node* node = GetRootPtr();
+        while (node != nullptr) {
+            if (KeyCompare()(node->GetKey(), lo)) {
+                node = node->GetRight().get();
+            } else if (!KeyCompare()(node->GetKey(), hi)) {
+                node = node->GetLeft().get();
+            } else {
+                return node;
+            }
         }
         return nullptr;
     }
 
-    void ConnectAfterRotation(SetNode<K>* parent, SetNode<K>* child, bool left) {
-        if (child != nullptr) {
-            child->GetParent() = parent;
+    // aggregate of keys not less than lo in the subtree
+    AggregateType SuffixAggregate(Node* node, const K& lo) const {
+        AggregateType result = Augment::Identity();
+        while (node != nullptr) {
+            if (KeyCompare()(node->GetKey(), lo)) {
+                node = node->GetRight().get();
+            } else {
+                AggregateType with_right = Augment::Combine(
+                    Augment::FromKey(node->GetKey()), GetNodeAggregate(node->GetRight().get()));
+                result = Augment::Combine(with_right, result);
+                node = node->GetLeft().get();
+            }
         }
-        if (parent != nullptr && left) {
-            parent->GetLeft() = std::unique_ptr<SetNode<K>>(child);
-        } else if (parent != nullptr) {
-            parent->GetRight() = std::unique_ptr<SetNode<K>>(child);
-        } else {
-            GetRoot() = std::unique_ptr<SetNode<K>>(child);
+        return result;
+    }
+
+    // aggregate of keys less than hi in the subtree
+    AggregateType PrefixAggregate(Node* node, const K& hi) const {
+        AggregateType result = Augment::Identity();
+        while (node != nullptr) {
+            if (KeyCompare()(node->GetKey(), hi)) {
+                result = Augment::Combine(result,
+                                          Augment::Combine(GetNodeAggregate(node->GetLeft().get()),
+                                                           Augment::FromKey(node->GetKey())));
+                node = node->GetRight().get();
+            } else {
+                node = node->GetLeft().get();
+            }
         }
+        return result;
     }
 
-    void FixLeftBalance(SetNode<K>* left_child, SetNode<K>* node) {
-        assert(left_child != nullptr);
-        assert(node != nullptr);
-        if ((GetNodeBalance(left_child) == -2) && (GetNodeBalance(node) == -1)) {
-            left_child->GetBalance() = 0;
-            node->GetBalance() = 0;
-        } else if ((GetNodeBalance(left_child) == -2) && (GetNodeBalance(node) == 0)) {
-            left_child->GetBalance() = -1;
-            node->GetBalance() = 1;
-        } else {
-            assert(false);
+    // lowest node on the way up from a finger whose key range holds the key,
+    // the nearest greater ancestor above it when known, and the rank of the
+    // first key of its subtree relative to the finger
+    struct FingerClimb {
+        Node* node = nullptr;
+        Node* upper = nullptr;
+        std::ptrdiff_t offset = 0;
+    };
+
+    FingerClimb ClimbFromFinger(const Node* finger, const K& key) const {
+        FingerClimb climb;
+        climb.node = const_cast<Node*>(finger);
+        climb.offset = -static_cast<std::ptrdiff_t>(GetNodeSize(finger->GetLeft().get()));
+        PrefixType prefix = MakePrefix(key);
+        int order = CompareWithNode(key, prefix, finger);
+        if (order == 0) {
+            return climb;
+        }
+        // going right only ancestors entered from the left can bound the key,
+        // going left only those entered from the right
+        while (climb.node->GetParent() != nullptr) {
+            Node* parent = climb.node->GetParent();
+            bool from_left = (parent->GetLeft().get() == climb.node);
+            if (from_left == (order > 0)) {
+                int parent_order = CompareWithNode(key, prefix, parent);
+                if (parent_order == -order) {
+                    climb.upper = (order > 0) ? parent : nullptr;
+                    return climb;
+                }
+                if (parent_order == 0) {
+                    climb.offset -= static_cast<std::ptrdiff_t>(
+                        from_left ? 0 : GetNodeSize(parent->GetLeft().get()) + 1);
+                    climb.node = parent;
+                    return climb;
+                }
+            }
+            if (!from_left) {
+                climb.offset -=
+                    static_cast<std::ptrdiff_t>(GetNodeSize(parent->GetLeft().get()) + 1);
+            }
+            climb.node = parent;
         }
+        return climb;
     }
-    void FixRightBalance(SetNode<K>* right_child, SetNode<K>* node) {
-        assert(right_child != nullptr);
-        assert(node != nullptr);
-        if ((GetNodeBalance(right_child) == 2) && (GetNodeBalance(node) == 1)) {
-            right_child->GetBalance() = 0;
-            node->GetBalance() = 0;
-        } else if ((GetNodeBalance(right_child) == 2) && (GetNodeBalance(node) == 0)) {
-            right_child->GetBalance() = 1;
-            node->GetBalance() = -1;
-        } else {
-            assert(false);
+
+    Node* FindNodeFrom(const BaseNode* finger, const K& key) const {
+        if (finger->IsSetEndNode()) {
+            return FindSetNode(key);
         }
+        Node* node = ClimbFromFinger(static_cast<const Node*>(finger), key).node;
+        PrefixType prefix = MakePrefix(key);
+        while (node != nullptr) {
+            int order = CompareWithNode(key, prefix, node);
+            if (order == 0) {
+                return node;
+            }
+            node = (order < 0) ? node->GetLeft().get() : node->GetRight().get();
+        }
+        return nullptr;
     }
-    void FixRightLeftBalance(SetNode<K>* left_child, SetNode<K>* right_child, SetNode<K>* node) {
-        assert(left_child != nullptr);
-        assert(right_child != nullptr);
-        assert(node != nullptr);
 
-        if ((GetNodeBalance(left_child) == -2) && (GetNodeBalance(right_child) == 1) &&
-            (GetNodeBalance(node) == 1)) {
-            left_child->GetBalance() = 0;
-            right_child->GetBalance() = -1;
-            node->GetBalance() = 0;
+    Node* LowerBoundNodeFrom(const BaseNode* finger, const K& key) const {
+        if (finger->IsSetEndNode()) {
+            return FindLowerBound(key);
+        }
+        FingerClimb climb = ClimbFromFinger(static_cast<const Node*>(finger), key);
+        return LowerBoundInSubTree(climb.node, climb.upper, key);
+    }
 
-        } else if ((GetNodeBalance(left_child) == -2) && (GetNodeBalance(right_child) == 1) &&
-                   (GetNodeBalance(node) == -1)) {
-            left_child->GetBalance() = 1;
-            right_child->GetBalance() = 0;
-            node->GetBalance() = 0;
+    Node* LowerBoundInSubTree(Node* node, Node* best_bound, const K& key) const {
+        PrefixType prefix = MakePrefix(key);
+        while (node != nullptr) {
+            int order = CompareWithNode(key, prefix, node);
+            if (order == 0) {
+                return node;
+            }
+            if (order < 0) {
+                best_bound = node;
+                node = node->GetLeft().get();
+            } else {
+                node = node->GetRight().get();
+            }
+        }
+        return best_bound;
+    }
 
-        } else if ((GetNodeBalance(left_child) == -2) && (GetNodeBalance(right_child) == 1) &&
-                   (GetNodeBalance(node) == 0)) {
-            left_child->GetBalance() = 0;
-            right_child->GetBalance() = 0;
-            node->GetBalance() = 0;
+    size_t CountNotLess(Node* node, const K& lo) const {
+        size_t count = 0;
+        while (node != nullptr) {
+            if (KeyCompare()(node->GetKey(), lo)) {
+                node = node->GetRight().get();
+            } else {
+                count += GetNodeSize(node->GetRight().get()) + 1;
+                node = node->GetLeft().get();
+            }
+        }
+        return count;
+    }
 
-        } else {
-            assert(false);
+    size_t CountLess(Node* node, const K& hi) const {
+        size_t count = 0;
+        while (node != nullptr) {
+            if (KeyCompare()(node->GetKey(), hi)) {
+                count += GetNodeSize(node->GetLeft().get()) + 1;
+                node = node->GetRight().get();
+            } else {
+                node = node->GetLeft().get();
+            }
         }
+        return count;
     }
-    void FixLeftRightBalance(SetNode<K>* right_child, SetNode<K>* left_child, SetNode<K>* node) {
-        assert(right_child != nullptr);
-        assert(left_child != nullptr);
-        assert(node != nullptr);
 
-        if ((GetNodeBalance(right_child) == 2) && (GetNodeBalance(left_child) == -1) &&
-            (GetNodeBalance(node) == -1)) {
-            right_child->GetBalance() = 0;
-            left_child->GetBalance() = 1;
-            node->GetBalance() = 0;
+    size_t IndexOfNode(const BaseNode* base) const {
+        assert(base != nullptr);
+        if (base->IsSetEndNode()) {
+            return Size();
+        }
+        auto node = static_cast<const Node*>(base);
+        size_t index = GetNodeSize(node->GetLeft().get());
+        while (node->GetParent() != nullptr) {
+            const Node* parent = node->GetParent();
+            if (parent->GetRight().get() == node) {
+                index += GetNodeSize(parent->GetLeft().get()) + 1;
+            }
+            node = parent;
+        }
+        return index;
+    }
 
-        } else if ((GetNodeBalance(right_child) == 2) && (GetNodeBalance(left_child) == -1) &&
-                   (GetNodeBalance(node) == 1)) {
-            right_child->GetBalance() = -1;
-            left_child->GetBalance() = 0;
-            node->GetBalance() = 0;
+    const Node* AdvanceNode(const BaseNode* base, std::ptrdiff_t k) const {
+        assert(base != nullptr);
+        if (base->IsSetEndNode()) {
+            if (k >= 0 || static_cast<size_t>(-k) > Size()) {
+                return nullptr;
+            }
+            return SelectNode(Size() + 1 - static_cast<size_t>(-k));
+        }
+        auto node = static_cast<const Node*>(base);
+        // target position inside the subtree of node
+        std::ptrdiff_t target = static_cast<std::ptrdiff_t>(GetNodeSize(node->GetLeft().get())) + k;
+        while (target < 0 || target >= static_cast<std::ptrdiff_t>(node->GetSize())) {
+            Node* parent = node->GetParent();
+            if (parent == nullptr) {
+                return nullptr;
+            }
+            if (parent->GetRight().get() == node) {
+                target += static_cast<std::ptrdiff_t>(GetNodeSize(parent->GetLeft().get()) + 1);
+            }
+            node = parent;
+        }
+        return SelectInSubTree(const_cast<Node*>(node), static_cast<size_t>(target) + 1);
+    }
+
+    Node* SelectNodeByWeight(const AggregateType& weight) const {
+        static_assert(NodePolicy::kAugmented, "SetAVL is not augmented");
+        Node* node = GetRootPtr();
+        AggregateType before = Augment::Identity();
+        while (node != nullptr) {
+            AggregateType with_left =
+                Augment::Combine(before, GetNodeAggregate(node->GetLeft().get()));
+            if (weight < with_left) {
+                node = node->GetLeft().get();
+                continue;
+            }
+            AggregateType with_node = Augment::Combine(with_left, Augment::FromKey(node->GetKey()));
+            if (weight < with_node) {
+                return node;
+            }
+            before = with_node;
+            node = node->GetRight().get();
+        }
+        return nullptr;
+    }
 
-        } else if ((GetNodeBalance(right_child) == 2) && (GetNodeBalance(left_child) == -1) &&
-                   (GetNodeBalance(node) == 0)) {
-            right_child->GetBalance() = 0;
-            left_child->GetBalance() = 0;
-            node->GetBalance() = 0;
+    Node* GetReleased(NodePtr& node) {
+        if (node != nullptr) {
+            return node.release();
+        }
+        return nullptr;
+    }
 
+    void ConnectAfterRotation(Node* parent, Node* child, bool left) {
+        if (child != nullptr) {
+            child->SetParent(parent);
+        }
+        if (parent != nullptr && left) {
+            parent->GetLeft() = NodePtr(child);
+        } else if (parent != nullptr) {
+            parent->GetRight() = NodePtr(child);
         } else {
-            assert(false);
+            GetRoot() = NodePtr(child);
+            LinkRootToEnd();
         }
     }
-    void FixSize(SetNode<K>* node) {
+
+    void FixAggregate(Node* node) {
+        node->GetAggregate() = Augment::Combine(
+            Augment::Combine(GetNodeAggregate(node->GetLeft().get()),
+                             Augment::FromKey(node->GetKey())),
+            GetNodeAggregate(node->GetRight().get()));
+    }
+    void FixSize(Node* node) {
         node->GetSize() =
             GetNodeSize(node->GetLeft().get()) + GetNodeSize(node->GetRight().get()) + 1;
+        if constexpr (NodePolicy::kAugmented) {
+            FixAggregate(node);
+        }
     }
 
-    std::pair<SetNode<K>*, SetNode<K>*> DoLeftRotate(std::unique_ptr<SetNode<K>>& node) {
+    std::pair<Node*, Node*> DoLeftRotate(NodePtr& node) {
         assert(node != nullptr);
         assert(node->GetRight() != nullptr);
+        ++rotation_count_;
 
-        std::unique_ptr<SetNode<K>>& right_child = node->GetRight();
-        std::unique_ptr<SetNode<K>>& left_subtree = node->GetLeft();
-        std::unique_ptr<SetNode<K>>& middle_subtree = right_child->GetLeft();
-        std::unique_ptr<SetNode<K>>& right_subtree = right_child->GetRight();
+        NodePtr& right_child = node->GetRight();
+        NodePtr& left_subtree = node->GetLeft();
+        NodePtr& middle_subtree = right_child->GetLeft();
+        NodePtr& right_subtree = right_child->GetRight();
 
         auto parent_ptr = node->GetParent();
         bool left_node = (parent_ptr != nullptr) && (parent_ptr->GetLeft().get() == node.get());
@@ -1256,25 +2289,15 @@ private:
         return {node_ptr, right_child_ptr};
     }
 
-    // may be written
-    SetNode<K>* RotateLeft(std::unique_ptr<SetNode<K>>& node) {
-
-        auto pair = DoLeftRotate(node);
-        auto left_child_ptr = pair.first;
-        auto node_ptr = pair.second;
-
-        FixLeftBalance(left_child_ptr, node_ptr);
-        return node_ptr;
-    }
-
-    std::pair<SetNode<K>*, SetNode<K>*> DoRightRotate(std::unique_ptr<SetNode<K>>& node) {
+    std::pair<Node*, Node*> DoRightRotate(NodePtr& node) {
         assert(node != nullptr);
         assert(node->GetLeft() != nullptr);
+        ++rotation_count_;
 
-        std::unique_ptr<SetNode<K>>& left_child = node->GetLeft();
-        std::unique_ptr<SetNode<K>>& left_subtree = left_child->GetLeft();
-        std::unique_ptr<SetNode<K>>& middle_subtree = left_child->GetRight();
-        std::unique_ptr<SetNode<K>>& right_subtree = node->GetRight();
+        NodePtr& left_child = node->GetLeft();
+        NodePtr& left_subtree = left_child->GetLeft();
+        NodePtr& middle_subtree = left_child->GetRight();
+        NodePtr& right_subtree = node->GetRight();
 
         auto parent_ptr = node->GetParent();
         bool left_node = (parent_ptr != nullptr) && (parent_ptr->GetLeft().get() == node.get());
@@ -1296,57 +2319,93 @@ private:
         return {node_ptr, left_child_ptr};
     }
 
-    // maybe written
-    SetNode<K>* RotateRight(std::unique_ptr<SetNode<K>>& node) {
-        auto pair = DoRightRotate(node);
-        auto right_child_ptr = pair.first;
-        auto node_ptr = pair.second;
-
-        FixRightBalance(right_child_ptr, node_ptr);
-        return node_ptr;
+    void BreadthFirstOrder(std::vector<Node*>& order) const {
+        order.push_back(GetRootPtr());
+        for (size_t i = 0; i < order.size(); ++i) {
+            if (order[i]->GetLeft() != nullptr) {
+                order.push_back(order[i]->GetLeft().get());
+            }
+            if (order[i]->GetRight() != nullptr) {
+                order.push_back(order[i]->GetRight().get());
+            }
+        }
     }
-
-    SetNode<K>* RotateRightLeft(std::unique_ptr<SetNode<K>>& node) {
-        assert(node != nullptr);
-        assert(node->GetRight() != nullptr);
-        assert(node->GetRight()->GetLeft() != nullptr);
-
-        assert(node->GetBalance() == -2);
-        assert(node->GetRight()->GetBalance() == 1);
-
-        auto pair = DoRightRotate(node->GetRight());
-        auto right_child_ptr = pair.first;
-        auto node_ptr = pair.second;
-
-        auto pair2 = DoLeftRotate(node);
-        auto left_child_ptr = pair2.first;
-        assert(node_ptr == pair2.second);
-
-        FixRightLeftBalance(left_child_ptr, right_child_ptr, node_ptr);
-        return node_ptr;
+    // the first levels of the subtree of node in van Emde Boas order
+    void VanEmdeBoasOrder(Node* node, size_t levels, std::vector<Node*>& order) const {
+        if (node == nullptr) {
+            return;
+        }
+        if (levels <= 2) {
+            order.push_back(node);
+            if (levels == 2) {
+                if (node->GetLeft() != nullptr) {
+                    order.push_back(node->GetLeft().get());
+                }
+                if (node->GetRight() != nullptr) {
+                    order.push_back(node->GetRight().get());
+                }
+            }
+            return;
+        }
+        size_t top = levels / 2;
+        VanEmdeBoasOrder(node, top, order);
+        std::vector<Node*> bottoms;
+        CollectAtDepth(node, top, bottoms);
+        for (Node* bottom : bottoms) {
+            VanEmdeBoasOrder(bottom, levels - top, order);
+        }
+    }
+    static void CollectAtDepth(Node* node, size_t depth, std::vector<Node*>& nodes) {
+        if (node == nullptr) {
+            return;
+        }
+        if (depth == 0) {
+            nodes.push_back(node);
+            return;
+        }
+        CollectAtDepth(node->GetLeft().get(), depth - 1, nodes);
+        CollectAtDepth(node->GetRight().get(), depth - 1, nodes);
     }
 
-    SetNode<K>* RotateLeftRight(std::unique_ptr<SetNode<K>>& node) {
-        assert(node != nullptr);
-        assert(node->GetLeft() != nullptr);
-        assert(node->GetLeft()->GetRight() != nullptr);
-
-        assert(node->GetBalance() == 2);
-        assert(node->GetLeft()->GetBalance() == -1);
-
-        auto pair = DoLeftRotate(node->GetLeft());
-        auto left_child_ptr = pair.first;
-        auto node_ptr = pair.second;
-
-        auto pair2 = DoRightRotate(node);
-        auto right_child_ptr = pair2.first;
-        assert(node_ptr == pair2.second);
-
-        FixLeftRightBalance(right_child_ptr, left_child_ptr, node_ptr);
-        return node_ptr;
+    static void CopyToBlock(const Node* node, Node* place) {
+        Node* copy = new (place) Node(node->GetKey(), nullptr, nullptr, node->GetSize(),
+                                      node->GetBalance());
+        copy->GetAggregate() = node->GetAggregate();
+        copy->SetInBlock();
+    }
+    // links the copies like the old nodes; the parent field of each old node is overwritten
+    // with its copy first, the old tree is only destroyed afterwards
+    void RelinkInBlock(const std::vector<Node*>& old_nodes, Node* new_nodes) noexcept {
+        for (size_t i = 0; i < old_nodes.size(); ++i) {
+            old_nodes[i]->SetParent(new_nodes + i);
+        }
+        auto copy_of = [](BaseNode* node) -> BaseNode* {
+            if (node->IsSetEndNode()) {
+                return node;
+            }
+            return static_cast<Node*>(node)->GetParent();
+        };
+        for (size_t i = 0; i < old_nodes.size(); ++i) {
+            Node* node = old_nodes[i];
+            Node* copy = new_nodes + i;
+            if (node->GetLeft() != nullptr) {
+                copy->GetLeft() = NodePtr(node->GetLeft()->GetParent());
+                copy->GetLeft()->SetParent(copy);
+            }
+            if (node->GetRight() != nullptr) {
+                copy->GetRight() = NodePtr(node->GetRight()->GetParent());
+                copy->GetRight()->SetParent(copy);
+            }
+            if constexpr (NodePolicy::kThreaded) {
+                copy->GetPrev() = copy_of(node->GetPrev());
+                copy->GetNext() = copy_of(node->GetNext());
+            }
+        }
+        rend_node_.GetNext() = copy_of(rend_node_.GetNext());
+        end_node_.GetPrev() = copy_of(end_node_.GetPrev());
     }
 
-    std::unique_ptr<SetNode<K>>& GetNodeUn(SetNode<K>* node) {
+    NodePtr& GetNodeUn(Node* node) {
         if (node->GetParent() == nullptr) {
             return GetRoot();
         } else if (node->GetParent()->GetLeft().get() == node) {
@@ -1357,56 +2416,20 @@ private:
         }
     }
 
-    // maybe finished
-    void BalanceAfterInsert(SetNode<K>* inserted_node) {
-        SetNode<K>* current_node = inserted_node->GetParent();
-        SetNode<K>* previous_node = inserted_node;
-        while (current_node != nullptr) {
-            if (current_node->GetLeft().get() == previous_node) {
-                ++(current_node->GetBalance());
-            } else {
-                assert(current_node->GetRight().get() == previous_node);
-                --(current_node->GetBalance());
-            }
-            assert(IsBalanceNormal(current_node));
-            if (current_node->GetBalance() == 0) {
-                return;
-            }
-            if (std::abs(current_node->GetBalance()) == 1) {
-                previous_node = current_node;
-                current_node = current_node->GetParent();
-            } else {
-                assert(std::abs(current_node->GetBalance()) == 2);
-                std::unique_ptr<SetNode<K>>& current_node_smart = GetNodeUn(current_node);
-                if (LeftRotateNeeded(current_node)) {
-                    current_node = RotateLeft(current_node_smart);
-                } else if (RightRotateNeded(current_node)) {
-                    current_node = RotateRight(current_node_smart);
-                } else if (RightLeftRotateNeeded(current_node)) {
-                    current_node = RotateRightLeft(current_node_smart);
-                } else if (LeftRightRotateNeeded(current_node)) {
-                    current_node = RotateLeftRight(current_node_smart);
-                } else {
-                    assert(false);
-                }
-                if (current_node->GetBalance() == 0) {
-                    return;
-                } else {
-                    assert(std::abs(current_node->GetBalance()) == 1);
-                    previous_node = current_node;
-                    current_node = current_node->GetParent();
-                }
-            }
-        }
-    }
-
-    CompressedPair<std::unique_ptr<SetNode<K>>, Compare> root_compare_;
-    SetEndNode<K> rend_node_{nullptr, std::addressof(end_node_)};
-    SetEndNode<K> end_node_{std::addressof(rend_node_), nullptr};
+    // nodes relocated by Compact or carved from the arena, declared first to outlive the tree
+    SetNodeArena arena_;
+    // nodes placed by the last Compact
+    size_t block_nodes_ = 0;
+    CompressedPair<NodePtr, Compare> root_compare_;
+    EndNode rend_node_{nullptr, std::addressof(end_node_), std::addressof(end_node_)};
+    EndNode end_node_{std::addressof(rend_node_), nullptr, std::addressof(rend_node_)};
+    size_t rotation_count_ = 0;
+    size_t compaction_count_ = 0;
 };
 
-template <typename K, typename Compare>
-bool operator==(const SetAVL<K, Compare>& lhs, const SetAVL<K, Compare>& rhs) {
+template <typename K, typename Compare, typename Augment, typename Balance, typename Layout>
+bool operator==(const SetAVL<K, Compare, Augment, Balance, Layout>& lhs,
+                const SetAVL<K, Compare, Augment, Balance, Layout>& rhs) {
     if (lhs.Size() != rhs.Size()) {
         return false;
     }
@@ -1421,18 +2444,20 @@ bool operator==(const SetAVL<K, Compare>& lhs, const SetAVL<K, Compare>& rhs) {
     return true;
 }
 
-template <typename K, typename Compare>
-void Swap(const SetAVL<K, Compare>& lhs, const SetAVL<K, Compare>& rhs) {
+template <typename K, typename Compare, typename Augment, typename Balance, typename Layout>
+void Swap(const SetAVL<K, Compare, Augment, Balance, Layout>& lhs,
+          const SetAVL<K, Compare, Augment, Balance, Layout>& rhs) {
     lhs.Swap(rhs);
 }
 
-template <typename K, typename Compare>
-bool operator!=(const SetAVL<K, Compare>& lhs, const SetAVL<K, Compare>& rhs) {
+template <typename K, typename Compare, typename Augment, typename Balance, typename Layout>
+bool operator!=(const SetAVL<K, Compare, Augment, Balance, Layout>& lhs,
+                const SetAVL<K, Compare, Augment, Balance, Layout>& rhs) {
     return (lhs != rhs);
 }
 
-template <typename K>
-size_t CalcNodeHeight(const SetNode<K>* node) {
+template <typename K, typename Policy>
+size_t CalcNodeHeight(const SetNode<K, Policy>* node) {
     if (!node) {
         return 0;
     }
@@ -0,0 +1,319 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "SetAVL.h"
+
+// Frozen SetAVL image that is used in place, e.g. straight from mmap.
+// The nodes are stored in key order in one array, links are indices into that array,
+// so the image does not depend on the address it is mapped at and holds no pointers.
+// The tree has halves of equal size (the shape of SetAVL::AssignSorted), its height is
+// the minimal one. The array position of a node is its rank: Select and iteration need
+// no descent, Find, LowerBound and Rank descend along the links.
+// Opening an image checks only its header, pages are faulted in by the queries.
+//   header (64 bytes): magic "SETAVLIM", u32 version, u32 byte order mark, u32 key size,
+//   u32 node size, u64 node count, u64 root index, padding; then the node array.
+
+inline constexpr char kSetImageMagic[8] = {'S', 'E', 'T', 'A', 'V', 'L', 'I', 'M'};
+inline constexpr uint32_t kSetImageVersion = 1;
+inline constexpr uint64_t kSetImageNoLink = ~uint64_t{0};
+
+template <typename K>
+struct SetImageNode {
+    K key;
+    uint64_t left;
+    uint64_t right;
+};
+
+struct SetImageHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t key_size;
+    uint32_t node_size;
+    uint64_t count;
+    uint64_t root;
+    char padding[24];
+};
+static_assert(sizeof(SetImageHeader) == 64);
+
+// Streams an image of count keys given in ascending order: the nodes are emitted in order,
+// each with the links of its place in the tree, so memory use does not depend on count.
+template <typename K>
+class SetImageWriter {
+public:
+    using Node = SetImageNode<K>;
+    static_assert(std::is_trivially_copyable_v<K>, "SetAVLImage stores keys as raw bytes");
+
+    SetImageWriter(std::ostream& out, uint64_t count) : writer_(out), count_(count) {
+        SetImageHeader header{};
+        std::memcpy(header.magic, kSetImageMagic, sizeof(kSetImageMagic));
+        header.version = kSetImageVersion;
+        header.byte_order = kSetSnapshotByteOrder;
+        header.key_size = sizeof(K);
+        header.node_size = sizeof(Node);
+        header.count = count;
+        header.root = (count == 0) ? kSetImageNoLink : RootOf(0, count);
+        writer_.WriteValue(header);
+    }
+
+    // next_key() is called count times and returns the keys in ascending order
+    template <typename NextKey>
+    void WriteNodes(NextKey next_key) {
+        WriteRange(0, count_, next_key);
+        writer_.Flush();
+    }
+
+private:
+    static uint64_t RootOf(uint64_t begin, uint64_t end) {
+        return begin + (end - begin - 1) / 2;
+    }
+
+    template <typename NextKey>
+    void WriteRange(uint64_t begin, uint64_t end, NextKey& next_key) {
+        if (begin == end) {
+            return;
+        }
+        uint64_t root = RootOf(begin, end);
+        WriteRange(begin, root, next_key);
+        Node node{};
+        node.key = next_key();
+        node.left = (begin == root) ? kSetImageNoLink : RootOf(begin, root);
+        node.right = (root + 1 == end) ? kSetImageNoLink : RootOf(root + 1, end);
+        writer_.WriteValue(node);
+        WriteRange(root + 1, end, next_key);
+    }
+
+    SetSnapshotWriter writer_;
+    uint64_t count_;
+};
+
+template <typename K, typename Compare = std::less<K>>
+class SetAVLImage {
+public:
+    using Node = SetImageNode<K>;
+
+    class ConstIterator {
+    public:
+        explicit ConstIterator(const Node* node) noexcept : node_(node) {
+        }
+        const K& operator*() const {
+            return node_->key;
+        }
+        const K* operator->() const {
+            return std::addressof(node_->key);
+        }
+        ConstIterator& operator++() {
+            ++node_;
+            return *this;
+        }
+        ConstIterator operator++(int) {
+            ConstIterator tmp = *this;
+            ++node_;
+            return tmp;
+        }
+        ConstIterator& operator--() {
+            --node_;
+            return *this;
+        }
+        ConstIterator operator--(int) {
+            ConstIterator tmp = *this;
+            --node_;
+            return tmp;
+        }
+        bool operator==(const ConstIterator& other) const noexcept {
+            return node_ == other.node_;
+        }
+        bool operator!=(const ConstIterator& other) const noexcept {
+            return node_ != other.node_;
+        }
+
+        friend class SetAVLImage;
+
+    private:
+        const Node* node_;
+    };
+
+    // image of the keys of a set, any balancing policy and node layout
+    template <typename Augment, typename Balance, typename Layout>
+    static void Write(std::ostream& out, const SetAVL<K, Compare, Augment, Balance, Layout>& set) {
+        SetImageWriter<K> writer(out, set.Size());
+        auto it = set.Begin();
+        writer.WriteNodes([&it]() { return *it++; });
+    }
+
+    // image over memory owned by the caller, which must stay valid and aligned for Node
+    static SetAVLImage View(const void* data, size_t size, const Compare& compare = Compare()) {
+        SetAVLImage image(compare);
+        image.Attach(data, size);
+        return image;
+    }
+    // read-only shared mapping of an image file, unmapped by the destructor
+    static SetAVLImage Map(const std::string& path, const Compare& compare = Compare()) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw SetSnapshotError("SetAVL image: can not open " + path);
+        }
+        struct stat info;
+        if (::fstat(fd, &info) != 0 || info.st_size == 0) {
+            ::close(fd);
+            throw SetSnapshotError("SetAVL image: can not map " + path);
+        }
+        size_t size = static_cast<size_t>(info.st_size);
+        void* data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            throw SetSnapshotError("SetAVL image: can not map " + path);
+        }
+        SetAVLImage image(compare);
+        image.mapping_ = data;
+        image.mapping_size_ = size;
+        image.Attach(data, size);
+        return image;
+    }
+
+    SetAVLImage(const SetAVLImage&) = delete;
+    SetAVLImage& operator=(const SetAVLImage&) = delete;
+    SetAVLImage(SetAVLImage&& other) noexcept : compare_(other.compare_) {
+        Steal(other);
+    }
+    SetAVLImage& operator=(SetAVLImage&& other) noexcept {
+        if (this != &other) {
+            Unmap();
+            compare_ = other.compare_;
+            Steal(other);
+        }
+        return *this;
+    }
+    ~SetAVLImage() {
+        Unmap();
+    }
+
+    size_t Size() const noexcept {
+        return count_;
+    }
+    bool Empty() const noexcept {
+        return count_ == 0;
+    }
+    ConstIterator Begin() const noexcept {
+        return ConstIterator(nodes_);
+    }
+    ConstIterator End() const noexcept {
+        return ConstIterator(nodes_ + count_);
+    }
+
+    ConstIterator Find(const K& key) const {
+        uint64_t index = root_;
+        while (index != kSetImageNoLink) {
+            const Node& node = nodes_[index];
+            if (compare_(key, node.key)) {
+                index = node.left;
+            } else if (compare_(node.key, key)) {
+                index = node.right;
+            } else {
+                return ConstIterator(nodes_ + index);
+            }
+        }
+        return End();
+    }
+    bool Contains(const K& key) const {
+        return Find(key) != End();
+    }
+    ConstIterator LowerBound(const K& key) const {
+        return ConstIterator(nodes_ + LowerBoundIndex(key));
+    }
+    // number of keys less than key: the array position of the lower bound
+    size_t RankInd0(const K& key) const {
+        return LowerBoundIndex(key);
+    }
+    ConstIterator SelectInd0(size_t i) const {
+        return (i < count_) ? ConstIterator(nodes_ + i) : End();
+    }
+    ConstIterator SelectInd1(size_t i) const {
+        return (i == 0) ? End() : SelectInd0(i - 1);
+    }
+    size_t IndexOf(ConstIterator it) const noexcept {
+        return static_cast<size_t>(it.node_ - nodes_);
+    }
+
+private:
+    explicit SetAVLImage(const Compare& compare) : compare_(compare) {
+    }
+
+    void Attach(const void* data, size_t size) {
+        if (size < sizeof(SetImageHeader)) {
+            throw SetSnapshotError("SetAVL image: too short");
+        }
+        SetImageHeader header;
+        std::memcpy(&header, data, sizeof(header));
+        if (!std::equal(kSetImageMagic, kSetImageMagic + sizeof(kSetImageMagic), header.magic)) {
+            throw SetSnapshotError("SetAVL image: bad magic");
+        }
+        if (header.version != kSetImageVersion) {
+            throw SetSnapshotError("SetAVL image: unsupported version");
+        }
+        if (header.byte_order != kSetSnapshotByteOrder || header.key_size != sizeof(K) ||
+            header.node_size != sizeof(Node)) {
+            throw SetSnapshotError("SetAVL image: written for another key type or machine");
+        }
+        if (header.count > (size - sizeof(SetImageHeader)) / sizeof(Node) ||
+            (header.count == 0) != (header.root == kSetImageNoLink) ||
+            (header.count != 0 && header.root >= header.count)) {
+            throw SetSnapshotError("SetAVL image: truncated");
+        }
+        auto bytes = static_cast<const char*>(data) + sizeof(SetImageHeader);
+        if (reinterpret_cast<uintptr_t>(bytes) % alignof(Node) != 0) {
+            throw SetSnapshotError("SetAVL image: misaligned");
+        }
+        nodes_ = reinterpret_cast<const Node*>(bytes);
+        count_ = static_cast<size_t>(header.count);
+        root_ = header.root;
+    }
+
+    size_t LowerBoundIndex(const K& key) const {
+        uint64_t index = root_;
+        uint64_t bound = count_;
+        while (index != kSetImageNoLink) {
+            const Node& node = nodes_[index];
+            if (compare_(node.key, key)) {
+                index = node.right;
+            } else {
+                bound = index;
+                index = node.left;
+            }
+        }
+        return static_cast<size_t>(bound);
+    }
+
+    void Steal(SetAVLImage& other) noexcept {
+        nodes_ = std::exchange(other.nodes_, nullptr);
+        count_ = std::exchange(other.count_, 0);
+        root_ = std::exchange(other.root_, kSetImageNoLink);
+        mapping_ = std::exchange(other.mapping_, nullptr);
+        mapping_size_ = std::exchange(other.mapping_size_, 0);
+    }
+    void Unmap() noexcept {
+        if (mapping_ != nullptr) {
+            ::munmap(mapping_, mapping_size_);
+            mapping_ = nullptr;
+        }
+    }
+
+    const Node* nodes_ = nullptr;
+    size_t count_ = 0;
+    uint64_t root_ = kSetImageNoLink;
+    void* mapping_ = nullptr;
+    size_t mapping_size_ = 0;
+    Compare compare_;
+};
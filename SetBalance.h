@@ -0,0 +1,356 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+
+// Balancing policies for SetAVL.
+// BalanceType is the per-node field a policy keeps, a new node starts with zero.
+// AfterInsert restores the invariant of the policy for a freshly attached leaf
+// with the rotations of the tree (DoLeftRotate/DoRightRotate keep subtree sizes,
+// aggregates and the in-order threading intact).
+// BuiltBalance gives the field of a node of a tree built from sorted keys, where the two
+// subtrees of every node differ in size by at most one, so every leaf is on the last
+// two levels: depth counts from the root, max_depth is the depth of the last level.
+
+// AVL tree: balance holds height(left) - height(right)
+struct SetAVLBalance {
+    using BalanceType = signed char;
+
+    static BalanceType BuiltBalance(size_t, size_t, size_t left_height, size_t right_height) {
+        return static_cast<BalanceType>(static_cast<int>(left_height) -
+                                        static_cast<int>(right_height));
+    }
+
+    template <typename Tree>
+    static void AfterInsert(Tree& tree, typename Tree::Node* inserted_node) {
+        using Node = typename Tree::Node;
+        Node* current_node = inserted_node->GetParent();
+        Node* previous_node = inserted_node;
+        while (current_node != nullptr) {
+            if (current_node->GetLeft().get() == previous_node) {
+                ++(current_node->GetBalance());
+            } else {
+                assert(current_node->GetRight().get() == previous_node);
+                --(current_node->GetBalance());
+            }
+            assert(IsBalanceNormal(current_node));
+            if (current_node->GetBalance() == 0) {
+                return;
+            }
+            if (std::abs(current_node->GetBalance()) == 1) {
+                previous_node = current_node;
+                current_node = current_node->GetParent();
+            } else {
+                assert(std::abs(current_node->GetBalance()) == 2);
+                typename Tree::NodePtr& current_node_smart = tree.GetNodeUn(current_node);
+                if (LeftRotateNeeded(current_node)) {
+                    current_node = RotateLeft(tree, current_node_smart);
+                } else if (RightRotateNeded(current_node)) {
+                    current_node = RotateRight(tree, current_node_smart);
+                } else if (RightLeftRotateNeeded(current_node)) {
+                    current_node = RotateRightLeft(tree, current_node_smart);
+                } else if (LeftRightRotateNeeded(current_node)) {
+                    current_node = RotateLeftRight(tree, current_node_smart);
+                } else {
+                    assert(false);
+                }
+                if (current_node->GetBalance() == 0) {
+                    return;
+                } else {
+                    assert(std::abs(current_node->GetBalance()) == 1);
+                    previous_node = current_node;
+                    current_node = current_node->GetParent();
+                }
+            }
+        }
+    }
+
+private:
+    template <typename Node>
+    static signed char GetNodeBalance(Node* node) {
+        if (node == nullptr) {
+            return 0;
+        }
+        return node->GetBalance();
+    }
+    template <typename Node>
+    static bool IsBalanceNormal(Node* node) {
+        return std::abs(GetNodeBalance(node)) <= 2;
+    }
+
+    template <typename Node>
+    static bool LeftRotateNeeded(Node* node) {
+        if (node == nullptr || node->GetRight() == nullptr) {
+            return false;
+        }
+        return (GetNodeBalance(node) == -2) && ((GetNodeBalance(node->GetRight().get()) == -1) ||
+                                                (GetNodeBalance(node->GetRight().get()) == 0));
+    }
+    template <typename Node>
+    static bool RightRotateNeded(Node* node) {
+        if (node == nullptr || node->GetLeft() == nullptr) {
+            return false;
+        }
+        return (GetNodeBalance(node) == 2) && ((GetNodeBalance(node->GetLeft().get()) == 1) ||
+                                               (GetNodeBalance(node->GetLeft().get()) == 0));
+    }
+    template <typename Node>
+    static bool RightLeftRotateNeeded(Node* node) {
+        if (node == nullptr || node->GetRight() == nullptr ||
+            node->GetRight()->GetLeft() == nullptr) {
+            return false;
+        }
+        return (GetNodeBalance(node) == -2) && (GetNodeBalance(node->GetRight().get()) == 1);
+    }
+    template <typename Node>
+    static bool LeftRightRotateNeeded(Node* node) {
+        if (node == nullptr || node->GetLeft() == nullptr ||
+            node->GetLeft()->GetRight() == nullptr) {
+            return false;
+        }
+        return (GetNodeBalance(node) == 2) && (GetNodeBalance(node->GetLeft().get()) == -1);
+    }
+
+    template <typename Node>
+    static void FixLeftBalance(Node* left_child, Node* node) {
+        assert(left_child != nullptr);
+        assert(node != nullptr);
+        if ((GetNodeBalance(left_child) == -2) && (GetNodeBalance(node) == -1)) {
+            left_child->GetBalance() = 0;
+            node->GetBalance() = 0;
+        } else if ((GetNodeBalance(left_child) == -2) && (GetNodeBalance(node) == 0)) {
+            left_child->GetBalance() = -1;
+            node->GetBalance() = 1;
+        } else {
+            assert(false);
+        }
+    }
+    template <typename Node>
+    static void FixRightBalance(Node* right_child, Node* node) {
+        assert(right_child != nullptr);
+        assert(node != nullptr);
+        if ((GetNodeBalance(right_child) == 2) && (GetNodeBalance(node) == 1)) {
+            right_child->GetBalance() = 0;
+            node->GetBalance() = 0;
+        } else if ((GetNodeBalance(right_child) == 2) && (GetNodeBalance(node) == 0)) {
+            right_child->GetBalance() = 1;
+            node->GetBalance() = -1;
+        } else {
+            assert(false);
+        }
+    }
+    template <typename Node>
+    static void FixRightLeftBalance(Node* left_child, Node* right_child, Node* node) {
+        assert(left_child != nullptr);
+        assert(right_child != nullptr);
+        assert(node != nullptr);
+
+        if ((GetNodeBalance(left_child) == -2) && (GetNodeBalance(right_child) == 1) &&
+            (GetNodeBalance(node) == 1)) {
+            left_child->GetBalance() = 0;
+            right_child->GetBalance() = -1;
+            node->GetBalance() = 0;
+
+        } else if ((GetNodeBalance(left_child) == -2) && (GetNodeBalance(right_child) == 1) &&
+                   (GetNodeBalance(node) == -1)) {
+            left_child->GetBalance() = 1;
+            right_child->GetBalance() = 0;
+            node->GetBalance() = 0;
+
+        } else if ((GetNodeBalance(left_child) == -2) && (GetNodeBalance(right_child) == 1) &&
+                   (GetNodeBalance(node) == 0)) {
+            left_child->GetBalance() = 0;
+            right_child->GetBalance() = 0;
+            node->GetBalance() = 0;
+
+        } else {
+            assert(false);
+        }
+    }
+    template <typename Node>
+    static void FixLeftRightBalance(Node* right_child, Node* left_child, Node* node) {
+        assert(right_child != nullptr);
+        assert(left_child != nullptr);
+        assert(node != nullptr);
+
+        if ((GetNodeBalance(right_child) == 2) && (GetNodeBalance(left_child) == -1) &&
+            (GetNodeBalance(node) == -1)) {
+            right_child->GetBalance() = 0;
+            left_child->GetBalance() = 1;
+            node->GetBalance() = 0;
+
+        } else if ((GetNodeBalance(right_child) == 2) && (GetNodeBalance(left_child) == -1) &&
+                   (GetNodeBalance(node) == 1)) {
+            right_child->GetBalance() = -1;
+            left_child->GetBalance() = 0;
+            node->GetBalance() = 0;
+
+        } else if ((GetNodeBalance(right_child) == 2) && (GetNodeBalance(left_child) == -1) &&
+                   (GetNodeBalance(node) == 0)) {
+            right_child->GetBalance() = 0;
+            left_child->GetBalance() = 0;
+            node->GetBalance() = 0;
+
+        } else {
+            assert(false);
+        }
+    }
+
+    template <typename Tree>
+    static typename Tree::Node* RotateLeft(Tree& tree, typename Tree::NodePtr& node) {
+        auto pair = tree.DoLeftRotate(node);
+        auto left_child_ptr = pair.first;
+        auto node_ptr = pair.second;
+
+        FixLeftBalance(left_child_ptr, node_ptr);
+        return node_ptr;
+    }
+
+    template <typename Tree>
+    static typename Tree::Node* RotateRight(Tree& tree, typename Tree::NodePtr& node) {
+        auto pair = tree.DoRightRotate(node);
+        auto right_child_ptr = pair.first;
+        auto node_ptr = pair.second;
+
+        FixRightBalance(right_child_ptr, node_ptr);
+        return node_ptr;
+    }
+
+    template <typename Tree>
+    static typename Tree::Node* RotateRightLeft(Tree& tree, typename Tree::NodePtr& node) {
+        assert(node != nullptr);
+        assert(node->GetRight() != nullptr);
+        assert(node->GetRight()->GetLeft() != nullptr);
+
+        assert(node->GetBalance() == -2);
+        assert(node->GetRight()->GetBalance() == 1);
+
+        auto pair = tree.DoRightRotate(node->GetRight());
+        auto right_child_ptr = pair.first;
+        auto node_ptr = pair.second;
+
+        auto pair2 = tree.DoLeftRotate(node);
+        auto left_child_ptr = pair2.first;
+        assert(node_ptr == pair2.second);
+
+        FixRightLeftBalance(left_child_ptr, right_child_ptr, node_ptr);
+        return node_ptr;
+    }
+
+    template <typename Tree>
+    static typename Tree::Node* RotateLeftRight(Tree& tree, typename Tree::NodePtr& node) {
+        assert(node != nullptr);
+        assert(node->GetLeft() != nullptr);
+        assert(node->GetLeft()->GetRight() != nullptr);
+
+        assert(node->GetBalance() == 2);
+        assert(node->GetLeft()->GetBalance() == -1);
+
+        auto pair = tree.DoLeftRotate(node->GetLeft());
+        auto left_child_ptr = pair.first;
+        auto node_ptr = pair.second;
+
+        auto pair2 = tree.DoRightRotate(node);
+        auto right_child_ptr = pair2.first;
+        assert(node_ptr == pair2.second);
+
+        FixLeftRightBalance(right_child_ptr, left_child_ptr, node_ptr);
+        return node_ptr;
+    }
+};
+
+// Red-black tree: balance holds the colour, a new node is red
+// at most two rotations per insert, the rest is recolouring
+struct SetRedBlackBalance {
+    using BalanceType = signed char;
+    static constexpr BalanceType kRed = 0;
+    static constexpr BalanceType kBlack = 1;
+
+    // red last level under black levels keeps the black height equal on all paths
+    static BalanceType BuiltBalance(size_t depth, size_t max_depth, size_t, size_t) {
+        return (depth == max_depth && depth > 0) ? kRed : kBlack;
+    }
+
+    template <typename Tree>
+    static void AfterInsert(Tree& tree, typename Tree::Node* node) {
+        using Node = typename Tree::Node;
+        node->GetBalance() = kRed;
+        while (true) {
+            Node* parent = node->GetParent();
+            if (parent == nullptr) {
+                node->GetBalance() = kBlack;
+                return;
+            }
+            if (parent->GetBalance() == kBlack) {
+                return;
+            }
+            Node* grandparent = parent->GetParent();
+            assert(grandparent != nullptr);
+            bool parent_left = (grandparent->GetLeft().get() == parent);
+            Node* uncle =
+                parent_left ? grandparent->GetRight().get() : grandparent->GetLeft().get();
+            if (uncle != nullptr && uncle->GetBalance() == kRed) {
+                parent->GetBalance() = kBlack;
+                uncle->GetBalance() = kBlack;
+                grandparent->GetBalance() = kRed;
+                node = grandparent;
+                continue;
+            }
+            if (parent_left) {
+                if (parent->GetRight().get() == node) {
+                    tree.DoLeftRotate(grandparent->GetLeft());
+                    parent = node;
+                }
+                tree.DoRightRotate(tree.GetNodeUn(grandparent));
+            } else {
+                if (parent->GetLeft().get() == node) {
+                    tree.DoRightRotate(grandparent->GetRight());
+                    parent = node;
+                }
+                tree.DoLeftRotate(tree.GetNodeUn(grandparent));
+            }
+            parent->GetBalance() = kBlack;
+            grandparent->GetBalance() = kRed;
+            return;
+        }
+    }
+};
+
+// Treap: balance holds a random priority, the tree is a max-heap by priority
+// expected O(log n) height, a new leaf is rotated up while it beats its parent
+struct SetTreapBalance {
+    using BalanceType = uint32_t;
+
+    // random priority inside a band of its level, higher levels get higher bands
+    static BalanceType BuiltBalance(size_t depth, size_t max_depth, size_t, size_t) {
+        uint64_t band = (uint64_t{1} << 32) / (max_depth + 1);
+        return static_cast<BalanceType>((max_depth - depth) * band + NextPriority() % band);
+    }
+
+    template <typename Tree>
+    static void AfterInsert(Tree& tree, typename Tree::Node* node) {
+        node->GetBalance() = NextPriority();
+        while (node->GetParent() != nullptr &&
+               node->GetParent()->GetBalance() < node->GetBalance()) {
+            auto parent = node->GetParent();
+            if (parent->GetLeft().get() == node) {
+                tree.DoRightRotate(tree.GetNodeUn(parent));
+            } else {
+                tree.DoLeftRotate(tree.GetNodeUn(parent));
+            }
+        }
+    }
+
+private:
+    // splitmix64 over a per-thread counter,
+    // so trees filled from different threads do not share state
+    static BalanceType NextPriority() noexcept {
+        thread_local uint64_t state = 0;
+        uint64_t value = (state += 0x9e3779b97f4a7c15ULL);
+        value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+        return static_cast<BalanceType>((value ^ (value >> 31)) >> 32);
+    }
+};
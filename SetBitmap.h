@@ -0,0 +1,171 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+#include "FenwickTree.h"
+
+// Order-statistic set of integers from a bounded universe [min_key, max_key].
+// One bit per possible key, grouped in blocks of 512 bits (8 words, one cache line);
+// a Fenwick tree keeps the number of keys in every block.
+// Contains is O(1), Insert and Rank are a Fenwick walk over U / 512 blocks plus popcounts
+// inside one block, Select descends the Fenwick tree and selects inside a word.
+// Memory is U / 8 + U / 64 bytes however many keys are inserted, so the set pays off
+// against SetAVL (a node per key) when keys are dense in the universe.
+
+// integral keys ordered by std::less can be stored as bits instead of nodes
+template <typename K, typename Compare>
+inline constexpr bool kSetBitmapEligible =
+    std::is_integral_v<K> && !std::is_same_v<K, bool> &&
+    (std::is_same_v<Compare, std::less<K>> || std::is_same_v<Compare, std::less<>>);
+
+// the bitmap wins when its fixed cost stays below the cost of a tree node per key;
+// keys is the number of keys to be inserted into [min_key, max_key]. At 64 slots per key
+// the bitmap costs 9 bytes per key, a margin of several times below a node
+template <typename K, typename Compare>
+bool SetBitmapPreferred(K min_key, K max_key, size_t keys) {
+    if constexpr (!kSetBitmapEligible<K, Compare>) {
+        return false;
+    } else {
+        constexpr uint64_t kMinUniverse = uint64_t{1} << 20;
+        constexpr uint64_t kSlotsPerKey = 64;
+        uint64_t universe = static_cast<uint64_t>(max_key) - static_cast<uint64_t>(min_key);
+        return max_key >= min_key && universe < std::max(kMinUniverse, keys * kSlotsPerKey);
+    }
+}
+
+// position of the k-th (0-indexed) set bit of a word with more than k set bits
+inline unsigned SelectInWord(uint64_t word, unsigned k) noexcept {
+    unsigned position = 0;
+    for (unsigned width = 32; width > 0; width >>= 1) {
+        unsigned low = std::popcount(word & ((uint64_t{1} << width) - 1));
+        if (k >= low) {
+            k -= low;
+            word >>= width;
+            position += width;
+        }
+    }
+    return position;
+}
+
+template <typename K>
+class SetBitmap {
+    static_assert(kSetBitmapEligible<K, std::less<K>>, "SetBitmap needs an integral key");
+
+public:
+    static constexpr size_t kWordBits = 64;
+    static constexpr size_t kBlockWords = 8;
+    static constexpr size_t kBlockBits = kWordBits * kBlockWords;
+
+    SetBitmap(K min_key, K max_key) : min_key_(min_key), max_key_(max_key) {
+        if (max_key < min_key) {
+            throw std::invalid_argument("SetBitmap: empty universe");
+        }
+        uint64_t last = Offset(max_key);
+        if (last >= std::numeric_limits<size_t>::max() - kBlockBits) {
+            throw std::length_error("SetBitmap: universe is too large");
+        }
+        size_t blocks = static_cast<size_t>(last) / kBlockBits + 1;
+        words_.assign(blocks * kBlockWords, 0);
+        counts_ = FenwickTree<size_t>(blocks);
+    }
+
+    // false if the key is already present
+    bool Insert(K key) {
+        if (key < min_key_ || max_key_ < key) {
+            throw std::out_of_range("SetBitmap: key outside the universe");
+        }
+        size_t offset = static_cast<size_t>(Offset(key));
+        uint64_t bit = uint64_t{1} << (offset % kWordBits);
+        uint64_t& word = words_[offset / kWordBits];
+        if (word & bit) {
+            return false;
+        }
+        word |= bit;
+        counts_.Add(offset / kBlockBits, 1);
+        ++size_;
+        return true;
+    }
+
+    bool Contains(K key) const {
+        if (key < min_key_ || max_key_ < key) {
+            return false;
+        }
+        size_t offset = static_cast<size_t>(Offset(key));
+        return (words_[offset / kWordBits] >> (offset % kWordBits)) & 1;
+    }
+
+    // number of keys less than key
+    size_t RankInd0(K key) const {
+        if (key <= min_key_) {
+            return 0;
+        }
+        if (max_key_ < key) {
+            return size_;
+        }
+        size_t offset = static_cast<size_t>(Offset(key));
+        size_t word_index = offset / kWordBits;
+        size_t rank = counts_.PrefixSum(offset / kBlockBits);
+        for (size_t i = word_index - word_index % kBlockWords; i < word_index; ++i) {
+            rank += std::popcount(words_[i]);
+        }
+        uint64_t below = (uint64_t{1} << (offset % kWordBits)) - 1;
+        return rank + std::popcount(words_[word_index] & below);
+    }
+
+    // i-th key in ascending order, nothing if i >= Size()
+    std::optional<K> SelectInd0(size_t i) const {
+        if (i >= size_) {
+            return std::nullopt;
+        }
+        size_t rest = 0;
+        size_t block = counts_.Select(i + 1, &rest);
+        size_t word_index = block * kBlockWords;
+        for (size_t count; (count = std::popcount(words_[word_index])) < rest; ++word_index) {
+            rest -= count;
+        }
+        uint64_t offset = word_index * kWordBits + SelectInWord(words_[word_index], rest - 1);
+        return static_cast<K>(static_cast<uint64_t>(min_key_) + offset);
+    }
+    std::optional<K> SelectInd1(size_t i) const {
+        if (i == 0) {
+            return std::nullopt;
+        }
+        return SelectInd0(i - 1);
+    }
+
+    size_t Size() const noexcept {
+        return size_;
+    }
+    bool Empty() const noexcept {
+        return size_ == 0;
+    }
+    K MinKey() const noexcept {
+        return min_key_;
+    }
+    K MaxKey() const noexcept {
+        return max_key_;
+    }
+    size_t MemoryBytes() const noexcept {
+        return words_.size() * sizeof(uint64_t) + (counts_.Size() + 1) * sizeof(size_t);
+    }
+
+private:
+    // distance from min_key_, wraps correctly for signed keys
+    uint64_t Offset(K key) const noexcept {
+        return static_cast<uint64_t>(key) - static_cast<uint64_t>(min_key_);
+    }
+
+    K min_key_;
+    K max_key_;
+    std::vector<uint64_t> words_;
+    FenwickTree<size_t> counts_;
+    size_t size_ = 0;
+};
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+// AVL tree over blocks of keys, the index of SetBucketAVL and SetPacked.
+// The tree owns its nodes and knows nothing of their keys; a Node provides
+//   Node* children[2], Node* parent: the links, nullptr when absent,
+//   size_t size: keys in the subtree, kept by the tree,
+//   uint32_t count: keys in the block, kept by the owner,
+//   int32_t height: kept by the tree,
+// a default constructor for an empty block and a copy constructor copying the keys only.
+// A set finds the block of a key by comparing it with the ends of blocks, changes count and
+// calls FixSizesUp; a new block is linked empty next to a block with AddBeside, which
+// rebalances, and then filled.
+
+template <typename Node>
+class SetBlockTree {
+public:
+    SetBlockTree() = default;
+    SetBlockTree(const SetBlockTree& other) : block_count_(other.block_count_) {
+        root_ = Clone(other.root_, nullptr);
+    }
+    SetBlockTree(SetBlockTree&& other) noexcept {
+        Swap(other);
+    }
+    SetBlockTree& operator=(const SetBlockTree& other) {
+        if (this != std::addressof(other)) {
+            SetBlockTree copy(other);
+            Swap(copy);
+        }
+        return *this;
+    }
+    SetBlockTree& operator=(SetBlockTree&& other) noexcept {
+        if (this != std::addressof(other)) {
+            Clear();
+            Swap(other);
+        }
+        return *this;
+    }
+    ~SetBlockTree() {
+        Clear();
+    }
+
+    void Clear() noexcept {
+        Destroy(root_);
+        root_ = nullptr;
+        block_count_ = 0;
+    }
+    void Swap(SetBlockTree& other) noexcept {
+        std::swap(root_, other.root_);
+        std::swap(block_count_, other.block_count_);
+    }
+
+    Node* Root() const noexcept {
+        return root_;
+    }
+    // keys in all blocks
+    size_t Size() const noexcept {
+        return SizeOf(root_);
+    }
+    size_t BlockCount() const noexcept {
+        return block_count_;
+    }
+    // number of blocks on the longest root-to-leaf path
+    size_t Height() const noexcept {
+        return static_cast<size_t>(HeightOf(root_));
+    }
+
+    // the first block of an empty tree
+    Node* AddRoot() {
+        root_ = new Node();
+        ++block_count_;
+        return root_;
+    }
+    // links an empty block as the next (side 1) or previous block of node and rebalances
+    Node* AddBeside(Node* node, int side) {
+        Node* fresh = new Node();
+        ++block_count_;
+        Node* parent = node;
+        if (node->children[side] != nullptr) {
+            parent = Extreme(node->children[side], 1 - side);
+            side = 1 - side;
+        }
+        parent->children[side] = fresh;
+        fresh->parent = parent;
+        Update(fresh);
+        for (Node* up = parent; up != nullptr; up = up->parent) {
+            Update(up);
+            up = Rebalance(up);
+        }
+        return fresh;
+    }
+
+    static size_t SizeOf(const Node* node) noexcept {
+        return (node == nullptr) ? 0 : node->size;
+    }
+    // after the count of node changed, or of node and a block of its subtree
+    static void FixSizesUp(Node* node) noexcept {
+        for (; node != nullptr; node = node->parent) {
+            Update(node);
+        }
+    }
+
+    // the leftmost (side 0) or rightmost block of a subtree
+    template <typename N>
+    static N* Extreme(N* node, int side) noexcept {
+        if (node != nullptr) {
+            while (node->children[side] != nullptr) {
+                node = node->children[side];
+            }
+        }
+        return node;
+    }
+    // the next (side 1) or previous block in key order, nullptr past the ends
+    template <typename N>
+    static N* Step(N* node, int side) noexcept {
+        if (node->children[side] != nullptr) {
+            return Extreme(node->children[side], 1 - side);
+        }
+        while (node->parent != nullptr && node->parent->children[side] == node) {
+            node = node->parent;
+        }
+        return node->parent;
+    }
+    // of two neighbouring blocks the one inside the subtree of the other
+    static Node* Lower(Node* node, Node* neighbour) noexcept {
+        for (Node* up = neighbour->parent; up != nullptr; up = up->parent) {
+            if (up == node) {
+                return neighbour;
+            }
+        }
+        return node;
+    }
+
+private:
+    static int32_t HeightOf(const Node* node) noexcept {
+        return (node == nullptr) ? 0 : node->height;
+    }
+    static void Update(Node* node) noexcept {
+        node->size = SizeOf(node->children[0]) + SizeOf(node->children[1]) + node->count;
+        node->height = std::max(HeightOf(node->children[0]), HeightOf(node->children[1])) + 1;
+    }
+
+    // returns the root of the subtree after the rotations
+    Node* Rebalance(Node* node) noexcept {
+        int32_t balance = HeightOf(node->children[0]) - HeightOf(node->children[1]);
+        if (balance > 1 || balance < -1) {
+            int side = (balance > 1) ? 0 : 1;
+            Node* child = node->children[side];
+            if (HeightOf(child->children[1 - side]) > HeightOf(child->children[side])) {
+                Rotate(child, 1 - side);
+            }
+            return Rotate(node, side);
+        }
+        return node;
+    }
+
+    // lifts the child of the given side over node
+    Node* Rotate(Node* node, int side) noexcept {
+        Node* child = node->children[side];
+        Node* moved = child->children[1 - side];
+        node->children[side] = moved;
+        if (moved != nullptr) {
+            moved->parent = node;
+        }
+        child->parent = node->parent;
+        if (node->parent == nullptr) {
+            root_ = child;
+        } else {
+            node->parent->children[node->parent->children[1] == node] = child;
+        }
+        child->children[1 - side] = node;
+        node->parent = child;
+        Update(node);
+        Update(child);
+        return child;
+    }
+
+    static Node* Clone(const Node* node, Node* parent) {
+        if (node == nullptr) {
+            return nullptr;
+        }
+        auto copy = std::make_unique<Node>(*node);
+        copy->size = node->size;
+        copy->height = node->height;
+        copy->parent = parent;
+        copy->children[0] = Clone(node->children[0], copy.get());
+        try {
+            copy->children[1] = Clone(node->children[1], copy.get());
+        } catch (...) {
+            Destroy(copy->children[0]);
+            throw;
+        }
+        return copy.release();
+    }
+
+    static void Destroy(Node* node) noexcept {
+        if (node != nullptr) {
+            Destroy(node->children[0]);
+            Destroy(node->children[1]);
+            delete node;
+        }
+    }
+
+    Node* root_ = nullptr;
+    size_t block_count_ = 0;
+};
@@ -0,0 +1,456 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <new>
+#include <utility>
+#include "SetBlockTree.h"
+
+// Order-statistic set with the API of SetAVL whose AVL tree is kept over blocks of keys:
+// every node holds a sorted block of up to B keys, all of them between the keys of its left
+// and of its right subtree, and the number of keys in its subtree.
+// A descent compares the key with the first and the last key of a block and ends with a
+// binary search in one block; SelectInd0 and RankInd0 descend by block counts and then index
+// inside the block. An insert shifts keys within one block, so for long long the per-key
+// overhead is the node header divided among the keys of a block instead of a node per key.
+// A full block first hands one key to a neighbouring block with room; otherwise it is split
+// in halves, except at the ends of the set, where a new block is started so that ascending or
+// descending inserts fill every block.
+// Inserting into a block invalidates the iterators into that block and into a neighbour it
+// gives a key to or splits into.
+
+template <typename K, typename Compare = std::less<K>, size_t B = 64>
+class SetBucketAVL {
+    static_assert(B >= 2, "a block holds at least two keys");
+
+    struct Node;
+    using Tree = SetBlockTree<Node>;
+
+public:
+    static constexpr size_t kBlockKeys = B;
+
+    class Iterator {
+    public:
+        Iterator() = default;
+
+        const K& operator*() const {
+            return node_->Key(index_);
+        }
+        const K* operator->() const {
+            return std::addressof(node_->Key(index_));
+        }
+        Iterator& operator++() {
+            if (++index_ == node_->count) {
+                node_ = Tree::Step(node_, 1);
+                index_ = 0;
+            }
+            return *this;
+        }
+        Iterator operator++(int) {
+            Iterator tmp = *this;
+            ++*this;
+            return tmp;
+        }
+        Iterator& operator--() {
+            if (node_ == nullptr) {
+                node_ = Tree::Extreme(set_->tree_.Root(), 1);
+                index_ = node_->count - 1;
+            } else if (index_ > 0) {
+                --index_;
+            } else {
+                node_ = Tree::Step(node_, 0);
+                index_ = node_->count - 1;
+            }
+            return *this;
+        }
+        Iterator operator--(int) {
+            Iterator tmp = *this;
+            --*this;
+            return tmp;
+        }
+        bool operator==(const Iterator& other) const noexcept {
+            return node_ == other.node_ && index_ == other.index_;
+        }
+        bool operator!=(const Iterator& other) const noexcept {
+            return !(*this == other);
+        }
+
+    private:
+        friend class SetBucketAVL;
+
+        Iterator(const SetBucketAVL* set, const Node* node, size_t index) noexcept
+            : set_(set), node_(node), index_(index) {
+        }
+
+        const SetBucketAVL* set_ = nullptr;
+        // nullptr at End()
+        const Node* node_ = nullptr;
+        size_t index_ = 0;
+    };
+    using ConstIterator = Iterator;
+
+    // walks an Iterator backwards, RBegin is the last key
+    class ReverseIterator {
+    public:
+        ReverseIterator() = default;
+        explicit ReverseIterator(Iterator base) noexcept : base_(base) {
+        }
+
+        const K& operator*() const {
+            Iterator it = base_;
+            --it;
+            return *it;
+        }
+        const K* operator->() const {
+            return std::addressof(**this);
+        }
+        ReverseIterator& operator++() {
+            --base_;
+            return *this;
+        }
+        ReverseIterator operator++(int) {
+            ReverseIterator tmp = *this;
+            --base_;
+            return tmp;
+        }
+        ReverseIterator& operator--() {
+            ++base_;
+            return *this;
+        }
+        ReverseIterator operator--(int) {
+            ReverseIterator tmp = *this;
+            ++base_;
+            return tmp;
+        }
+        bool operator==(const ReverseIterator& other) const noexcept {
+            return base_ == other.base_;
+        }
+        bool operator!=(const ReverseIterator& other) const noexcept {
+            return base_ != other.base_;
+        }
+        Iterator Base() const noexcept {
+            return base_;
+        }
+
+    private:
+        Iterator base_;
+    };
+    using ConstReverseIterator = ReverseIterator;
+
+    SetBucketAVL() : SetBucketAVL(Compare()) {
+    }
+    explicit SetBucketAVL(const Compare& compare) : compare_(compare) {
+    }
+    void Clear() noexcept {
+        tree_.Clear();
+    }
+    void Swap(SetBucketAVL& other) noexcept {
+        std::swap(compare_, other.compare_);
+        tree_.Swap(other.tree_);
+    }
+
+    template <typename P>
+    std::pair<Iterator, bool> Insert(P&& key) {
+        if (tree_.Root() == nullptr) {
+            Node* root = tree_.AddRoot();
+            root->InsertAt(0, K(std::forward<P>(key)));
+            Tree::FixSizesUp(root);
+            return {Iterator(this, root, 0), true};
+        }
+        Node* node = tree_.Root();
+        size_t index = 0;
+        while (true) {
+            if (compare_(key, node->Key(0))) {
+                if (node->children[0] == nullptr) {
+                    break;
+                }
+                node = node->children[0];
+            } else if (compare_(node->Key(node->count - 1), key)) {
+                if (node->children[1] == nullptr) {
+                    index = node->count;
+                    break;
+                }
+                node = node->children[1];
+            } else {
+                index = node->LowerIndex(key, compare_);
+                if (!compare_(key, node->Key(index))) {
+                    return {Iterator(this, node, index), false};
+                }
+                break;
+            }
+        }
+        auto [place, place_index] = InsertIntoBlock(node, index, K(std::forward<P>(key)));
+        return {Iterator(this, place, place_index), true};
+    }
+    template <typename InputIt>
+    void Insert(InputIt first, InputIt last) {
+        for (auto it = first; it != last; ++it) {
+            Insert(*it);
+        }
+    }
+    void Insert(std::initializer_list<K> ilist) {
+        Insert(ilist.begin(), ilist.end());
+    }
+
+    Iterator Find(const K& key) const {
+        Iterator it = LowerBound(key);
+        if (it != End() && !compare_(key, *it)) {
+            return it;
+        }
+        return End();
+    }
+    Iterator LowerBound(const K& key) const {
+        const Node* best = nullptr;
+        for (const Node* node = tree_.Root(); node != nullptr;) {
+            if (compare_(node->Key(node->count - 1), key)) {
+                node = node->children[1];
+                continue;
+            }
+            best = node;
+            if (compare_(node->Key(0), key)) {
+                break;
+            }
+            node = node->children[0];
+        }
+        return (best == nullptr) ? End() : Iterator(this, best, best->LowerIndex(key, compare_));
+    }
+    Iterator UpperBound(const K& key) const {
+        const Node* best = nullptr;
+        for (const Node* node = tree_.Root(); node != nullptr;) {
+            if (!compare_(key, node->Key(node->count - 1))) {
+                node = node->children[1];
+                continue;
+            }
+            best = node;
+            if (!compare_(key, node->Key(0))) {
+                break;
+            }
+            node = node->children[0];
+        }
+        return (best == nullptr) ? End() : Iterator(this, best, best->UpperIndex(key, compare_));
+    }
+    std::pair<Iterator, Iterator> EqualRange(const K& key) const {
+        return {LowerBound(key), UpperBound(key)};
+    }
+    bool Contains(const K& key) const {
+        return Find(key) != End();
+    }
+    size_t Count(const K& key) const {
+        return static_cast<size_t>(Contains(key));
+    }
+
+    Iterator Begin() const noexcept {
+        return Iterator(this, Tree::Extreme(tree_.Root(), 0), 0);
+    }
+    Iterator End() const noexcept {
+        return Iterator(this, nullptr, 0);
+    }
+    Iterator CBegin() const noexcept {
+        return Begin();
+    }
+    Iterator CEnd() const noexcept {
+        return End();
+    }
+    ReverseIterator RBegin() const noexcept {
+        return ReverseIterator(End());
+    }
+    ReverseIterator REnd() const noexcept {
+        return ReverseIterator(Begin());
+    }
+    ReverseIterator CRBegin() const noexcept {
+        return RBegin();
+    }
+    ReverseIterator CREnd() const noexcept {
+        return REnd();
+    }
+
+    // End() if i >= Size()
+    Iterator SelectInd0(size_t i) const {
+        const Node* node = tree_.Root();
+        while (node != nullptr) {
+            size_t left = Tree::SizeOf(node->children[0]);
+            if (i < left) {
+                node = node->children[0];
+            } else if (i - left < node->count) {
+                return Iterator(this, node, i - left);
+            } else {
+                i -= left + node->count;
+                node = node->children[1];
+            }
+        }
+        return End();
+    }
+    // End() if i == 0 or i > Size()
+    Iterator SelectInd1(size_t i) const {
+        return (i == 0) ? End() : SelectInd0(i - 1);
+    }
+    // number of keys less than key
+    size_t RankInd0(const K& key) const {
+        size_t rank = 0;
+        const Node* node = tree_.Root();
+        while (node != nullptr) {
+            if (compare_(node->Key(node->count - 1), key)) {
+                rank += Tree::SizeOf(node->children[0]) + node->count;
+                node = node->children[1];
+            } else if (!compare_(node->Key(0), key)) {
+                node = node->children[0];
+            } else {
+                return rank + Tree::SizeOf(node->children[0]) + node->LowerIndex(key, compare_);
+            }
+        }
+        return rank;
+    }
+    size_t RankInd1(const K& key) const {
+        return RankInd0(key) + 1;
+    }
+
+    size_t Size() const noexcept {
+        return tree_.Size();
+    }
+    bool Empty() const noexcept {
+        return tree_.Root() == nullptr;
+    }
+    Compare KeyCompare() const {
+        return compare_;
+    }
+    size_t BlockCount() const noexcept {
+        return tree_.BlockCount();
+    }
+    // number of blocks on the longest root-to-leaf path
+    size_t Height() const noexcept {
+        return tree_.Height();
+    }
+    // bytes of all blocks
+    size_t BlockBytes() const noexcept {
+        return tree_.BlockCount() * sizeof(Node);
+    }
+
+private:
+    struct Node {
+        Node() = default;
+        // the keys only, SetBlockTree links the copy
+        Node(const Node& other) {
+            for (; count < other.count; ++count) {
+                new (storage + count * sizeof(K)) K(other.Key(count));
+            }
+        }
+        Node& operator=(const Node&) = delete;
+        ~Node() {
+            for (size_t i = 0; i < count; ++i) {
+                Key(i).~K();
+            }
+        }
+
+        K& Key(size_t i) noexcept {
+            return *std::launder(reinterpret_cast<K*>(storage + i * sizeof(K)));
+        }
+        const K& Key(size_t i) const noexcept {
+            return *std::launder(reinterpret_cast<const K*>(storage + i * sizeof(K)));
+        }
+        size_t LowerIndex(const K& key, const Compare& compare) const {
+            return static_cast<size_t>(
+                std::lower_bound(&Key(0), &Key(0) + count, key, compare) - &Key(0));
+        }
+        size_t UpperIndex(const K& key, const Compare& compare) const {
+            return static_cast<size_t>(
+                std::upper_bound(&Key(0), &Key(0) + count, key, compare) - &Key(0));
+        }
+
+        // the block must have room
+        void InsertAt(size_t index, K&& key) {
+            if (index == count) {
+                new (storage + count * sizeof(K)) K(std::move(key));
+            } else {
+                new (storage + count * sizeof(K)) K(std::move(Key(count - 1)));
+                std::move_backward(&Key(index), &Key(count - 1), &Key(count));
+                Key(index) = std::move(key);
+            }
+            ++count;
+        }
+        K TakeAt(size_t index) {
+            K key(std::move(Key(index)));
+            std::move(&Key(index + 1), &Key(count), &Key(index));
+            Key(--count).~K();
+            return key;
+        }
+
+        Node* children[2] = {nullptr, nullptr};
+        Node* parent = nullptr;
+        // keys in the subtree
+        size_t size = 0;
+        // keys in the block
+        uint32_t count = 0;
+        int32_t height = 1;
+        alignas(K) unsigned char storage[B * sizeof(K)];
+    };
+
+    // key goes before position index of a block, returns where it ended up
+    std::pair<Node*, size_t> InsertIntoBlock(Node* node, size_t index, K&& key) {
+        if (node->count < B) {
+            node->InsertAt(index, std::move(key));
+            Tree::FixSizesUp(node);
+            return {node, index};
+        }
+        if (Node* next = Tree::Step(node, 1); next != nullptr && next->count < B) {
+            std::pair<Node*, size_t> place{next, 0};
+            if (index == B) {
+                next->InsertAt(0, std::move(key));
+            } else {
+                next->InsertAt(0, node->TakeAt(B - 1));
+                node->InsertAt(index, std::move(key));
+                place = {node, index};
+            }
+            Tree::FixSizesUp(Tree::Lower(node, next));
+            return place;
+        }
+        if (Node* prev = Tree::Step(node, 0); prev != nullptr && prev->count < B) {
+            std::pair<Node*, size_t> place{prev, prev->count};
+            if (index == 0) {
+                prev->InsertAt(prev->count, std::move(key));
+            } else {
+                prev->InsertAt(prev->count, node->TakeAt(0));
+                node->InsertAt(index - 1, std::move(key));
+                place = {node, index - 1};
+            }
+            Tree::FixSizesUp(Tree::Lower(node, prev));
+            return place;
+        }
+        if (index == 0 && Tree::Step(node, 0) == nullptr) {
+            // below the first key of the set
+            Node* fresh = tree_.AddBeside(node, 0);
+            fresh->InsertAt(0, std::move(key));
+            Tree::FixSizesUp(fresh);
+            return {fresh, 0};
+        }
+        if (index == B && Tree::Step(node, 1) == nullptr) {
+            // above the last key of the set
+            Node* fresh = tree_.AddBeside(node, 1);
+            fresh->InsertAt(0, std::move(key));
+            Tree::FixSizesUp(fresh);
+            return {fresh, 0};
+        }
+        Node* fresh = tree_.AddBeside(node, 1);
+        size_t half = B / 2;
+        for (size_t i = half; i < B; ++i) {
+            fresh->InsertAt(i - half, std::move(node->Key(i)));
+            node->Key(i).~K();
+        }
+        node->count = static_cast<uint32_t>(half);
+        std::pair<Node*, size_t> place{node, index};
+        if (index <= half) {
+            node->InsertAt(index, std::move(key));
+        } else {
+            fresh->InsertAt(index - half, std::move(key));
+            place = {fresh, index - half};
+        }
+        Tree::FixSizesUp(Tree::Lower(node, fresh));
+        return place;
+    }
+
+    Compare compare_;
+    Tree tree_;
+};
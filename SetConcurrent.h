@@ -0,0 +1,434 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Order-statistic set for many concurrent writers.
+// Inserts run in parallel: a descent reads child links without locking and a new leaf is
+// linked with a compare-and-swap on the empty child slot, so there are no node locks at
+// all; a failed CAS means another thread linked there first and the descent goes on from
+// its node. Inserts never rotate, so a key always has one path and the CAS also settles
+// races between equal keys.
+// Rebalancing is relaxed, as in a scapegoat tree: an insert that ends deeper than
+// log_{1/alpha}(n) + 1 takes the tree exclusively afterwards and rebuilds the highest
+// ancestor on its path whose heavier child has more than alpha of its keys.
+// Each node keeps its subtree size, incremented along the path once the leaf is linked.
+// Every insert passes the top levels, so there the sizes, like the total size, are striped
+// counters (SetStripedCounter): threads of different stripes write different cache lines.
+// Readers and writers announce themselves in the reader count of their stripe only;
+// a rebuild raises a flag and waits for all stripes to drain, and new arrivals step back
+// while the flag is up, so the rebuild is not starved.
+// Contains, RankInd0 and SelectInd0 run concurrently with inserts. An insert still in
+// progress may or may not be counted by them, every finished one is: RankInd0(key) lies
+// between the number of smaller keys inserted before the call and the number inserted
+// before it returns. SelectInd0 retries when a half counted insert leads it astray and
+// finally takes the tree exclusively. Size() is such a snapshot as well.
+
+inline constexpr size_t kSetStripes = 16;
+
+// stripe of the calling thread, threads are dealt round-robin
+inline size_t SetStripeOfThread() noexcept {
+    static std::atomic<size_t> next{0};
+    thread_local size_t stripe = next.fetch_add(1, std::memory_order_relaxed) % kSetStripes;
+    return stripe;
+}
+
+// Counter split into one cache line per stripe: an add writes the line of its stripe only,
+// a read sums the lines. Between resets the counter only grows, so a sum read while others
+// add lies between the values at the start and at the end of the read.
+class SetStripedCounter {
+public:
+    void Add(size_t delta) noexcept {
+        stripes_[SetStripeOfThread()].value.fetch_add(delta, std::memory_order_relaxed);
+    }
+    size_t Sum() const noexcept {
+        size_t sum = 0;
+        for (const auto& stripe : stripes_) {
+            sum += stripe.value.load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+    // while nobody adds
+    void Reset(size_t value) noexcept {
+        for (auto& stripe : stripes_) {
+            stripe.value.store(0, std::memory_order_relaxed);
+        }
+        stripes_[0].value.store(value, std::memory_order_relaxed);
+    }
+
+private:
+    struct alignas(64) Stripe {
+        std::atomic<size_t> value{0};
+    };
+    Stripe stripes_[kSetStripes];
+};
+
+template <typename K, typename Compare = std::less<K>>
+class SetConcurrent {
+public:
+    explicit SetConcurrent(const Compare& compare = Compare()) : compare_(compare) {
+    }
+    SetConcurrent(const SetConcurrent&) = delete;
+    SetConcurrent& operator=(const SetConcurrent&) = delete;
+    ~SetConcurrent() {
+        std::vector<Node*> stack;
+        if (Node* root = root_.load(std::memory_order_relaxed)) {
+            stack.push_back(root);
+        }
+        while (!stack.empty()) {
+            Node* node = stack.back();
+            stack.pop_back();
+            for (const auto& child : node->children) {
+                if (Node* next = child.load(std::memory_order_relaxed)) {
+                    stack.push_back(next);
+                }
+            }
+            delete node;
+        }
+    }
+
+    // false if the key is already present; safe to call from any number of threads
+    bool Insert(const K& key) {
+        size_t depth = 0;
+        {
+            SharedLock lock(*this);
+            std::vector<Node*> path;
+            path.reserve(64);
+            Node* created = nullptr;
+            std::atomic<Node*>* slot = &root_;
+            while (true) {
+                Node* node = slot->load(std::memory_order_acquire);
+                if (node == nullptr) {
+                    if (created == nullptr) {
+                        created = NewNode(key, path.size());
+                    }
+                    if (slot->compare_exchange_strong(node, created, std::memory_order_release,
+                                                      std::memory_order_acquire)) {
+                        break;
+                    }
+                }
+                if (compare_(key, node->key)) {
+                    slot = &node->children[0];
+                } else if (compare_(node->key, key)) {
+                    slot = &node->children[1];
+                } else {
+                    delete created;
+                    return false;
+                }
+                path.push_back(node);
+            }
+            for (Node* node : path) {
+                if (node->striped != nullptr) {
+                    node->striped->Add(1);
+                } else {
+                    node->size.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+            depth = path.size() + 1;
+        }
+        size_.Add(1);
+        // the hint is a stale lower bound of the size, the stripes are summed only when
+        // the insert may be too deep for it
+        size_t hint = std::max<size_t>(size_hint_.load(std::memory_order_relaxed), 1);
+        if (depth > DepthBound(hint)) {
+            size_t size = Size();
+            size_hint_.store(size, std::memory_order_relaxed);
+            if (depth > DepthBound(size)) {
+                Rebalance(key);
+            }
+        }
+        return true;
+    }
+
+    bool Contains(const K& key) const {
+        SharedLock lock(*this);
+        const Node* node = root_.load(std::memory_order_acquire);
+        while (node != nullptr) {
+            if (compare_(key, node->key)) {
+                node = node->children[0].load(std::memory_order_acquire);
+            } else if (compare_(node->key, key)) {
+                node = node->children[1].load(std::memory_order_acquire);
+            } else {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // number of keys less than key
+    size_t RankInd0(const K& key) const {
+        SharedLock lock(*this);
+        size_t rank = 0;
+        const Node* node = Root();
+        while (node != nullptr) {
+            if (compare_(node->key, key)) {
+                rank += SizeOf(Child(node, 0)) + 1;
+                node = Child(node, 1);
+            } else {
+                node = Child(node, 0);
+            }
+        }
+        return rank;
+    }
+
+    // i-th key in ascending order, nothing if i >= Size()
+    std::optional<K> SelectInd0(size_t i) const {
+        for (int attempt = 0; attempt < kSelectAttempts; ++attempt) {
+            SharedLock lock(*this);
+            bool settled = true;
+            std::optional<K> key = Select(i, settled);
+            if (settled) {
+                return key;
+            }
+        }
+        ExclusiveLock lock(*this);
+        bool settled = true;
+        return Select(i, settled);
+    }
+    std::optional<K> SelectInd1(size_t i) const {
+        if (i == 0) {
+            return std::nullopt;
+        }
+        return SelectInd0(i - 1);
+    }
+
+    size_t Size() const noexcept {
+        return size_.Sum();
+    }
+    bool Empty() const noexcept {
+        return Size() == 0;
+    }
+    // number of nodes on the longest root-to-leaf path
+    size_t Height() const {
+        ExclusiveLock lock(*this);
+        return HeightOf(Root());
+    }
+
+private:
+    struct Node {
+        explicit Node(const K& key) : key(key) {
+        }
+        const K key;
+        std::atomic<Node*> children[2] = {nullptr, nullptr};
+        // subtree size below the striped levels
+        std::atomic<size_t> size{1};
+        // subtree size in the striped levels, where every insert passes
+        std::unique_ptr<SetStripedCounter> striped;
+    };
+
+    // a subtree is rebuilt when one child holds more than 7/10 of its keys
+    static constexpr size_t kAlphaNumerator = 7;
+    static constexpr size_t kAlphaDenominator = 10;
+    // nodes at depth 0 .. kStripedLevels - 1 count their subtree in stripes
+    static constexpr size_t kStripedLevels = 6;
+    static constexpr int kSelectAttempts = 4;
+
+    class SharedLock {
+    public:
+        explicit SharedLock(const SetConcurrent& set)
+            : set_(set), readers_(set.readers_[SetStripeOfThread()].value) {
+            while (true) {
+                while (set_.exclusive_.load(std::memory_order_acquire)) {
+                    std::this_thread::yield();
+                }
+                // the seq_cst pair with ExclusiveLock: either the rebuild sees this reader
+                // or this reader sees the flag
+                readers_.fetch_add(1, std::memory_order_seq_cst);
+                if (!set_.exclusive_.load(std::memory_order_seq_cst)) {
+                    return;
+                }
+                readers_.fetch_sub(1, std::memory_order_release);
+            }
+        }
+        ~SharedLock() {
+            readers_.fetch_sub(1, std::memory_order_release);
+        }
+
+    private:
+        const SetConcurrent& set_;
+        std::atomic<size_t>& readers_;
+    };
+
+    class ExclusiveLock {
+    public:
+        explicit ExclusiveLock(const SetConcurrent& set)
+            : set_(set), lock_(set.exclusive_mutex_) {
+            set_.exclusive_.store(true, std::memory_order_seq_cst);
+            for (const auto& stripe : set_.readers_) {
+                while (stripe.value.load(std::memory_order_seq_cst) != 0) {
+                    std::this_thread::yield();
+                }
+            }
+        }
+        ~ExclusiveLock() {
+            set_.exclusive_.store(false, std::memory_order_release);
+        }
+
+    private:
+        const SetConcurrent& set_;
+        std::unique_lock<std::mutex> lock_;
+    };
+
+    struct alignas(64) ReaderCount {
+        std::atomic<size_t> value{0};
+    };
+
+    static Node* NewNode(const K& key, size_t depth) {
+        auto node = std::make_unique<Node>(key);
+        if (depth < kStripedLevels) {
+            node->striped = std::make_unique<SetStripedCounter>();
+            node->striped->Reset(1);
+        }
+        return node.release();
+    }
+
+    static size_t DepthBound(size_t size) {
+        static const double kLogBase =
+            std::log(static_cast<double>(kAlphaDenominator) / kAlphaNumerator);
+        return static_cast<size_t>(std::log(static_cast<double>(size)) / kLogBase) + 1;
+    }
+
+    Node* Root() const {
+        return root_.load(std::memory_order_acquire);
+    }
+    static Node* Child(const Node* node, int side) {
+        return node->children[side].load(std::memory_order_acquire);
+    }
+    static size_t SizeOf(const Node* node) {
+        if (node == nullptr) {
+            return 0;
+        }
+        if (node->striped != nullptr) {
+            return node->striped->Sum();
+        }
+        return node->size.load(std::memory_order_relaxed);
+    }
+    // settled is false if the descent ran out of nodes, misled by an insert in progress
+    std::optional<K> Select(size_t i, bool& settled) const {
+        const Node* node = Root();
+        if (i >= SizeOf(node)) {
+            return std::nullopt;
+        }
+        while (node != nullptr) {
+            size_t left = SizeOf(Child(node, 0));
+            if (i < left) {
+                node = Child(node, 0);
+            } else if (i == left) {
+                return node->key;
+            } else {
+                i -= left + 1;
+                node = Child(node, 1);
+            }
+        }
+        settled = false;
+        return std::nullopt;
+    }
+    static size_t HeightOf(const Node* node) {
+        if (node == nullptr) {
+            return 0;
+        }
+        return std::max(HeightOf(Child(node, 0)), HeightOf(Child(node, 1))) + 1;
+    }
+
+    // rebuilds the highest unbalanced ancestor on the path of key, if the path is still deep
+    void Rebalance(const K& key) {
+        ExclusiveLock lock(*this);
+        std::atomic<Node*>* slot = &root_;
+        std::atomic<Node*>* scapegoat = nullptr;
+        size_t scapegoat_depth = 0;
+        size_t depth = 0;
+        for (Node* node = Root(); node != nullptr; node = slot->load(std::memory_order_relaxed)) {
+            size_t heavier = std::max(SizeOf(Child(node, 0)), SizeOf(Child(node, 1)));
+            if (scapegoat == nullptr &&
+                heavier * kAlphaDenominator > SizeOf(node) * kAlphaNumerator) {
+                scapegoat = slot;
+                scapegoat_depth = depth;
+            }
+            ++depth;
+            if (compare_(key, node->key)) {
+                slot = &node->children[0];
+            } else if (compare_(node->key, key)) {
+                slot = &node->children[1];
+            } else {
+                break;
+            }
+        }
+        if (scapegoat == nullptr || depth <= DepthBound(Size())) {
+            return;
+        }
+        std::vector<Node*> nodes;
+        nodes.reserve(SizeOf(scapegoat->load(std::memory_order_relaxed)));
+        Flatten(scapegoat->load(std::memory_order_relaxed), nodes);
+        // the only allocations come first, so a failure leaves the subtree as it was
+        PrepareStripes(nodes, 0, nodes.size(), scapegoat_depth);
+        scapegoat->store(Build(nodes, 0, nodes.size(), scapegoat_depth),
+                         std::memory_order_relaxed);
+    }
+
+    // stripes for the nodes Build puts into the striped levels
+    static void PrepareStripes(const std::vector<Node*>& nodes, size_t begin, size_t end,
+                               size_t depth) {
+        if (begin == end || depth >= kStripedLevels) {
+            return;
+        }
+        size_t middle = begin + (end - begin) / 2;
+        if (nodes[middle]->striped == nullptr) {
+            nodes[middle]->striped = std::make_unique<SetStripedCounter>();
+        }
+        PrepareStripes(nodes, begin, middle, depth + 1);
+        PrepareStripes(nodes, middle + 1, end, depth + 1);
+    }
+
+    // in-order list of the nodes of a subtree
+    static void Flatten(Node* root, std::vector<Node*>& nodes) {
+        std::vector<Node*> stack;
+        Node* node = root;
+        while (node != nullptr || !stack.empty()) {
+            for (; node != nullptr; node = Child(node, 0)) {
+                stack.push_back(node);
+            }
+            node = stack.back();
+            stack.pop_back();
+            nodes.push_back(node);
+            node = Child(node, 1);
+        }
+    }
+
+    static Node* Build(const std::vector<Node*>& nodes, size_t begin, size_t end,
+                       size_t depth) noexcept {
+        if (begin == end) {
+            return nullptr;
+        }
+        size_t middle = begin + (end - begin) / 2;
+        Node* node = nodes[middle];
+        node->children[0].store(Build(nodes, begin, middle, depth + 1),
+                                std::memory_order_relaxed);
+        node->children[1].store(Build(nodes, middle + 1, end, depth + 1),
+                                std::memory_order_relaxed);
+        if (depth < kStripedLevels) {
+            node->striped->Reset(end - begin);
+        } else {
+            node->striped.reset();
+            node->size.store(end - begin, std::memory_order_relaxed);
+        }
+        return node;
+    }
+
+    Compare compare_;
+    std::atomic<Node*> root_{nullptr};
+    SetStripedCounter size_;
+    // lower bound of the size, refreshed by inserts that look too deep for it
+    std::atomic<size_t> size_hint_{0};
+    mutable ReaderCount readers_[kSetStripes];
+    mutable std::atomic<bool> exclusive_{false};
+    mutable std::mutex exclusive_mutex_;
+};
@@ -0,0 +1,307 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+#include "RadixSort.h"
+#include "SetAVLImage.h"
+#include "trial_commands.h"
+
+// Out-of-core build of a SetAVLImage<long long> from unsorted key dumps larger than memory.
+// 1. Keys are read as whitespace-separated integers into runs of run_keys keys;
+//    each run is radix sorted, deduplicated and spilled to a file.
+// 2. The runs are merged k-way with a heap, duplicates across runs are dropped. While there
+//    are more than merge_fan_in runs, groups of merge_fan_in runs are merged into one run
+//    per pass, so the open files and read buffers stay bounded. The last pass writes the
+//    unique keys to one more file, so their count is known before the image is written.
+// 3. The image is streamed from that file in key order to a partial file, which replaces
+//    the image only when complete; on failure every temporary file is removed.
+// Resident memory is about 16 * run_keys bytes plus a read buffer per merged run, whatever
+// the input size; queries on the result are served through mmap (SetAVLImage::Map).
+
+// keys per read or write of a run file
+inline constexpr size_t kSetExternalBlockKeys = size_t{1} << 14;
+
+struct SetExternalBuildOptions {
+    size_t run_keys = size_t{1} << 22;
+    // runs merged at once, each holds an open file and a read buffer of 128 KiB
+    size_t merge_fan_in = 64;
+    // temporary files are placed next to the image with these suffixes
+    std::string run_suffix = ".run";
+    std::string merged_suffix = ".merged";
+    std::string partial_suffix = ".partial";
+};
+
+struct SetExternalBuildStats {
+    uint64_t keys_read = 0;
+    uint64_t runs = 0;
+    uint64_t merge_passes = 0;
+    uint64_t unique_keys = 0;
+};
+
+// Reads keys of whitespace-separated text in blocks, a token split by a block edge is kept
+// for the next block. Keys are parsed like trial_task keys, a malformed one throws.
+class SetKeyFileReader {
+public:
+    explicit SetKeyFileReader(const std::string& path) : in_(path, std::ios::binary) {
+        if (!in_) {
+            throw SetSnapshotError("can not open " + path);
+        }
+    }
+
+    // false at the end of the input
+    bool Next(long long& key) {
+        while (true) {
+            while (position_ < text_.size() && IsTokenSpace(text_[position_])) {
+                ++position_;
+            }
+            size_t end = position_;
+            while (end < text_.size() && !IsTokenSpace(text_[end])) {
+                ++end;
+            }
+            if (position_ < text_.size() && (end < text_.size() || finished_)) {
+                ParseKey(std::string_view(text_).substr(position_, end - position_), key);
+                position_ = end;
+                return true;
+            }
+            if (finished_) {
+                return false;
+            }
+            Refill();
+        }
+    }
+
+private:
+    void Refill() {
+        text_.erase(0, position_);
+        position_ = 0;
+        size_t kept = text_.size();
+        text_.resize(kept + kBlockBytes);
+        in_.read(text_.data() + kept, static_cast<std::streamsize>(kBlockBytes));
+        text_.resize(kept + static_cast<size_t>(in_.gcount()));
+        finished_ = (in_.gcount() == 0);
+    }
+
+    // the token is followed by whitespace or by the terminating NUL of text_
+    static void ParseKey(std::string_view token, long long& key) {
+        ParseStatus status = ParseLongLong(token.data(), key);
+        if (status == ParseStatus::INVALID) {
+            throw SetSnapshotError("invalid integer key");
+        }
+        if (status == ParseStatus::OUT_OF_RANGE) {
+            throw SetSnapshotError("key out of long long range");
+        }
+    }
+
+    static constexpr size_t kBlockBytes = size_t{1} << 20;
+
+    std::ifstream in_;
+    std::string text_;
+    size_t position_ = 0;
+    bool finished_ = false;
+};
+
+// a file of raw sorted keys and the number of keys written to it
+struct SetRunFile {
+    std::string path;
+    uint64_t keys = 0;
+};
+
+// Sequential reader of a file of raw keys; a file shorter than the keys written to it
+// throws, so a lost write is not taken for the end of the run
+class SetRunReader {
+public:
+    explicit SetRunReader(const SetRunFile& run)
+        : in_(run.path, std::ios::binary), path_(run.path), left_(run.keys) {
+        if (!in_) {
+            throw SetSnapshotError("can not open " + path_);
+        }
+    }
+
+    bool Next(long long& key) {
+        if (left_ == 0) {
+            return false;
+        }
+        if (position_ == keys_.size()) {
+            keys_.resize(static_cast<size_t>(std::min<uint64_t>(left_, kSetExternalBlockKeys)));
+            in_.read(reinterpret_cast<char*>(keys_.data()),
+                     static_cast<std::streamsize>(keys_.size() * sizeof(long long)));
+            if (static_cast<size_t>(in_.gcount()) != keys_.size() * sizeof(long long)) {
+                throw SetSnapshotError("truncated " + path_);
+            }
+            position_ = 0;
+        }
+        --left_;
+        key = keys_[position_++];
+        return true;
+    }
+
+private:
+    std::ifstream in_;
+    std::string path_;
+    uint64_t left_;
+    std::vector<long long> keys_;
+    size_t position_ = 0;
+};
+
+inline void SortUniqueRun(std::vector<long long>& keys) {
+    ParallelRadixSort(keys, [](long long key) { return RadixKey(key); });
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+}
+
+// closes out so that the last buffered write is checked too
+inline void CloseChecked(std::ofstream& out, const std::string& path) {
+    out.close();
+    if (out.fail()) {
+        throw SetSnapshotError("can not write " + path);
+    }
+}
+
+inline SetRunFile WriteRun(const std::string& path, const std::vector<long long>& keys) {
+    std::ofstream out(path, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(keys.data()),
+              static_cast<std::streamsize>(keys.size() * sizeof(long long)));
+    CloseChecked(out, path);
+    return {path, keys.size()};
+}
+
+// k-way merge of sorted runs with a heap into out_path, a key equal to the previous one is
+// dropped
+inline SetRunFile MergeRuns(const std::vector<SetRunFile>& runs, const std::string& out_path) {
+    std::vector<SetRunReader> readers;
+    readers.reserve(runs.size());
+    using HeapItem = std::pair<long long, size_t>;
+    std::priority_queue<HeapItem, std::vector<HeapItem>, std::greater<HeapItem>> heap;
+    for (size_t i = 0; i < runs.size(); ++i) {
+        readers.emplace_back(runs[i]);
+        long long key = 0;
+        if (readers[i].Next(key)) {
+            heap.push({key, i});
+        }
+    }
+    std::ofstream out(out_path, std::ios::binary);
+    std::vector<long long> block;
+    auto write_block = [&]() {
+        out.write(reinterpret_cast<const char*>(block.data()),
+                  static_cast<std::streamsize>(block.size() * sizeof(long long)));
+        block.clear();
+    };
+    uint64_t written = 0;
+    long long last = 0;
+    while (!heap.empty()) {
+        auto [key, i] = heap.top();
+        heap.pop();
+        if (written == 0 || key != last) {
+            block.push_back(key);
+            last = key;
+            ++written;
+            if (block.size() == kSetExternalBlockKeys) {
+                write_block();
+            }
+        }
+        long long next = 0;
+        if (readers[i].Next(next)) {
+            heap.push({next, i});
+        }
+    }
+    write_block();
+    CloseChecked(out, out_path);
+    return {out_path, written};
+}
+
+inline SetExternalBuildStats BuildImageFromKeyFiles(const std::vector<std::string>& inputs,
+                                                    const std::string& image_path,
+                                                    const SetExternalBuildOptions& options = {}) {
+    SetExternalBuildStats stats;
+    // every run file ever written, intermediate ones are removed as soon as they are merged
+    std::vector<std::string> temporaries;
+    std::string merged_path = image_path + options.merged_suffix;
+    std::string partial_path = image_path + options.partial_suffix;
+    auto remove_temporaries = [&]() {
+        for (const auto& path : temporaries) {
+            std::remove(path.c_str());
+        }
+        std::remove(merged_path.c_str());
+    };
+    auto new_run_path = [&]() {
+        temporaries.push_back(image_path + options.run_suffix +
+                              std::to_string(temporaries.size()));
+        return temporaries.back();
+    };
+    try {
+        std::vector<SetRunFile> runs;
+        std::vector<long long> run;
+        run.reserve(options.run_keys);
+        auto spill = [&]() {
+            SortUniqueRun(run);
+            ++stats.runs;
+            runs.push_back(WriteRun(new_run_path(), run));
+            run.clear();
+        };
+        for (const auto& input : inputs) {
+            SetKeyFileReader reader(input);
+            long long key = 0;
+            while (reader.Next(key)) {
+                run.push_back(key);
+                ++stats.keys_read;
+                if (run.size() == options.run_keys) {
+                    spill();
+                }
+            }
+        }
+        if (!run.empty() || runs.empty()) {
+            spill();
+        }
+        std::vector<long long>().swap(run);
+
+        size_t fan_in = std::max<size_t>(options.merge_fan_in, 2);
+        while (runs.size() > fan_in) {
+            std::vector<SetRunFile> merged_runs;
+            for (size_t begin = 0; begin < runs.size(); begin += fan_in) {
+                size_t end = std::min(begin + fan_in, runs.size());
+                std::vector<SetRunFile> group(runs.begin() + begin, runs.begin() + end);
+                merged_runs.push_back(MergeRuns(group, new_run_path()));
+                for (const auto& merged : group) {
+                    std::remove(merged.path.c_str());
+                }
+            }
+            runs = std::move(merged_runs);
+            ++stats.merge_passes;
+        }
+        SetRunFile merged = MergeRuns(runs, merged_path);
+        stats.unique_keys = merged.keys;
+        ++stats.merge_passes;
+        for (const auto& run_file : runs) {
+            std::remove(run_file.path.c_str());
+        }
+
+        {
+            std::ofstream image(partial_path, std::ios::binary);
+            if (!image) {
+                throw SetSnapshotError("can not write " + partial_path);
+            }
+            SetRunReader unique_keys(merged);
+            SetImageWriter<long long> writer(image, stats.unique_keys);
+            writer.WriteNodes([&unique_keys]() {
+                long long key = 0;
+                unique_keys.Next(key);
+                return key;
+            });
+            CloseChecked(image, partial_path);
+        }
+        if (std::rename(partial_path.c_str(), image_path.c_str()) != 0) {
+            throw SetSnapshotError("can not write " + image_path);
+        }
+    } catch (...) {
+        remove_temporaries();
+        std::remove(partial_path.c_str());
+        throw;
+    }
+    remove_temporaries();
+    return stats;
+}
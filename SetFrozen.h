@@ -0,0 +1,152 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+// Order-statistic set fixed at compile time: N keys in one sorted std::array, so a
+// constexpr table costs no work at startup and lives in read-only data.
+// MakeSetFrozen runs a key generator during constant evaluation, sorts and deduplicates its
+// keys in a std::vector (C++20 constexpr allocation) and freezes them into a SetFrozen
+// whose size is the number of distinct keys.
+// Find, LowerBound and RankInd0 are a binary search whose loop has no data-dependent
+// branches (the step is a conditional move), SelectInd0 is an index. Everything works in
+// constant expressions as well as at run time.
+
+template <typename K, size_t N, typename Compare = std::less<K>>
+class SetFrozen {
+public:
+    using ConstIterator = const K*;
+    using Iterator = ConstIterator;
+    using ConstReverseIterator = std::reverse_iterator<const K*>;
+    using ReverseIterator = ConstReverseIterator;
+
+    // keys in any order, all distinct
+    constexpr explicit SetFrozen(std::array<K, N> keys, const Compare& compare = Compare())
+        : keys_(keys), compare_(compare) {
+        std::sort(keys_.begin(), keys_.end(), compare_);
+        for (size_t i = 1; i < N; ++i) {
+            if (!compare_(keys_[i - 1], keys_[i])) {
+                throw std::invalid_argument("SetFrozen: duplicate keys");
+            }
+        }
+    }
+
+    constexpr ConstIterator Find(const K& key) const {
+        ConstIterator it = LowerBound(key);
+        return (it != End() && !compare_(key, *it)) ? it : End();
+    }
+    constexpr ConstIterator LowerBound(const K& key) const {
+        return keys_.data() + RankInd0(key);
+    }
+    constexpr ConstIterator UpperBound(const K& key) const {
+        if constexpr (N == 0) {
+            return End();
+        } else {
+            const K* base = keys_.data();
+            for (size_t length = N; length > 1; length -= length / 2) {
+                base = compare_(key, base[length / 2]) ? base : base + length / 2;
+            }
+            return base + !compare_(key, *base);
+        }
+    }
+    constexpr bool Contains(const K& key) const {
+        return Find(key) != End();
+    }
+    constexpr size_t Count(const K& key) const {
+        return static_cast<size_t>(Contains(key));
+    }
+
+    constexpr ConstIterator Begin() const noexcept {
+        return keys_.data();
+    }
+    constexpr ConstIterator End() const noexcept {
+        return keys_.data() + N;
+    }
+    constexpr ConstIterator CBegin() const noexcept {
+        return Begin();
+    }
+    constexpr ConstIterator CEnd() const noexcept {
+        return End();
+    }
+    constexpr ConstReverseIterator RBegin() const noexcept {
+        return ConstReverseIterator(End());
+    }
+    constexpr ConstReverseIterator REnd() const noexcept {
+        return ConstReverseIterator(Begin());
+    }
+
+    // End() if i >= Size()
+    constexpr ConstIterator SelectInd0(size_t i) const noexcept {
+        return keys_.data() + std::min(i, N);
+    }
+    // End() if i == 0 or i > Size()
+    constexpr ConstIterator SelectInd1(size_t i) const noexcept {
+        return (i == 0) ? End() : SelectInd0(i - 1);
+    }
+    // number of keys less than key
+    constexpr size_t RankInd0(const K& key) const {
+        if constexpr (N == 0) {
+            return 0;
+        } else {
+            const K* base = keys_.data();
+            for (size_t length = N; length > 1; length -= length / 2) {
+                base = compare_(base[length / 2], key) ? base + length / 2 : base;
+            }
+            return static_cast<size_t>(base - keys_.data()) + compare_(*base, key);
+        }
+    }
+    constexpr size_t RankInd1(const K& key) const {
+        return RankInd0(key) + 1;
+    }
+
+    static constexpr size_t Size() noexcept {
+        return N;
+    }
+    static constexpr bool Empty() noexcept {
+        return N == 0;
+    }
+    constexpr Compare KeyCompare() const {
+        return compare_;
+    }
+
+private:
+    std::array<K, N> keys_;
+    [[no_unique_address]] Compare compare_;
+};
+
+template <typename Make>
+using SetFrozenKey = std::remove_cvref_t<decltype(*std::begin(std::declval<Make>()()))>;
+
+// the keys of make() sorted and without duplicates
+template <typename Compare, typename Make>
+constexpr std::vector<SetFrozenKey<Make>> SetFrozenKeys(Make make) {
+    auto made = make();
+    std::vector<SetFrozenKey<Make>> keys(std::begin(made), std::end(made));
+    Compare compare;
+    std::sort(keys.begin(), keys.end(), compare);
+    auto equal = [&compare](const auto& lhs, const auto& rhs) {
+        return !compare(lhs, rhs) && !compare(rhs, lhs);
+    };
+    keys.erase(std::unique(keys.begin(), keys.end(), equal), keys.end());
+    return keys;
+}
+
+// make is a lambda without captures returning a range of keys, e.g. a std::vector filled in
+// a loop; its duplicates are dropped. Compare defaults to std::less of the keys:
+//   constexpr auto kPrimes = MakeSetFrozen([] { std::vector<int> primes; ...; return primes; });
+template <typename Compare = void, typename Make>
+consteval auto MakeSetFrozen(Make make) {
+    using K = SetFrozenKey<Make>;
+    using KeyCompare = std::conditional_t<std::is_void_v<Compare>, std::less<K>, Compare>;
+    constexpr size_t kSize = SetFrozenKeys<KeyCompare>(Make()).size();
+    std::vector<K> keys = SetFrozenKeys<KeyCompare>(make);
+    std::array<K, kSize> frozen{};
+    std::copy(keys.begin(), keys.end(), frozen.begin());
+    return SetFrozen<K, kSize, KeyCompare>(frozen);
+}
@@ -0,0 +1,284 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+#include "SetAVL.h"
+
+// Write-optimized order-statistic set in the style of an LSM tree.
+// Inserts go to a small SetAVL buffer that stays in cache; a full buffer is frozen into an
+// immutable sorted level. Levels are kept newest first and about ratio times larger than
+// the previous one: a background thread merges neighbours that break this, so there are
+// O(log_ratio(n / buffer_keys)) levels. Levels hold disjoint keys, because Insert checks
+// all of them first, so Contains and duplicate detection stay exact.
+//   RankInd0: sum of the ranks in the buffer and in every level.
+//   SelectInd0: multi-sequence selection over the levels and the buffer, O(L log n) steps
+//   that each search only inside the part of every level the answer can still be in.
+// Insert and queries must come from one thread; merges never block queries, they publish
+// a new list of levels and the querying thread picks it up on its next call.
+
+template <typename K, typename Compare = std::less<K>>
+class SetLSM {
+public:
+    struct Options {
+        size_t buffer_keys = size_t{1} << 13;
+        size_t ratio = 8;
+        // Insert waits for the merges when there are this many levels
+        size_t max_levels = 24;
+        // false: merges run inside Insert, for deterministic tests and single-core hosts
+        bool background = true;
+    };
+
+    explicit SetLSM(Options options = Options(), const Compare& compare = Compare())
+        : options_(options), compare_(compare), buffer_(compare) {
+        options_.buffer_keys = std::max<size_t>(options_.buffer_keys, 1);
+        options_.ratio = std::max<size_t>(options_.ratio, 2);
+        options_.max_levels = std::max<size_t>(options_.max_levels, 2);
+        if (options_.background) {
+            merger_ = std::thread([this] { MergeLoop(); });
+        }
+    }
+    SetLSM(const SetLSM&) = delete;
+    SetLSM& operator=(const SetLSM&) = delete;
+    ~SetLSM() {
+        if (merger_.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            work_.notify_all();
+            merger_.join();
+        }
+    }
+
+    // false if the key is already present
+    bool Insert(const K& key) {
+        if (Contains(key)) {
+            return false;
+        }
+        buffer_.Insert(key);
+        ++size_;
+        if (buffer_.Size() == options_.buffer_keys) {
+            FreezeBuffer();
+        }
+        return true;
+    }
+
+    bool Contains(const K& key) const {
+        if (buffer_.Contains(key)) {
+            return true;
+        }
+        for (const auto& level : View()) {
+            if (std::binary_search(level->begin(), level->end(), key, compare_)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // number of keys less than key
+    size_t RankInd0(const K& key) const {
+        return RankIn(View(), key);
+    }
+
+    // i-th key in ascending order, nothing if i >= Size()
+    std::optional<K> SelectInd0(size_t i) const {
+        if (i >= size_) {
+            return std::nullopt;
+        }
+        const auto& levels = View();
+        // the number of keys of sequence k less than the answer is within [low, high]; the
+        // buffer is the last sequence. Ranking the middle key of the widest window counts
+        // each sequence inside its window only, which clamps the count to the window without
+        // changing how it compares with i, and then every window shrinks to one side of it.
+        struct Window {
+            size_t low;
+            size_t high;
+            size_t rank;
+        };
+        std::vector<Window> windows(levels.size() + 1);
+        for (size_t k = 0; k < levels.size(); ++k) {
+            windows[k] = {0, levels[k]->size(), 0};
+        }
+        windows.back() = {0, buffer_.Size(), 0};
+        while (true) {
+            size_t widest = 0;
+            for (size_t k = 1; k < windows.size(); ++k) {
+                if (windows[k].high - windows[k].low > windows[widest].high - windows[widest].low) {
+                    widest = k;
+                }
+            }
+            size_t middle = windows[widest].low + (windows[widest].high - windows[widest].low) / 2;
+            const K& pivot = (widest < levels.size()) ? (*levels[widest])[middle]
+                                                      : *buffer_.SelectInd0(middle);
+            size_t rank = 0;
+            for (size_t k = 0; k < windows.size(); ++k) {
+                Window& window = windows[k];
+                if (window.low == window.high) {
+                    window.rank = window.low;
+                } else if (k < levels.size()) {
+                    auto begin = levels[k]->begin();
+                    window.rank = std::lower_bound(begin + window.low, begin + window.high, pivot,
+                                                   compare_) -
+                                  begin;
+                } else {
+                    window.rank = std::clamp(buffer_.RankInd0(pivot), window.low, window.high);
+                }
+                rank += window.rank;
+            }
+            if (rank == i) {
+                return pivot;
+            }
+            for (auto& window : windows) {
+                (rank < i ? window.low : window.high) = window.rank;
+            }
+            if (rank < i) {
+                windows[widest].low = middle + 1;
+            } else {
+                windows[widest].high = middle;
+            }
+        }
+    }
+    std::optional<K> SelectInd1(size_t i) const {
+        if (i == 0) {
+            return std::nullopt;
+        }
+        return SelectInd0(i - 1);
+    }
+
+    size_t Size() const noexcept {
+        return size_;
+    }
+    bool Empty() const noexcept {
+        return size_ == 0;
+    }
+    size_t LevelCount() const {
+        return View().size();
+    }
+    // blocks until no merge is pending
+    void WaitForMerges() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this] { return !merging_ && !NeedsMerge(); });
+    }
+
+private:
+    using Level = std::shared_ptr<const std::vector<K>>;
+
+    size_t RankIn(const std::vector<Level>& levels, const K& key) const {
+        size_t rank = buffer_.RankInd0(key);
+        for (const auto& level : levels) {
+            rank += std::lower_bound(level->begin(), level->end(), key, compare_) - level->begin();
+        }
+        return rank;
+    }
+
+    // levels as of the last merge, refreshed only when a merge has published a new list
+    const std::vector<Level>& View() const {
+        uint64_t version = version_.load(std::memory_order_acquire);
+        if (version != view_version_) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            view_ = levels_;
+            view_version_ = version_.load(std::memory_order_relaxed);
+        }
+        return view_;
+    }
+
+    void FreezeBuffer() {
+        auto keys = std::make_shared<std::vector<K>>();
+        keys->reserve(buffer_.Size());
+        for (auto it = buffer_.Begin(); it != buffer_.End(); ++it) {
+            keys->push_back(*it);
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this] { return levels_.size() < options_.max_levels; });
+        levels_.insert(levels_.begin(), std::move(keys));
+        // the buffer is cleared only after its keys are in the view
+        view_ = levels_;
+        view_version_ = version_.fetch_add(1, std::memory_order_release) + 1;
+        buffer_.Clear();
+        if (options_.background) {
+            lock.unlock();
+            work_.notify_one();
+        } else {
+            while (NeedsMerge()) {
+                MergeOnce(lock);
+            }
+        }
+    }
+
+    // index of the newer level of the first pair out of the size ratio, or levels_.size();
+    // with max_levels levels the newest pair is merged anyway
+    size_t MergeCandidate() const {
+        if (levels_.size() >= options_.max_levels) {
+            return 0;
+        }
+        for (size_t i = 0; i + 1 < levels_.size(); ++i) {
+            if (levels_[i]->size() * options_.ratio > levels_[i + 1]->size()) {
+                return i;
+            }
+        }
+        return levels_.size();
+    }
+    bool NeedsMerge() const {
+        return MergeCandidate() != levels_.size();
+    }
+
+    // merges one pair with the lock released; only the merger removes levels, so the pair
+    // is still adjacent afterwards even if new levels were added in front
+    void MergeOnce(std::unique_lock<std::mutex>& lock) {
+        size_t index = MergeCandidate();
+        Level newer = levels_[index];
+        Level older = levels_[index + 1];
+        merging_ = true;
+        lock.unlock();
+        auto merged = std::make_shared<std::vector<K>>();
+        merged->reserve(newer->size() + older->size());
+        std::merge(newer->begin(), newer->end(), older->begin(), older->end(),
+                   std::back_inserter(*merged), compare_);
+        lock.lock();
+        auto position = std::find(levels_.begin(), levels_.end(), newer);
+        *position = std::move(merged);
+        levels_.erase(position + 1);
+        merging_ = false;
+        version_.fetch_add(1, std::memory_order_release);
+        done_.notify_all();
+    }
+
+    void MergeLoop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            work_.wait(lock, [this] { return stop_ || NeedsMerge(); });
+            if (stop_) {
+                return;
+            }
+            MergeOnce(lock);
+        }
+    }
+
+    Options options_;
+    Compare compare_;
+    SetAVL<K, Compare> buffer_;
+    size_t size_ = 0;
+
+    mutable std::mutex mutex_;
+    std::condition_variable work_;
+    std::condition_variable done_;
+    std::vector<Level> levels_;
+    std::atomic<uint64_t> version_{0};
+    bool merging_ = false;
+    bool stop_ = false;
+    std::thread merger_;
+
+    // copy of levels_ owned by the querying thread
+    mutable std::vector<Level> view_;
+    mutable uint64_t view_version_ = 0;
+};
@@ -0,0 +1,267 @@
+#pragma once
+
+#include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <utility>
+#include <vector>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Node storage of SetAVL in large chunks, selected per tree with SetAVL::UseNodeArena.
+// huge_pages maps 2 MB chunks backed by huge pages, so a descent through a large tree needs
+// far fewer TLB entries: explicit huge pages (MAP_HUGETLB) are tried first, then
+// transparent huge pages of an aligned mapping (madvise MADV_HUGEPAGE), then small pages.
+// numa_node binds the chunks to the memory of one NUMA node with mbind.
+// Where the system lacks any of these the next fallback is used silently; the report hook
+// and Backing() tell what was actually obtained.
+// Memory of an arena is returned only all at once, by Release or the destructor.
+
+inline constexpr size_t kSetArenaChunkBytes = size_t{1} << 21;
+
+enum class SetArenaBacking {
+    // operator new, the arena only groups the nodes
+    kHeap,
+    // anonymous mapping of small pages
+    kPages,
+    // anonymous mapping advised to use transparent huge pages
+    kTransparentHugePages,
+    // reserved huge pages of MAP_HUGETLB
+    kHugeTlb,
+};
+
+inline const char* SetArenaBackingName(SetArenaBacking backing) {
+    switch (backing) {
+        case SetArenaBacking::kHeap:
+            return "heap";
+        case SetArenaBacking::kPages:
+            return "pages";
+        case SetArenaBacking::kTransparentHugePages:
+            return "transparent huge pages";
+        case SetArenaBacking::kHugeTlb:
+            return "hugetlb";
+    }
+    return "unknown";
+}
+
+// what one chunk got
+struct SetArenaReport {
+    SetArenaBacking backing = SetArenaBacking::kHeap;
+    size_t bytes = 0;
+    // requested node, -1 if none
+    int numa_node = -1;
+    bool numa_bound = false;
+};
+
+struct SetArenaOptions {
+    bool huge_pages = false;
+    // NUMA node for the chunks, -1: the default policy of the thread
+    int numa_node = -1;
+    // called for every chunk obtained
+    std::function<void(const SetArenaReport&)> report;
+
+    // without huge pages or a node the tree allocates each node on its own
+    bool Pooled() const noexcept {
+        return huge_pages || numa_node >= 0;
+    }
+};
+
+class SetNodeArena {
+public:
+    SetNodeArena() = default;
+    explicit SetNodeArena(SetArenaOptions options) : options_(std::move(options)) {
+    }
+    SetNodeArena(const SetNodeArena&) = delete;
+    SetNodeArena& operator=(const SetNodeArena&) = delete;
+    SetNodeArena(SetNodeArena&& other) noexcept {
+        Swap(other);
+    }
+    SetNodeArena& operator=(SetNodeArena&& other) noexcept {
+        SetNodeArena tmp = std::move(other);
+        Swap(tmp);
+        return *this;
+    }
+    ~SetNodeArena() {
+        Release();
+    }
+
+    void Swap(SetNodeArena& other) noexcept {
+        std::swap(options_, other.options_);
+        std::swap(chunks_, other.chunks_);
+        std::swap(used_, other.used_);
+    }
+
+    // bytes at the given alignment (at most the page size); a request larger than a chunk
+    // gets a chunk of its own
+    void* Allocate(size_t bytes, size_t alignment) {
+        if (!chunks_.empty()) {
+            size_t offset = (used_ + alignment - 1) / alignment * alignment;
+            if (offset + bytes <= chunks_.back().bytes) {
+                used_ = offset + bytes;
+                return static_cast<char*>(chunks_.back().data) + offset;
+            }
+        }
+        size_t chunk_bytes = std::max(bytes, kSetArenaChunkBytes);
+        chunk_bytes = (chunk_bytes + kSetArenaChunkBytes - 1) / kSetArenaChunkBytes *
+                      kSetArenaChunkBytes;
+        AddChunk(chunk_bytes);
+        used_ = bytes;
+        return chunks_.back().data;
+    }
+
+    // bytes in a chunk of their own for a block filled at once, such as a copied tree: without
+    // pooling the chunk is exactly that large, pooled chunks stay whole mappings as in Allocate
+    void* AllocateExact(size_t bytes, size_t alignment) {
+        if (options_.Pooled()) {
+            return Allocate(bytes, alignment);
+        }
+        AddChunk(bytes);
+        used_ = bytes;
+        return chunks_.back().data;
+    }
+    void Release() noexcept {
+        for (const auto& chunk : chunks_) {
+            UnmapChunk(chunk);
+        }
+        chunks_.clear();
+        used_ = 0;
+    }
+
+    const SetArenaOptions& Options() const noexcept {
+        return options_;
+    }
+    // for the chunks obtained from now on
+    void SetOptions(SetArenaOptions options) {
+        options_ = std::move(options);
+    }
+    // backing of the newest chunk, kHeap before the first one
+    SetArenaBacking Backing() const noexcept {
+        return chunks_.empty() ? SetArenaBacking::kHeap : chunks_.back().backing;
+    }
+    size_t ChunkCount() const noexcept {
+        return chunks_.size();
+    }
+    size_t MappedBytes() const noexcept {
+        size_t bytes = 0;
+        for (const auto& chunk : chunks_) {
+            bytes += chunk.bytes;
+        }
+        return bytes;
+    }
+
+private:
+    struct Chunk {
+        void* data = nullptr;
+        size_t bytes = 0;
+        SetArenaBacking backing = SetArenaBacking::kHeap;
+    };
+
+    // the chunk is owned by chunks_ before the report hook runs
+    void AddChunk(size_t bytes) {
+        if (chunks_.size() == chunks_.capacity()) {
+            chunks_.reserve(2 * chunks_.size() + 1);
+        }
+        Chunk chunk{nullptr, bytes, SetArenaBacking::kHeap};
+#ifdef __linux__
+        if (options_.Pooled()) {
+            chunk = MapPages(bytes);
+        }
+#endif
+        if (chunk.data == nullptr) {
+            chunk.backing = SetArenaBacking::kHeap;
+            chunk.data = ::operator new(bytes, std::align_val_t(kPageAlignment));
+        }
+        SetArenaReport report{chunk.backing, bytes, options_.numa_node, false};
+#ifdef __linux__
+        if (options_.numa_node >= 0 && chunk.backing != SetArenaBacking::kHeap) {
+            report.numa_bound = BindToNode(chunk);
+        }
+#endif
+        chunks_.push_back(chunk);
+        if (options_.report) {
+            options_.report(report);
+        }
+    }
+
+    static void UnmapChunk(const Chunk& chunk) noexcept {
+#ifdef __linux__
+        if (chunk.backing != SetArenaBacking::kHeap) {
+            munmap(chunk.data, chunk.bytes);
+            return;
+        }
+#endif
+        ::operator delete(chunk.data, std::align_val_t(kPageAlignment));
+    }
+
+#ifdef __linux__
+    // data stays nullptr if no mapping could be made
+    Chunk MapPages(size_t bytes) const {
+        Chunk chunk{nullptr, bytes, SetArenaBacking::kPages};
+#ifdef MAP_HUGETLB
+        if (options_.huge_pages) {
+            void* data = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (data != MAP_FAILED) {
+                chunk.data = data;
+                chunk.backing = SetArenaBacking::kHugeTlb;
+                return chunk;
+            }
+        }
+#endif
+        // one extra chunk of address space to cut a 2 MB aligned range out of
+        size_t reserved = bytes + kSetArenaChunkBytes;
+        void* data =
+            mmap(nullptr, reserved, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED) {
+            return chunk;
+        }
+        auto begin = reinterpret_cast<uintptr_t>(data);
+        uintptr_t aligned = (begin + kSetArenaChunkBytes - 1) / kSetArenaChunkBytes *
+                            kSetArenaChunkBytes;
+        if (aligned != begin) {
+            munmap(data, aligned - begin);
+        }
+        if (aligned + bytes != begin + reserved) {
+            munmap(reinterpret_cast<void*>(aligned + bytes), begin + reserved - aligned - bytes);
+        }
+        chunk.data = reinterpret_cast<void*>(aligned);
+#ifdef MADV_HUGEPAGE
+        if (options_.huge_pages && madvise(chunk.data, bytes, MADV_HUGEPAGE) == 0) {
+            chunk.backing = SetArenaBacking::kTransparentHugePages;
+        }
+#endif
+        return chunk;
+    }
+
+    // before the first touch, so the pages are allocated on the node
+    bool BindToNode(const Chunk& chunk) const {
+#ifdef SYS_mbind
+        constexpr int kMpolBind = 2;
+        constexpr unsigned kMaskBits = sizeof(unsigned long) * CHAR_BIT;
+        if (options_.numa_node >= static_cast<int>(kMaskBits)) {
+            return false;
+        }
+        unsigned long mask = 1UL << options_.numa_node;
+        // the kernel reads maxnode - 1 bits of the mask
+        return syscall(SYS_mbind, chunk.data, chunk.bytes, kMpolBind, &mask, kMaskBits + 1,
+                       0) == 0;
+#else
+        (void)chunk;
+        return false;
+#endif
+    }
+#endif
+
+    static constexpr size_t kPageAlignment = 4096;
+
+    SetArenaOptions options_;
+    std::vector<Chunk> chunks_;
+    // bytes taken from the newest chunk
+    size_t used_ = 0;
+};
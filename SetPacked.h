@@ -0,0 +1,427 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include "SetBlockTree.h"
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define SET_PACKED_AVX2 1
+#endif
+
+// Order-statistic set of integers stored as compressed blocks of up to B sorted keys, an
+// AVL tree (SetBlockTree) over the blocks keeps the number of keys in every subtree.
+// A block is frame of reference coded: its first key in full and the differences of the
+// other keys from it bit-packed at the smallest width that pays off (PFOR): the largest
+// differences, always a suffix of a sorted block, are kept in 64 bits as exceptions when
+// that takes fewer bits than widening all the others. Dense keys such as timestamps need a
+// few bits per key instead of the 72 bytes of a SetAVL node.
+// The k-th key of a block is read without decoding the others, so SelectInd0 descends by
+// block counts and extracts one key, and RankInd0 and Contains binary search one block.
+// Inserts and ForEach decode whole blocks, with AVX2 where the CPU has it.
+
+// unpacks n values of width bits, width at most 56 (blocks never pack wider); words must be
+// readable 8 bytes past the last value
+inline void SetPackedUnpackScalar(const uint64_t* words, unsigned width, size_t n,
+                                  uint64_t* out) {
+    if (width == 0) {
+        std::fill(out, out + n, uint64_t{0});
+        return;
+    }
+    uint64_t mask = (uint64_t{1} << width) - 1;
+    for (size_t i = 0; i < n; ++i) {
+        size_t bit = i * width;
+        uint64_t value = words[bit / 64] >> (bit % 64);
+        if (bit % 64 + width > 64) {
+            value |= words[bit / 64 + 1] << (64 - bit % 64);
+        }
+        out[i] = value & mask;
+    }
+}
+
+#ifdef SET_PACKED_AVX2
+// four values per step: a gather of the 8 bytes holding each value, then a variable shift
+__attribute__((target("avx2"))) inline void SetPackedUnpackAvx2(const uint64_t* words,
+                                                               unsigned width, size_t n,
+                                                               uint64_t* out) {
+    const auto* bytes = reinterpret_cast<const long long*>(words);
+    const __m256i mask = _mm256_set1_epi64x(static_cast<long long>((uint64_t{1} << width) - 1));
+    const __m256i step = _mm256_set1_epi64x(4 * width);
+    const __m256i low_bits = _mm256_set1_epi64x(7);
+    __m256i bit = _mm256_setr_epi64x(0, width, 2 * width, 3 * width);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i value = _mm256_i64gather_epi64(bytes, _mm256_srli_epi64(bit, 3), 1);
+        value = _mm256_srlv_epi64(value, _mm256_and_si256(bit, low_bits));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_and_si256(value, mask));
+        bit = _mm256_add_epi64(bit, step);
+    }
+    for (; i < n; ++i) {
+        size_t offset = i * width;
+        uint64_t value;
+        std::memcpy(&value, reinterpret_cast<const char*>(words) + offset / 8, sizeof(value));
+        out[i] = (value >> (offset % 8)) & ((uint64_t{1} << width) - 1);
+    }
+}
+#endif
+
+inline bool SetPackedHasAvx2() {
+#ifdef SET_PACKED_AVX2
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    return has_avx2;
+#else
+    return false;
+#endif
+}
+
+// scratch for N values of a block, value-initialized; on the stack up to 4 KiB and on the
+// heap above, so a large B does not put whole blocks on the stack
+template <typename T, size_t N, bool OnStack = N * sizeof(T) <= 4096>
+class SetPackedBuffer {
+public:
+    T* Data() noexcept {
+        return values_;
+    }
+
+private:
+    T values_[N]{};
+};
+
+template <typename T, size_t N>
+class SetPackedBuffer<T, N, false> {
+public:
+    T* Data() noexcept {
+        return values_.get();
+    }
+
+private:
+    std::unique_ptr<T[]> values_ = std::make_unique<T[]>(N);
+};
+
+template <typename K, size_t B = 128>
+class SetPacked {
+    static_assert(std::is_integral_v<K> && !std::is_same_v<K, bool>, "keys are integers");
+    static_assert(B >= 2 && B <= 65536, "a block holds 2 to 65536 keys");
+
+    struct Node;
+    using Tree = SetBlockTree<Node>;
+
+public:
+    static constexpr size_t kBlockKeys = B;
+
+    // false if the key is already present
+    bool Insert(K key) {
+        if (tree_.Root() == nullptr) {
+            Node* root = tree_.AddRoot();
+            Encode(root, &key, 1);
+            Tree::FixSizesUp(root);
+            return true;
+        }
+        Node* node = tree_.Root();
+        size_t index = 0;
+        while (true) {
+            if (key < node->base) {
+                if (node->children[0] == nullptr) {
+                    break;
+                }
+                node = node->children[0];
+            } else if (node->Last() < key) {
+                if (node->children[1] == nullptr) {
+                    index = node->count;
+                    break;
+                }
+                node = node->children[1];
+            } else {
+                index = node->LowerIndex(key);
+                if (node->Key(index) == key) {
+                    return false;
+                }
+                break;
+            }
+        }
+        InsertIntoBlock(node, index, key);
+        return true;
+    }
+
+    bool Contains(K key) const {
+        const Node* node = LowerBoundBlock(key);
+        return node != nullptr && node->Key(node->LowerIndex(key)) == key;
+    }
+    // the least key not less than key
+    std::optional<K> LowerBound(K key) const {
+        const Node* node = LowerBoundBlock(key);
+        if (node == nullptr) {
+            return std::nullopt;
+        }
+        return node->Key(node->LowerIndex(key));
+    }
+
+    // number of keys less than key
+    size_t RankInd0(K key) const {
+        size_t rank = 0;
+        const Node* node = tree_.Root();
+        while (node != nullptr) {
+            if (node->Last() < key) {
+                rank += Tree::SizeOf(node->children[0]) + node->count;
+                node = node->children[1];
+            } else if (key <= node->base) {
+                node = node->children[0];
+            } else {
+                return rank + Tree::SizeOf(node->children[0]) + node->LowerIndex(key);
+            }
+        }
+        return rank;
+    }
+    size_t RankInd1(K key) const {
+        return RankInd0(key) + 1;
+    }
+    // i-th key in ascending order, nothing if i >= Size()
+    std::optional<K> SelectInd0(size_t i) const {
+        const Node* node = tree_.Root();
+        while (node != nullptr) {
+            size_t left = Tree::SizeOf(node->children[0]);
+            if (i < left) {
+                node = node->children[0];
+            } else if (i - left < node->count) {
+                return node->Key(i - left);
+            } else {
+                i -= left + node->count;
+                node = node->children[1];
+            }
+        }
+        return std::nullopt;
+    }
+    std::optional<K> SelectInd1(size_t i) const {
+        if (i == 0) {
+            return std::nullopt;
+        }
+        return SelectInd0(i - 1);
+    }
+
+    // calls visit(key) for all keys in ascending order, a block decoded at a time
+    template <typename Visit>
+    void ForEach(Visit visit) const {
+        SetPackedBuffer<K, B> buffer;
+        K* keys = buffer.Data();
+        for (const Node* node = Tree::Extreme(tree_.Root(), 0); node != nullptr;
+             node = Tree::Step(node, 1)) {
+            node->Decode(keys);
+            for (size_t i = 0; i < node->count; ++i) {
+                visit(keys[i]);
+            }
+        }
+    }
+
+    void Clear() noexcept {
+        tree_.Clear();
+        word_count_ = 0;
+    }
+    size_t Size() const noexcept {
+        return tree_.Size();
+    }
+    bool Empty() const noexcept {
+        return tree_.Root() == nullptr;
+    }
+    size_t BlockCount() const noexcept {
+        return tree_.BlockCount();
+    }
+    // bytes of the blocks and of their packed keys
+    size_t MemoryBytes() const noexcept {
+        return tree_.BlockCount() * sizeof(Node) + word_count_ * sizeof(uint64_t);
+    }
+
+private:
+    struct Node {
+        Node() = default;
+        // the keys only, SetBlockTree links the copy
+        Node(const Node& other)
+            : count(other.count), base(other.base), width(other.width), packed(other.packed) {
+            if (other.words != nullptr) {
+                words = std::make_unique<uint64_t[]>(WordCount());
+                std::copy(other.words.get(), other.words.get() + WordCount(), words.get());
+            }
+        }
+        Node& operator=(const Node&) = delete;
+
+        size_t PackedWords() const noexcept {
+            return (static_cast<size_t>(packed) * width + 63) / 64;
+        }
+        // with one word of padding for the unaligned reads of the decoder
+        size_t WordCount() const noexcept {
+            return PackedWords() + (count - packed) + 1;
+        }
+
+        uint64_t Delta(size_t i) const noexcept {
+            if (i >= packed) {
+                return words[PackedWords() + (i - packed)];
+            }
+            if (width == 0) {
+                return 0;
+            }
+            size_t bit = i * width;
+            uint64_t value = words[bit / 64] >> (bit % 64);
+            if (bit % 64 + width > 64) {
+                value |= words[bit / 64 + 1] << (64 - bit % 64);
+            }
+            return value & ((uint64_t{1} << width) - 1);
+        }
+        K Key(size_t i) const noexcept {
+            return static_cast<K>(static_cast<uint64_t>(base) + Delta(i));
+        }
+        K Last() const noexcept {
+            return Key(count - 1);
+        }
+        // binary search without decoding the block
+        size_t LowerIndex(K key) const noexcept {
+            uint64_t delta = static_cast<uint64_t>(key) - static_cast<uint64_t>(base);
+            if (key < base) {
+                return 0;
+            }
+            size_t low = 0;
+            size_t high = count;
+            while (low < high) {
+                size_t middle = (low + high) / 2;
+                if (Delta(middle) < delta) {
+                    low = middle + 1;
+                } else {
+                    high = middle;
+                }
+            }
+            return low;
+        }
+
+        void Decode(K* keys) const {
+            SetPackedBuffer<uint64_t, B> buffer;
+            uint64_t* deltas = buffer.Data();
+#ifdef SET_PACKED_AVX2
+            if (SetPackedHasAvx2()) {
+                SetPackedUnpackAvx2(words.get(), width, packed, deltas);
+            } else {
+                SetPackedUnpackScalar(words.get(), width, packed, deltas);
+            }
+#else
+            SetPackedUnpackScalar(words.get(), width, packed, deltas);
+#endif
+            std::copy(words.get() + PackedWords(), words.get() + PackedWords() + (count - packed),
+                      deltas + packed);
+            uint64_t first = static_cast<uint64_t>(base);
+            for (size_t i = 0; i < count; ++i) {
+                keys[i] = static_cast<K>(first + deltas[i]);
+            }
+        }
+
+        Node* children[2] = {nullptr, nullptr};
+        Node* parent = nullptr;
+        // keys in the subtree
+        size_t size = 0;
+        // keys in the block
+        uint32_t count = 0;
+        int32_t height = 1;
+        // the first key
+        K base = 0;
+        // bits per packed difference
+        uint32_t width = 0;
+        // differences [0, packed) are bit-packed, the others are exceptions of 64 bits
+        uint32_t packed = 0;
+        std::unique_ptr<uint64_t[]> words;
+    };
+
+    // the block with the least key not less than key
+    const Node* LowerBoundBlock(K key) const {
+        const Node* best = nullptr;
+        for (const Node* node = tree_.Root(); node != nullptr;) {
+            if (node->Last() < key) {
+                node = node->children[1];
+                continue;
+            }
+            best = node;
+            if (node->base < key) {
+                break;
+            }
+            node = node->children[0];
+        }
+        return best;
+    }
+
+    // keys sorted, count at most B
+    void Encode(Node* node, const K* keys, size_t count) {
+        SetPackedBuffer<uint64_t, B> buffer;
+        uint64_t* deltas = buffer.Data();
+        uint64_t first = static_cast<uint64_t>(keys[0]);
+        for (size_t i = 0; i < count; ++i) {
+            deltas[i] = static_cast<uint64_t>(keys[i]) - first;
+        }
+        // every width from 0 to 56 bits against keeping the deltas at or above 2^width whole
+        size_t best_width = 0;
+        size_t best_packed = 0;
+        size_t best_bits = count * 64;
+        for (size_t width = 0; width <= 56; ++width) {
+            size_t packed = static_cast<size_t>(
+                std::lower_bound(deltas, deltas + count, uint64_t{1} << width) - deltas);
+            size_t bits = packed * width + (count - packed) * 64;
+            if (bits < best_bits) {
+                best_bits = bits;
+                best_width = width;
+                best_packed = packed;
+            }
+        }
+        word_count_ -= (node->words != nullptr) ? node->WordCount() : 0;
+        node->base = keys[0];
+        node->count = static_cast<uint32_t>(count);
+        node->width = static_cast<uint32_t>(best_width);
+        node->packed = static_cast<uint32_t>(best_packed);
+        auto words = std::make_unique<uint64_t[]>(node->WordCount());
+        for (size_t i = 0; i < best_packed && best_width > 0; ++i) {
+            size_t bit = i * best_width;
+            words[bit / 64] |= deltas[i] << (bit % 64);
+            if (bit % 64 + best_width > 64) {
+                words[bit / 64 + 1] |= deltas[i] >> (64 - bit % 64);
+            }
+        }
+        std::copy(deltas + best_packed, deltas + count, words.get() + node->PackedWords());
+        node->words = std::move(words);
+        word_count_ += node->WordCount();
+    }
+
+    // decodes the block, adds the key before position index and encodes it again, split in
+    // halves when full; at the ends of the set a new block is started instead
+    void InsertIntoBlock(Node* node, size_t index, K key) {
+        SetPackedBuffer<K, B + 1> buffer;
+        K* keys = buffer.Data();
+        node->Decode(keys);
+        size_t count = node->count;
+        if (count == B && index == 0 && Tree::Step(node, 0) == nullptr) {
+            Node* fresh = tree_.AddBeside(node, 0);
+            Encode(fresh, &key, 1);
+            Tree::FixSizesUp(fresh);
+            return;
+        }
+        if (count == B && index == B && Tree::Step(node, 1) == nullptr) {
+            Node* fresh = tree_.AddBeside(node, 1);
+            Encode(fresh, &key, 1);
+            Tree::FixSizesUp(fresh);
+            return;
+        }
+        std::copy_backward(keys + index, keys + count, keys + count + 1);
+        keys[index] = key;
+        ++count;
+        if (count <= B) {
+            Encode(node, keys, count);
+            Tree::FixSizesUp(node);
+            return;
+        }
+        Node* fresh = tree_.AddBeside(node, 1);
+        size_t half = count / 2;
+        Encode(node, keys, half);
+        Encode(fresh, keys + half, count - half);
+        Tree::FixSizesUp(Tree::Lower(node, fresh));
+    }
+
+    Tree tree_;
+    // 64-bit words of packed keys in all blocks
+    size_t word_count_ = 0;
+};
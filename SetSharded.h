@@ -0,0 +1,351 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+#include "FenwickTree.h"
+#include "SetAVL.h"
+#include "ThreadPool.h"
+
+// Order-statistic set split by key ranges into shards, each an independent SetAVL behind
+// its own mutex, so writers to different ranges do not contend.
+// An AtomicFenwickTree keeps the shard sizes: global SelectInd0 finds the shard by a
+// Fenwick select in O(log P) and selects inside it, RankInd0 adds the keys of the shards
+// before the one of the key. A shard that grows past max_shard_keys is split into equal
+// parts (the shard list is locked exclusively for that), so hot ranges get more shards.
+// Queries are exact when no insert runs at the same time; alongside inserts every shard is
+// read at a slightly different moment.
+// Every shard belongs to one worker of a ThreadPool, dealt round-robin as shards are made;
+// InsertBatch routes keys to shards and each worker inserts into its own shards, and the
+// parts of a split shard are rebuilt by their workers too. With Options::cpus each worker
+// is pinned to one CPU: the nodes of a shard are then allocated and later touched from one
+// CPU, which keeps them on its NUMA node under the default first-touch policy of Linux.
+
+template <typename K, typename Compare = std::less<K>>
+class SetSharded {
+public:
+    struct Options {
+        size_t max_shard_keys = size_t{1} << 20;
+        // workers of InsertBatch and of splits, 0 means one per hardware thread
+        size_t threads = 0;
+        // CPUs to pin the workers to, one worker per entry; empty: no pinning
+        std::vector<int> cpus;
+    };
+
+    // split_keys are the lowest keys of shards 1, 2, ...; without them there is one shard
+    // to start with
+    explicit SetSharded(std::vector<K> split_keys = {}, Options options = Options(),
+                        const Compare& compare = Compare())
+        : options_(std::move(options)), compare_(compare) {
+        options_.max_shard_keys = std::max<size_t>(options_.max_shard_keys, 2);
+        std::sort(split_keys.begin(), split_keys.end(), compare_);
+        split_keys.erase(std::unique(split_keys.begin(), split_keys.end(),
+                                     [this](const K& lhs, const K& rhs) {
+                                         return !compare_(lhs, rhs) && !compare_(rhs, lhs);
+                                     }),
+                         split_keys.end());
+        split_keys_ = std::move(split_keys);
+        workers_ = options_.cpus.empty() ? options_.threads : options_.cpus.size();
+        if (workers_ == 0) {
+            workers_ = std::max<size_t>(1, std::thread::hardware_concurrency());
+        }
+        for (size_t i = 0; i <= split_keys_.size(); ++i) {
+            shards_.push_back(std::make_unique<Shard>(compare_, NextWorker()));
+        }
+        counts_ = AtomicFenwickTree(shards_.size());
+    }
+
+    // false if the key is already present; safe to call from any number of threads. If the
+    // split that the key triggers throws, the key stays inserted and the error is rethrown.
+    bool Insert(const K& key) {
+        bool split = false;
+        {
+            std::shared_lock<std::shared_mutex> lock(shards_mutex_);
+            size_t index = ShardOf(key);
+            Shard& shard = *shards_[index];
+            std::lock_guard<std::mutex> shard_lock(shard.mutex);
+            if (!shard.set.Insert(key).second) {
+                return false;
+            }
+            counts_.Add(index, 1);
+            split = shard.set.Size() > options_.max_shard_keys;
+        }
+        size_.fetch_add(1, std::memory_order_relaxed);
+        if (split) {
+            SplitLargeShards();
+        }
+        return true;
+    }
+
+    // inserts on the workers of Options, returns the number of new keys; if an insert
+    // throws, the keys inserted before it stay and are counted, and the error is rethrown
+    size_t InsertBatch(const std::vector<K>& keys) {
+        size_t inserted = 0;
+        bool split = false;
+        std::exception_ptr error;
+        {
+            std::shared_lock<std::shared_mutex> lock(shards_mutex_);
+            std::vector<std::vector<const K*>> routed(shards_.size());
+            for (const auto& key : keys) {
+                routed[ShardOf(key)].push_back(&key);
+            }
+            std::vector<size_t> worker_inserted(workers_);
+            // a char per worker, so the workers do not write to one bool
+            std::vector<char> worker_split(workers_);
+            try {
+                RunOnWorkers([&](size_t worker) {
+                    for (size_t index = 0; index < shards_.size(); ++index) {
+                        if (shards_[index]->worker != worker || routed[index].empty()) {
+                            continue;
+                        }
+                        Shard& shard = *shards_[index];
+                        std::lock_guard<std::mutex> shard_lock(shard.mutex);
+                        size_t before = shard.set.Size();
+                        auto count = [&]() {
+                            counts_.Add(index, shard.set.Size() - before);
+                            worker_inserted[worker] += shard.set.Size() - before;
+                            worker_split[worker] |= shard.set.Size() > options_.max_shard_keys;
+                        };
+                        try {
+                            for (const K* key : routed[index]) {
+                                shard.set.Insert(*key);
+                            }
+                        } catch (...) {
+                            count();
+                            throw;
+                        }
+                        count();
+                    }
+                });
+            } catch (...) {
+                error = std::current_exception();
+            }
+            for (size_t count : worker_inserted) {
+                inserted += count;
+            }
+            split = std::find(worker_split.begin(), worker_split.end(), 1) != worker_split.end();
+        }
+        size_.fetch_add(inserted, std::memory_order_relaxed);
+        if (error != nullptr) {
+            std::rethrow_exception(error);
+        }
+        // as in Insert, the exclusive lock is taken only when a shard went over the limit
+        if (split) {
+            SplitLargeShards();
+        }
+        return inserted;
+    }
+
+    bool Contains(const K& key) const {
+        std::shared_lock<std::shared_mutex> lock(shards_mutex_);
+        const Shard& shard = *shards_[ShardOf(key)];
+        std::lock_guard<std::mutex> shard_lock(shard.mutex);
+        return shard.set.Contains(key);
+    }
+
+    // number of keys less than key
+    size_t RankInd0(const K& key) const {
+        std::shared_lock<std::shared_mutex> lock(shards_mutex_);
+        size_t index = ShardOf(key);
+        const Shard& shard = *shards_[index];
+        std::lock_guard<std::mutex> shard_lock(shard.mutex);
+        return counts_.PrefixSum(index) + shard.set.RankInd0(key);
+    }
+
+    // i-th key in ascending order, nothing if i >= Size()
+    std::optional<K> SelectInd0(size_t i) const {
+        std::shared_lock<std::shared_mutex> lock(shards_mutex_);
+        size_t rest = 0;
+        size_t index = counts_.Select(i + 1, &rest);
+        if (index == shards_.size()) {
+            return std::nullopt;
+        }
+        // counts_ is added to after the shard and read with acquire, so the local index is
+        // in the shard; End() is still checked rather than trusted to that argument
+        const Shard& shard = *shards_[index];
+        std::lock_guard<std::mutex> shard_lock(shard.mutex);
+        auto it = shard.set.SelectInd0(rest - 1);
+        if (it == shard.set.End()) {
+            return std::nullopt;
+        }
+        return *it;
+    }
+    std::optional<K> SelectInd1(size_t i) const {
+        if (i == 0) {
+            return std::nullopt;
+        }
+        return SelectInd0(i - 1);
+    }
+
+    size_t Size() const noexcept {
+        return size_.load(std::memory_order_relaxed);
+    }
+    bool Empty() const noexcept {
+        return Size() == 0;
+    }
+    size_t ShardCount() const {
+        std::shared_lock<std::shared_mutex> lock(shards_mutex_);
+        return shards_.size();
+    }
+    // keys per shard in key order
+    std::vector<size_t> ShardSizes() const {
+        std::shared_lock<std::shared_mutex> lock(shards_mutex_);
+        std::vector<size_t> sizes;
+        for (const auto& shard : shards_) {
+            std::lock_guard<std::mutex> shard_lock(shard->mutex);
+            sizes.push_back(shard->set.Size());
+        }
+        return sizes;
+    }
+
+private:
+    struct Shard {
+        Shard(const Compare& compare, size_t worker) : set(compare), worker(worker) {
+        }
+        mutable std::mutex mutex;
+        SetAVL<K, Compare> set;
+        // the worker that inserts into the shard and rebuilds it
+        size_t worker;
+    };
+
+    size_t ShardOf(const K& key) const {
+        return std::upper_bound(split_keys_.begin(), split_keys_.end(), key, compare_) -
+               split_keys_.begin();
+    }
+
+    size_t NextWorker() noexcept {
+        return next_worker_++ % workers_;
+    }
+
+    // work(w) for every worker w; with Options::cpus on the pool thread pinned to the w-th
+    // CPU. The pool is started on first use and serves one caller at a time. Pool tasks
+    // must not throw, so an exception of work is caught on its worker and the first one is
+    // rethrown here once every worker is done.
+    void RunOnWorkers(const std::function<void(size_t)>& work) {
+        if (workers_ == 1 && options_.cpus.empty()) {
+            work(0);
+            return;
+        }
+        std::vector<std::exception_ptr> errors(workers_);
+        std::function<void(size_t)> task = [&work, &errors](size_t worker) {
+            try {
+                work(worker);
+            } catch (...) {
+                errors[worker] = std::current_exception();
+            }
+        };
+        {
+            std::lock_guard<std::mutex> lock(pool_mutex_);
+            if (pool_ == nullptr) {
+                pool_ = options_.cpus.empty() ? std::make_unique<ThreadPool>(workers_)
+                                              : std::make_unique<ThreadPool>(options_.cpus);
+            }
+            if (options_.cpus.empty()) {
+                pool_->ParallelFor(workers_, task);
+            } else {
+                pool_->RunOnEachWorker(task);
+            }
+        }
+        for (const auto& error : errors) {
+            if (error != nullptr) {
+                std::rethrow_exception(error);
+            }
+        }
+    }
+
+    // splits every shard above max_shard_keys into equal shards of at most max_shard_keys;
+    // the keys are copied out here and the new shards are built in linear time by their
+    // workers. The shard list changes only after every new shard is built, so a failure
+    // leaves the shards as they were.
+    void SplitLargeShards() {
+        std::unique_lock<std::shared_mutex> lock(shards_mutex_);
+        struct Piece {
+            Shard* shard;
+            size_t keys;
+            size_t begin;
+            size_t end;
+        };
+        std::vector<std::vector<K>> split_contents;
+        std::vector<Piece> pieces;
+        // shards that are split are replaced by their pieces, in order
+        std::vector<std::unique_ptr<Shard>> fresh;
+        std::vector<size_t> piece_counts(shards_.size());
+        std::vector<K> split_keys;
+        for (size_t index = 0; index < shards_.size(); ++index) {
+            if (index > 0) {
+                split_keys.push_back(split_keys_[index - 1]);
+            }
+            const Shard& shard = *shards_[index];
+            if (shard.set.Size() <= options_.max_shard_keys) {
+                continue;
+            }
+            std::vector<K>& keys = split_contents.emplace_back();
+            keys.reserve(shard.set.Size());
+            for (auto it = shard.set.Begin(); it != shard.set.End(); ++it) {
+                keys.push_back(*it);
+            }
+            size_t count = (keys.size() + options_.max_shard_keys - 1) / options_.max_shard_keys;
+            piece_counts[index] = count;
+            for (size_t piece = 0; piece < count; ++piece) {
+                size_t begin = keys.size() * piece / count;
+                if (piece > 0) {
+                    split_keys.push_back(keys[begin]);
+                }
+                size_t worker = (piece == 0) ? shard.worker : NextWorker();
+                fresh.push_back(std::make_unique<Shard>(compare_, worker));
+                pieces.push_back({fresh.back().get(), split_contents.size() - 1, begin,
+                                  keys.size() * (piece + 1) / count});
+            }
+        }
+        if (pieces.empty()) {
+            return;
+        }
+        RunOnWorkers([&](size_t worker) {
+            for (const Piece& piece : pieces) {
+                if (piece.shard->worker == worker) {
+                    const std::vector<K>& keys = split_contents[piece.keys];
+                    piece.shard->set.AssignSorted(keys.begin() + piece.begin,
+                                                  keys.begin() + piece.end);
+                }
+            }
+        });
+        std::vector<std::unique_ptr<Shard>> shards;
+        shards.reserve(split_keys.size() + 1);
+        AtomicFenwickTree counts(split_keys.size() + 1);
+        for (size_t index = 0, next = 0; index < shards_.size(); ++index) {
+            if (piece_counts[index] == 0) {
+                shards.push_back(std::move(shards_[index]));
+            }
+            for (size_t piece = 0; piece < piece_counts[index]; ++piece) {
+                shards.push_back(std::move(fresh[next++]));
+            }
+        }
+        for (size_t index = 0; index < shards.size(); ++index) {
+            counts.Add(index, shards[index]->set.Size());
+        }
+        shards_ = std::move(shards);
+        split_keys_ = std::move(split_keys);
+        counts_ = std::move(counts);
+    }
+
+    Options options_;
+    Compare compare_;
+    mutable std::shared_mutex shards_mutex_;
+    std::vector<K> split_keys_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    AtomicFenwickTree counts_;
+    std::atomic<size_t> size_{0};
+    size_t workers_ = 1;
+    // owner of the next shard, advanced under the exclusive lock of shards_mutex_
+    size_t next_worker_ = 0;
+    std::mutex pool_mutex_;
+    std::unique_ptr<ThreadPool> pool_;
+};
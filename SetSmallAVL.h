@@ -0,0 +1,361 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <utility>
+#include "SetAVL.h"
+
+// Order-statistic set with the API of SetAVL that keeps up to N keys inline, in a sorted
+// array inside the object: no allocation at all, Find and RankInd0 by binary search,
+// SelectInd0 by index. Inserting key N + 1 moves the keys into a SetAVL built in O(N)
+// and the set stays a tree from then on; Clear returns it to the array.
+// The iterators work the same in both modes. Like the growth of a vector, the switch to the
+// tree invalidates every iterator taken before it; insertions into the array shift keys,
+// so they invalidate the iterators after the insertion point.
+
+template <typename K, typename Compare = std::less<K>, size_t N = 32>
+class SetSmallAVL {
+public:
+    using Tree = SetAVL<K, Compare>;
+    static constexpr size_t kInlineKeys = N;
+
+    class ReverseIterator;
+
+    class Iterator {
+    public:
+        Iterator() = default;
+
+        const K& operator*() const {
+            return (set_->tree_ == nullptr) ? set_->Key(index_) : *node_;
+        }
+        const K* operator->() const {
+            return std::addressof(**this);
+        }
+        Iterator& operator++() {
+            if (set_->tree_ == nullptr) {
+                ++index_;
+            } else {
+                ++node_;
+            }
+            return *this;
+        }
+        Iterator operator++(int) {
+            Iterator tmp = *this;
+            ++*this;
+            return tmp;
+        }
+        Iterator& operator--() {
+            if (set_->tree_ == nullptr) {
+                --index_;
+            } else {
+                --node_;
+            }
+            return *this;
+        }
+        Iterator operator--(int) {
+            Iterator tmp = *this;
+            --*this;
+            return tmp;
+        }
+        bool operator==(const Iterator& other) const noexcept {
+            return index_ == other.index_ && node_ == other.node_;
+        }
+        bool operator!=(const Iterator& other) const noexcept {
+            return !(*this == other);
+        }
+
+    private:
+        friend class SetSmallAVL;
+
+        Iterator(const SetSmallAVL* set, size_t index) noexcept : set_(set), index_(index) {
+        }
+        Iterator(const SetSmallAVL* set, typename Tree::ConstIterator node) noexcept
+            : set_(set), node_(node) {
+        }
+
+        const SetSmallAVL* set_ = nullptr;
+        // position in the array, 0 in the tree
+        size_t index_ = 0;
+        // position in the tree, a null iterator in the array
+        typename Tree::ConstIterator node_{nullptr};
+    };
+    using ConstIterator = Iterator;
+
+    // walks an Iterator backwards, RBegin is the last key
+    class ReverseIterator {
+    public:
+        ReverseIterator() = default;
+        explicit ReverseIterator(Iterator base) noexcept : base_(base) {
+        }
+
+        const K& operator*() const {
+            Iterator it = base_;
+            --it;
+            return *it;
+        }
+        const K* operator->() const {
+            return std::addressof(**this);
+        }
+        ReverseIterator& operator++() {
+            --base_;
+            return *this;
+        }
+        ReverseIterator operator++(int) {
+            ReverseIterator tmp = *this;
+            --base_;
+            return tmp;
+        }
+        ReverseIterator& operator--() {
+            ++base_;
+            return *this;
+        }
+        ReverseIterator operator--(int) {
+            ReverseIterator tmp = *this;
+            ++base_;
+            return tmp;
+        }
+        bool operator==(const ReverseIterator& other) const noexcept {
+            return base_ == other.base_;
+        }
+        bool operator!=(const ReverseIterator& other) const noexcept {
+            return base_ != other.base_;
+        }
+        Iterator Base() const noexcept {
+            return base_;
+        }
+
+    private:
+        Iterator base_;
+    };
+    using ConstReverseIterator = ReverseIterator;
+
+    SetSmallAVL() : SetSmallAVL(Compare()) {
+    }
+    explicit SetSmallAVL(const Compare& compare) : compare_(compare) {
+    }
+    SetSmallAVL(const SetSmallAVL& other) : compare_(other.compare_) {
+        if (other.tree_ != nullptr) {
+            tree_ = std::make_unique<Tree>(*other.tree_);
+            return;
+        }
+        for (; size_ < other.size_; ++size_) {
+            new (Slot(size_)) K(other.Key(size_));
+        }
+    }
+    SetSmallAVL(SetSmallAVL&& other) : compare_(other.compare_) {
+        TakeFrom(other);
+    }
+    SetSmallAVL& operator=(const SetSmallAVL& other) {
+        if (this != std::addressof(other)) {
+            SetSmallAVL copy(other);
+            *this = std::move(copy);
+        }
+        return *this;
+    }
+    SetSmallAVL& operator=(SetSmallAVL&& other) {
+        if (this != std::addressof(other)) {
+            Clear();
+            compare_ = other.compare_;
+            TakeFrom(other);
+        }
+        return *this;
+    }
+    ~SetSmallAVL() {
+        Clear();
+    }
+
+    void Clear() noexcept {
+        tree_.reset();
+        for (size_t i = 0; i < size_; ++i) {
+            Key(i).~K();
+        }
+        size_ = 0;
+    }
+    void Swap(SetSmallAVL& other) {
+        SetSmallAVL tmp(std::move(other));
+        other = std::move(*this);
+        *this = std::move(tmp);
+    }
+
+    template <typename P>
+    std::pair<Iterator, bool> Insert(P&& key) {
+        if (tree_ != nullptr) {
+            auto [node, inserted] = tree_->Insert(std::forward<P>(key));
+            return {Iterator(this, typename Tree::ConstIterator(node)), inserted};
+        }
+        size_t index = LowerIndex(key);
+        if (index < size_ && !compare_(key, Key(index))) {
+            return {Iterator(this, index), false};
+        }
+        if (size_ == N) {
+            MoveToTree();
+            return Insert(std::forward<P>(key));
+        }
+        if (index == size_) {
+            new (Slot(size_)) K(std::forward<P>(key));
+        } else {
+            // made first, key may be of another type or refer to a key of the array
+            K inserted(std::forward<P>(key));
+            new (Slot(size_)) K(std::move(Key(size_ - 1)));
+            std::move_backward(Ptr(index), Ptr(size_ - 1), Ptr(size_));
+            Key(index) = std::move(inserted);
+        }
+        ++size_;
+        return {Iterator(this, index), true};
+    }
+    template <typename InputIt>
+    void Insert(InputIt first, InputIt last) {
+        for (auto it = first; it != last; ++it) {
+            Insert(*it);
+        }
+    }
+    void Insert(std::initializer_list<K> ilist) {
+        Insert(ilist.begin(), ilist.end());
+    }
+
+    Iterator Find(const K& key) const {
+        if (tree_ != nullptr) {
+            return Iterator(this, tree_->Find(key));
+        }
+        size_t index = LowerIndex(key);
+        if (index < size_ && !compare_(key, Key(index))) {
+            return Iterator(this, index);
+        }
+        return End();
+    }
+    Iterator LowerBound(const K& key) const {
+        if (tree_ != nullptr) {
+            return Iterator(this, tree_->LowerBound(key));
+        }
+        return Iterator(this, LowerIndex(key));
+    }
+    Iterator UpperBound(const K& key) const {
+        if (tree_ != nullptr) {
+            return Iterator(this, tree_->UpperBound(key));
+        }
+        return Iterator(this, static_cast<size_t>(
+                                  std::upper_bound(Ptr(0), Ptr(size_), key, compare_) - Ptr(0)));
+    }
+    std::pair<Iterator, Iterator> EqualRange(const K& key) const {
+        return {LowerBound(key), UpperBound(key)};
+    }
+    bool Contains(const K& key) const {
+        return Find(key) != End();
+    }
+    size_t Count(const K& key) const {
+        return static_cast<size_t>(Contains(key));
+    }
+
+    Iterator Begin() const noexcept {
+        return (tree_ == nullptr) ? Iterator(this, size_t{0}) : Iterator(this, tree_->Begin());
+    }
+    Iterator End() const noexcept {
+        return (tree_ == nullptr) ? Iterator(this, size_) : Iterator(this, tree_->End());
+    }
+    Iterator CBegin() const noexcept {
+        return Begin();
+    }
+    Iterator CEnd() const noexcept {
+        return End();
+    }
+    ReverseIterator RBegin() const noexcept {
+        return ReverseIterator(End());
+    }
+    ReverseIterator REnd() const noexcept {
+        return ReverseIterator(Begin());
+    }
+    ReverseIterator CRBegin() const noexcept {
+        return RBegin();
+    }
+    ReverseIterator CREnd() const noexcept {
+        return REnd();
+    }
+
+    // End() if i >= Size()
+    Iterator SelectInd0(size_t i) const {
+        if (tree_ != nullptr) {
+            return Iterator(this, tree_->SelectInd0(i));
+        }
+        return Iterator(this, std::min(i, size_));
+    }
+    // End() if i == 0 or i > Size()
+    Iterator SelectInd1(size_t i) const {
+        return (i == 0) ? End() : SelectInd0(i - 1);
+    }
+    // number of keys less than key
+    size_t RankInd0(const K& key) const {
+        return (tree_ != nullptr) ? tree_->RankInd0(key) : LowerIndex(key);
+    }
+    size_t RankInd1(const K& key) const {
+        return RankInd0(key) + 1;
+    }
+
+    size_t Size() const noexcept {
+        return (tree_ != nullptr) ? tree_->Size() : size_;
+    }
+    bool Empty() const noexcept {
+        return Size() == 0;
+    }
+    Compare KeyCompare() const {
+        return compare_;
+    }
+    // true while the keys are in the inline array
+    bool IsInline() const noexcept {
+        return tree_ == nullptr;
+    }
+
+private:
+    void* Slot(size_t i) noexcept {
+        return storage_ + i * sizeof(K);
+    }
+    K* Ptr(size_t i) noexcept {
+        return std::launder(reinterpret_cast<K*>(storage_ + i * sizeof(K)));
+    }
+    const K* Ptr(size_t i) const noexcept {
+        return std::launder(reinterpret_cast<const K*>(storage_ + i * sizeof(K)));
+    }
+    K& Key(size_t i) noexcept {
+        return *Ptr(i);
+    }
+    const K& Key(size_t i) const noexcept {
+        return *Ptr(i);
+    }
+
+    size_t LowerIndex(const K& key) const {
+        return static_cast<size_t>(std::lower_bound(Ptr(0), Ptr(size_), key, compare_) - Ptr(0));
+    }
+
+    // the sorted array is already the input of the linear build
+    void MoveToTree() {
+        auto tree = std::make_unique<Tree>(compare_);
+        tree->AssignSorted(std::make_move_iterator(Ptr(0)), std::make_move_iterator(Ptr(size_)));
+        for (size_t i = 0; i < size_; ++i) {
+            Key(i).~K();
+        }
+        size_ = 0;
+        tree_ = std::move(tree);
+    }
+
+    // other is left empty, this must be empty
+    void TakeFrom(SetSmallAVL& other) {
+        if (other.tree_ != nullptr) {
+            tree_ = std::move(other.tree_);
+            return;
+        }
+        for (; size_ < other.size_; ++size_) {
+            new (Slot(size_)) K(std::move(other.Key(size_)));
+        }
+        other.Clear();
+    }
+
+    Compare compare_;
+    // null while the keys are inline
+    std::unique_ptr<Tree> tree_;
+    size_t size_ = 0;
+    alignas(K) unsigned char storage_[N * sizeof(K)];
+};
@@ -0,0 +1,216 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+// Binary snapshot of a SetAVL: keys in order, framed by a header and a checksum.
+//   magic "SETAVLSN", u32 version, u32 byte order mark, u32 key format of the serializer,
+//   u32 reserved, u64 key count, serialized keys, u64 checksum of everything before it.
+// Header fields are stored in the byte order of the writing machine, a snapshot from
+// a machine of the other byte order is rejected by the byte order mark.
+
+class SetSnapshotError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+inline constexpr char kSetSnapshotMagic[8] = {'S', 'E', 'T', 'A', 'V', 'L', 'S', 'N'};
+inline constexpr uint32_t kSetSnapshotVersion = 1;
+inline constexpr uint32_t kSetSnapshotByteOrder = 0x01020304;
+
+// 64-bit checksum over a byte stream, consumed a word at a time
+class SetSnapshotChecksum {
+public:
+    void Update(const void* data, size_t size) noexcept {
+        auto bytes = static_cast<const unsigned char*>(data);
+        while (size > 0) {
+            if (pending_size_ == 0 && size >= sizeof(uint64_t)) {
+                uint64_t word;
+                std::memcpy(&word, bytes, sizeof(word));
+                Mix(word);
+                bytes += sizeof(word);
+                size -= sizeof(word);
+                continue;
+            }
+            pending_[pending_size_++] = *bytes++;
+            --size;
+            if (pending_size_ == sizeof(uint64_t)) {
+                uint64_t word;
+                std::memcpy(&word, pending_.data(), sizeof(word));
+                Mix(word);
+                pending_size_ = 0;
+            }
+        }
+    }
+    uint64_t Value() const noexcept {
+        uint64_t tail = 0;
+        std::memcpy(&tail, pending_.data(), pending_size_);
+        uint64_t value = state_ ^ (tail + pending_size_);
+        value = (value ^ (value >> 33)) * 0xff51afd7ed558ccdULL;
+        return value ^ (value >> 33);
+    }
+
+private:
+    void Mix(uint64_t word) noexcept {
+        state_ = std::rotl(state_ ^ (word * 0x9e3779b97f4a7c15ULL), 29) * 0xbf58476d1ce4e5b9ULL;
+    }
+
+    uint64_t state_ = 0x243f6a8885a308d3ULL;
+    std::array<unsigned char, sizeof(uint64_t)> pending_{};
+    size_t pending_size_ = 0;
+};
+
+// Buffered writer that checksums everything written
+class SetSnapshotWriter {
+public:
+    explicit SetSnapshotWriter(std::ostream& out) : out_(out) {
+    }
+    SetSnapshotWriter(const SetSnapshotWriter&) = delete;
+    SetSnapshotWriter& operator=(const SetSnapshotWriter&) = delete;
+
+    void Write(const void* data, size_t size) {
+        checksum_.Update(data, size);
+        auto bytes = static_cast<const char*>(data);
+        if (used_ + size > buffer_.size()) {
+            Flush();
+        }
+        if (size >= buffer_.size()) {
+            out_.write(bytes, static_cast<std::streamsize>(size));
+            return;
+        }
+        std::memcpy(buffer_.data() + used_, bytes, size);
+        used_ += size;
+    }
+    template <typename T>
+    void WriteValue(const T& value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        Write(std::addressof(value), sizeof(T));
+    }
+    // the checksum itself is not checksummed; the stream is flushed, so that a write the
+    // stream still buffered fails here rather than unnoticed later
+    void Finish() {
+        uint64_t checksum = checksum_.Value();
+        Write(&checksum, sizeof(checksum));
+        Flush();
+        out_.flush();
+        if (!out_) {
+            throw SetSnapshotError("SetAVL snapshot: write failed");
+        }
+    }
+    // writes out the buffer, for formats without the trailing checksum
+    void Flush() {
+        out_.write(buffer_.data(), static_cast<std::streamsize>(used_));
+        used_ = 0;
+        if (!out_) {
+            throw SetSnapshotError("SetAVL snapshot: write failed");
+        }
+    }
+
+private:
+    std::ostream& out_;
+    SetSnapshotChecksum checksum_;
+    std::array<char, 1 << 16> buffer_;
+    size_t used_ = 0;
+};
+
+// Buffered reader that checksums everything read, a short read throws
+class SetSnapshotReader {
+public:
+    explicit SetSnapshotReader(std::istream& in) : in_(in) {
+    }
+    SetSnapshotReader(const SetSnapshotReader&) = delete;
+    SetSnapshotReader& operator=(const SetSnapshotReader&) = delete;
+
+    void Read(void* data, size_t size) {
+        auto bytes = static_cast<char*>(data);
+        size_t done = 0;
+        while (done < size) {
+            if (position_ == available_) {
+                Refill();
+            }
+            size_t part = std::min(size - done, available_ - position_);
+            std::memcpy(bytes + done, buffer_.data() + position_, part);
+            position_ += part;
+            done += part;
+        }
+        checksum_.Update(data, size);
+    }
+    template <typename T>
+    T ReadValue() {
+        static_assert(std::is_trivially_copyable_v<T>);
+        std::array<unsigned char, sizeof(T)> bytes;
+        Read(bytes.data(), bytes.size());
+        return std::bit_cast<T>(bytes);
+    }
+    void Finish() {
+        uint64_t expected = checksum_.Value();
+        if (ReadValue<uint64_t>() != expected) {
+            throw SetSnapshotError("SetAVL snapshot: checksum mismatch");
+        }
+    }
+
+private:
+    void Refill() {
+        in_.read(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+        available_ = static_cast<size_t>(in_.gcount());
+        position_ = 0;
+        if (available_ == 0) {
+            throw SetSnapshotError("SetAVL snapshot: unexpected end of data");
+        }
+    }
+
+    std::istream& in_;
+    SetSnapshotChecksum checksum_;
+    std::array<char, 1 << 16> buffer_;
+    size_t available_ = 0;
+    size_t position_ = 0;
+};
+
+// Serializer of keys: Write(writer, key) and Read(reader) -> K,
+// kFormat tells snapshots of different key encodings apart.
+// The default one copies the bytes of trivially copyable keys.
+template <typename K>
+struct SetSerializer {
+    static_assert(std::is_trivially_copyable_v<K>,
+                  "SetAVL snapshot of this key type needs a custom serializer");
+    static constexpr uint32_t kFormat = 0x42000000 | sizeof(K);
+
+    void Write(SetSnapshotWriter& out, const K& key) const {
+        out.WriteValue(key);
+    }
+    K Read(SetSnapshotReader& in) const {
+        return in.ReadValue<K>();
+    }
+};
+
+template <>
+struct SetSerializer<std::string> {
+    static constexpr uint32_t kFormat = 0x53000001;
+
+    void Write(SetSnapshotWriter& out, const std::string& key) const {
+        out.WriteValue(static_cast<uint64_t>(key.size()));
+        out.Write(key.data(), key.size());
+    }
+    // grows in pieces, so a damaged length fails on the data instead of on allocation
+    std::string Read(SetSnapshotReader& in) const {
+        uint64_t size = in.ReadValue<uint64_t>();
+        std::string key;
+        while (key.size() < size) {
+            size_t done = key.size();
+            size_t part = static_cast<size_t>(std::min<uint64_t>(size - done, 1 << 16));
+            key.resize(done + part);
+            in.Read(key.data() + done, part);
+        }
+        return key;
+    }
+};
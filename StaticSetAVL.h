@@ -0,0 +1,485 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <limits>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Order-statistic AVL set with the API of SetAVL for at most N keys that never touches the
+// heap: keys and nodes live in two arrays inside the object, the k-th inserted key in slot k,
+// and the links are 16-bit indices below 65535 keys, 32-bit ones above. An insert costs a
+// descent and the rebalancing, with no allocator call to make its latency vary.
+// When the set is full, inserting a new key does nothing and returns {End(), false}; a key
+// that is already present returns its iterator as usual. Full() tells in advance.
+// The object is large, so it belongs in static storage or inside another object. Its pages
+// are faulted in by the first inserts that reach them unless Prefault() touched them first.
+// Keys live inside the object, so a move or Swap moves them one by one in O(Size()) and
+// needs keys that move without throwing.
+
+template <typename K, size_t N, typename Compare = std::less<K>>
+class StaticSetAVL {
+    static_assert(N >= 1 && N < std::numeric_limits<uint32_t>::max(), "capacity out of range");
+
+public:
+    using Index = std::conditional_t<(N < std::numeric_limits<uint16_t>::max()), uint16_t,
+                                     uint32_t>;
+    static constexpr size_t kCapacity = N;
+
+    class Iterator {
+    public:
+        Iterator() = default;
+
+        const K& operator*() const {
+            return set_->Key(index_);
+        }
+        const K* operator->() const {
+            return std::addressof(set_->Key(index_));
+        }
+        Iterator& operator++() {
+            index_ = set_->Step(index_, 1);
+            return *this;
+        }
+        Iterator operator++(int) {
+            Iterator tmp = *this;
+            ++*this;
+            return tmp;
+        }
+        Iterator& operator--() {
+            index_ = (index_ == kNone) ? set_->Extreme(set_->root_, 1) : set_->Step(index_, 0);
+            return *this;
+        }
+        Iterator operator--(int) {
+            Iterator tmp = *this;
+            --*this;
+            return tmp;
+        }
+        bool operator==(const Iterator& other) const noexcept {
+            return index_ == other.index_;
+        }
+        bool operator!=(const Iterator& other) const noexcept {
+            return index_ != other.index_;
+        }
+
+    private:
+        friend class StaticSetAVL;
+
+        Iterator(const StaticSetAVL* set, Index index) noexcept : set_(set), index_(index) {
+        }
+
+        const StaticSetAVL* set_ = nullptr;
+        // kNone at End()
+        Index index_ = kNone;
+    };
+    using ConstIterator = Iterator;
+
+    // walks an Iterator backwards, RBegin is the last key
+    class ReverseIterator {
+    public:
+        ReverseIterator() = default;
+        explicit ReverseIterator(Iterator base) noexcept : base_(base) {
+        }
+
+        const K& operator*() const {
+            Iterator it = base_;
+            --it;
+            return *it;
+        }
+        const K* operator->() const {
+            return std::addressof(**this);
+        }
+        ReverseIterator& operator++() {
+            --base_;
+            return *this;
+        }
+        ReverseIterator operator++(int) {
+            ReverseIterator tmp = *this;
+            --base_;
+            return tmp;
+        }
+        ReverseIterator& operator--() {
+            ++base_;
+            return *this;
+        }
+        ReverseIterator operator--(int) {
+            ReverseIterator tmp = *this;
+            ++base_;
+            return tmp;
+        }
+        bool operator==(const ReverseIterator& other) const noexcept {
+            return base_ == other.base_;
+        }
+        bool operator!=(const ReverseIterator& other) const noexcept {
+            return base_ != other.base_;
+        }
+        Iterator Base() const noexcept {
+            return base_;
+        }
+
+    private:
+        Iterator base_;
+    };
+    using ConstReverseIterator = ReverseIterator;
+
+    StaticSetAVL() : StaticSetAVL(Compare()) {
+    }
+    explicit StaticSetAVL(const Compare& compare) : compare_(compare) {
+    }
+    StaticSetAVL(const StaticSetAVL& other) : compare_(other.compare_) {
+        CopyFrom(other);
+    }
+    StaticSetAVL(StaticSetAVL&& other) noexcept : compare_(other.compare_) {
+        Swap(other);
+    }
+    // this is left empty if a key fails to copy
+    StaticSetAVL& operator=(const StaticSetAVL& other) {
+        if (this != std::addressof(other)) {
+            Clear();
+            compare_ = other.compare_;
+            CopyFrom(other);
+        }
+        return *this;
+    }
+    // other is left empty
+    StaticSetAVL& operator=(StaticSetAVL&& other) noexcept {
+        if (this != std::addressof(other)) {
+            Clear();
+            Swap(other);
+        }
+        return *this;
+    }
+    ~StaticSetAVL() {
+        Clear();
+    }
+
+    // swaps the keys slot for slot, so the links stay valid
+    void Swap(StaticSetAVL& other) noexcept {
+        static_assert(std::is_nothrow_move_constructible_v<K> && std::is_nothrow_swappable_v<K>,
+                      "StaticSetAVL moves keys one by one");
+        using std::swap;
+        StaticSetAVL& larger = (size_ < other.size_) ? other : *this;
+        StaticSetAVL& smaller = (size_ < other.size_) ? *this : other;
+        for (size_t i = 0; i < smaller.size_; ++i) {
+            swap(Key(static_cast<Index>(i)), other.Key(static_cast<Index>(i)));
+        }
+        for (size_t i = smaller.size_; i < larger.size_; ++i) {
+            K& key = larger.Key(static_cast<Index>(i));
+            new (smaller.keys_ + i * sizeof(K)) K(std::move(key));
+            key.~K();
+        }
+        std::swap_ranges(nodes_, nodes_ + smaller.size_, other.nodes_);
+        std::copy(larger.nodes_ + smaller.size_, larger.nodes_ + larger.size_,
+                  smaller.nodes_ + smaller.size_);
+        swap(compare_, other.compare_);
+        swap(root_, other.root_);
+        swap(size_, other.size_);
+    }
+
+    // writes to every page of the key and node arrays, so that inserts into fresh storage
+    // (a static object is zero-filled on first touch) do not stall on page faults
+    void Prefault() noexcept {
+        constexpr size_t kPage = 4096;
+        auto touch = [](void* data, size_t bytes) {
+            auto* byte = static_cast<volatile unsigned char*>(data);
+            for (size_t i = 0; i < bytes; i += kPage) {
+                byte[i] = byte[i];
+            }
+            if (bytes > 0) {
+                byte[bytes - 1] = byte[bytes - 1];
+            }
+        };
+        touch(nodes_, sizeof(nodes_));
+        touch(keys_, sizeof(keys_));
+    }
+
+    void Clear() noexcept {
+        for (size_t i = 0; i < size_; ++i) {
+            Key(static_cast<Index>(i)).~K();
+        }
+        size_ = 0;
+        root_ = kNone;
+    }
+
+    // {End(), false} if the key is new and the set is full
+    template <typename P>
+    std::pair<Iterator, bool> Insert(P&& key) {
+        Index parent = kNone;
+        int side = 0;
+        for (Index node = root_; node != kNone; node = nodes_[node].children[side]) {
+            if (compare_(key, Key(node))) {
+                side = 0;
+            } else if (compare_(Key(node), key)) {
+                side = 1;
+            } else {
+                return {Iterator(this, node), false};
+            }
+            parent = node;
+        }
+        if (size_ == N) {
+            return {End(), false};
+        }
+        auto fresh = static_cast<Index>(size_);
+        new (keys_ + fresh * sizeof(K)) K(std::forward<P>(key));
+        ++size_;
+        nodes_[fresh] = Node{{kNone, kNone}, parent, 1, 1};
+        if (parent == kNone) {
+            root_ = fresh;
+        } else {
+            nodes_[parent].children[side] = fresh;
+        }
+        for (Index up = parent; up != kNone; up = nodes_[up].parent) {
+            Update(up);
+            up = Rebalance(up);
+        }
+        return {Iterator(this, fresh), true};
+    }
+    template <typename InputIt>
+    void Insert(InputIt first, InputIt last) {
+        for (auto it = first; it != last; ++it) {
+            Insert(*it);
+        }
+    }
+    void Insert(std::initializer_list<K> ilist) {
+        Insert(ilist.begin(), ilist.end());
+    }
+
+    Iterator Find(const K& key) const {
+        Iterator it = LowerBound(key);
+        if (it != End() && !compare_(key, *it)) {
+            return it;
+        }
+        return End();
+    }
+    Iterator LowerBound(const K& key) const {
+        Index best = kNone;
+        for (Index node = root_; node != kNone;) {
+            if (compare_(Key(node), key)) {
+                node = nodes_[node].children[1];
+            } else {
+                best = node;
+                node = nodes_[node].children[0];
+            }
+        }
+        return Iterator(this, best);
+    }
+    Iterator UpperBound(const K& key) const {
+        Index best = kNone;
+        for (Index node = root_; node != kNone;) {
+            if (compare_(key, Key(node))) {
+                best = node;
+                node = nodes_[node].children[0];
+            } else {
+                node = nodes_[node].children[1];
+            }
+        }
+        return Iterator(this, best);
+    }
+    std::pair<Iterator, Iterator> EqualRange(const K& key) const {
+        return {LowerBound(key), UpperBound(key)};
+    }
+    bool Contains(const K& key) const {
+        return Find(key) != End();
+    }
+    size_t Count(const K& key) const {
+        return static_cast<size_t>(Contains(key));
+    }
+
+    Iterator Begin() const noexcept {
+        return Iterator(this, Extreme(root_, 0));
+    }
+    Iterator End() const noexcept {
+        return Iterator(this, kNone);
+    }
+    Iterator CBegin() const noexcept {
+        return Begin();
+    }
+    Iterator CEnd() const noexcept {
+        return End();
+    }
+    ReverseIterator RBegin() const noexcept {
+        return ReverseIterator(End());
+    }
+    ReverseIterator REnd() const noexcept {
+        return ReverseIterator(Begin());
+    }
+    ReverseIterator CRBegin() const noexcept {
+        return RBegin();
+    }
+    ReverseIterator CREnd() const noexcept {
+        return REnd();
+    }
+
+    // End() if i >= Size()
+    Iterator SelectInd0(size_t i) const {
+        Index node = root_;
+        while (node != kNone) {
+            size_t left = SizeOf(nodes_[node].children[0]);
+            if (i < left) {
+                node = nodes_[node].children[0];
+            } else if (i == left) {
+                break;
+            } else {
+                i -= left + 1;
+                node = nodes_[node].children[1];
+            }
+        }
+        return Iterator(this, node);
+    }
+    // End() if i == 0 or i > Size()
+    Iterator SelectInd1(size_t i) const {
+        return (i == 0) ? End() : SelectInd0(i - 1);
+    }
+    // number of keys less than key
+    size_t RankInd0(const K& key) const {
+        size_t rank = 0;
+        for (Index node = root_; node != kNone;) {
+            if (compare_(Key(node), key)) {
+                rank += SizeOf(nodes_[node].children[0]) + 1;
+                node = nodes_[node].children[1];
+            } else {
+                node = nodes_[node].children[0];
+            }
+        }
+        return rank;
+    }
+    size_t RankInd1(const K& key) const {
+        return RankInd0(key) + 1;
+    }
+
+    size_t Size() const noexcept {
+        return size_;
+    }
+    bool Empty() const noexcept {
+        return size_ == 0;
+    }
+    static constexpr size_t Capacity() noexcept {
+        return N;
+    }
+    // a new key can not be inserted
+    bool Full() const noexcept {
+        return size_ == N;
+    }
+    Compare KeyCompare() const {
+        return compare_;
+    }
+    // number of nodes on the longest root-to-leaf path
+    size_t Height() const noexcept {
+        return HeightOf(root_);
+    }
+
+private:
+    static constexpr Index kNone = std::numeric_limits<Index>::max();
+
+    struct Node {
+        Index children[2];
+        Index parent;
+        // keys in the subtree
+        Index size;
+        uint8_t height;
+    };
+
+    K& Key(Index i) noexcept {
+        return *std::launder(reinterpret_cast<K*>(keys_ + i * sizeof(K)));
+    }
+    const K& Key(Index i) const noexcept {
+        return *std::launder(reinterpret_cast<const K*>(keys_ + i * sizeof(K)));
+    }
+
+    size_t SizeOf(Index node) const noexcept {
+        return (node == kNone) ? 0 : nodes_[node].size;
+    }
+    int HeightOf(Index node) const noexcept {
+        return (node == kNone) ? 0 : nodes_[node].height;
+    }
+    void Update(Index node) noexcept {
+        Node& data = nodes_[node];
+        data.size = static_cast<Index>(SizeOf(data.children[0]) + SizeOf(data.children[1]) + 1);
+        int height = std::max(HeightOf(data.children[0]), HeightOf(data.children[1])) + 1;
+        data.height = static_cast<uint8_t>(height);
+    }
+
+    // the leftmost (side 0) or rightmost node of a subtree
+    Index Extreme(Index node, int side) const noexcept {
+        if (node != kNone) {
+            while (nodes_[node].children[side] != kNone) {
+                node = nodes_[node].children[side];
+            }
+        }
+        return node;
+    }
+    // the next (side 1) or previous node in key order, kNone past the ends
+    Index Step(Index node, int side) const noexcept {
+        if (nodes_[node].children[side] != kNone) {
+            return Extreme(nodes_[node].children[side], 1 - side);
+        }
+        Index parent = nodes_[node].parent;
+        while (parent != kNone && nodes_[parent].children[side] == node) {
+            node = parent;
+            parent = nodes_[node].parent;
+        }
+        return parent;
+    }
+
+    // returns the root of the subtree after the rotations
+    Index Rebalance(Index node) noexcept {
+        int balance = HeightOf(nodes_[node].children[0]) - HeightOf(nodes_[node].children[1]);
+        if (balance > 1 || balance < -1) {
+            int side = (balance > 1) ? 0 : 1;
+            Index child = nodes_[node].children[side];
+            if (HeightOf(nodes_[child].children[1 - side]) >
+                HeightOf(nodes_[child].children[side])) {
+                Rotate(child, 1 - side);
+            }
+            return Rotate(node, side);
+        }
+        return node;
+    }
+
+    // lifts the child of the given side over node
+    Index Rotate(Index node, int side) noexcept {
+        Index child = nodes_[node].children[side];
+        Index moved = nodes_[child].children[1 - side];
+        Index parent = nodes_[node].parent;
+        nodes_[node].children[side] = moved;
+        if (moved != kNone) {
+            nodes_[moved].parent = node;
+        }
+        nodes_[child].parent = parent;
+        if (parent == kNone) {
+            root_ = child;
+        } else {
+            nodes_[parent].children[nodes_[parent].children[1] == node] = child;
+        }
+        nodes_[child].children[1 - side] = node;
+        nodes_[node].parent = child;
+        Update(node);
+        Update(child);
+        return child;
+    }
+
+    // slot for slot, so the links stay valid; this must be empty and is left empty if a key
+    // throws, the keys copied before it are destroyed
+    void CopyFrom(const StaticSetAVL& other) {
+        try {
+            for (; size_ < other.size_; ++size_) {
+                new (keys_ + size_ * sizeof(K)) K(other.Key(static_cast<Index>(size_)));
+            }
+        } catch (...) {
+            Clear();
+            throw;
+        }
+        std::copy(other.nodes_, other.nodes_ + other.size_, nodes_);
+        root_ = other.root_;
+    }
+
+    [[no_unique_address]] Compare compare_;
+    Index root_ = kNone;
+    size_t size_ = 0;
+    Node nodes_[N];
+    alignas(K) unsigned char keys_[N * sizeof(K)];
+};
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// a failed pinning leaves the thread unpinned, the placement is only a hint
+inline void PinThisThread(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)cpu;
+#endif
+}
+
+// Fixed pool of worker threads for fork-join loops.
+// ParallelFor hands out task indices from a shared counter to the workers and the calling
+// thread and returns once every index is done. RunOnEachWorker runs a task once on every
+// worker thread, which matters when the workers are pinned to CPUs: memory a worker touches
+// first stays on its NUMA node. Tasks must not throw.
+class ThreadPool {
+public:
+    // threads counts the calling thread, 0 means one per hardware thread
+    explicit ThreadPool(size_t threads = 0) {
+        if (threads == 0) {
+            threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+        }
+        for (size_t i = 1; i < threads; ++i) {
+            workers_.emplace_back([this, i] { WorkerLoop(i - 1); });
+        }
+    }
+    // one worker per entry of cpus, pinned to it before it runs any task
+    explicit ThreadPool(const std::vector<int>& cpus) {
+        for (size_t i = 0; i < cpus.size(); ++i) {
+            workers_.emplace_back([this, i, cpu = cpus[i]] {
+                PinThisThread(cpu);
+                WorkerLoop(i);
+            });
+        }
+    }
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    size_t Size() const noexcept {
+        return workers_.size() + 1;
+    }
+    size_t WorkerCount() const noexcept {
+        return workers_.size();
+    }
+
+    // task(0), ..., task(count - 1), in any order and on any thread of the pool
+    void ParallelFor(size_t count, const std::function<void(size_t)>& task) {
+        if (count == 0) {
+            return;
+        }
+        Start(task, count, false);
+        RunTasks(task, count);
+        Wait();
+    }
+
+    // task(w) on worker thread w for every w below WorkerCount(), the calling thread waits
+    void RunOnEachWorker(const std::function<void(size_t)>& task) {
+        if (workers_.empty()) {
+            return;
+        }
+        Start(task, 0, true);
+        Wait();
+    }
+
+private:
+    void RunTasks(const std::function<void(size_t)>& task, size_t count) {
+        for (size_t i = next_.fetch_add(1); i < count; i = next_.fetch_add(1)) {
+            task(i);
+        }
+    }
+
+    void Start(const std::function<void(size_t)>& task, size_t count, bool each_worker) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            task_ = &task;
+            count_ = count;
+            each_worker_ = each_worker;
+            next_.store(0, std::memory_order_relaxed);
+            busy_ = workers_.size();
+            ++generation_;
+        }
+        wake_.notify_all();
+    }
+
+    void Wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this] { return busy_ == 0; });
+        task_ = nullptr;
+    }
+
+    void WorkerLoop(size_t index) {
+        size_t seen_generation = 0;
+        while (true) {
+            const std::function<void(size_t)>* task = nullptr;
+            size_t count = 0;
+            bool each_worker = false;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [&] { return stop_ || generation_ != seen_generation; });
+                if (stop_) {
+                    return;
+                }
+                seen_generation = generation_;
+                task = task_;
+                count = count_;
+                each_worker = each_worker_;
+            }
+            if (each_worker) {
+                (*task)(index);
+            } else {
+                RunTasks(*task, count);
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (--busy_ == 0) {
+                done_.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    const std::function<void(size_t)>* task_ = nullptr;
+    size_t count_ = 0;
+    bool each_worker_ = false;
+    size_t busy_ = 0;
+    size_t generation_ = 0;
+    std::atomic<size_t> next_{0};
+    bool stop_ = false;
+};
@@ -0,0 +1,443 @@
+#include "SetAVL.h"
+#include "SetBucketAVL.h"
+#include "SetConcurrent.h"
+#include "SetPacked.h"
+#include "StaticSetAVL.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Compares balancing policies, node layouts, node orders and node storage of SetAVL on a trace
+// of trial_task commands, times copies of the resulting tree and compares it with
+// SetBucketAVL and SetPacked, the latency of single inserts with StaticSetAVL and how
+// concurrent inserts into SetConcurrent scale with the number of threads.
+// Usage: balance_bench [trace_file]
+// Without a file a synthetic trace of 90% inserts and 10% queries is used.
+// For the others it reports the node size, the insert rate and the cost of a descent: each
+// inserted key is looked up once in random order; cache misses are read from the hardware
+// counters where perf events are available, "n/a" otherwise.
+
+struct Command {
+    char type;
+    long long value;
+};
+
+std::vector<Command> ReadTrace(std::istream& in) {
+    std::vector<Command> trace;
+    std::string type;
+    std::string value;
+    while (in >> type >> value) {
+        if (type != "k" && type != "m" && type != "n") {
+            break;
+        }
+        try {
+            trace.push_back({type[0], std::stoll(value)});
+        } catch (const std::exception& e) {
+            break;
+        }
+    }
+    return trace;
+}
+
+std::vector<Command> MakeTrace(size_t size, unsigned seed) {
+    std::vector<Command> trace;
+    std::mt19937_64 gen(seed);
+    std::uniform_int_distribution<long long> key_dis(-1'000'000'000LL, 1'000'000'000LL);
+    std::uniform_int_distribution<int> type_dis(0, 9);
+    size_t inserted = 0;
+    for (size_t i = 0; i < size; ++i) {
+        int type = type_dis(gen);
+        if (type < 9 || inserted == 0) {
+            trace.push_back({'k', key_dis(gen)});
+            ++inserted;
+        } else if (type == 9 && i % 2 == 0) {
+            trace.push_back({'m', static_cast<long long>(gen() % inserted + 1)});
+        } else {
+            trace.push_back({'n', key_dis(gen)});
+        }
+    }
+    return trace;
+}
+
+template <typename Balance>
+void RunPolicy(const std::string& name, const std::vector<Command>& trace) {
+    SetAVL<long long, std::less<long long>, SetNoAugment<long long>, Balance> set;
+    size_t inserts = 0;
+    size_t checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (const auto& command : trace) {
+        if (command.type == 'k') {
+            inserts += set.Insert(command.value).second;
+        } else if (command.type == 'm') {
+            auto it = set.SelectInd1(static_cast<size_t>(command.value));
+            checksum += (it == set.End()) ? 0 : static_cast<size_t>(*it);
+        } else {
+            checksum += set.RankInd0(command.value);
+        }
+    }
+    auto finish = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(finish - start).count();
+
+    std::cout << std::left << std::setw(10) << name << std::right << std::setw(12) << inserts
+              << std::setw(12) << set.RotationCount() << std::setw(12) << std::fixed
+              << std::setprecision(3)
+              << static_cast<double>(set.RotationCount()) / std::max<size_t>(inserts, 1)
+              << std::setw(8) << CalcNodeHeight(set.GetRootPtr()) << std::setw(12)
+              << std::setprecision(2) << trace.size() / seconds / 1e6 << std::setw(22)
+              << checksum << "\n";
+}
+
+// hardware cache misses of the calling thread between Start and Stop, -1 if not available
+class CacheMissCounter {
+public:
+    CacheMissCounter() {
+#ifdef __linux__
+        perf_event_attr attr{};
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd_ = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+    }
+    CacheMissCounter(const CacheMissCounter&) = delete;
+    CacheMissCounter& operator=(const CacheMissCounter&) = delete;
+    ~CacheMissCounter() {
+#ifdef __linux__
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+#endif
+    }
+
+    void Start() {
+#ifdef __linux__
+        if (fd_ >= 0) {
+            ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+    long long Stop() {
+        long long count = -1;
+#ifdef __linux__
+        if (fd_ >= 0) {
+            ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd_, &count, sizeof(count)) != sizeof(count)) {
+                count = -1;
+            }
+        }
+#endif
+        return count;
+    }
+
+private:
+    int fd_ = -1;
+};
+
+// one RankInd0 per key in the order of keys
+struct DescentCost {
+    double nanoseconds = 0;
+    // negative without hardware counters
+    double misses = -1;
+    size_t checksum = 0;
+};
+
+template <typename Set>
+DescentCost MeasureDescents(const Set& set, const std::vector<long long>& keys) {
+    DescentCost cost;
+    CacheMissCounter misses;
+    auto start = std::chrono::steady_clock::now();
+    misses.Start();
+    for (long long key : keys) {
+        cost.checksum += set.RankInd0(key);
+    }
+    long long miss_count = misses.Stop();
+    auto finish = std::chrono::steady_clock::now();
+    size_t count = std::max<size_t>(keys.size(), 1);
+    cost.nanoseconds = std::chrono::duration<double>(finish - start).count() * 1e9 / count;
+    if (miss_count >= 0) {
+        cost.misses = static_cast<double>(miss_count) / count;
+    }
+    return cost;
+}
+
+void PrintDescents(const DescentCost& cost) {
+    std::cout << std::setw(14) << std::fixed << std::setprecision(2) << cost.nanoseconds
+              << std::setw(14);
+    if (cost.misses < 0) {
+        std::cout << "n/a";
+    } else {
+        std::cout << cost.misses;
+    }
+    std::cout << std::setw(22) << cost.checksum << "\n";
+}
+
+std::vector<long long> InsertedKeys(const std::vector<Command>& trace) {
+    std::vector<long long> keys;
+    for (const auto& command : trace) {
+        if (command.type == 'k') {
+            keys.push_back(command.value);
+        }
+    }
+    return keys;
+}
+
+template <typename Layout>
+void RunLayout(const std::string& name, const std::vector<Command>& trace) {
+    using Set = SetAVL<long long, std::less<long long>, SetNoAugment<long long>, SetAVLBalance,
+                       Layout>;
+    std::vector<long long> keys = InsertedKeys(trace);
+    Set set;
+    auto start = std::chrono::steady_clock::now();
+    for (long long key : keys) {
+        set.Insert(key);
+    }
+    auto finish = std::chrono::steady_clock::now();
+    double insert_seconds = std::chrono::duration<double>(finish - start).count();
+
+    std::shuffle(keys.begin(), keys.end(), std::mt19937_64(7));
+    std::cout << std::left << std::setw(22) << name << std::right << std::setw(10)
+              << sizeof(typename Set::Node) << std::setw(10) << alignof(typename Set::Node)
+              << std::setw(12) << std::fixed << std::setprecision(2)
+              << keys.size() / insert_seconds / 1e6;
+    PrintDescents(MeasureDescents(set, keys));
+}
+
+// descents on the nodes as the inserts left them and after each kind of compaction
+void RunCompaction(const std::vector<Command>& trace) {
+    std::vector<long long> keys = InsertedKeys(trace);
+    SetAVL<long long> set;
+    for (long long key : keys) {
+        set.Insert(key);
+    }
+    std::shuffle(keys.begin(), keys.end(), std::mt19937_64(7));
+    std::cout << std::left << std::setw(22) << "scattered" << std::right;
+    PrintDescents(MeasureDescents(set, keys));
+    set.Compact(SetCompactOrder::kBreadthFirst);
+    std::cout << std::left << std::setw(22) << "breadth-first" << std::right;
+    PrintDescents(MeasureDescents(set, keys));
+    set.Compact(SetCompactOrder::kVanEmdeBoas);
+    std::cout << std::left << std::setw(22) << "van Emde Boas" << std::right;
+    PrintDescents(MeasureDescents(set, keys));
+}
+
+// inserts and descents with the nodes in the given arena
+void RunStorage(const std::string& name, SetArenaOptions options,
+                const std::vector<Command>& trace) {
+    std::vector<long long> keys = InsertedKeys(trace);
+    SetAVL<long long> set;
+    set.UseNodeArena(std::move(options));
+    auto start = std::chrono::steady_clock::now();
+    for (long long key : keys) {
+        set.Insert(key);
+    }
+    auto finish = std::chrono::steady_clock::now();
+    double insert_seconds = std::chrono::duration<double>(finish - start).count();
+    std::shuffle(keys.begin(), keys.end(), std::mt19937_64(7));
+    std::cout << std::left << std::setw(22) << name << std::setw(24)
+              << SetArenaBackingName(set.NodeArena().Backing()) << std::right << std::setw(12)
+              << std::fixed << std::setprecision(2) << keys.size() / insert_seconds / 1e6;
+    PrintDescents(MeasureDescents(set, keys));
+}
+
+// copy construction and copy assignment into a tree of the same size, as on a reporting tick
+void RunCopies(const std::vector<Command>& trace) {
+    SetAVL<long long> set;
+    for (long long key : InsertedKeys(trace)) {
+        set.Insert(key);
+    }
+    constexpr int kRounds = 5;
+    auto start = std::chrono::steady_clock::now();
+    size_t checksum = 0;
+    for (int round = 0; round < kRounds; ++round) {
+        SetAVL<long long> copy(set);
+        checksum += copy.Size();
+    }
+    auto middle = std::chrono::steady_clock::now();
+    SetAVL<long long> target(set);
+    for (int round = 0; round < kRounds; ++round) {
+        target = set;
+        checksum += target.Size();
+    }
+    auto finish = std::chrono::steady_clock::now();
+    std::cout << "copy of " << set.Size() << " keys: construct " << std::fixed
+              << std::setprecision(2)
+              << std::chrono::duration<double, std::milli>(middle - start).count() / kRounds
+              << " ms, assign "
+              << std::chrono::duration<double, std::milli>(finish - middle).count() / kRounds
+              << " ms (checksum " << checksum << ")\n";
+}
+
+// memory per key with one node per key and with blocks of keys
+template <typename Set, typename Bytes>
+void RunBuckets(const std::string& name, const std::vector<Command>& trace, Bytes bytes) {
+    std::vector<long long> keys = InsertedKeys(trace);
+    Set set;
+    auto start = std::chrono::steady_clock::now();
+    for (long long key : keys) {
+        set.Insert(key);
+    }
+    auto finish = std::chrono::steady_clock::now();
+    double insert_seconds = std::chrono::duration<double>(finish - start).count();
+    std::shuffle(keys.begin(), keys.end(), std::mt19937_64(7));
+    std::cout << std::left << std::setw(22) << name << std::right << std::setw(12)
+              << std::fixed << std::setprecision(2)
+              << static_cast<double>(bytes(set)) / std::max<size_t>(set.Size(), 1)
+              << std::setw(12) << keys.size() / insert_seconds / 1e6;
+    PrintDescents(MeasureDescents(set, keys));
+}
+
+// each insert timed on its own: the median, the 99.9th percentile and the worst one; an
+// untimed pass over the same keys first warms up the allocator, the caches and the pages
+template <typename Set>
+void RunInsertLatency(const std::string& name, Set& set, const std::vector<long long>& keys) {
+    for (long long key : keys) {
+        set.Insert(key);
+    }
+    set.Clear();
+    std::vector<double> latencies;
+    latencies.reserve(keys.size());
+    for (long long key : keys) {
+        auto start = std::chrono::steady_clock::now();
+        set.Insert(key);
+        auto finish = std::chrono::steady_clock::now();
+        latencies.push_back(std::chrono::duration<double, std::nano>(finish - start).count());
+    }
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << std::left << std::setw(22) << name << std::right << std::fixed
+              << std::setprecision(0) << std::setw(12) << latencies[latencies.size() / 2]
+              << std::setw(12) << latencies[latencies.size() * 999 / 1000] << std::setw(12)
+              << latencies.back() << std::setw(22) << set.Size() << "\n";
+}
+
+void RunLatencies(const std::vector<Command>& trace) {
+    constexpr size_t kKeys = 65000;
+    std::vector<long long> keys = InsertedKeys(trace);
+    keys.resize(std::min(keys.size(), kKeys));
+    std::cout << "\n" << std::left << std::setw(22) << "inserts of " + std::to_string(keys.size())
+              << std::right << std::setw(12) << "median ns" << std::setw(12) << "p99.9 ns"
+              << std::setw(12) << "max ns" << std::setw(22) << "keys" << "\n";
+    SetAVL<long long> heap;
+    RunInsertLatency("SetAVL", heap, keys);
+    static StaticSetAVL<long long, kKeys> fixed;
+    fixed.Prefault();
+    RunInsertLatency("StaticSetAVL", fixed, keys);
+}
+
+// the inserted keys of the trace dealt round-robin to 1, 2, 4, ... threads, up to twice
+// the hardware threads and at least 16
+void RunConcurrentScaling(const std::vector<Command>& trace) {
+    std::vector<long long> keys = InsertedKeys(trace);
+    size_t max_threads = std::max<size_t>(16, 2 * std::thread::hardware_concurrency());
+    double base_rate = 0;
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        SetConcurrent<long long> set;
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t]() {
+                for (size_t i = t; i < keys.size(); i += threads) {
+                    set.Insert(keys[i]);
+                }
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        double seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double rate = keys.size() / seconds / 1e6;
+        if (threads == 1) {
+            base_rate = rate;
+        }
+        std::cout << std::left << std::setw(22) << "SetConcurrent" << std::right
+                  << std::setw(12) << threads << std::fixed << std::setprecision(2)
+                  << std::setw(12) << rate << std::setw(12) << rate / base_rate
+                  << std::setw(22) << set.Size() << "\n";
+    }
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<Command> trace;
+    if (argc > 1) {
+        std::ifstream in(argv[1]);
+        if (!in) {
+            std::cout << "Can not open " << argv[1] << ". Error.\n";
+            return -1;
+        }
+        trace = ReadTrace(in);
+    } else {
+        trace = MakeTrace(1'000'000, 42);
+    }
+
+    std::cout << "commands: " << trace.size() << "\n";
+    std::cout << std::left << std::setw(10) << "policy" << std::right << std::setw(12)
+              << "inserts" << std::setw(12) << "rotations" << std::setw(12) << "rot/insert"
+              << std::setw(8) << "height" << std::setw(12) << "Mops/s" << std::setw(22)
+              << "checksum" << "\n";
+    RunPolicy<SetAVLBalance>("avl", trace);
+    RunPolicy<SetRedBlackBalance>("red-black", trace);
+    RunPolicy<SetTreapBalance>("treap", trace);
+
+    std::cout << "\n" << std::left << std::setw(22) << "layout" << std::right << std::setw(10)
+              << "node B" << std::setw(10) << "align" << std::setw(12) << "ins Mops/s"
+              << std::setw(14) << "ns/descent" << std::setw(14) << "miss/descent"
+              << std::setw(22) << "checksum" << "\n";
+    RunLayout<SetThreadedLayout>("threaded", trace);
+    RunLayout<SetUnthreadedLayout>("unthreaded", trace);
+    RunLayout<SetHotColdLayout>("hot/cold", trace);
+    RunLayout<SetHotColdUnthreadedLayout>("hot/cold unthreaded", trace);
+
+    std::cout << "\n" << std::left << std::setw(22) << "node order" << std::right
+              << std::setw(14) << "ns/descent" << std::setw(14) << "miss/descent"
+              << std::setw(22) << "checksum" << "\n";
+    RunCompaction(trace);
+
+    std::cout << "\n" << std::left << std::setw(22) << "node storage" << std::setw(24)
+              << "backing" << std::right << std::setw(12) << "ins Mops/s" << std::setw(14)
+              << "ns/descent" << std::setw(14) << "miss/descent" << std::setw(22) << "checksum"
+              << "\n";
+    SetArenaOptions huge_pages;
+    huge_pages.huge_pages = true;
+    SetArenaOptions numa = huge_pages;
+    numa.numa_node = 0;
+    RunStorage("heap", SetArenaOptions(), trace);
+    RunStorage("huge pages", huge_pages, trace);
+    RunStorage("huge pages, node 0", numa, trace);
+
+    std::cout << "\n";
+    RunCopies(trace);
+
+    std::cout << "\n" << std::left << std::setw(22) << "storage" << std::right << std::setw(12)
+              << "bytes/key" << std::setw(12) << "ins Mops/s" << std::setw(14) << "ns/descent"
+              << std::setw(14) << "miss/descent" << std::setw(22) << "checksum" << "\n";
+    auto nodes = [](const auto& set) { return set.Size() * sizeof(SetAVL<long long>::Node); };
+    auto blocks = [](const auto& set) { return set.BlockBytes(); };
+    RunBuckets<SetAVL<long long>>("node per key", trace, nodes);
+    RunBuckets<SetBucketAVL<long long, std::less<long long>, 16>>("blocks of 16", trace, blocks);
+    RunBuckets<SetBucketAVL<long long>>("blocks of 64", trace, blocks);
+    RunBuckets<SetPacked<long long>>("packed blocks of 128", trace,
+                                     [](const auto& set) { return set.MemoryBytes(); });
+
+    RunLatencies(trace);
+
+    std::cout << "\n" << std::left << std::setw(22) << "concurrent inserts" << std::right
+              << std::setw(12) << "threads" << std::setw(12) << "Mops/s" << std::setw(12)
+              << "speedup" << std::setw(22) << "keys" << "\n";
+    RunConcurrentScaling(trace);
+}
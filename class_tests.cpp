@@ -1,4 +1,19 @@
 #include "SetAVL.h"
+#include "FenwickTree.h"
+#include "RadixSort.h"
+#include "SetAVLImage.h"
+#include "SetBitmap.h"
+#include "SetBucketAVL.h"
+#include "SetConcurrent.h"
+#include "SetExternalBuild.h"
+#include "SetFrozen.h"
+#include "SetLSM.h"
+#include "SetPacked.h"
+#include "SetSharded.h"
+#include "SetSmallAVL.h"
+#include "StaticSetAVL.h"
+#include "ThreadPool.h"
+#include "trial_commands.h"
 #include <cassert>
 #include <iostream>
 #include <string>
@@ -7,6 +22,20 @@
 #include <functional>
 #include <utility>
 #include <random>
+#include <numeric>
+#include <sstream>
+#include <cstdio>
+#include <fstream>
+#include <thread>
+#include <set>
+#include <cmath>
+#include <limits>
+#include <array>
+#include <string_view>
+#ifdef __linux__
+#include <csignal>
+#include <sys/resource.h>
+#endif
 
 struct ComplexKey {
     int x;
@@ -1120,6 +1149,1921 @@ void TestLogarithmicAVLHeightProperty() {
     std::cout << "TestLogarithmicAVLHeightProperty passed\n";
 }
 
+void TestStringKeysWithPrefix() {
+    static_assert(SetAVL<std::string>::NodePolicy::kUsePrefix);
+    static_assert(SetAVL<std::string, std::greater<std::string>>::NodePolicy::kUsePrefix);
+    static_assert(!SetAVL<int>::NodePolicy::kUsePrefix);
+    static_assert(sizeof(SetNode<int>) ==
+                  sizeof(SetNode<int, SetNodePolicy<int, std::greater<int>>>));
+
+    // long shared prefixes force the fallback to full comparisons
+    std::mt19937 gen(73);
+    std::vector<std::string> heads = {"", "a", "abcdefg", "abcdefgh", "abcdefghij", "zz"};
+    std::uniform_int_distribution<> head_dis(0, heads.size() - 1);
+    std::uniform_int_distribution<> len_dis(0, 12);
+    std::uniform_int_distribution<> char_dis(0, 255);
+    std::vector<std::string> input;
+    for (int i = 0; i < 2000; ++i) {
+        std::string key = heads[head_dis(gen)];
+        int tail = len_dis(gen);
+        for (int j = 0; j < tail; ++j) {
+            key.push_back(static_cast<char>(char_dis(gen) % 4 == 0 ? 0 : 'a' + char_dis(gen) % 3));
+        }
+        input.push_back(key);
+    }
+    std::vector<std::string> sorted_unique = input;
+    std::sort(sorted_unique.begin(), sorted_unique.end());
+    sorted_unique.erase(std::unique(sorted_unique.begin(), sorted_unique.end()),
+                        sorted_unique.end());
+
+    SetAVL<std::string> set_avl;
+    SetAVL<std::string, std::greater<std::string>> set_greater{std::greater<std::string>()};
+    for (const auto& key : input) {
+        set_avl.Insert(key);
+        set_greater.Insert(key);
+    }
+    assert(set_avl.Size() == sorted_unique.size());
+    assert(set_greater.Size() == sorted_unique.size());
+    assert(std::equal(set_avl.Begin(), set_avl.End(), sorted_unique.begin()));
+    assert(std::equal(set_greater.Begin(), set_greater.End(), sorted_unique.rbegin()));
+    for (size_t i = 0; i < sorted_unique.size(); ++i) {
+        assert(*set_avl.Find(sorted_unique[i]) == sorted_unique[i]);
+        assert(set_avl.RankInd0(sorted_unique[i]) == i);
+        assert(set_greater.RankInd0(sorted_unique[i]) == sorted_unique.size() - 1 - i);
+        assert(!set_avl.Insert(sorted_unique[i]).second);
+    }
+    for (const auto& key : {std::string("abcdefgh\x01"), std::string("abcdefg"), std::string()}) {
+        auto lb = std::lower_bound(sorted_unique.begin(), sorted_unique.end(), key);
+        assert((lb == sorted_unique.end()) == (set_avl.LowerBound(key) == set_avl.End()));
+        assert(lb == sorted_unique.end() || *set_avl.LowerBound(key) == *lb);
+    }
+    std::cout << "TestStringKeysWithPrefix passed\n";
+}
+
+struct HalfWeight {
+    long long operator()(int key) const {
+        return key / 2;
+    }
+};
+
+void TestAugmentedAggregates() {
+    static_assert(sizeof(SetAVL<int>::Node) == sizeof(SetNode<int>));
+    auto input = GenerateRandomVector(1500, 0, 5000, 74);
+    SetAVL<int, std::less<int>, SetSumAugment<int>> sum_set;
+    SetAVL<int, std::less<int>, SetMinGapAugment<int>> gap_set;
+    SetAVL<int, std::less<int>, SetWeightAugment<int, HalfWeight>> weight_set;
+    std::vector<int> sorted_unique;
+    for (int val : input) {
+        sum_set.Insert(val);
+        gap_set.Insert(val);
+        weight_set.Insert(val);
+        auto it = std::lower_bound(sorted_unique.begin(), sorted_unique.end(), val);
+        if (it == sorted_unique.end() || *it != val) {
+            sorted_unique.insert(it, val);
+        }
+        assert(sum_set.Aggregate() ==
+               std::accumulate(sorted_unique.begin(), sorted_unique.end(), 0));
+    }
+
+    std::mt19937 gen(74);
+    std::uniform_int_distribution<> dis(-100, 5100);
+    for (int i = 0; i < 300; ++i) {
+        int lo = dis(gen);
+        int hi = dis(gen);
+        auto first = std::lower_bound(sorted_unique.begin(), sorted_unique.end(), lo);
+        auto last = std::lower_bound(sorted_unique.begin(), sorted_unique.end(), hi);
+        int expected_sum = (lo < hi) ? std::accumulate(first, last, 0) : 0;
+        assert(sum_set.RangeAggregate(lo, hi) == expected_sum);
+
+        auto gap = gap_set.RangeAggregate(lo, hi);
+        size_t expected_count = (lo < hi) ? static_cast<size_t>(last - first) : 0;
+        assert(gap.count == expected_count);
+        if (expected_count >= 2) {
+            int expected_gap = std::numeric_limits<int>::max();
+            for (auto it = first + 1; it != last; ++it) {
+                expected_gap = std::min(expected_gap, *it - *(it - 1));
+            }
+            assert(gap.min == *first && gap.max == *(last - 1));
+            assert(gap.min_gap == expected_gap);
+        }
+    }
+
+    long long total = weight_set.Aggregate();
+    for (long long weight : {0LL, 1LL, total / 4, total / 2, total - 1, total, total + 5}) {
+        long long running = 0;
+        auto expected = sorted_unique.end();
+        for (auto it = sorted_unique.begin(); it != sorted_unique.end(); ++it) {
+            running += *it / 2;
+            if (weight < running) {
+                expected = it;
+                break;
+            }
+        }
+        auto it = weight_set.SelectByWeight(weight);
+        assert((expected == sorted_unique.end()) == (it == weight_set.End()));
+        assert(it == weight_set.End() || *it == *expected);
+    }
+
+    auto copy = sum_set;
+    assert(copy.Aggregate() == sum_set.Aggregate());
+    assert(copy.RangeAggregate(100, 4000) == sum_set.RangeAggregate(100, 4000));
+    std::cout << "TestAugmentedAggregates passed\n";
+}
+
+void TestRangeCountsAndIteratorDistance() {
+    auto input = GenerateRandomVector(1200, -3000, 3000, 75);
+    SetAVL<int> set_avl;
+    for (int val : input) {
+        set_avl.Insert(val);
+    }
+    std::vector<int> sorted_unique = input;
+    std::sort(sorted_unique.begin(), sorted_unique.end());
+    sorted_unique.erase(std::unique(sorted_unique.begin(), sorted_unique.end()),
+                        sorted_unique.end());
+    size_t n = sorted_unique.size();
+
+    std::mt19937 gen(75);
+    std::uniform_int_distribution<> key_dis(-3100, 3100);
+    for (int i = 0; i < 300; ++i) {
+        int lo = key_dis(gen);
+        int hi = key_dis(gen);
+        auto first = std::lower_bound(sorted_unique.begin(), sorted_unique.end(), lo);
+        auto last = std::lower_bound(sorted_unique.begin(), sorted_unique.end(), hi);
+        size_t expected = (lo < hi) ? static_cast<size_t>(last - first) : 0;
+        assert(set_avl.CountRange(lo, hi) == expected);
+    }
+
+    assert(set_avl.IndexOf(set_avl.End()) == n);
+    size_t index = 0;
+    for (auto it = set_avl.Begin(); it != set_avl.End(); ++it, ++index) {
+        assert(set_avl.IndexOf(it) == index);
+    }
+
+    std::uniform_int_distribution<size_t> rank_dis(0, n);
+    for (int i = 0; i < 300; ++i) {
+        size_t a = rank_dis(gen);
+        size_t b = rank_dis(gen);
+        auto it_a = (a == n) ? set_avl.End() : set_avl.SelectInd0(a);
+        auto it_b = (b == n) ? set_avl.End() : set_avl.SelectInd0(b);
+        std::ptrdiff_t distance = static_cast<std::ptrdiff_t>(b) - static_cast<std::ptrdiff_t>(a);
+        assert(set_avl.Distance(it_a, it_b) == distance);
+        assert(set_avl.Advance(it_a, distance) == it_b);
+        assert(set_avl.Advance(it_a, static_cast<std::ptrdiff_t>(n - a) + 1) == set_avl.End());
+        assert(set_avl.Advance(it_a, -static_cast<std::ptrdiff_t>(a) - 1) == set_avl.End());
+
+        auto range = set_avl.SelectRange(std::min(a, b), std::max(a, b));
+        size_t expected_rank = std::min(a, b);
+        for (auto it = range.first; it != range.second; ++it, ++expected_rank) {
+            assert(*it == sorted_unique[expected_rank]);
+        }
+        assert(expected_rank == std::max(a, b) || range.first == set_avl.End());
+    }
+    const SetAVL<int>& const_set = set_avl;
+    assert(*const_set.Advance(const_set.Begin(), 5) == sorted_unique[5]);
+    assert(*const_set.Advance(const_set.End(), -1) == sorted_unique.back());
+    std::cout << "TestRangeCountsAndIteratorDistance passed\n";
+}
+
+void TestFingerSearch() {
+    auto input = GenerateRandomVector(1500, -4000, 4000, 76);
+    SetAVL<int> set_avl;
+    for (int val : input) {
+        set_avl.Insert(val);
+    }
+    std::vector<int> sorted_unique = input;
+    std::sort(sorted_unique.begin(), sorted_unique.end());
+    sorted_unique.erase(std::unique(sorted_unique.begin(), sorted_unique.end()),
+                        sorted_unique.end());
+    size_t n = sorted_unique.size();
+
+    std::mt19937 gen(76);
+    std::uniform_int_distribution<size_t> rank_dis(0, n);
+    std::uniform_int_distribution<> step_dis(-40, 40);
+    std::uniform_int_distribution<> key_dis(-4100, 4100);
+    size_t finger_rank = rank_dis(gen);
+    SetAVL<int>::ConstIterator finger =
+        (finger_rank == n) ? set_avl.End() : set_avl.SelectInd0(finger_rank);
+    for (int i = 0; i < 2000; ++i) {
+        // mostly nearby keys, sometimes far ones
+        int key = (i % 5 == 0 || finger == set_avl.End()) ? key_dis(gen) : *finger + step_dis(gen);
+        auto lb = std::lower_bound(sorted_unique.begin(), sorted_unique.end(), key);
+        size_t expected_rank = lb - sorted_unique.begin();
+        bool present = (lb != sorted_unique.end() && *lb == key);
+
+        auto found = set_avl.FindFrom(finger, key);
+        assert(present == (found != set_avl.End()));
+        assert(!present || *found == key);
+        auto lower = set_avl.LowerBoundFrom(finger, key);
+        assert((lb == sorted_unique.end()) == (lower == set_avl.End()));
+        assert(lower == set_avl.End() || *lower == *lb);
+        assert(set_avl.RankInd0From(finger, finger_rank, key) == expected_rank);
+
+        std::ptrdiff_t step = static_cast<std::ptrdiff_t>(finger_rank) + step_dis(gen);
+        size_t target = std::min(n, static_cast<size_t>(std::max<std::ptrdiff_t>(0, step)));
+        auto selected = set_avl.SelectInd0From(finger, finger_rank, target);
+        assert((target == n) == (selected == set_avl.End()));
+        assert(selected == set_avl.End() || *selected == sorted_unique[target]);
+
+        auto next = set_avl.LowerBoundAndRankFrom(finger, finger_rank, key);
+        assert(next.second == expected_rank);
+        finger = (i % 2 == 0) ? next.first : selected;
+        finger_rank = (i % 2 == 0) ? next.second : target;
+    }
+    std::cout << "TestFingerSearch passed\n";
+}
+
+template <typename Node>
+int CheckRedBlackNode(const Node* node) {
+    if (node == nullptr) {
+        return 1;
+    }
+    if (node->GetBalance() == SetRedBlackBalance::kRed) {
+        assert(node->GetLeft() == nullptr ||
+               node->GetLeft()->GetBalance() == SetRedBlackBalance::kBlack);
+        assert(node->GetRight() == nullptr ||
+               node->GetRight()->GetBalance() == SetRedBlackBalance::kBlack);
+    }
+    int left_black = CheckRedBlackNode(node->GetLeft().get());
+    int right_black = CheckRedBlackNode(node->GetRight().get());
+    assert(left_black == right_black);
+    return left_black + (node->GetBalance() == SetRedBlackBalance::kBlack ? 1 : 0);
+}
+
+template <typename Node>
+void CheckTreapNode(const Node* node) {
+    if (node == nullptr) {
+        return;
+    }
+    assert(node->GetLeft() == nullptr || node->GetLeft()->GetBalance() <= node->GetBalance());
+    assert(node->GetRight() == nullptr || node->GetRight()->GetBalance() <= node->GetBalance());
+    CheckTreapNode(node->GetLeft().get());
+    CheckTreapNode(node->GetRight().get());
+}
+
+template <typename Set>
+void CheckAgainstSorted(const Set& set, const std::vector<int>& sorted_unique) {
+    assert(set.Size() == sorted_unique.size());
+    assert(std::equal(set.Begin(), set.End(), sorted_unique.begin()));
+    for (size_t i = 0; i < sorted_unique.size(); ++i) {
+        assert(*set.SelectInd0(i) == sorted_unique[i]);
+        assert(set.RankInd0(sorted_unique[i]) == i);
+    }
+}
+
+void TestBalancingPolicies() {
+    auto input = GenerateRandomVector(3000, -5000, 5000, 77);
+    std::vector<int> ascending(2000);
+    std::iota(ascending.begin(), ascending.end(), 0);
+
+    SetAVL<int> avl_set;
+    SetAVL<int, std::less<int>, SetNoAugment<int>, SetRedBlackBalance> rb_set;
+    SetAVL<int, std::less<int>, SetSumAugment<int>, SetTreapBalance> treap_set;
+    for (int val : input) {
+        avl_set.Insert(val);
+        rb_set.Insert(val);
+        treap_set.Insert(val);
+    }
+    std::vector<int> sorted_unique = input;
+    std::sort(sorted_unique.begin(), sorted_unique.end());
+    sorted_unique.erase(std::unique(sorted_unique.begin(), sorted_unique.end()),
+                        sorted_unique.end());
+    CheckAgainstSorted(avl_set, sorted_unique);
+    CheckAgainstSorted(rb_set, sorted_unique);
+    CheckAgainstSorted(treap_set, sorted_unique);
+    assert(treap_set.Aggregate() == std::accumulate(sorted_unique.begin(), sorted_unique.end(), 0));
+    assert(avl_set.RotationCount() > 0 && rb_set.RotationCount() > 0);
+
+    assert(rb_set.GetRoot()->GetBalance() == SetRedBlackBalance::kBlack);
+    CheckRedBlackNode(rb_set.GetRootPtr());
+    size_t rb_height = CalcNodeHeight(rb_set.GetRootPtr());
+    assert(rb_height <= 2 * std::log2(rb_set.Size() + 1));
+    CheckTreapNode(treap_set.GetRootPtr());
+
+    SetAVL<int, std::less<int>, SetNoAugment<int>, SetRedBlackBalance> rb_ascending;
+    SetAVL<int, std::less<int>, SetNoAugment<int>, SetTreapBalance> treap_ascending;
+    for (int val : ascending) {
+        rb_ascending.Insert(val);
+        treap_ascending.Insert(val);
+    }
+    CheckAgainstSorted(rb_ascending, ascending);
+    CheckAgainstSorted(treap_ascending, ascending);
+    CheckRedBlackNode(rb_ascending.GetRootPtr());
+    assert(CalcNodeHeight(rb_ascending.GetRootPtr()) <= 2 * std::log2(ascending.size() + 1));
+    // expected height of a treap is about 3 log n, far below the degenerate n
+    assert(CalcNodeHeight(treap_ascending.GetRootPtr()) < 100);
+
+    auto rb_copy = rb_set;
+    CheckRedBlackNode(rb_copy.GetRootPtr());
+    rb_copy.Insert(100000);
+    CheckRedBlackNode(rb_copy.GetRootPtr());
+    std::cout << "TestBalancingPolicies passed\n";
+}
+
+void TestOfflineOrderStatistics() {
+    FenwickTree<size_t> counts(10);
+    for (size_t pos : {1, 3, 4, 8}) {
+        counts.Add(pos, 1);
+    }
+    assert(counts.PrefixSum(0) == 0);
+    assert(counts.PrefixSum(4) == 2);
+    assert(counts.PrefixSum(10) == 4);
+    assert(counts.Select(1) == 1);
+    assert(counts.Select(3) == 4);
+    assert(counts.Select(4) == 8);
+    assert(counts.Select(5) == counts.Size());
+
+    // enough items for several threads, pairs with equal keys check stability
+    auto input = GenerateRandomVector(300000, -1000000, 1000000, 91);
+    std::vector<std::pair<long long, size_t>> items;
+    for (size_t i = 0; i < input.size(); ++i) {
+        items.push_back({input[i], i});
+    }
+    auto expected = items;
+    std::stable_sort(expected.begin(), expected.end(),
+                     [](const auto& a, const auto& b) { return a.first < b.first; });
+    ParallelRadixSort(items, [](const auto& item) { return RadixKey(item.first); }, 4);
+    assert(items == expected);
+
+    std::istringstream in("k 5 k -3 m 2 n 4 k 12abc n");
+    auto commands = DecodeCommands(in);
+    assert(commands.size() == 6);
+    assert(commands[1].type == CommandType::INSERT && commands[1].key == -3);
+    assert(commands[2].type == CommandType::SELECT && commands[2].index == 2);
+    assert(commands[3].type == CommandType::RANK && commands[3].key == 4);
+    assert(commands[4].key == 12);
+    assert(commands[5].type == CommandType::ERROR && commands[5].error == kInputEndedError);
+    std::istringstream bad("k 1 n 99999999999999999999 k 2");
+    commands = DecodeCommands(bad);
+    assert(commands.size() == 2 && commands[1].error == kLongLongRangeError);
+    std::cout << "TestOfflineOrderStatistics passed\n";
+}
+
+void TestBitmapSet() {
+    static_assert(kSetBitmapEligible<long long, std::less<long long>>);
+    static_assert(kSetBitmapEligible<unsigned, std::less<>>);
+    static_assert(!kSetBitmapEligible<int, std::greater<int>>);
+    static_assert(!kSetBitmapEligible<std::string, std::less<std::string>>);
+    assert(SelectInWord(0b1011000, 0) == 3);
+    assert(SelectInWord(0b1011000, 2) == 6);
+    assert(SelectInWord(uint64_t{1} << 63, 0) == 63);
+    assert((SetBitmapPreferred<int, std::less<int>>(-1000, 1000, 10)));
+    assert((!SetBitmapPreferred<long long, std::less<long long>>(0, 1LL << 40, 10)));
+    assert((SetBitmapPreferred<int, std::less<int>>(0, 32 * 100000, 100000)));
+    assert((!SetBitmapPreferred<int, std::less<int>>(0, 512 * 100000, 100000)));
+
+    auto input = GenerateRandomVector(5000, -3000, 3000, 5);
+    SetBitmap<int> bitmap(-3000, 3000);
+    SetAVL<int> tree;
+    for (int val : input) {
+        assert(bitmap.Insert(val) == tree.Insert(val).second);
+    }
+    assert(bitmap.Size() == tree.Size());
+    for (int key = -3005; key <= 3005; key += 7) {
+        assert(bitmap.Contains(key) == tree.Contains(key));
+        assert(bitmap.RankInd0(key) == tree.RankInd0(key));
+    }
+    for (size_t i = 0; i < tree.Size(); ++i) {
+        assert(*bitmap.SelectInd0(i) == *tree.SelectInd0(i));
+    }
+    assert(!bitmap.SelectInd0(tree.Size()));
+    assert(!bitmap.SelectInd1(0));
+
+    SetBitmap<long long> extremes(std::numeric_limits<long long>::max() - 10,
+                                  std::numeric_limits<long long>::max());
+    extremes.Insert(std::numeric_limits<long long>::max());
+    extremes.Insert(std::numeric_limits<long long>::max() - 10);
+    assert(*extremes.SelectInd1(2) == std::numeric_limits<long long>::max());
+    assert(extremes.RankInd0(std::numeric_limits<long long>::max()) == 1);
+    std::cout << "TestBitmapSet passed\n";
+}
+
+void TestBatchedLookups() {
+    auto input = GenerateRandomVector(4000, -10000, 10000, 13);
+    SetAVL<int> set;
+    set.Insert(input.begin(), input.end());
+    SetAVL<std::string> strings;
+    for (int val : input) {
+        strings.Insert("key" + std::to_string(val));
+    }
+
+    std::vector<int> keys = GenerateRandomVector(1000, -10005, 10005, 14);
+    std::vector<size_t> indices;
+    for (size_t i = 0; i <= set.Size() + 1; i += 3) {
+        indices.push_back(i);
+    }
+    auto found = set.FindBatch(keys);
+    auto ranks = set.RankBatch(keys);
+    auto selected = set.SelectBatch(indices);
+    assert(found.size() == keys.size() && ranks.size() == keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        assert(found[i] == std::as_const(set).Find(keys[i]));
+        assert(ranks[i] == set.RankInd0(keys[i]));
+    }
+    for (size_t i = 0; i < indices.size(); ++i) {
+        assert(selected[i] == std::as_const(set).SelectInd1(indices[i]));
+    }
+
+    std::vector<std::string> string_keys;
+    for (int val : keys) {
+        string_keys.push_back("key" + std::to_string(val));
+    }
+    auto string_ranks = strings.RankBatch(string_keys);
+    for (size_t i = 0; i < string_keys.size(); ++i) {
+        assert(string_ranks[i] == strings.RankInd0(string_keys[i]));
+    }
+
+    SetAVL<int> empty;
+    assert(empty.FindBatch({1, 2})[1] == empty.End());
+    assert(empty.RankBatch({1})[0] == 0);
+    assert(empty.SelectBatch({0, 1})[0] == empty.End());
+    assert(set.FindBatch({}).empty());
+    std::cout << "TestBatchedLookups passed\n";
+}
+
+void TestConcurrentReaders() {
+    auto input = GenerateRandomVector(20000, -50000, 50000, 21);
+    SetAVL<int> set;
+    set.Insert(input.begin(), input.end());
+    const SetAVL<int>& reader = set;
+
+    ThreadPool pool(4);
+    assert(pool.Size() == 4);
+    constexpr size_t kChunks = 64;
+    std::vector<size_t> mismatches(kChunks);
+    for (int round = 0; round < 3; ++round) {
+        pool.ParallelFor(kChunks, [&](size_t chunk) {
+            std::vector<int> keys;
+            std::vector<size_t> indices;
+            for (size_t i = chunk; i < input.size(); i += kChunks) {
+                keys.push_back(input[i] + round);
+                indices.push_back(i % (reader.Size() + 2));
+            }
+            auto ranks = reader.RankBatch(keys);
+            auto selected = reader.SelectBatch(indices);
+            for (size_t i = 0; i < keys.size(); ++i) {
+                mismatches[chunk] += (ranks[i] != reader.RankInd0(keys[i]));
+                mismatches[chunk] += (selected[i] != reader.SelectInd1(indices[i]));
+                bool found = (reader.Find(keys[i]) != reader.End());
+                mismatches[chunk] += (reader.Contains(keys[i]) != found);
+            }
+        });
+    }
+    assert(std::accumulate(mismatches.begin(), mismatches.end(), size_t{0}) == 0);
+
+    std::vector<int> hits(1000);
+    pool.ParallelFor(hits.size(), [&](size_t i) { ++hits[i]; });
+    pool.ParallelFor(0, [&](size_t) { assert(false); });
+    assert(std::count(hits.begin(), hits.end(), 1) == 1000);
+    std::cout << "TestConcurrentReaders passed\n";
+}
+
+bool SameCommands(const std::vector<Command>& lhs, const std::vector<Command>& rhs) {
+    if (lhs.size() != rhs.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < lhs.size(); ++i) {
+        if (lhs[i].type != rhs[i].type || lhs[i].key != rhs[i].key ||
+            lhs[i].index != rhs[i].index || lhs[i].error != rhs[i].error) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void TestParallelDecoding() {
+    std::mt19937 gen(17);
+    const std::vector<std::string> tokens = {"k", "m", "n", "12", "-7", "0", "x1",
+                                             "99999999999999999999", "3abc", "-"};
+    const std::vector<std::string> spaces = {" ", "\n", "  \t", "\r\n"};
+    for (int round = 0; round < 300; ++round) {
+        // mostly well-formed pairs, sometimes a broken token
+        std::string text;
+        size_t pairs = gen() % 40;
+        for (size_t i = 0; i < pairs; ++i) {
+            text += tokens[gen() % 3] + spaces[gen() % spaces.size()];
+            text += tokens[3 + gen() % 3] + spaces[gen() % spaces.size()];
+            if (gen() % 50 == 0) {
+                text += tokens[gen() % tokens.size()] + " ";
+            }
+        }
+        if (gen() % 4 == 0) {
+            text += tokens[gen() % 3];
+        }
+        std::istringstream in(text);
+        auto expected = DecodeCommands(in);
+        for (size_t min_chunk : {1, 2, 5, 16}) {
+            assert(SameCommands(DecodeText(text, 4, min_chunk), expected));
+            assert(SameCommands(DecodeText(text, 1, min_chunk), expected));
+        }
+    }
+    std::istringstream in("k 1 k 2 m 1");
+    assert(ReadAll(in) == "k 1 k 2 m 1");
+    std::cout << "TestParallelDecoding passed\n";
+}
+
+template <typename Node>
+int CheckAVLNode(const Node* node) {
+    if (node == nullptr) {
+        return 0;
+    }
+    int left_height = CheckAVLNode(node->GetLeft().get());
+    int right_height = CheckAVLNode(node->GetRight().get());
+    assert(node->GetBalance() == left_height - right_height);
+    assert(std::abs(left_height - right_height) <= 1);
+    for (const Node* child : {node->GetLeft().get(), node->GetRight().get()}) {
+        assert(child == nullptr || child->GetParent() == node);
+    }
+    return std::max(left_height, right_height) + 1;
+}
+
+// binary key without a default serializer, written as its two fields
+struct PairSerializer {
+    static constexpr uint32_t kFormat = 0x50000001;
+
+    void Write(SetSnapshotWriter& out, const ComplexKey& key) const {
+        out.WriteValue(key.x);
+        SetSerializer<std::string>().Write(out, key.y);
+    }
+    ComplexKey Read(SetSnapshotReader& in) const {
+        int x = in.ReadValue<int>();
+        return {x, SetSerializer<std::string>().Read(in)};
+    }
+};
+
+void TestSnapshots() {
+    auto input = GenerateRandomVector(5000, -100000, 100000, 31);
+    std::vector<int> sorted_unique = input;
+    std::sort(sorted_unique.begin(), sorted_unique.end());
+    sorted_unique.erase(std::unique(sorted_unique.begin(), sorted_unique.end()),
+                        sorted_unique.end());
+
+    for (size_t size : {0, 1, 2, 3, 7, 8, 100, 1000}) {
+        std::vector<int> keys(sorted_unique.begin(), sorted_unique.begin() + size);
+        SetAVL<int> avl_set;
+        avl_set.AssignSorted(keys.begin(), keys.end());
+        CheckAgainstSorted(avl_set, keys);
+        assert(std::equal(avl_set.RBegin(), avl_set.REnd(), keys.rbegin()));
+        CheckAVLNode(avl_set.GetRootPtr());
+        avl_set.Insert(1000000);
+        avl_set.Insert(-1000000);
+        CheckAVLNode(avl_set.GetRootPtr());
+
+        SetAVL<int, std::less<int>, SetSumAugment<int>, SetRedBlackBalance> rb_set;
+        rb_set.AssignSorted(keys.begin(), keys.end());
+        CheckAgainstSorted(rb_set, keys);
+        CheckRedBlackNode(rb_set.GetRootPtr());
+        assert(rb_set.Empty() || rb_set.GetRoot()->GetBalance() == SetRedBlackBalance::kBlack);
+        assert(rb_set.Aggregate() == std::accumulate(keys.begin(), keys.end(), 0));
+
+        SetAVL<int, std::less<int>, SetNoAugment<int>, SetTreapBalance> treap_set;
+        treap_set.AssignSorted(keys.begin(), keys.end());
+        CheckTreapNode(treap_set.GetRootPtr());
+        treap_set.Insert(1000000);
+        CheckTreapNode(treap_set.GetRootPtr());
+    }
+
+    SetAVL<int> set;
+    set.Insert(input.begin(), input.end());
+    std::stringstream stream;
+    set.Save(stream);
+    std::string image = stream.str();
+    SetAVL<int> loaded;
+    loaded.Insert(42);
+    loaded.Load(stream);
+    assert(loaded.Size() == set.Size());
+    assert(std::equal(loaded.Begin(), loaded.End(), set.Begin()));
+    CheckAgainstSorted(loaded, sorted_unique);
+    CheckAVLNode(loaded.GetRootPtr());
+
+    // a damaged, truncated or foreign snapshot throws and keeps the content
+    for (size_t position : {size_t{3}, size_t{40}, image.size() / 2, image.size() - 1}) {
+        std::string damaged = image;
+        damaged[position] ^= 1;
+        std::istringstream in(damaged);
+        bool thrown = false;
+        try {
+            loaded.Load(in);
+        } catch (const SetSnapshotError&) {
+            thrown = true;
+        }
+        assert(thrown);
+        assert(loaded.Size() == sorted_unique.size());
+    }
+    std::istringstream truncated(image.substr(0, image.size() - 9));
+    bool thrown = false;
+    try {
+        loaded.Load(truncated);
+    } catch (const SetSnapshotError&) {
+        thrown = true;
+    }
+    assert(thrown);
+    std::istringstream foreign(image);
+    SetAVL<long long> wide;
+    thrown = false;
+    try {
+        wide.Load(foreign);
+    } catch (const SetSnapshotError&) {
+        thrown = true;
+    }
+    assert(thrown && wide.Empty());
+
+    std::stringstream empty_stream;
+    SetAVL<int>().Save(empty_stream);
+    loaded.Load(empty_stream);
+    assert(loaded.Empty() && loaded.Begin() == loaded.End());
+    loaded.Insert(5);
+    assert(*loaded.Begin() == 5 && loaded.Size() == 1);
+
+    SetAVL<std::string> strings;
+    SetAVL<ComplexKey> complex_keys;
+    for (int val : input) {
+        strings.Insert(std::string(val % 50 + 50, 'a') + std::to_string(val));
+        complex_keys.Insert({val % 100, std::to_string(val)});
+    }
+    std::stringstream string_stream;
+    strings.Save(string_stream);
+    SetAVL<std::string> strings_loaded;
+    strings_loaded.Load(string_stream);
+    assert(strings_loaded.Size() == strings.Size());
+    assert(std::equal(strings.Begin(), strings.End(), strings_loaded.Begin()));
+    assert(strings_loaded.Find(*strings.SelectInd0(17)) != strings_loaded.End());
+
+    std::stringstream complex_stream;
+    complex_keys.Save(complex_stream, PairSerializer());
+    SetAVL<ComplexKey> complex_loaded;
+    complex_loaded.Load(complex_stream, PairSerializer());
+    assert(complex_loaded.Size() == complex_keys.Size());
+    for (size_t i = 0; i < complex_keys.Size(); i += 97) {
+        assert(complex_loaded.RankInd0(*complex_keys.SelectInd0(i)) == i);
+    }
+
+#ifdef __linux__
+    // a small snapshot stays in the buffer of the stream until Save flushes it
+    std::ofstream full("/dev/full", std::ios::binary);
+    SetAVL<int> few;
+    few.Insert({1, 2, 3});
+    thrown = false;
+    try {
+        few.Save(full);
+    } catch (const SetSnapshotError&) {
+        thrown = true;
+    }
+    assert(thrown);
+#endif
+    std::cout << "TestSnapshots passed\n";
+}
+
+void TestImages() {
+    auto input = GenerateRandomVector(3000, -100000, 100000, 41);
+    SetAVL<int> set;
+    set.Insert(input.begin(), input.end());
+    std::ostringstream out;
+    SetAVLImage<int>::Write(out, set);
+    std::string bytes = out.str();
+    assert(bytes.size() == sizeof(SetImageHeader) + set.Size() * sizeof(SetImageNode<int>));
+
+    // any aligned copy of the bytes works, the image holds no pointers
+    std::vector<uint64_t> memory(bytes.size() / sizeof(uint64_t) + 1);
+    std::memcpy(memory.data(), bytes.data(), bytes.size());
+    auto image = SetAVLImage<int>::View(memory.data(), bytes.size());
+    assert(image.Size() == set.Size());
+    assert(std::equal(image.Begin(), image.End(), set.Begin()));
+    for (int key = -100010; key <= 100010; key += 37) {
+        assert(image.Contains(key) == set.Contains(key));
+        assert(image.RankInd0(key) == set.RankInd0(key));
+        auto bound = image.LowerBound(key);
+        assert((bound == image.End()) == (set.LowerBound(key) == set.End()));
+        assert(bound == image.End() || *bound == *set.LowerBound(key));
+    }
+    for (size_t i = 0; i <= set.Size(); ++i) {
+        assert((image.SelectInd0(i) == image.End()) == (i == set.Size()));
+        assert(i == set.Size() || *image.SelectInd0(i) == *set.SelectInd0(i));
+        assert(i == set.Size() || image.IndexOf(image.SelectInd0(i)) == i);
+    }
+    assert(image.SelectInd1(0) == image.End());
+
+    const char* path = "class_tests_image.bin";
+    {
+        std::ofstream file(path, std::ios::binary);
+        SetAVLImage<int>::Write(file, set);
+    }
+    {
+        auto mapped = SetAVLImage<int>::Map(path);
+        auto moved = std::move(mapped);
+        assert(moved.Size() == set.Size() && mapped.Empty());
+        assert(*moved.SelectInd1(set.Size()) == *set.SelectInd1(set.Size()));
+        assert(moved.Find(input[5]) != moved.End());
+    }
+    std::remove(path);
+
+    std::ostringstream empty_out;
+    SetAVLImage<int>::Write(empty_out, SetAVL<int>());
+    std::string empty_bytes = empty_out.str();
+    std::vector<uint64_t> empty_memory(empty_bytes.size() / sizeof(uint64_t));
+    std::memcpy(empty_memory.data(), empty_bytes.data(), empty_bytes.size());
+    auto empty_image = SetAVLImage<int>::View(empty_memory.data(), empty_bytes.size());
+    assert(empty_image.Empty() && empty_image.Begin() == empty_image.End());
+    assert(empty_image.RankInd0(5) == 0 && !empty_image.Contains(5));
+
+    bool thrown = false;
+    try {
+        SetAVLImage<long long>::View(memory.data(), bytes.size());
+    } catch (const SetSnapshotError&) {
+        thrown = true;
+    }
+    assert(thrown);
+    thrown = false;
+    try {
+        SetAVLImage<int>::View(memory.data(), bytes.size() - 1);
+    } catch (const SetSnapshotError&) {
+        thrown = true;
+    }
+    assert(thrown);
+    std::cout << "TestImages passed\n";
+}
+
+void TestExternalBuild() {
+    // two dumps with duplicates inside and across files, runs much smaller than the input
+    auto first = GenerateRandomVector(5000, -3000, 3000, 43);
+    auto second = GenerateRandomVector(4000, -3000, 3000, 47);
+    const char* paths[] = {"class_tests_keys0.txt", "class_tests_keys1.txt"};
+    const char* image_path = "class_tests_external.bin";
+    {
+        std::ofstream out(paths[0]);
+        for (int key : first) {
+            out << key << ((key % 7 == 0) ? "\n" : "  ");
+        }
+        out << "9223372036854775807 -9223372036854775808";
+        std::ofstream other(paths[1]);
+        for (int key : second) {
+            other << key << "\t";
+        }
+    }
+    SetAVL<long long> set;
+    set.Insert(first.begin(), first.end());
+    set.Insert(second.begin(), second.end());
+    set.Insert(std::numeric_limits<long long>::max());
+    set.Insert(std::numeric_limits<long long>::min());
+
+    SetExternalBuildOptions options;
+    options.run_keys = 700;
+    auto stats = BuildImageFromKeyFiles({paths[0], paths[1]}, image_path, options);
+    assert(stats.keys_read == first.size() + second.size() + 2);
+    assert(stats.runs == (stats.keys_read + 699) / 700);
+    assert(stats.unique_keys == set.Size());
+    {
+        auto image = SetAVLImage<long long>::Map(image_path);
+        assert(image.Size() == set.Size());
+        assert(std::equal(image.Begin(), image.End(), set.Begin()));
+        for (long long key = -3010; key <= 3010; key += 3) {
+            assert(image.RankInd0(key) == set.RankInd0(key));
+        }
+        for (size_t i = 1; i <= set.Size(); i += 11) {
+            assert(*image.SelectInd1(i) == *set.SelectInd1(i));
+        }
+    }
+    // temporary runs are gone, a rebuild over one file in one run gives a smaller image
+    assert(!std::ifstream(std::string(image_path) + options.run_suffix + "0"));
+    assert(!std::ifstream(std::string(image_path) + options.merged_suffix));
+    assert(!std::ifstream(std::string(image_path) + options.partial_suffix));
+    assert(stats.merge_passes == 1);
+    // 13 runs merged 4 at a time: 13 -> 4 -> 1
+    options.merge_fan_in = 4;
+    stats = BuildImageFromKeyFiles({paths[0], paths[1]}, image_path, options);
+    assert(stats.runs == 13 && stats.merge_passes == 2 && stats.unique_keys == set.Size());
+    {
+        auto image = SetAVLImage<long long>::Map(image_path);
+        assert(std::equal(image.Begin(), image.End(), set.Begin()));
+    }
+    for (size_t i = 0; i < 20; ++i) {
+        assert(!std::ifstream(std::string(image_path) + options.run_suffix + std::to_string(i)));
+    }
+    stats = BuildImageFromKeyFiles({paths[1]}, image_path);
+    assert(stats.runs == 1 && stats.unique_keys <= second.size());
+    assert(SetAVLImage<long long>::Map(image_path).Size() == stats.unique_keys);
+
+    {
+        std::ofstream out(paths[1]);
+        out << "1 2 x3";
+    }
+    bool thrown = false;
+    try {
+        BuildImageFromKeyFiles({paths[0], paths[1]}, image_path, options);
+    } catch (const SetSnapshotError&) {
+        thrown = true;
+    }
+    assert(thrown);
+    assert(!std::ifstream(std::string(image_path) + options.run_suffix + "0"));
+    assert(!std::ifstream(std::string(image_path) + options.partial_suffix));
+    // the image of the last successful build is kept
+    assert(SetAVLImage<long long>::Map(image_path).Size() == stats.unique_keys);
+
+    // a run file shorter than the keys written to it is an error, not the end of the run
+    WriteRun(paths[1], {1, 2, 3});
+    SetRunReader short_run({paths[1], 5});
+    long long key = 0;
+    thrown = false;
+    try {
+        while (short_run.Next(key)) {
+        }
+    } catch (const SetSnapshotError&) {
+        thrown = true;
+    }
+    assert(thrown);
+#ifdef __linux__
+    // writes that fail on a file size limit throw and leave the previous image alone
+    {
+        std::ofstream out(paths[1]);
+        out << "5 3 1 3 9";
+    }
+    rlimit limit{};
+    getrlimit(RLIMIT_FSIZE, &limit);
+    rlimit lowered = limit;
+    auto old_handler = std::signal(SIGXFSZ, SIG_IGN);
+    for (rlim_t bytes : {rlim_t{0}, rlim_t{64}}) {
+        lowered.rlim_cur = bytes;
+        setrlimit(RLIMIT_FSIZE, &lowered);
+        thrown = false;
+        try {
+            BuildImageFromKeyFiles({paths[1]}, image_path);
+        } catch (const SetSnapshotError&) {
+            thrown = true;
+        }
+        setrlimit(RLIMIT_FSIZE, &limit);
+        assert(thrown);
+        assert(SetAVLImage<long long>::Map(image_path).Size() == stats.unique_keys);
+        assert(!std::ifstream(std::string(image_path) + options.partial_suffix));
+        assert(!std::ifstream(std::string(image_path) + options.merged_suffix));
+    }
+    std::signal(SIGXFSZ, old_handler);
+#endif
+    for (const char* path : {paths[0], paths[1], image_path}) {
+        std::remove(path);
+    }
+    std::cout << "TestExternalBuild passed\n";
+}
+
+void TestLSMSet() {
+    for (bool background : {false, true}) {
+        SetLSM<int>::Options options;
+        options.buffer_keys = 64;
+        options.ratio = 4;
+        options.background = background;
+        SetLSM<int> lsm(options);
+        SetAVL<int> set;
+        auto input = GenerateRandomVector(6000, -20000, 20000, 53);
+        for (size_t i = 0; i < input.size(); ++i) {
+            assert(lsm.Insert(input[i]) == set.Insert(input[i]).second);
+            assert(lsm.Size() == set.Size());
+            if (i % 97 == 0) {
+                int key = input[i / 2] + 1;
+                assert(lsm.Contains(key) == set.Contains(key));
+                assert(lsm.RankInd0(key) == set.RankInd0(key));
+                size_t index = i % set.Size();
+                assert(*lsm.SelectInd0(index) == *set.SelectInd0(index));
+            }
+        }
+        lsm.WaitForMerges();
+        assert(lsm.LevelCount() > 1 && lsm.LevelCount() < 10);
+        for (int key = -20010; key <= 20010; key += 13) {
+            assert(lsm.Contains(key) == set.Contains(key));
+            assert(lsm.RankInd0(key) == set.RankInd0(key));
+        }
+        for (size_t i = 0; i < set.Size(); ++i) {
+            assert(*lsm.SelectInd0(i) == *set.SelectInd0(i));
+        }
+        assert(!lsm.SelectInd0(set.Size()) && !lsm.SelectInd1(0));
+        assert(*lsm.SelectInd1(set.Size()) == *set.SelectInd1(set.Size()));
+        assert(!lsm.Insert(input[0]));
+    }
+
+    // many levels of every size and a part-full buffer for the multi-sequence select
+    SetLSM<int> deep({3, 2, 24, false});
+    SetAVL<int> deep_set;
+    for (int key : GenerateRandomVector(5000, -1000000, 1000000, 59)) {
+        deep.Insert(key);
+        deep_set.Insert(key);
+    }
+    assert(deep.LevelCount() >= 8 && deep.Size() == deep_set.Size());
+    for (size_t i = 0; i < deep_set.Size(); ++i) {
+        assert(*deep.SelectInd0(i) == *deep_set.SelectInd0(i));
+    }
+
+    SetLSM<std::string, std::greater<std::string>> words({4, 2, 3, false});
+    for (const char* word : {"pear", "fig", "apple", "kiwi", "plum", "lime", "date", "fig"}) {
+        words.Insert(word);
+    }
+    assert(words.Size() == 7 && words.LevelCount() <= 2);
+    assert(*words.SelectInd0(0) == "plum" && *words.SelectInd0(6) == "apple");
+    assert(words.RankInd0("kiwi") == 3 && words.Contains("date") && !words.Contains("cherry"));
+    std::cout << "TestLSMSet passed\n";
+}
+
+void TestConcurrentWriters() {
+    // threads insert overlapping slices, every key must be accepted exactly once
+    auto input = GenerateRandomVector(40000, -30000, 30000, 59);
+    SetConcurrent<int> concurrent;
+    constexpr size_t kThreads = 8;
+    std::vector<size_t> accepted(kThreads);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < kThreads; ++t) {
+        threads.emplace_back([&, t]() {
+            for (size_t i = t; i < input.size(); i += kThreads / 2) {
+                bool inserted = concurrent.Insert(input[i]);
+                accepted[t] += inserted;
+                if (i % 1000 == 0) {
+                    assert(concurrent.Contains(input[i]));
+                    // the own finished insert is counted, the ones in progress may be
+                    size_t rank = concurrent.RankInd0(input[i]);
+                    auto selected = concurrent.SelectInd0(rank);
+                    assert(!inserted || (selected && concurrent.Contains(*selected)));
+                    assert(concurrent.Size() >= rank + (inserted ? 1 : 0));
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    SetAVL<int> set;
+    set.Insert(input.begin(), input.end());
+    assert(std::accumulate(accepted.begin(), accepted.end(), size_t{0}) == set.Size());
+    assert(concurrent.Size() == set.Size());
+    for (int key = -30010; key <= 30010; key += 7) {
+        assert(concurrent.Contains(key) == set.Contains(key));
+        assert(concurrent.RankInd0(key) == set.RankInd0(key));
+    }
+    for (size_t i = 0; i < set.Size(); i += 5) {
+        assert(*concurrent.SelectInd0(i) == *set.SelectInd0(i));
+    }
+    assert(!concurrent.SelectInd0(set.Size()) && !concurrent.SelectInd1(0));
+
+    // sorted input is rebalanced by the partial rebuilds
+    SetConcurrent<int, std::greater<int>> sorted;
+    for (int key = 0; key < 50000; ++key) {
+        assert(sorted.Insert(key));
+    }
+    assert(!sorted.Insert(123));
+    assert(sorted.Height() <= 2 * 16 + 2);
+    assert(*sorted.SelectInd1(1) == 49999 && sorted.RankInd0(100) == 49899);
+    std::cout << "TestConcurrentWriters passed\n";
+}
+
+void TestShardedSet() {
+    auto input = GenerateRandomVector(30000, -40000, 40000, 61);
+    SetAVL<int> set;
+    set.Insert(input.begin(), input.end());
+
+    SetSharded<int>::Options options;
+    options.max_shard_keys = 2000;
+    SetSharded<int> sharded({10000, -10000, 0, 10000}, options);
+    assert(sharded.ShardCount() == 4);
+    constexpr size_t kThreads = 4;
+    std::vector<size_t> accepted(kThreads);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < kThreads; ++t) {
+        threads.emplace_back([&, t]() {
+            for (size_t i = t; i < input.size() / 2; i += kThreads / 2) {
+                accepted[t] += sharded.Insert(input[i]);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    std::vector<int> rest(input.begin() + input.size() / 2, input.end());
+    size_t batch = sharded.InsertBatch(rest);
+    assert(std::accumulate(accepted.begin(), accepted.end(), batch) == set.Size());
+    assert(sharded.Size() == set.Size());
+
+    // the shards were split as they grew
+    auto sizes = sharded.ShardSizes();
+    assert(sizes.size() == sharded.ShardCount() && sizes.size() > 4);
+    assert(*std::max_element(sizes.begin(), sizes.end()) <= options.max_shard_keys);
+    assert(std::accumulate(sizes.begin(), sizes.end(), size_t{0}) == set.Size());
+    for (int key = -40010; key <= 40010; key += 9) {
+        assert(sharded.Contains(key) == set.Contains(key));
+        assert(sharded.RankInd0(key) == set.RankInd0(key));
+    }
+    for (size_t i = 0; i < set.Size(); i += 7) {
+        assert(*sharded.SelectInd0(i) == *set.SelectInd0(i));
+    }
+    assert(!sharded.SelectInd0(set.Size()) && !sharded.SelectInd1(0));
+
+    // RunOnEachWorker gives every worker of the pool exactly one call, never the caller
+    ThreadPool pool(std::vector<int>{0, 0, 0});
+    assert(pool.WorkerCount() == 3 && pool.Size() == 4);
+    std::vector<std::thread::id> ids(pool.WorkerCount());
+    for (int round = 0; round < 3; ++round) {
+        pool.RunOnEachWorker([&ids](size_t worker) { ids[worker] = std::this_thread::get_id(); });
+        assert(std::count(ids.begin(), ids.end(), std::this_thread::get_id()) == 0);
+        assert(ids[0] != ids[1] && ids[1] != ids[2] && ids[0] != ids[2]);
+    }
+
+    // pinned workers, descending order
+    SetSharded<int, std::greater<int>>::Options pinned;
+    pinned.cpus = {0, 0};
+    SetSharded<int, std::greater<int>> descending({0}, pinned);
+    assert(descending.InsertBatch({5, -5, 3, 5, -1}) == 4);
+    assert(descending.InsertBatch({3, 7}) == 1);
+    assert(*descending.SelectInd1(1) == 7 && *descending.SelectInd1(5) == -5);
+    assert(descending.RankInd0(0) == 3 && descending.ShardSizes() == std::vector<size_t>({3, 2}));
+    // a batch far above max_shard_keys is split into equal parts rebuilt on the pool
+    pinned.max_shard_keys = 1000;
+    SetSharded<int, std::greater<int>> split({}, pinned);
+    std::vector<int> many(input.begin(), input.end());
+    assert(split.InsertBatch(many) == set.Size() && split.ShardCount() >= set.Size() / 1000);
+    sizes = split.ShardSizes();
+    assert(*std::max_element(sizes.begin(), sizes.end()) <= 1000);
+    assert(*std::min_element(sizes.begin(), sizes.end()) >= 500);
+    for (size_t i = 0; i < set.Size(); i += 13) {
+        assert(*split.SelectInd0(i) == *set.SelectInd1(set.Size() - i));
+    }
+    std::cout << "TestShardedSet passed\n";
+}
+
+template <typename Layout>
+void CheckNodeLayout(const std::vector<int>& input) {
+    using Set = SetAVL<int, std::less<int>, SetNoAugment<int>, SetAVLBalance, Layout>;
+    SetAVL<int> expected;
+    expected.Insert(input.begin(), input.end());
+    Set set;
+    set.Insert(input.begin(), input.end());
+    assert(set.Size() == expected.Size());
+    assert(std::equal(set.Begin(), set.End(), expected.Begin()));
+    assert(std::equal(set.RBegin(), set.REnd(), expected.RBegin()));
+    assert(std::equal(set.CBegin(), set.CEnd(), expected.CBegin()));
+
+    // steps across the ends
+    auto last = set.End();
+    --last;
+    assert(*last == *expected.RBegin());
+    ++last;
+    assert(last == set.End());
+    auto first = set.Begin();
+    --first;
+    assert(first == typename Set::Iterator(nullptr));
+    for (int key = -1100; key <= 1100; key += 17) {
+        assert(set.UpperBound(key) == set.End() ? expected.UpperBound(key) == expected.End()
+                                                : *set.UpperBound(key) == *expected.UpperBound(key));
+        auto it = set.Find(key);
+        if (it != set.End() && it != set.Begin()) {
+            auto before = it;
+            --before;
+            assert(*before == *expected.SelectInd0(expected.IndexOf(expected.Find(key)) - 1));
+            assert(set.IndexOf(before) + 1 == set.IndexOf(it));
+        }
+    }
+
+    Set copy(set);
+    assert(std::equal(copy.Begin(), copy.End(), expected.Begin()));
+    Set other;
+    other.Insert(5);
+    other.Swap(copy);
+    assert(*copy.Begin() == 5 && *copy.RBegin() == 5 && other.Size() == expected.Size());
+    assert(std::equal(other.RBegin(), other.REnd(), expected.RBegin()));
+    std::vector<int> sorted;
+    for (auto it = expected.Begin(); it != expected.End(); ++it) {
+        sorted.push_back(*it);
+    }
+    Set built;
+    built.AssignSorted(sorted.begin(), sorted.end());
+    assert(std::equal(built.Begin(), built.End(), expected.Begin()));
+    assert(*--built.End() == sorted.back());
+
+    // iterators follow their nodes to the new owner of a move or swap and reach its ends
+    auto middle = built.Find(sorted[sorted.size() / 2]);
+    auto reverse = built.RBegin();
+    Set moved(std::move(built));
+    size_t steps = 0;
+    for (auto it = middle; it != moved.End(); ++it) {
+        ++steps;
+    }
+    assert(steps == sorted.size() - sorted.size() / 2);
+    steps = 0;
+    for (auto it = reverse; it != moved.REnd(); ++it) {
+        ++steps;
+    }
+    assert(steps == sorted.size());
+    Set swapped;
+    swapped.Insert({-5000, 5000});
+    auto low = swapped.Begin();
+    moved.Swap(swapped);
+    ++low;
+    assert(*low == 5000 && ++low == moved.End());
+    steps = 0;
+    for (auto it = middle; it != swapped.End(); ++it) {
+        ++steps;
+    }
+    assert(steps == sorted.size() - sorted.size() / 2);
+    auto first_moved = swapped.Begin();
+    --first_moved;
+    assert(first_moved == typename Set::Iterator(nullptr));
+    moved = std::move(swapped);
+    steps = 0;
+    for (auto it = middle; it != moved.End(); ++it) {
+        ++steps;
+    }
+    assert(steps == sorted.size() - sorted.size() / 2 && swapped.Empty());
+    Set empty;
+    assert(empty.Begin() == empty.End() && empty.RBegin() == empty.REnd());
+}
+
+void TestNodeLayouts() {
+    auto input = GenerateRandomVector(3000, -1000, 1000, 67);
+    CheckNodeLayout<SetThreadedLayout>(input);
+    CheckNodeLayout<SetUnthreadedLayout>(input);
+    CheckNodeLayout<SetHotColdLayout>(input);
+    CheckNodeLayout<SetHotColdUnthreadedLayout>(input);
+
+    using Threaded = SetAVL<long long>::Node;
+    using Unthreaded = SetAVL<long long, std::less<long long>, SetNoAugment<long long>,
+                              SetAVLBalance, SetUnthreadedLayout>::Node;
+    using HotCold = SetAVL<long long, std::less<long long>, SetNoAugment<long long>,
+                           SetAVLBalance, SetHotColdUnthreadedLayout>::Node;
+    static_assert(sizeof(Unthreaded) + 2 * sizeof(void*) == sizeof(Threaded));
+    static_assert(alignof(HotCold) == 64 && sizeof(HotCold) == 64);
+    std::cout << "TestNodeLayouts passed\n";
+}
+
+template <typename Node>
+void CheckParentLinks(const Node* node) {
+    if (node == nullptr) {
+        return;
+    }
+    assert(node->GetLeft() == nullptr || node->GetLeft()->GetParent() == node);
+    assert(node->GetRight() == nullptr || node->GetRight()->GetParent() == node);
+    CheckParentLinks(node->GetLeft().get());
+    CheckParentLinks(node->GetRight().get());
+}
+
+void TestCompact() {
+    auto input = GenerateRandomVector(3000, -5000, 5000, 91);
+    std::vector<int> sorted_unique = input;
+    std::sort(sorted_unique.begin(), sorted_unique.end());
+    sorted_unique.erase(std::unique(sorted_unique.begin(), sorted_unique.end()),
+                        sorted_unique.end());
+
+    SetAVL<int> set;
+    set.Insert(input.begin(), input.end());
+    size_t height = CalcNodeHeight(set.GetRootPtr());
+    assert(set.ScatteredCount() == set.Size() && set.CompactionCount() == 0);
+    set.Compact(SetCompactOrder::kBreadthFirst);
+    assert(set.CompactionCount() == 1 && set.ScatteredCount() == 0);
+    CheckAgainstSorted(set, sorted_unique);
+    CheckParentLinks(set.GetRootPtr());
+    assert(CalcNodeHeight(set.GetRootPtr()) == height);
+    // the root and its children are the first nodes of the block
+    auto root = set.GetRootPtr();
+    assert(root->GetLeft().get() == root + 1 && root->GetRight().get() == root + 2);
+    assert(std::equal(set.RBegin(), set.REnd(), sorted_unique.rbegin()));
+
+    // nodes in the block and new ones mix under rotations
+    for (int key = 5001; key < 6000; ++key) {
+        set.Insert(key);
+        sorted_unique.push_back(key);
+    }
+    assert(set.ScatteredCount() == 999);
+    set.Compact();
+    CheckAgainstSorted(set, sorted_unique);
+    CheckParentLinks(set.GetRootPtr());
+    set.Insert(-6000);
+    sorted_unique.insert(sorted_unique.begin(), -6000);
+    CheckAgainstSorted(set, sorted_unique);
+    SetAVL<int> copy(set);
+    set.Clear();
+    assert(set.Empty() && set.Begin() == set.End());
+    CheckAgainstSorted(copy, sorted_unique);
+    copy.Compact(SetCompactOrder::kBreadthFirst);
+    SetAVL<int> moved(std::move(copy));
+    CheckAgainstSorted(moved, sorted_unique);
+    moved = SetAVL<int>();
+    assert(moved.Empty());
+
+    assert(!set.CompactIfScattered());
+    set.Insert({1, 2, 3});
+    assert(!set.CompactIfScattered(4) && set.CompactIfScattered(3));
+    set.Insert(4);
+    assert(!set.CompactIfScattered(3) && set.ScatteredCount() == 1);
+    set.Compact();
+    set.Compact();
+    assert(set.CompactionCount() == 5 && set.Size() == 4);
+
+    // keys with their own storage, no threading, an augmented treap
+    SetAVL<std::string, std::less<std::string>, SetNoAugment<std::string>, SetAVLBalance,
+           SetUnthreadedLayout>
+        strings;
+    for (int key : input) {
+        strings.Insert(std::string(40, 'k') + std::to_string(key));
+    }
+    std::vector<std::string> string_keys;
+    for (auto it = strings.Begin(); it != strings.End(); ++it) {
+        string_keys.push_back(*it);
+    }
+    strings.Compact();
+    assert(strings.Size() == string_keys.size());
+    assert(std::equal(strings.Begin(), strings.End(), string_keys.begin()));
+    assert(std::equal(strings.RBegin(), strings.REnd(), string_keys.rbegin()));
+    CheckParentLinks(strings.GetRootPtr());
+
+    SetAVL<int, std::less<int>, SetSumAugment<int>, SetTreapBalance> treap;
+    treap.Insert(input.begin(), input.end());
+    int sum = treap.Aggregate();
+    treap.Compact();
+    treap.Insert(-7000);
+    assert(treap.Aggregate() == sum - 7000);
+    CheckTreapNode(treap.GetRootPtr());
+    std::cout << "TestCompact passed\n";
+}
+
+void TestNodeArena() {
+    auto input = GenerateRandomVector(20000, -100000, 100000, 93);
+    std::vector<int> sorted_unique = input;
+    std::sort(sorted_unique.begin(), sorted_unique.end());
+    sorted_unique.erase(std::unique(sorted_unique.begin(), sorted_unique.end()),
+                        sorted_unique.end());
+
+    std::vector<SetArenaReport> reports;
+    SetArenaOptions options;
+    options.huge_pages = true;
+    options.report = [&reports](const SetArenaReport& report) { reports.push_back(report); };
+    SetAVL<int> set;
+    set.UseNodeArena(options);
+    set.Insert(input.begin(), input.end());
+    CheckAgainstSorted(set, sorted_unique);
+    CheckParentLinks(set.GetRootPtr());
+    // whatever the system grants, every chunk is reported
+    assert(!reports.empty() && reports.size() == set.NodeArena().ChunkCount());
+    assert(reports.back().backing == set.NodeArena().Backing());
+    assert(set.NodeArena().MappedBytes() == reports.size() * kSetArenaChunkBytes);
+    assert(std::string(SetArenaBackingName(set.NodeArena().Backing())) != "unknown");
+
+    SetAVL<int> copy(set);
+    assert(copy.NodeArena().Options().huge_pages && copy.NodeArena().ChunkCount() > 0);
+    CheckAgainstSorted(copy, sorted_unique);
+    size_t reported = reports.size();
+    set.Compact();
+    assert(reports.size() == reported + 1 && set.NodeArena().ChunkCount() == 1);
+    set.Insert(200000);
+    sorted_unique.push_back(200000);
+    CheckAgainstSorted(set, sorted_unique);
+    set.Clear();
+    assert(set.NodeArena().ChunkCount() == 0 && set.NodeArena().Options().huge_pages);
+    set.Insert(1);
+    assert(set.NodeArena().ChunkCount() == 1 && *set.Begin() == 1);
+
+    // binding may be refused on this machine, it is reported either way
+    SetArenaOptions numa;
+    numa.numa_node = 0;
+    std::vector<SetArenaReport> numa_reports;
+    numa.report = [&numa_reports](const SetArenaReport& report) {
+        numa_reports.push_back(report);
+    };
+    SetAVL<std::string> strings;
+    strings.UseNodeArena(numa);
+    strings.Insert({"b", "a", std::string(100, 'c')});
+    assert(numa_reports.size() == 1 && numa_reports[0].numa_node == 0);
+    assert(*strings.Begin() == "a" && strings.Size() == 3);
+
+    // the default storage allocates nodes on their own, only Compact makes a chunk
+    SetAVL<int> plain;
+    plain.Insert(input.begin(), input.end());
+    assert(plain.NodeArena().ChunkCount() == 0);
+    plain.Compact();
+    assert(plain.NodeArena().ChunkCount() == 1);
+    assert(plain.NodeArena().Backing() == SetArenaBacking::kHeap);
+    std::cout << "TestNodeArena passed\n";
+}
+
+// key whose copy throws once the budget of copies is spent
+struct CountedKey {
+    static inline int copies_left = -1;
+    static inline int alive = 0;
+
+    explicit CountedKey(int value) : value(value) {
+        ++alive;
+    }
+    CountedKey(const CountedKey& other) : value(other.value) {
+        if (copies_left == 0) {
+            throw std::runtime_error("copy budget spent");
+        }
+        if (copies_left > 0) {
+            --copies_left;
+        }
+        ++alive;
+    }
+    ~CountedKey() {
+        --alive;
+    }
+    bool operator<(const CountedKey& other) const {
+        return value < other.value;
+    }
+
+    int value;
+};
+
+template <typename Set>
+std::vector<const void*> NodeAddresses(const Set& set) {
+    std::vector<const void*> addresses;
+    for (auto it = set.Begin(); it != set.End(); ++it) {
+        addresses.push_back(std::addressof(*it));
+    }
+    std::sort(addresses.begin(), addresses.end());
+    return addresses;
+}
+
+// keys that fail to copy inside the workers of SetSharded reach the caller
+void TestShardedErrors() {
+    SetSharded<CountedKey>::Options options;
+    options.max_shard_keys = 100;
+    options.cpus = {0};
+    SetSharded<CountedKey> sharded({}, options);
+    std::vector<CountedKey> keys;
+    for (int key = 0; key < 150; ++key) {
+        keys.emplace_back(key);
+    }
+    auto check_counts = [&sharded]() {
+        auto sizes = sharded.ShardSizes();
+        assert(std::accumulate(sizes.begin(), sizes.end(), size_t{0}) == sharded.Size());
+        for (size_t i = 0; i < sharded.Size(); ++i) {
+            assert(sharded.SelectInd0(i)->value == static_cast<int>(i));
+        }
+    };
+    std::vector<CountedKey> batch(keys.begin(), keys.begin() + 90);
+    CountedKey::copies_left = 60;
+    bool thrown = false;
+    try {
+        sharded.InsertBatch(batch);
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    CountedKey::copies_left = -1;
+    assert(thrown && sharded.Size() == 60 && sharded.ShardCount() == 1);
+    check_counts();
+
+    // the split copies the keys out and builds the shards on the worker, a failure there
+    // keeps the old shard whole
+    sharded.InsertBatch({keys.begin() + 60, keys.begin() + 100});
+    CountedKey::copies_left = 1 + 101 + 10;
+    thrown = false;
+    try {
+        sharded.Insert(keys[100]);
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    CountedKey::copies_left = -1;
+    assert(thrown && sharded.Size() == 101 && sharded.ShardCount() == 1);
+    check_counts();
+    assert(sharded.Insert(keys[101]) && sharded.ShardCount() == 2);
+    check_counts();
+    std::cout << "TestShardedErrors passed\n";
+}
+
+void TestStructuralCopy() {
+    auto input = GenerateRandomVector(5000, -100000, 100000, 95);
+    SetAVL<int, std::greater<int>> source;
+    source.Insert(input.begin(), input.end());
+    std::vector<int> keys;
+    for (auto it = source.Begin(); it != source.End(); ++it) {
+        keys.push_back(*it);
+    }
+
+    SetAVL<int, std::greater<int>> copy(source);
+    assert(copy.Size() == keys.size() && std::equal(copy.Begin(), copy.End(), keys.begin()));
+    assert(std::equal(copy.RBegin(), copy.REnd(), keys.rbegin()));
+    CheckParentLinks(copy.GetRootPtr());
+    assert(CalcNodeHeight(copy.GetRootPtr()) == CalcNodeHeight(source.GetRootPtr()));
+    assert(copy.GetRoot()->GetKey() == source.GetRoot()->GetKey());
+    // an unpooled copy takes one heap chunk of exactly its nodes
+    assert(copy.ScatteredCount() == 0 && copy.NodeArena().ChunkCount() == 1);
+    assert(copy.NodeArena().MappedBytes() ==
+           keys.size() * sizeof(SetAVL<int, std::greater<int>>::Node));
+    assert(copy.NodeArena().Backing() == SetArenaBacking::kHeap);
+    assert(copy.GetRoot()->GetLeft().get() == copy.GetRootPtr() + 1);
+    assert(*copy.SelectInd0(10) == keys[10] && copy.RankInd0(keys[100]) == 100);
+    // a pooled one gets one block in depth-first order: the root, then its left child
+    SetAVL<int, std::greater<int>> pooled;
+    pooled.UseNodeArena({true, -1, {}});
+    pooled.Insert(input.begin(), input.end());
+    SetAVL<int, std::greater<int>> pooled_copy(pooled);
+    assert(pooled_copy.ScatteredCount() == 0 && pooled_copy.NodeArena().ChunkCount() == 1);
+    assert(pooled_copy.GetRoot()->GetLeft().get() == pooled_copy.GetRootPtr() + 1);
+    assert(std::equal(pooled_copy.Begin(), pooled_copy.End(), keys.begin()));
+    copy.Insert(1000000);
+    assert(*copy.Begin() == 1000000 && source.Size() == keys.size());
+
+    // a larger destination keeps its nodes, the surplus is freed
+    SetAVL<int, std::greater<int>> small;
+    small.Insert({7, 3, 5});
+    auto before = NodeAddresses(copy);
+    copy = small;
+    assert(copy.Size() == 3 && *copy.Begin() == 7 && *copy.RBegin() == 3);
+    auto after = NodeAddresses(copy);
+    assert(std::includes(before.begin(), before.end(), after.begin(), after.end()));
+    CheckParentLinks(copy.GetRootPtr());
+
+    // a smaller one reuses all of its nodes and allocates the rest
+    SetAVL<int, std::greater<int>> grown;
+    grown.Insert(input.begin(), input.begin() + 100);
+    before = NodeAddresses(grown);
+    grown = source;
+    assert(std::equal(grown.Begin(), grown.End(), keys.begin()) && grown.Size() == keys.size());
+    after = NodeAddresses(grown);
+    assert(std::includes(after.begin(), after.end(), before.begin(), before.end()));
+    assert(grown.NodeArena().ChunkCount() == 0);
+    CheckParentLinks(grown.GetRootPtr());
+
+    // alternating sizes keep the arena memory bounded: a compacted tree frees its block once
+    // no node lives there, a pooled one is copied afresh when it shrinks
+    SetAVL<int, std::greater<int>> alternating(source);
+    alternating.Compact();
+    assert(alternating.NodeArena().ChunkCount() == 1);
+    for (int round = 0; round < 20; ++round) {
+        alternating = small;
+        alternating = source;
+        assert(alternating.NodeArena().ChunkCount() <= 1);
+        pooled_copy = source;
+        pooled_copy = small;
+    }
+    assert(std::equal(alternating.Begin(), alternating.End(), keys.begin()));
+    SetAVL<int, std::greater<int>> empty;
+    alternating = empty;
+    assert(alternating.Empty() && alternating.NodeArena().ChunkCount() == 0);
+    alternating = small;
+    assert(alternating.NodeArena().ChunkCount() == 0);
+    assert(pooled_copy.Size() == 3 && pooled_copy.NodeArena().ChunkCount() == 1);
+    assert(std::equal(pooled_copy.Begin(), pooled_copy.End(), small.Begin()));
+    CheckParentLinks(pooled_copy.GetRootPtr());
+    grown = grown;
+    assert(grown.Size() == keys.size());
+    grown = SetAVL<int, std::greater<int>>();
+    assert(grown.Empty() && grown.Begin() == grown.End());
+
+    SetAVL<std::string, std::less<std::string>, SetNoAugment<std::string>, SetAVLBalance,
+           SetUnthreadedLayout>
+        strings;
+    for (int key : input) {
+        strings.Insert(std::string(30, 's') + std::to_string(key));
+    }
+    auto string_copy = strings;
+    string_copy.Insert("a");
+    string_copy = strings;
+    assert(std::equal(string_copy.Begin(), string_copy.End(), strings.Begin()));
+    assert(string_copy.Size() == strings.Size());
+
+    // a throwing key copy frees everything, the assigned tree is left empty
+    SetAVL<CountedKey> counted;
+    for (int key : input) {
+        counted.Insert(CountedKey(key));
+    }
+    SetAVL<CountedKey> target;
+    target.Insert(CountedKey(1));
+    CountedKey::copies_left = 100;
+    bool thrown = false;
+    try {
+        SetAVL<CountedKey> failed(counted);
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    assert(thrown);
+    CountedKey::copies_left = 100;
+    thrown = false;
+    try {
+        target = counted;
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    assert(thrown && target.Empty() && target.Begin() == target.End());
+    CountedKey::copies_left = -1;
+    target = counted;
+    assert(target.Size() == counted.Size());
+    std::cout << "TestStructuralCopy passed\n";
+}
+
+void TestSmallSet() {
+    SetSmallAVL<int, std::greater<int>, 8> set;
+    std::vector<int> keys;
+    for (int key : GenerateRandomVector(8, -100, 100, 96)) {
+        if (set.Insert(key).second) {
+            keys.push_back(key);
+        }
+    }
+    std::sort(keys.begin(), keys.end(), std::greater<int>());
+    while (keys.size() < 8) {
+        int key = keys.back() - 1;
+        auto [it, inserted] = set.Insert(key);
+        assert(inserted && *it == key);
+        keys.push_back(key);
+    }
+    assert(set.IsInline() && set.Size() == 8);
+    assert(std::equal(set.Begin(), set.End(), keys.begin()));
+    assert(std::equal(set.RBegin(), set.REnd(), keys.rbegin()));
+    auto [found, inserted] = set.Insert(keys[3]);
+    assert(!inserted && found == set.Find(keys[3]));
+    for (size_t i = 0; i < keys.size(); ++i) {
+        assert(*set.SelectInd0(i) == keys[i] && *set.SelectInd1(i + 1) == keys[i]);
+        assert(set.RankInd0(keys[i]) == i && set.RankInd1(keys[i]) == i + 1);
+        assert(set.LowerBound(keys[i]) == set.SelectInd0(i));
+        assert(set.UpperBound(keys[i]) == set.SelectInd0(i + 1));
+    }
+    assert(set.SelectInd0(8) == set.End() && set.SelectInd1(0) == set.End());
+    assert(set.Find(1000) == set.End() && set.RankInd0(1000) == 0 && set.Count(-1000) == 0);
+    auto last = set.End();
+    assert(*--last == keys.back());
+
+    // the ninth key moves everything into a tree, the API stays the same
+    auto inline_copy = set;
+    std::vector<int> more = GenerateRandomVector(2000, -100000, 100000, 97);
+    set.Insert(more.begin(), more.end());
+    keys.insert(keys.end(), more.begin(), more.end());
+    std::sort(keys.begin(), keys.end(), std::greater<int>());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    assert(!set.IsInline() && set.Size() == keys.size());
+    assert(std::equal(set.Begin(), set.End(), keys.begin()));
+    assert(std::equal(set.RBegin(), set.REnd(), keys.rbegin()));
+    for (size_t i = 0; i < keys.size(); i += 37) {
+        assert(*set.SelectInd0(i) == keys[i] && set.RankInd0(keys[i]) == i);
+        assert(*set.Find(keys[i]) == keys[i] && set.Contains(keys[i]));
+    }
+    assert(set.SelectInd0(keys.size()) == set.End());
+
+    // copies and moves keep the mode of the source
+    auto tree_copy = set;
+    assert(!tree_copy.IsInline() && std::equal(tree_copy.Begin(), tree_copy.End(), keys.begin()));
+    assert(inline_copy.IsInline() && inline_copy.Size() == 8);
+    tree_copy.Swap(inline_copy);
+    assert(tree_copy.IsInline() && tree_copy.Size() == 8 && inline_copy.Size() == keys.size());
+    auto moved = std::move(tree_copy);
+    assert(moved.IsInline() && moved.Size() == 8 && tree_copy.Empty());
+    moved = std::move(inline_copy);
+    assert(!moved.IsInline() && moved.Size() == keys.size());
+    set.Clear();
+    assert(set.IsInline() && set.Empty() && set.Begin() == set.End());
+
+    SetSmallAVL<std::string> strings;
+    std::vector<std::string> words;
+    for (int i = 0; i < 100; ++i) {
+        words.push_back(std::string(20, 'w') + std::to_string(i * 7919 % 100));
+        strings.Insert(words.back());
+        assert(strings.IsInline() == (words.size() <= SetSmallAVL<std::string>::kInlineKeys));
+        assert(!strings.Insert(*strings.Begin()).second);
+    }
+    std::sort(words.begin(), words.end());
+    assert(std::equal(strings.Begin(), strings.End(), words.begin()));
+    assert(strings.Begin()->size() == words[0].size());
+    auto first = strings.Insert("a").first;
+    assert(first == strings.Begin() && *first == "a");
+    std::cout << "TestSmallSet passed\n";
+}
+
+void TestBucketSet() {
+    auto input = GenerateRandomVector(20000, -1000000, 1000000, 98);
+    SetBucketAVL<int, std::greater<int>, 16> set;
+    std::set<int, std::greater<int>> expected;
+    for (int key : input) {
+        auto [it, inserted] = set.Insert(key);
+        assert(inserted == expected.insert(key).second && *it == key);
+    }
+    std::vector<int> keys(expected.begin(), expected.end());
+    assert(set.Size() == keys.size() && !set.Empty());
+    assert(std::equal(set.Begin(), set.End(), keys.begin()));
+    assert(std::equal(set.RBegin(), set.REnd(), keys.rbegin()));
+    // every block but the ones at the ends is at least half full
+    assert(set.BlockCount() * 8 <= keys.size() + 16);
+    assert(set.Height() <= 1.45 * std::log2(set.BlockCount() + 2));
+    for (size_t i = 0; i < keys.size(); ++i) {
+        assert(*set.SelectInd0(i) == keys[i] && set.RankInd0(keys[i]) == i);
+    }
+    assert(set.SelectInd0(keys.size()) == set.End() && set.SelectInd1(0) == set.End());
+    for (int key = -1000010; key <= 1000010; key += 997) {
+        assert(set.Contains(key) == (expected.count(key) == 1));
+        auto lower = expected.lower_bound(key);
+        auto upper = expected.upper_bound(key);
+        assert(lower == expected.end() ? set.LowerBound(key) == set.End()
+                                       : *set.LowerBound(key) == *lower);
+        assert(upper == expected.end() ? set.UpperBound(key) == set.End()
+                                       : *set.UpperBound(key) == *upper);
+        assert(set.RankInd0(key) == static_cast<size_t>(std::distance(expected.begin(), lower)));
+    }
+    auto it = set.End();
+    for (size_t i = keys.size(); i-- > 0;) {
+        assert(*--it == keys[i]);
+    }
+    assert(it == set.Begin());
+
+    // inserts in key order fill whole blocks
+    SetBucketAVL<long long> ascending;
+    SetBucketAVL<long long> descending;
+    for (long long key = 0; key < 6400; ++key) {
+        ascending.Insert(key);
+        descending.Insert(-key);
+    }
+    assert(ascending.BlockCount() == 100 && descending.BlockCount() == 100);
+    assert(*ascending.SelectInd0(4321) == 4321 && descending.RankInd0(-4321) == 6400 - 4322);
+    assert(ascending.BlockBytes() < 6400 * sizeof(SetAVL<long long>::Node) / 4);
+
+    auto copy = set;
+    assert(copy.Size() == set.Size() && std::equal(copy.Begin(), copy.End(), set.Begin()));
+    copy.Insert(5000000);
+    assert(*copy.Begin() == 5000000 && copy.Size() == set.Size() + 1);
+    auto moved = std::move(copy);
+    assert(copy.Empty() && copy.Begin() == copy.End() && moved.Size() == set.Size() + 1);
+    moved = set;
+    assert(moved.Size() == set.Size() && moved.BlockCount() == set.BlockCount());
+    moved.Clear();
+    assert(moved.Empty() && moved.BlockCount() == 0);
+
+    SetBucketAVL<std::string, std::less<std::string>, 4> strings;
+    std::vector<std::string> words;
+    for (int i = 0; i < 500; ++i) {
+        words.push_back(std::string(24, 'b') + std::to_string(i * 7919 % 500));
+        strings.Insert(words.back());
+        assert(!strings.Insert(words.back()).second);
+    }
+    std::sort(words.begin(), words.end());
+    assert(std::equal(strings.Begin(), strings.End(), words.begin()));
+    assert(*strings.SelectInd0(250) == words[250] && strings.Find("a") == strings.End());
+    std::cout << "TestBucketSet passed\n";
+}
+
+void TestPackedSet() {
+    // the decoders agree at every width
+    std::mt19937_64 gen(99);
+    std::vector<uint64_t> words(64);
+    for (auto& word : words) {
+        word = gen();
+    }
+    for (unsigned width = 0; width <= 56; ++width) {
+        std::vector<uint64_t> scalar(40);
+        SetPackedUnpackScalar(words.data(), width, scalar.size(), scalar.data());
+        for (size_t i = 0; i < scalar.size(); ++i) {
+            uint64_t bits = 0;
+            for (unsigned b = 0; b < width; ++b) {
+                size_t bit = i * width + b;
+                bits |= ((words[bit / 64] >> (bit % 64)) & 1) << b;
+            }
+            assert(scalar[i] == bits);
+        }
+#ifdef SET_PACKED_AVX2
+        if (SetPackedHasAvx2()) {
+            std::vector<uint64_t> simd(scalar.size());
+            SetPackedUnpackAvx2(words.data(), width, simd.size(), simd.data());
+            assert(simd == scalar);
+        }
+#endif
+    }
+
+    auto input = GenerateRandomVector(20000, -1000000000, 1000000000, 100);
+    SetPacked<long long, 32> set;
+    std::set<long long> expected;
+    for (int key : input) {
+        assert(set.Insert(key) == expected.insert(key).second);
+    }
+    constexpr long long kMin = std::numeric_limits<long long>::min();
+    constexpr long long kMax = std::numeric_limits<long long>::max();
+    for (long long key : {kMin, kMax, -1LL, 0LL, 1LL}) {
+        assert(set.Insert(key) == expected.insert(key).second);
+    }
+    std::vector<long long> keys(expected.begin(), expected.end());
+    std::vector<long long> visited;
+    set.ForEach([&visited](long long key) { visited.push_back(key); });
+    assert(visited == keys && set.Size() == keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        assert(*set.SelectInd0(i) == keys[i] && set.RankInd0(keys[i]) == i);
+        assert(set.Contains(keys[i]) && *set.LowerBound(keys[i]) == keys[i]);
+    }
+    assert(!set.SelectInd0(keys.size()) && !set.SelectInd1(0));
+    for (long long key = -1000000007; key <= 1000000007; key += 1000003) {
+        auto lower = expected.lower_bound(key);
+        assert(set.Contains(key) == (expected.count(key) == 1));
+        assert(set.RankInd0(key) == static_cast<size_t>(std::distance(expected.begin(), lower)));
+        assert(set.LowerBound(key) == std::optional<long long>(*lower));
+    }
+    assert(*set.LowerBound(kMax - 1) == kMax && *set.SelectInd0(0) == kMin);
+
+    // timestamps a few ms apart with rare long pauses, the pauses become exceptions
+    SetPacked<long long> stamps;
+    long long stamp = 1700000000000LL;
+    std::vector<long long> stamp_keys;
+    for (int i = 0; i < 100000; ++i) {
+        stamp += (i % 1000 == 999) ? 86400000 : 1 + static_cast<long long>(gen() % 16);
+        stamp_keys.push_back(stamp);
+    }
+    std::shuffle(stamp_keys.begin(), stamp_keys.end(), gen);
+    for (long long key : stamp_keys) {
+        stamps.Insert(key);
+    }
+    std::sort(stamp_keys.begin(), stamp_keys.end());
+    visited.clear();
+    stamps.ForEach([&visited](long long key) { visited.push_back(key); });
+    assert(visited == stamp_keys);
+    assert(*stamps.SelectInd0(54321) == stamp_keys[54321]);
+    assert(stamps.RankInd0(stamp_keys[99999]) == 99999);
+    assert(stamps.MemoryBytes() * 4 < stamps.Size() * sizeof(SetAVL<long long>::Node));
+
+    auto copy = stamps;
+    copy.Insert(1);
+    assert(copy.Size() == stamps.Size() + 1 && *copy.SelectInd0(1) == stamp_keys[0]);
+    assert(copy.MemoryBytes() > stamps.MemoryBytes());
+    copy.Clear();
+    assert(copy.Empty() && copy.MemoryBytes() == 0 && stamps.Size() == stamp_keys.size());
+
+    SetPacked<unsigned char, 8> bytes;
+    for (int i = 0; i < 1000; ++i) {
+        bytes.Insert(static_cast<unsigned char>(i * 37));
+    }
+    assert(bytes.Size() == 256 && *bytes.SelectInd0(255) == 255 && bytes.RankInd0(128) == 128);
+
+    // blocks over 4 KiB decode into heap buffers
+    SetPacked<long long, 1024> wide;
+    for (size_t i = 0; i < 5000; ++i) {
+        wide.Insert(stamp_keys[(i * 7919) % stamp_keys.size()]);
+    }
+    visited.clear();
+    wide.ForEach([&visited](long long key) { visited.push_back(key); });
+    assert(visited.size() == 5000 && std::is_sorted(visited.begin(), visited.end()));
+    assert(*wide.SelectInd0(4999) == visited.back() && wide.BlockCount() < 16);
+    std::cout << "TestPackedSet passed\n";
+}
+
+constexpr auto kFrozenPrimes = MakeSetFrozen([] {
+    std::vector<int> primes;
+    for (int n = 2; n < 1000; ++n) {
+        bool prime = true;
+        for (int p : primes) {
+            prime = prime && n % p != 0;
+        }
+        if (prime) {
+            primes.push_back(n);
+        }
+    }
+    // duplicates are dropped
+    primes.push_back(2);
+    return primes;
+});
+static_assert(kFrozenPrimes.Size() == 168);
+static_assert(*kFrozenPrimes.SelectInd0(0) == 2 && *kFrozenPrimes.SelectInd1(168) == 997);
+static_assert(kFrozenPrimes.Contains(997) && !kFrozenPrimes.Contains(999));
+static_assert(kFrozenPrimes.RankInd0(100) == 25 && *kFrozenPrimes.LowerBound(90) == 97);
+
+void TestFrozenSet() {
+    std::vector<int> primes(kFrozenPrimes.Begin(), kFrozenPrimes.End());
+    assert(std::is_sorted(primes.begin(), primes.end()) && primes.size() == 168);
+    for (int key = -5; key <= 1005; ++key) {
+        auto lower = std::lower_bound(primes.begin(), primes.end(), key);
+        auto upper = std::upper_bound(primes.begin(), primes.end(), key);
+        assert(kFrozenPrimes.RankInd0(key) == static_cast<size_t>(lower - primes.begin()));
+        assert(kFrozenPrimes.UpperBound(key) - kFrozenPrimes.Begin() == upper - primes.begin());
+        assert(kFrozenPrimes.Contains(key) == std::binary_search(primes.begin(), primes.end(), key));
+    }
+    assert(std::equal(kFrozenPrimes.RBegin(), kFrozenPrimes.REnd(), primes.rbegin()));
+    assert(kFrozenPrimes.SelectInd0(168) == kFrozenPrimes.End());
+
+    // a comparator and keys other than integers
+    static constexpr auto kWords = MakeSetFrozen([] {
+        return std::array<std::string_view, 5>{"pear", "apple", "fig", "apple", "kiwi"};
+    });
+    static_assert(kWords.Size() == 4 && *kWords.Begin() == "apple");
+    constexpr auto kDescending =
+        MakeSetFrozen<std::greater<int>>([] { return std::vector<int>{1, 5, 3}; });
+    static_assert(*kDescending.SelectInd0(0) == 5 && kDescending.RankInd0(3) == 1);
+    assert(kWords.Find("fig") == kWords.SelectInd0(1) && kWords.Find("plum") == kWords.End());
+
+    // built at run time, the keys must be distinct
+    SetFrozen<int, 4> runtime({40, 10, 30, 20});
+    assert(*runtime.SelectInd0(2) == 30 && runtime.RankInd1(25) == 3);
+    bool thrown = false;
+    try {
+        SetFrozen<int, 3> duplicates({1, 2, 1});
+    } catch (const std::invalid_argument&) {
+        thrown = true;
+    }
+    assert(thrown);
+    constexpr SetFrozen<int, 0> empty({});
+    static_assert(empty.Empty() && empty.RankInd0(5) == 0 && empty.Find(5) == empty.End());
+    std::cout << "TestFrozenSet passed\n";
+}
+
+void TestStaticSet() {
+    using Set = StaticSetAVL<int, 3000, std::greater<int>>;
+    static_assert(std::is_same_v<Set::Index, uint16_t> && Set::Capacity() == 3000);
+    static Set set;
+    std::set<int, std::greater<int>> expected;
+    auto input = GenerateRandomVector(5000, -100000, 100000, 101);
+    size_t rejected = 0;
+    for (int key : input) {
+        bool present = expected.count(key) == 1;
+        bool full = set.Full();
+        auto [it, inserted] = set.Insert(key);
+        if (!present && full) {
+            // a full set refuses new keys without throwing
+            assert(!inserted && it == set.End());
+            ++rejected;
+        } else {
+            assert(inserted == !present && *it == key);
+            expected.insert(key);
+        }
+    }
+    assert(rejected > 0 && set.Full() && set.Size() == 3000 && expected.size() == 3000);
+    std::vector<int> keys(expected.begin(), expected.end());
+    assert(std::equal(set.Begin(), set.End(), keys.begin()));
+    assert(std::equal(set.RBegin(), set.REnd(), keys.rbegin()));
+    assert(set.Height() <= 1.45 * std::log2(set.Size() + 2));
+    for (size_t i = 0; i < keys.size(); ++i) {
+        assert(*set.SelectInd0(i) == keys[i] && set.RankInd0(keys[i]) == i);
+        assert(*set.Find(keys[i]) == keys[i] && set.UpperBound(keys[i]) == set.SelectInd0(i + 1));
+    }
+    assert(set.SelectInd0(keys.size()) == set.End() && set.SelectInd1(0) == set.End());
+    for (int key = -100010; key <= 100010; key += 97) {
+        auto lower = expected.lower_bound(key);
+        assert(set.Contains(key) == (expected.count(key) == 1));
+        assert(set.RankInd0(key) == static_cast<size_t>(std::distance(expected.begin(), lower)));
+        assert(lower == expected.end() ? set.LowerBound(key) == set.End()
+                                       : *set.LowerBound(key) == *lower);
+    }
+    assert(*set.Insert(keys[7]).first == keys[7]);
+
+    // copies keep the slots, so both sets answer alike
+    static Set copy(set);
+    assert(std::equal(copy.Begin(), copy.End(), keys.begin()) && copy.Full());
+    copy.Clear();
+    assert(copy.Empty() && copy.Begin() == copy.End() && !copy.Full());
+    copy.Insert({5, 1, 9});
+    assert(copy.Size() == 3 && *copy.Begin() == 9 && *copy.RBegin() == 1);
+    copy = set;
+    assert(copy.Size() == 3000 && *copy.SelectInd0(100) == keys[100]);
+
+    // 32-bit links past 65534 keys, ascending inserts keep it balanced
+    using Large = StaticSetAVL<long long, 70000>;
+    static_assert(std::is_same_v<Large::Index, uint32_t>);
+    static Large large;
+    for (long long key = 0; key < 70000; ++key) {
+        assert(large.Insert(key * 3).second);
+    }
+    assert(!large.Insert(-1).second && large.Full() && large.Height() <= 18);
+    assert(*large.SelectInd0(69999) == 209997 && large.RankInd0(30000) == 10000);
+
+    StaticSetAVL<std::string, 64> strings;
+    for (int i = 0; i < 100; ++i) {
+        strings.Insert(std::string(20, 's') + std::to_string(i));
+    }
+    assert(strings.Size() == 64 && strings.Begin()->size() >= 21);
+
+    // moves and Swap carry the keys slot by slot, the links stay valid
+    std::vector<std::string> words;
+    for (auto it = strings.Begin(); it != strings.End(); ++it) {
+        words.push_back(*it);
+    }
+    StaticSetAVL<std::string, 64> few;
+    few.Insert({"b", "a", "c"});
+    few.Swap(strings);
+    assert(strings.Size() == 3 && *strings.Begin() == "a" && *strings.RBegin() == "c");
+    assert(std::equal(few.Begin(), few.End(), words.begin()) && few.Size() == 64);
+    assert(*few.SelectInd0(40) == words[40] && few.RankInd0(words[50]) == 50);
+    StaticSetAVL<std::string, 64> moved(std::move(few));
+    assert(few.Empty() && few.Begin() == few.End() && moved.Size() == 64);
+    assert(std::equal(moved.Begin(), moved.End(), words.begin()));
+    strings = std::move(moved);
+    assert(moved.Empty() && strings.Size() == 64 && *strings.SelectInd1(64) == words.back());
+    assert(!strings.Insert("a").second && *strings.Insert(words[3]).first == words[3]);
+    strings.Prefault();
+    assert(std::equal(strings.RBegin(), strings.REnd(), words.rbegin()));
+
+    // a key that fails to copy destroys the keys copied before it
+    {
+        StaticSetAVL<CountedKey, 64> counted;
+        for (int key = 0; key < 50; ++key) {
+            counted.Insert(CountedKey(key * 7 % 50));
+        }
+        int alive = CountedKey::alive;
+        CountedKey::copies_left = 20;
+        bool thrown = false;
+        try {
+            StaticSetAVL<CountedKey, 64> failed(counted);
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown && CountedKey::alive == alive);
+        StaticSetAVL<CountedKey, 64> target;
+        CountedKey::copies_left = -1;
+        target.Insert(CountedKey(1));
+        alive = CountedKey::alive - 1;
+        CountedKey::copies_left = 20;
+        thrown = false;
+        try {
+            target = counted;
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown && target.Empty() && CountedKey::alive == alive);
+        CountedKey::copies_left = -1;
+        target = counted;
+        assert(target.Size() == 50 && target.SelectInd0(49)->value == 49);
+    }
+    assert(CountedKey::alive == 0);
+    std::cout << "TestStaticSet passed\n";
+}
+
 int main() {
     TestDefaultConstructor();
     TestComparatorConstructor();
@@ -1158,6 +3102,32 @@ int main() {
     TestSingleElement();
     TestRanksForAbsentKeys();
     TestLogarithmicAVLHeightProperty();
+    TestStringKeysWithPrefix();
+    TestAugmentedAggregates();
+    TestRangeCountsAndIteratorDistance();
+    TestFingerSearch();
+    TestBalancingPolicies();
+    TestOfflineOrderStatistics();
+    TestBitmapSet();
+    TestBatchedLookups();
+    TestConcurrentReaders();
+    TestParallelDecoding();
+    TestSnapshots();
+    TestImages();
+    TestExternalBuild();
+    TestLSMSet();
+    TestConcurrentWriters();
+    TestShardedSet();
+    TestShardedErrors();
+    TestNodeLayouts();
+    TestCompact();
+    TestNodeArena();
+    TestStructuralCopy();
+    TestSmallSet();
+    TestBucketSet();
+    TestPackedSet();
+    TestFrozenSet();
+    TestStaticSet();
 
     std::cout << "\nAll tests passed";
 }
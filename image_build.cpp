@@ -0,0 +1,49 @@
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "SetExternalBuild.h"
+
+// Builds a SetAVLImage<long long> from unsorted files of whitespace-separated keys, which
+// may be larger than memory; duplicate keys are kept once. trial_task --image serves it.
+// Usage: image_build [--run-keys N] IMAGE KEY_FILE...
+
+int main(int argc, char* argv[]) {
+    SetExternalBuildOptions options;
+    std::vector<std::string> paths;
+    for (int arg = 1; arg < argc; ++arg) {
+        std::string option = argv[arg];
+        if (option == "--run-keys" && arg + 1 < argc) {
+            std::string count = argv[++arg];
+            size_t parsed = 0;
+            try {
+                options.run_keys = std::stoull(count, &parsed);
+            } catch (const std::logic_error&) {
+                parsed = 0;
+            }
+            if (parsed == 0 || parsed != count.size() || count.front() == '-') {
+                std::cerr << "Invalid --run-keys " << count << ". Error.\n"
+                          << "Usage: image_build [--run-keys N] IMAGE KEY_FILE...\n";
+                return 1;
+            }
+        } else {
+            paths.push_back(option);
+        }
+    }
+    if (paths.size() < 2 || options.run_keys == 0) {
+        std::cerr << "Usage: image_build [--run-keys N] IMAGE KEY_FILE...\n";
+        return 1;
+    }
+    std::string image_path = paths.front();
+    paths.erase(paths.begin());
+    try {
+        SetExternalBuildStats stats = BuildImageFromKeyFiles(paths, image_path, options);
+        std::cout << "keys read: " << stats.keys_read << "\n"
+                  << "runs: " << stats.runs << "\n"
+                  << "merge passes: " << stats.merge_passes << "\n"
+                  << "unique keys: " << stats.unique_keys << "\n";
+    } catch (const SetSnapshotError& e) {
+        std::cerr << "Can not build image " << image_path << " (" << e.what() << ")\n";
+        return 1;
+    }
+}
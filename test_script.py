@@ -12,7 +12,7 @@ expected_outputs_data_error = {
     "test8.txt": "Value out of long long range. Error.\n"
 }
 
-compile_cmd = ["clang++", "trial_task.cpp", "-o", "trial_task", "-std=c++20", "-fsanitize=address"]
+compile_cmd = ["clang++", "trial_task.cpp", "-o", "trial_task", "-std=c++20", "-fsanitize=address", "-pthread"]
 try:
     subprocess.check_call(compile_cmd)
     print("Compilation for tests with errors in data input is successful\n")
@@ -27,31 +27,33 @@ if not test_files:
     print("No test files found.")
     exit(1)
 
-for (i, test_file) in enumerate(test_files):
-    with open(test_file, 'r') as f:
-        input_data = f.read()
+for flags in [[], ["--finger"], ["--offline"], ["--integer"], ["--lsm"]]:
+    print("Flags: " + " ".join(flags))
+    for (i, test_file) in enumerate(test_files):
+        with open(test_file, 'r') as f:
+            input_data = f.read()
     
-    try:
-        result = subprocess.run(["./trial_task"], input=input_data, text=True, capture_output=True)
-        output = result.stdout
-        if result.stderr:
-            print("Errors:")
-            print(result.stderr)
+        try:
+            result = subprocess.run(["./trial_task"] + flags, input=input_data, text=True, capture_output=True)
+            output = result.stdout
+            if result.stderr:
+                print("Errors:")
+                print(result.stderr)
         
-        expected = expected_outputs_data_error.get(test_file, "")
-        if output == expected:
-            print("Test " +  str(i + 1) +  " passed")
-        else:
-            print("Test failed!")
-            print(f"Expected:\n{expected}\n")
-    except Exception as e:
-        print(f"Run failed: {e}\n")
+            expected = expected_outputs_data_error.get(test_file, "")
+            if output == expected:
+                print("Test " +  str(i + 1) +  " passed")
+            else:
+                print("Test failed!")
+                print(f"Expected:\n{expected}\n")
+        except Exception as e:
+            print(f"Run failed: {e}\n")
 
 print("Tests with corrupted data passed\n")
 
 print("Running stress tests to check how SetAVL class works")
 
-compile_cmd2 = ["clang++", "class_tests.cpp", "-o", "class_tests", "-std=c++20", "-fsanitize=address"]
+compile_cmd2 = ["clang++", "class_tests.cpp", "-o", "class_tests", "-std=c++20", "-fsanitize=address", "-pthread"]
 try:
     subprocess.check_call(compile_cmd2)
     print("Compilation for main tests successful\n")
@@ -0,0 +1,273 @@
+#pragma once
+
+#include <cerrno>
+#include <algorithm>
+#include <cstdlib>
+#include <istream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "ThreadPool.h"
+
+// Commands of trial_task decoded from the input in advance.
+// Decoding follows the input state machine token by token: the first malformed token
+// becomes an ERROR command with its message and ends the list, so executors reproduce
+// the output of the original loop byte for byte by stopping at the first failing command.
+
+enum class CommandType { INSERT, SELECT, RANK, ERROR };
+
+struct Command {
+    CommandType type;
+    long long key = 0;          // INSERT, RANK
+    size_t index = 0;           // SELECT, 1-indexed as typed
+    const char* error = nullptr;  // ERROR
+};
+
+enum class ParseStatus { OK, INVALID, OUT_OF_RANGE };
+
+// same acceptance as std::stoll / std::stoull (strtoll/strtoull in base 10),
+// without exceptions on the failing path
+inline ParseStatus ParseLongLong(const char* str, long long& value) {
+    char* end = nullptr;
+    int saved_errno = errno;
+    errno = 0;
+    value = std::strtoll(str, &end, 10);
+    ParseStatus status = ParseStatus::OK;
+    if (end == str) {
+        status = ParseStatus::INVALID;
+    } else if (errno == ERANGE) {
+        status = ParseStatus::OUT_OF_RANGE;
+    }
+    errno = saved_errno;
+    return status;
+}
+
+inline ParseStatus ParseSizeT(const char* str, size_t& value) {
+    char* end = nullptr;
+    int saved_errno = errno;
+    errno = 0;
+    unsigned long long parsed = std::strtoull(str, &end, 10);
+    ParseStatus status = ParseStatus::OK;
+    if (end == str) {
+        status = ParseStatus::INVALID;
+    } else if (errno == ERANGE) {
+        status = ParseStatus::OUT_OF_RANGE;
+    }
+    errno = saved_errno;
+    value = static_cast<size_t>(parsed);
+    return status;
+}
+
+inline constexpr const char* kNoNumberError = "NO number followed. Error.\n";
+inline constexpr const char* kNoCommandError = "NO k/m/n followed. Error.\n";
+inline constexpr const char* kInvalidIntegerError = "Invalid integer argument. Error.\n";
+inline constexpr const char* kLongLongRangeError = "Value out of long long range. Error.\n";
+inline constexpr const char* kSizeTRangeError = "Value out of size_t range. Error.\n";
+inline constexpr const char* kInputEndedError =
+    "Input ended without a following number. Error. \n";
+inline constexpr const char* kDuplicateError = "You entered a duplicate. Error. \n";
+inline constexpr const char* kWrongIndexError = "Wrong index for k-th order statistic. Error. \n";
+
+inline bool IsCommandToken(std::string_view token) noexcept {
+    return token == "k" || token == "m" || token == "n";
+}
+
+// Incremental decoder: feed tokens in input order, Finish() at the end of input.
+// Returns false once an ERROR command has been produced.
+class CommandDecoder {
+public:
+    explicit CommandDecoder(std::vector<Command>& commands) : commands_(commands) {
+    }
+
+    // the token must be followed by whitespace or by the end of a NUL-terminated buffer
+    bool Feed(std::string_view token) {
+        bool is_command = IsCommandToken(token);
+        if (is_command && pending_ == OFF) {
+            pending_ = (token[0] == 'k') ? INSERT : (token[0] == 'm') ? SELECT : RANK;
+            return true;
+        }
+        if (is_command) {
+            return Fail(kNoNumberError);
+        }
+        if (pending_ == OFF) {
+            return Fail(kNoCommandError);
+        }
+        Command command{CommandType::ERROR};
+        if (pending_ == SELECT) {
+            ParseStatus status = ParseSizeT(token.data(), command.index);
+            if (status != ParseStatus::OK) {
+                return Fail(status == ParseStatus::INVALID ? kInvalidIntegerError
+                                                           : kSizeTRangeError);
+            }
+            command.type = CommandType::SELECT;
+        } else {
+            ParseStatus status = ParseLongLong(token.data(), command.key);
+            if (status != ParseStatus::OK) {
+                return Fail(status == ParseStatus::INVALID ? kInvalidIntegerError
+                                                           : kLongLongRangeError);
+            }
+            command.type = (pending_ == INSERT) ? CommandType::INSERT : CommandType::RANK;
+        }
+        commands_.push_back(command);
+        pending_ = OFF;
+        return true;
+    }
+
+    void Finish() {
+        if (pending_ != OFF) {
+            Fail(kInputEndedError);
+        }
+    }
+
+    // k/m/n still waiting for its number, '\0' if none
+    char PendingCommand() const noexcept {
+        constexpr char kLetters[] = {'\0', 'k', 'm', 'n'};
+        return kLetters[pending_];
+    }
+
+private:
+    enum Pending { OFF, INSERT, SELECT, RANK };
+
+    bool Fail(const char* message) {
+        Command command{CommandType::ERROR};
+        command.error = message;
+        commands_.push_back(command);
+        pending_ = OFF;
+        return false;
+    }
+
+    std::vector<Command>& commands_;
+    Pending pending_ = OFF;
+};
+
+inline std::vector<Command> DecodeCommands(std::istream& in) {
+    std::vector<Command> commands;
+    CommandDecoder decoder(commands);
+    std::string token;
+    while (in >> token) {
+        if (!decoder.Feed(token)) {
+            return commands;
+        }
+    }
+    decoder.Finish();
+    return commands;
+}
+
+// Whole stream as one NUL-terminated buffer for DecodeText
+inline std::string ReadAll(std::istream& in) {
+    std::string text;
+    char block[1 << 16];
+    while (in.read(block, sizeof(block)) || in.gcount() > 0) {
+        text.append(block, static_cast<size_t>(in.gcount()));
+    }
+    return text;
+}
+
+// same whitespace as operator>> in the "C" locale
+inline bool IsTokenSpace(char c) noexcept {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+// Commands of one chunk of the input decoded as if the chunk started between commands.
+// A leading number belongs to a k/m/n at the end of an earlier chunk, it is left to the
+// edge fix-up together with a k/m/n left without its number at the end of the chunk.
+struct CommandChunk {
+    std::vector<Command> commands;
+    std::string_view first_token;
+    bool first_is_number = false;
+    char pending = '\0';
+    bool failed = false;
+};
+
+inline CommandChunk DecodeChunk(std::string_view text) {
+    CommandChunk chunk;
+    CommandDecoder decoder(chunk.commands);
+    size_t position = 0;
+    while (true) {
+        while (position < text.size() && IsTokenSpace(text[position])) {
+            ++position;
+        }
+        if (position == text.size()) {
+            break;
+        }
+        size_t start = position;
+        while (position < text.size() && !IsTokenSpace(text[position])) {
+            ++position;
+        }
+        std::string_view token = text.substr(start, position - start);
+        if (chunk.first_token.empty()) {
+            chunk.first_token = token;
+            if (!IsCommandToken(token)) {
+                chunk.first_is_number = true;
+                continue;
+            }
+        }
+        if (!decoder.Feed(token)) {
+            chunk.failed = true;
+            return chunk;
+        }
+    }
+    chunk.pending = decoder.PendingCommand();
+    return chunk;
+}
+
+// Decodes a NUL-terminated buffer, chunks split at whitespace are decoded in parallel and
+// stitched in order: the state between chunks (a k/m/n waiting for its number) is replayed
+// through one decoder, so the result and the first error are those of DecodeCommands.
+inline std::vector<Command> DecodeText(std::string_view text, size_t threads = 0,
+                                       size_t min_chunk_bytes = 1 << 20) {
+    if (threads == 0) {
+        threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+    }
+    size_t chunk_count =
+        std::max<size_t>(1, std::min(4 * threads, text.size() / min_chunk_bytes));
+    std::vector<size_t> bounds(chunk_count + 1, text.size());
+    bounds[0] = 0;
+    for (size_t i = 1; i < chunk_count; ++i) {
+        size_t bound = std::max(bounds[i - 1], text.size() * i / chunk_count);
+        while (bound < text.size() && !IsTokenSpace(text[bound])) {
+            ++bound;
+        }
+        bounds[i] = bound;
+    }
+
+    std::vector<CommandChunk> chunks(chunk_count);
+    auto decode_chunk = [&](size_t i) {
+        chunks[i] = DecodeChunk(text.substr(bounds[i], bounds[i + 1] - bounds[i]));
+    };
+    if (chunk_count == 1 || threads == 1) {
+        for (size_t i = 0; i < chunk_count; ++i) {
+            decode_chunk(i);
+        }
+    } else {
+        ThreadPool pool(threads);
+        pool.ParallelFor(chunk_count, decode_chunk);
+    }
+
+    size_t total = 0;
+    for (const auto& chunk : chunks) {
+        total += chunk.commands.size() + 1;
+    }
+    std::vector<Command> commands;
+    commands.reserve(total);
+    CommandDecoder edges(commands);
+    for (const auto& chunk : chunks) {
+        if (chunk.first_token.empty()) {
+            continue;
+        }
+        if ((chunk.first_is_number || edges.PendingCommand() != '\0') &&
+            !edges.Feed(chunk.first_token)) {
+            return commands;
+        }
+        commands.insert(commands.end(), chunk.commands.begin(), chunk.commands.end());
+        if (chunk.failed) {
+            return commands;
+        }
+        if (chunk.pending != '\0') {
+            edges.Feed(std::string_view(&chunk.pending, 1));
+        }
+    }
+    edges.Finish();
+    return commands;
+}
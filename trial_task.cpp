@@ -1,6 +1,14 @@
 #include "SetAVL.h"
-
-enum MODE { OFF, INSERT, SELECT, RANK };
+#include <cstdio>
+#include <fstream>
+#include <optional>
+#include "FenwickTree.h"
+#include "RadixSort.h"
+#include "SetAVLImage.h"
+#include "SetBitmap.h"
+#include "SetLSM.h"
+#include "ThreadPool.h"
+#include "trial_commands.h"
 
 // This function is O(n)
 // It is specifically for testing
@@ -11,86 +19,422 @@ bool IsLograithmicHeightBoundForTree(const SetAVL<K>& tree) {
     return CheckAVLHeightBound(tree.Size(), height);
 }
 
-int main() {
-    SetAVL<long long> container;
-    std::string str;
-    int mode = OFF;
-    while (std::cin >> str) {
-        if (str == "k" && mode == OFF) {
-            mode = INSERT;
-        } else if (str == "k") {
-            std::cout << "NO number followed. Error.\n";
-            return -1;
-        } else if (str == "m" && mode == OFF) {
-            mode = SELECT;
-        } else if (str == "m") {
-            std::cout << "NO number followed. Error.\n";
-            return -1;
-        } else if (str == "n" && mode == OFF) {
-            mode = RANK;
-        } else if (str == "n") {
-            std::cout << "NO number followed. Error.\n";
-            return -1;
-        } else if (mode == OFF) {
-            std::cout << "NO k/m/n followed. Error.\n";
+// Answers of commands [begin, end) of a query run appended to out with the batched lookups.
+// Stops after the error message of the first failing select and returns false.
+bool FormatQueryRun(const SetAVL<long long>& container, const std::vector<Command>& commands,
+                    size_t begin, size_t end, std::string& out) {
+    std::vector<size_t> indices;
+    std::vector<long long> keys;
+    for (size_t i = begin; i < end; ++i) {
+        if (commands[i].type == CommandType::SELECT) {
+            indices.push_back(commands[i].index);
+        } else {
+            keys.push_back(commands[i].key);
+        }
+    }
+    auto selected = container.SelectBatch(indices);
+    auto ranks = container.RankBatch(keys);
+    auto next_selected = selected.begin();
+    auto next_rank = ranks.begin();
+    for (size_t i = begin; i < end; ++i) {
+        if (commands[i].type == CommandType::SELECT) {
+            if (*next_selected == container.End()) {
+                out += kWrongIndexError;
+                return false;
+            }
+            out += std::to_string(**next_selected++);
+        } else {
+            out += std::to_string(*next_rank++);
+        }
+        out += ' ';
+    }
+    return true;
+}
+
+// Without a finger a run of consecutive m/n commands does not change the tree,
+// a long run is split into chunks answered in parallel by const readers of the tree.
+// The chunks are printed in order up to the first failing one.
+int AnswerQueryRun(const SetAVL<long long>& container, const std::vector<Command>& commands,
+                   size_t begin, size_t end, std::unique_ptr<ThreadPool>& pool) {
+    constexpr size_t kMinChunk = 1 << 12;
+    size_t chunks = 1;
+    if (end - begin >= 2 * kMinChunk && std::thread::hardware_concurrency() > 1) {
+        if (pool == nullptr) {
+            pool = std::make_unique<ThreadPool>();
+        }
+        chunks = std::min(4 * pool->Size(), (end - begin) / kMinChunk);
+    }
+    std::vector<std::string> texts(chunks);
+    std::vector<char> answered(chunks);
+    auto answer_chunk = [&](size_t chunk) {
+        size_t chunk_begin = begin + (end - begin) * chunk / chunks;
+        size_t chunk_end = begin + (end - begin) * (chunk + 1) / chunks;
+        answered[chunk] = FormatQueryRun(container, commands, chunk_begin, chunk_end, texts[chunk]);
+    };
+    if (chunks == 1) {
+        answer_chunk(0);
+    } else {
+        pool->ParallelFor(chunks, answer_chunk);
+    }
+    for (size_t chunk = 0; chunk < chunks; ++chunk) {
+        std::cout << texts[chunk];
+        if (!answered[chunk]) {
             return -1;
-        } else if (mode == INSERT) {
-            long long k;
-            try {
-                k = std::stoll(str);
-            } catch (const std::invalid_argument& e) {
-                std::cout << "Invalid integer argument. Error.\n";
-                return -1;
-            } catch (const std::out_of_range& e) {
-                std::cout << "Value out of long long range. Error.\n";
+        }
+    }
+    return 0;
+}
+
+// Online mode: every command goes straight to SetAVL
+// sticky_finger starts each query from the answer of the previous one
+int RunOnline(const std::vector<Command>& commands, bool sticky_finger,
+              SetAVL<long long>& container) {
+    SetAVL<long long>::ConstIterator finger = container.End();
+    size_t finger_rank = container.Size();
+    std::unique_ptr<ThreadPool> pool;
+    for (size_t position = 0; position < commands.size(); ++position) {
+        const auto& command = commands[position];
+        if (!sticky_finger &&
+            (command.type == CommandType::SELECT || command.type == CommandType::RANK)) {
+            size_t end = position;
+            while (end < commands.size() && (commands[end].type == CommandType::SELECT ||
+                                             commands[end].type == CommandType::RANK)) {
+                ++end;
+            }
+            // no iterator is held between query runs, the idle point to restore locality
+            container.CompactIfScattered();
+            if (AnswerQueryRun(container, commands, position, end, pool) != 0) {
                 return -1;
             }
+            position = end - 1;
+        } else if (command.type == CommandType::ERROR) {
+            std::cout << command.error;
+            return -1;
+        } else if (command.type == CommandType::INSERT) {
+            long long k = command.key;
             auto result = container.Insert(k);
             if (result.second == false) {
-                std::cout << "You entered a duplicate. Error. \n";
+                std::cout << kDuplicateError;
                 return -1;
             }
-            mode = OFF;
-            assert(IsLograithmicHeightBoundForTree(container));
-        } else if (mode == SELECT) {
-            size_t i;
-            try {
-                i = std::stoull(str);
-            } catch (const std::invalid_argument& e) {
-                std::cout << "Invalid integer argument. Error.\n";
-                return -1;
-            } catch (const std::out_of_range& e) {
-                std::cout << "Value out of size_t range. Error.\n";
-                return -1;
+            if (finger == container.End()) {
+                finger_rank = container.Size();
+            } else if (k < *finger) {
+                ++finger_rank;
             }
-            auto it = container.SelectInd1(i);
+            assert(IsLograithmicHeightBoundForTree(container));
+        } else if (command.type == CommandType::SELECT) {
+            size_t i = command.index;
+            auto it = container.SelectInd0From(finger, finger_rank, i - 1);
             if (it == container.End()) {
-                std::cout << "Wrong index for k-th order statistic. Error. \n";
+                std::cout << kWrongIndexError;
                 return -1;
             } else {
                 long long key = *it;
                 std::cout << key << " ";
+                finger = it;
+                finger_rank = i - 1;
             }
-            mode = OFF;
-        } else if (mode == RANK) {
-            long long k;
-            try {
-                k = std::stoll(str);
-            } catch (const std::invalid_argument& e) {
-                std::cout << "Invalid integer argument. Error.\n";
+        } else if (command.type == CommandType::RANK) {
+            auto next = container.LowerBoundAndRankFrom(finger, finger_rank, command.key);
+            finger = next.first;
+            finger_rank = next.second;
+            std::cout << next.second << " ";
+        }
+    }
+    return 0;
+}
+
+// Offline mode: every key that will ever be inserted is known after decoding.
+// The keys of inserts and rank queries are radix sorted together and compressed to
+// positions among the distinct inserted keys, then a Fenwick tree of inserted positions
+// answers select by binary lifting and rank by a prefix sum, without a node per key.
+int RunOffline(const std::vector<Command>& commands) {
+    struct KeyRef {
+        uint64_t key;
+        size_t command;
+    };
+    std::vector<KeyRef> refs;
+    for (size_t i = 0; i < commands.size(); ++i) {
+        if (commands[i].type == CommandType::INSERT || commands[i].type == CommandType::RANK) {
+            refs.push_back({RadixKey(commands[i].key), i});
+        }
+    }
+    ParallelRadixSort(refs, [](const KeyRef& ref) { return ref.key; });
+
+    // INSERT: position of its key, RANK: number of distinct inserted keys below its key
+    std::vector<size_t> positions(commands.size());
+    std::vector<long long> keys;
+    for (size_t i = 0; i < refs.size();) {
+        size_t j = i;
+        bool inserted = false;
+        for (; j < refs.size() && refs[j].key == refs[i].key; ++j) {
+            inserted |= (commands[refs[j].command].type == CommandType::INSERT);
+            positions[refs[j].command] = keys.size();
+        }
+        if (inserted) {
+            keys.push_back(commands[refs[i].command].key);
+        }
+        i = j;
+    }
+
+    FenwickTree<size_t> counts(keys.size());
+    std::vector<char> present(keys.size());
+    size_t total = 0;
+    for (size_t i = 0; i < commands.size(); ++i) {
+        const auto& command = commands[i];
+        if (command.type == CommandType::ERROR) {
+            std::cout << command.error;
+            return -1;
+        } else if (command.type == CommandType::INSERT) {
+            if (present[positions[i]]) {
+                std::cout << kDuplicateError;
+                return -1;
+            }
+            present[positions[i]] = true;
+            counts.Add(positions[i], 1);
+            ++total;
+        } else if (command.type == CommandType::SELECT) {
+            if (command.index == 0 || command.index > total) {
+                std::cout << kWrongIndexError;
                 return -1;
-            } catch (const std::out_of_range& e) {
-                std::cout << "Value out of long long range. Error.\n";
+            }
+            std::cout << keys[counts.Select(command.index)] << " ";
+        } else if (command.type == CommandType::RANK) {
+            std::cout << counts.PrefixSum(positions[i]) << " ";
+        }
+    }
+    return 0;
+}
+
+// Integer mode: keys go to SetBitmap over the range of inserted keys
+// when the trait allows it and the range is dense enough, otherwise to SetAVL
+int RunInteger(const std::vector<Command>& commands) {
+    long long min_key = 0;
+    long long max_key = 0;
+    size_t inserts = 0;
+    for (const auto& command : commands) {
+        if (command.type == CommandType::INSERT) {
+            min_key = (inserts == 0) ? command.key : std::min(min_key, command.key);
+            max_key = (inserts == 0) ? command.key : std::max(max_key, command.key);
+            ++inserts;
+        }
+    }
+    if (!SetBitmapPreferred<long long, std::less<long long>>(min_key, max_key, inserts)) {
+        SetAVL<long long> container;
+        return RunOnline(commands, false, container);
+    }
+
+    SetBitmap<long long> container(min_key, max_key);
+    for (const auto& command : commands) {
+        if (command.type == CommandType::ERROR) {
+            std::cout << command.error;
+            return -1;
+        } else if (command.type == CommandType::INSERT) {
+            if (!container.Insert(command.key)) {
+                std::cout << kDuplicateError;
                 return -1;
             }
-            size_t result = container.RankInd0(k);
-            std::cout << result << " ";
-            mode = OFF;
+        } else if (command.type == CommandType::SELECT) {
+            auto key = container.SelectInd1(command.index);
+            if (!key) {
+                std::cout << kWrongIndexError;
+                return -1;
+            }
+            std::cout << *key << " ";
+        } else if (command.type == CommandType::RANK) {
+            std::cout << container.RankInd0(command.key) << " ";
         }
     }
-    if (mode != OFF) {
-        std::cout << "Input ended without a following number. Error. \n";
+    return 0;
+}
+
+// LSM mode: inserts go to the write-optimized SetLSM, its levels merge in the background
+int RunLSM(const std::vector<Command>& commands) {
+    SetLSM<long long>::Options options;
+    options.background = std::thread::hardware_concurrency() > 1;
+    SetLSM<long long> container(options);
+    for (const auto& command : commands) {
+        if (command.type == CommandType::ERROR) {
+            std::cout << command.error;
+            return -1;
+        } else if (command.type == CommandType::INSERT) {
+            if (!container.Insert(command.key)) {
+                std::cout << kDuplicateError;
+                return -1;
+            }
+        } else if (command.type == CommandType::SELECT) {
+            auto key = container.SelectInd1(command.index);
+            if (!key) {
+                std::cout << kWrongIndexError;
+                return -1;
+            }
+            std::cout << *key << " ";
+        } else if (command.type == CommandType::RANK) {
+            std::cout << container.RankInd0(command.key) << " ";
+        }
+    }
+    return 0;
+}
+
+// Image mode: queries against a read-only SetAVLImage mapped from a file, e.g. one built by
+// image_build from key dumps larger than memory; only the touched pages become resident
+int RunImage(const std::vector<Command>& commands, const SetAVLImage<long long>& image) {
+    for (const auto& command : commands) {
+        if (command.type == CommandType::ERROR) {
+            std::cout << command.error;
+            return -1;
+        } else if (command.type == CommandType::INSERT) {
+            std::cout << "Image is read-only. Error.\n";
+            return -1;
+        } else if (command.type == CommandType::SELECT) {
+            auto it = image.SelectInd1(command.index);
+            if (it == image.End()) {
+                std::cout << kWrongIndexError;
+                return -1;
+            }
+            std::cout << *it << " ";
+        } else if (command.type == CommandType::RANK) {
+            std::cout << image.RankInd0(command.key) << " ";
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    // --finger: start each query from the answer of the previous one
+    // --offline: read the whole input first and answer without SetAVL
+    // --integer: store dense keys as bits of SetBitmap
+    // --load-snapshot FILE: start from the keys of a snapshot
+    // --save-snapshot FILE: write the keys to a snapshot after the last command
+    // --image FILE: answer queries from a SetAVLImage file, inserts are rejected
+    // --lsm: buffer inserts in the write-optimized SetLSM
+    bool sticky_finger = false;
+    bool offline = false;
+    bool integer = false;
+    bool lsm = false;
+    std::string load_path;
+    std::string save_path;
+    std::string image_path;
+    for (int arg = 1; arg < argc; ++arg) {
+        std::string option = argv[arg];
+        if (option == "--finger") {
+            sticky_finger = true;
+        } else if (option == "--offline") {
+            offline = true;
+        } else if (option == "--integer") {
+            integer = true;
+        } else if (option == "--lsm") {
+            lsm = true;
+        } else if (option == "--load-snapshot" || option == "--save-snapshot" ||
+                   option == "--image") {
+            if (arg + 1 == argc) {
+                std::cout << "Option " << option << " needs a file. Error.\n";
+                return -1;
+            }
+            std::string& path = (option == "--load-snapshot")   ? load_path
+                                : (option == "--save-snapshot") ? save_path
+                                                                : image_path;
+            path = argv[++arg];
+        } else {
+            std::cout << "Unknown option " << option << ". Error.\n";
+            return -1;
+        }
+    }
+    if (lsm && (sticky_finger || offline || integer || !image_path.empty())) {
+        std::cout << "Option --lsm can not be combined with other modes. Error.\n";
+        return -1;
+    }
+    if (offline && integer) {
+        std::cout << "Options --offline and --integer can not be combined. Error.\n";
+        return -1;
+    }
+    if (sticky_finger && (offline || integer)) {
+        std::cout << "Option --finger works with SetAVL only, not with --offline or --integer. "
+                     "Error.\n";
+        return -1;
+    }
+    if ((offline || integer || lsm) && !(load_path.empty() && save_path.empty())) {
+        std::cout << "Snapshots work with SetAVL only, not with --offline, --integer or --lsm. "
+                     "Error.\n";
         return -1;
     }
+    if (!image_path.empty() && (sticky_finger || offline || integer || !load_path.empty() ||
+                                !save_path.empty())) {
+        std::cout << "Option --image can not be combined with other options. Error.\n";
+        return -1;
+    }
+    std::ios::sync_with_stdio(false);
+
+    if (!image_path.empty()) {
+        std::optional<SetAVLImage<long long>> image;
+        try {
+            image.emplace(SetAVLImage<long long>::Map(image_path));
+        } catch (const SetSnapshotError& e) {
+            std::cout << "Can not open image " << image_path << " (" << e.what() << "). Error.\n";
+            return -1;
+        }
+        std::string input = ReadAll(std::cin);
+        int code = RunImage(DecodeText(input), *image);
+        if (code != 0) {
+            return code;
+        }
+        std::cout << "\n";
+        return 0;
+    }
+
+    SetAVL<long long> container;
+    if (!load_path.empty()) {
+        std::ifstream in(load_path, std::ios::binary);
+        try {
+            if (!in) {
+                throw SetSnapshotError("can not open the file");
+            }
+            container.Load(in);
+        } catch (const SetSnapshotError& e) {
+            std::cout << "Can not load snapshot " << load_path << " (" << e.what()
+                      << "). Error.\n";
+            return -1;
+        }
+    }
+
+    std::string input = ReadAll(std::cin);
+    std::vector<Command> commands = DecodeText(input);
+    int code = 0;
+    if (offline) {
+        code = RunOffline(commands);
+    } else if (integer) {
+        code = RunInteger(commands);
+    } else if (lsm) {
+        code = RunLSM(commands);
+    } else {
+        code = RunOnline(commands, sticky_finger, container);
+    }
+    if (code != 0) {
+        return code;
+    }
+    if (!save_path.empty()) {
+        // written beside the file and renamed over it, so a failed save keeps the old one
+        std::string partial_path = save_path + ".partial";
+        try {
+            std::ofstream out(partial_path, std::ios::binary);
+            if (!out) {
+                throw SetSnapshotError("can not open the file");
+            }
+            container.Save(out);
+            out.close();
+            if (out.fail()) {
+                throw SetSnapshotError("can not write the file");
+            }
+            if (std::rename(partial_path.c_str(), save_path.c_str()) != 0) {
+                throw SetSnapshotError("can not replace the file");
+            }
+        } catch (const SetSnapshotError& e) {
+            std::remove(partial_path.c_str());
+            std::cout << "Can not save snapshot " << save_path << " (" << e.what()
+                      << "). Error.\n";
+            return -1;
+        }
+    }
     std::cout << "\n";
-}
\ No newline at end of file
+}